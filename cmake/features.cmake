@@ -69,3 +69,17 @@ CHECK_CXX_SOURCE_COMPILES("
     return 0;
   }
 " FSPP_HAVE_STD_OPTIONAL)
+
+
+CHECK_CXX_SOURCE_COMPILES("
+  #include <linux/io_uring.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  int main() {
+    struct statx buf;
+    auto sqe = io_uring_sqe();
+    sqe.opcode = IORING_OP_MKDIRAT;
+    sqe.rename_flags = 0;
+    return int(__NR_io_uring_setup) + int(IORING_REGISTER_PROBE) + int(sizeof(buf));
+  }
+" FSPP_HAVE_IO_URING)
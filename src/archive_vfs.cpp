@@ -0,0 +1,615 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs.hpp"
+#include "memory_vfs_image.hpp"
+#include "memory_vfs_nodes.hpp"
+
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+const std::size_t k_tar_block_size = 512;
+
+const std::uint32_t k_zip_local_header = 0x04034b50;
+const std::uint32_t k_zip_central_header = 0x02014b50;
+const std::uint32_t k_zip_end_of_central_dir = 0x06054b50;
+const std::uint32_t k_zip64_end_of_central_dir = 0x06064b50;
+const std::uint32_t k_zip64_end_locator = 0x07064b50;
+
+
+std::uint64_t
+read_le(const char* data, std::size_t bytes)
+{
+  auto value = std::uint64_t(0);
+  for (auto i = bytes; i > 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(data[i - 1]);
+  }
+  return value;
+}
+
+
+std::time_t
+utc_time(int year, unsigned month, unsigned day, int hour, int min, int sec)
+{
+  // days since 1970-01-01 of the proleptic gregorian calendar
+  year -= month <= 2 ? 1 : 0;
+  const auto era = (year >= 0 ? year : year - 399) / 400;
+  const auto yoe = static_cast<unsigned>(year - era * 400);
+  const auto doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  const auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  const auto days = std::int64_t(era) * 146097 + std::int64_t(doe) - 719468;
+
+  return static_cast<std::time_t>(days * 86400 + hour * 3600 + min * 60 + sec);
+}
+
+
+/*! Turns the name of an archive member into an absolute path.  Returns false for
+ *  names leading outside of the archive root. */
+bool
+member_path(const std::string& name, path& result)
+{
+  auto normalized = std::string();
+  auto start = std::size_t(0);
+  while (start <= name.size()) {
+    auto end = name.find('/', start);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+
+    const auto len = end - start;
+    if (len == 2 && name.compare(start, len, "..") == 0) {
+      return false;
+    }
+    if (len > 0 && !(len == 1 && name[start] == '.')) {
+      normalized += '/';
+      normalized.append(name, start, len);
+    }
+    start = end + 1;
+  }
+
+  result = u8path(normalized.empty() ? std::string("/") : normalized);
+  return true;
+}
+
+
+/*! Fills a memory filesystem with the members of an archive, viewing their data in the
+ *  mapped archive. */
+class ArchiveBuilder
+{
+public:
+  ArchiveBuilder(MemoryFilesystem& fs, std::shared_ptr<const ImageMapping> archive)
+    : _fs(fs)
+    , _archive(std::move(archive))
+  {
+  }
+
+  bool add_directory(const std::string& name, std::time_t mtime, std::error_code& ec)
+  {
+    auto p = path();
+    if (!member_path(name, p)) {
+      ec = std::make_error_code(std::errc::bad_message);
+      return false;
+    }
+
+    EpochDomain::Guard guard(_fs.epochs());
+    if (_fs.find_node(p, ec, true) == k_no_node) {
+      return false;
+    }
+    _fs.last_write_time(p, mtime, ec);
+    return !ec;
+  }
+
+  bool add_file(const std::string& name,
+                const char* data,
+                std::uint64_t size,
+                std::time_t mtime,
+                std::error_code& ec)
+  {
+    auto p = path();
+    if (!member_path(name, p) || p == "/") {
+      ec = std::make_error_code(std::errc::bad_message);
+      return false;
+    }
+
+    EpochDomain::Guard guard(_fs.epochs());
+    const auto parent = _fs.find_node(p.parent_path(), ec, true);
+    if (parent == k_no_node) {
+      return false;
+    }
+    // a later member of the same name replaces an earlier one
+    const auto nd = _fs.create_regular_file_node(parent, p.filename().string(), ec);
+    if (nd == k_no_node) {
+      return false;
+    }
+    if (_fs.node_type(nd) != file_type::regular) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return false;
+    }
+
+    _fs.publish_content(nd,
+                        size > 0 ? std::make_shared<FileContent>(
+                                     _archive, data, static_cast<file_size_type>(size))
+                                 : nullptr,
+                        0);
+    _fs.last_write_time(p, mtime, ec);
+    return !ec;
+  }
+
+  bool add_hard_link(const std::string& name,
+                     const std::string& target,
+                     std::error_code& ec)
+  {
+    auto p = path();
+    auto target_p = path();
+    if (!member_path(name, p) || !member_path(target, target_p)) {
+      ec = std::make_error_code(std::errc::bad_message);
+      return false;
+    }
+
+    EpochDomain::Guard guard(_fs.epochs());
+    if (_fs.find_node(p.parent_path(), ec, true) == k_no_node) {
+      return false;
+    }
+    _fs.remove(p, ec);
+    _fs.create_hard_link(target_p, p, ec);
+    return !ec;
+  }
+
+  const char* data() const { return _archive->data(); }
+  std::size_t size() const { return _archive->size(); }
+
+private:
+  MemoryFilesystem& _fs;
+  std::shared_ptr<const ImageMapping> _archive;
+};
+
+
+//----------------------------------------------------------------------------------------
+
+// Parses a numeric tar header field: octal digits or, for large values, big endian
+// base-256 marked by the high bit of the first byte.
+bool
+tar_number(const char* field, std::size_t len, std::uint64_t& value)
+{
+  value = 0;
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    if (static_cast<unsigned char>(field[0]) & 0x40) {
+      return false;  // negative
+    }
+    for (auto i = std::size_t(0); i < len; ++i) {
+      const auto byte = static_cast<unsigned char>(i == 0 ? field[0] & 0x3f : field[i]);
+      if (value >> 56) {
+        return false;
+      }
+      value = (value << 8) | byte;
+    }
+    return true;
+  }
+
+  auto i = std::size_t(0);
+  while (i < len && field[i] == ' ') {
+    ++i;
+  }
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+    if (value >> 61) {
+      return false;
+    }
+    value = value * 8 + static_cast<std::uint64_t>(field[i] - '0');
+  }
+  return i == len || field[i] == ' ' || field[i] == '\0';
+}
+
+
+std::string
+tar_string(const char* field, std::size_t len)
+{
+  return std::string(field, strnlen(field, len));
+}
+
+
+bool
+is_zero_block(const char* block)
+{
+  for (auto i = std::size_t(0); i < k_tar_block_size; ++i) {
+    if (block[i] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool
+is_valid_tar_header(const char* block)
+{
+  auto expected = std::uint64_t(0);
+  if (!tar_number(block + 148, 8, expected)) {
+    return false;
+  }
+
+  // the checksum is computed with the checksum field itself taken as spaces
+  auto sum = std::uint64_t(0);
+  for (auto i = std::size_t(0); i < k_tar_block_size; ++i) {
+    sum += i >= 148 && i < 156 ? ' ' : static_cast<unsigned char>(block[i]);
+  }
+  return sum == expected;
+}
+
+
+struct PaxOverrides
+{
+  std::string name;
+  std::string link_name;
+  std::uint64_t size = 0;
+  std::time_t mtime = 0;
+  bool has_size = false;
+  bool has_mtime = false;
+};
+
+
+// Applies the records of a pax extended header ("<len> <key>=<value>\n") to
+// @p overrides.
+bool
+apply_pax_header(const char* data, std::size_t len, PaxOverrides& overrides)
+{
+  auto pos = std::size_t(0);
+  while (pos < len) {
+    auto record_len = std::size_t(0);
+    auto i = pos;
+    for (; i < len && data[i] >= '0' && data[i] <= '9'; ++i) {
+      record_len = record_len * 10 + static_cast<std::size_t>(data[i] - '0');
+      if (record_len > len) {
+        return false;
+      }
+    }
+    if (i == len || data[i] != ' ' || record_len == 0 || record_len > len - pos
+        || data[pos + record_len - 1] != '\n') {
+      return false;
+    }
+
+    const auto record = std::string(data + i + 1, data + pos + record_len - 1);
+    const auto eq = record.find('=');
+    if (eq != std::string::npos) {
+      const auto key = record.substr(0, eq);
+      const auto value = record.substr(eq + 1);
+      if (key == "path") {
+        overrides.name = value;
+      }
+      else if (key == "linkpath") {
+        overrides.link_name = value;
+      }
+      else if (key == "size") {
+        overrides.size = std::strtoull(value.c_str(), nullptr, 10);
+        overrides.has_size = true;
+      }
+      else if (key == "mtime") {
+        // may have a fraction of seconds
+        overrides.mtime =
+          static_cast<std::time_t>(std::strtoll(value.c_str(), nullptr, 10));
+        overrides.has_mtime = true;
+      }
+    }
+
+    pos += record_len;
+  }
+
+  return true;
+}
+
+
+bool
+read_tar(ArchiveBuilder& builder, std::error_code& ec)
+{
+  const auto bad_archive = [&ec]() {
+    ec = std::make_error_code(std::errc::bad_message);
+    return false;
+  };
+
+  const auto* data = builder.data();
+  const auto size = builder.size();
+
+  // set by GNU long name and pax headers for the next member
+  auto next = PaxOverrides();
+
+  auto pos = std::size_t(0);
+  while (pos + k_tar_block_size <= size) {
+    const auto* header = data + pos;
+    if (is_zero_block(header)) {
+      break;
+    }
+    if (!is_valid_tar_header(header)) {
+      return bad_archive();
+    }
+
+    auto member_size = std::uint64_t(0);
+    auto mtime_value = std::uint64_t(0);
+    if (!tar_number(header + 124, 12, member_size)
+        || !tar_number(header + 136, 12, mtime_value)) {
+      return bad_archive();
+    }
+    if (next.has_size) {
+      member_size = next.size;
+    }
+
+    pos += k_tar_block_size;
+    if (member_size > size - pos) {
+      return bad_archive();
+    }
+    const auto* member_data = data + pos;
+    pos += static_cast<std::size_t>(
+      (member_size + k_tar_block_size - 1) / k_tar_block_size * k_tar_block_size);
+
+    auto name = tar_string(header, 100);
+    auto link_name = tar_string(header + 157, 100);
+    if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+      name = tar_string(header + 345, 155) + "/" + name;
+    }
+    const auto mtime =
+      next.has_mtime ? next.mtime : static_cast<std::time_t>(mtime_value);
+
+    auto type = header[156];
+    const auto is_meta = type == 'L' || type == 'K' || type == 'x' || type == 'g';
+    if (!is_meta) {
+      if (!next.name.empty()) {
+        name = next.name;
+      }
+      if (!next.link_name.empty()) {
+        link_name = next.link_name;
+      }
+      next = PaxOverrides();
+    }
+    if ((type == '0' || type == '\0') && !name.empty() && name.back() == '/') {
+      // old archives mark directories by the name only
+      type = '5';
+    }
+
+    auto is_ok = true;
+    switch (type) {
+    case 'L':
+      next.name = tar_string(member_data, static_cast<std::size_t>(member_size));
+      break;
+    case 'K':
+      next.link_name = tar_string(member_data, static_cast<std::size_t>(member_size));
+      break;
+    case 'x':
+      if (!apply_pax_header(member_data, static_cast<std::size_t>(member_size), next)) {
+        return bad_archive();
+      }
+      break;
+    case '0':
+    case '\0':
+    case '7':
+      is_ok = builder.add_file(name, member_data, member_size, mtime, ec);
+      break;
+    case '5':
+      is_ok = builder.add_directory(name, mtime, ec);
+      break;
+    case '1':
+      is_ok = builder.add_hard_link(name, link_name, ec);
+      break;
+    default:
+      // global pax headers, symlinks and special files are not supported by the
+      // memory filesystem and skipped.
+      break;
+    }
+
+    if (!is_ok) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+//----------------------------------------------------------------------------------------
+
+struct ZipDirectory
+{
+  std::uint64_t count;
+  std::uint64_t offset;
+  std::uint64_t size;
+};
+
+
+bool
+find_zip_directory(const char* data, std::size_t size, ZipDirectory& dir)
+{
+  const auto k_end_size = std::size_t(22);
+  if (size < k_end_size) {
+    return false;
+  }
+
+  // the end record is followed by a comment of up to 64 KiB
+  const auto lowest = size - k_end_size > 0xffff ? size - k_end_size - 0xffff : 0;
+  auto end = size - k_end_size;
+  while (read_le(data + end, 4) != k_zip_end_of_central_dir) {
+    if (end == lowest) {
+      return false;
+    }
+    --end;
+  }
+
+  dir.count = read_le(data + end + 10, 2);
+  dir.size = read_le(data + end + 12, 4);
+  dir.offset = read_le(data + end + 16, 4);
+
+  if (dir.count == 0xffff || dir.size == 0xffffffff || dir.offset == 0xffffffff) {
+    // zip64: the locator preceding the end record points to the zip64 end record
+    if (end < 20 || read_le(data + end - 20, 4) != k_zip64_end_locator) {
+      return false;
+    }
+    const auto end64 = read_le(data + end - 20 + 8, 8);
+    if (size < 56 || end64 > size - 56
+        || read_le(data + end64, 4) != k_zip64_end_of_central_dir) {
+      return false;
+    }
+    dir.count = read_le(data + end64 + 32, 8);
+    dir.size = read_le(data + end64 + 40, 8);
+    dir.offset = read_le(data + end64 + 48, 8);
+  }
+
+  return dir.offset <= size && dir.size <= size - dir.offset;
+}
+
+
+std::time_t
+dos_time(std::uint64_t date, std::uint64_t time)
+{
+  return utc_time(1980 + static_cast<int>(date >> 9), (date >> 5) & 0x0f, date & 0x1f,
+                  static_cast<int>(time >> 11), static_cast<int>((time >> 5) & 0x3f),
+                  static_cast<int>(time & 0x1f) * 2);
+}
+
+
+bool
+read_zip(ArchiveBuilder& builder, std::error_code& ec)
+{
+  const auto bad_archive = [&ec]() {
+    ec = std::make_error_code(std::errc::bad_message);
+    return false;
+  };
+
+  const auto* data = builder.data();
+  const auto size = builder.size();
+
+  auto dir = ZipDirectory();
+  if (!find_zip_directory(data, size, dir)) {
+    return bad_archive();
+  }
+
+  auto pos = static_cast<std::size_t>(dir.offset);
+  const auto dir_end = static_cast<std::size_t>(dir.offset + dir.size);
+  for (auto n = std::uint64_t(0); n < dir.count; ++n) {
+    if (dir_end - pos < 46 || read_le(data + pos, 4) != k_zip_central_header) {
+      return bad_archive();
+    }
+
+    const auto flags = read_le(data + pos + 8, 2);
+    const auto method = read_le(data + pos + 10, 2);
+    auto compressed_size = read_le(data + pos + 20, 4);
+    auto uncompressed_size = read_le(data + pos + 24, 4);
+    const auto name_len = static_cast<std::size_t>(read_le(data + pos + 28, 2));
+    const auto extra_len = static_cast<std::size_t>(read_le(data + pos + 30, 2));
+    const auto comment_len = static_cast<std::size_t>(read_le(data + pos + 32, 2));
+    auto local_offset = read_le(data + pos + 42, 4);
+    auto mtime = dos_time(read_le(data + pos + 14, 2), read_le(data + pos + 12, 2));
+
+    if (dir_end - pos - 46 < name_len + extra_len + comment_len) {
+      return bad_archive();
+    }
+    const auto name = std::string(data + pos + 46, name_len);
+
+    // the zip64 extra field holds the values too large for their header fields, the
+    // extended timestamp field the modification time in UTC.
+    const auto* extra = data + pos + 46 + name_len;
+    for (auto e = std::size_t(0); e + 4 <= extra_len;) {
+      const auto id = read_le(extra + e, 2);
+      const auto len = static_cast<std::size_t>(read_le(extra + e + 2, 2));
+      if (len > extra_len - e - 4) {
+        return bad_archive();
+      }
+      const auto* field = extra + e + 4;
+      auto field_pos = std::size_t(0);
+      if (id == 0x0001) {
+        for (auto* value : {&uncompressed_size, &compressed_size, &local_offset}) {
+          if (*value == 0xffffffff && field_pos + 8 <= len) {
+            *value = read_le(field + field_pos, 8);
+            field_pos += 8;
+          }
+        }
+      }
+      else if (id == 0x5455 && len >= 5 && (field[0] & 1)) {
+        mtime =
+          static_cast<std::time_t>(static_cast<std::int32_t>(read_le(field + 1, 4)));
+      }
+      e += 4 + len;
+    }
+
+    pos += 46 + name_len + extra_len + comment_len;
+
+    auto is_ok = true;
+    if (!name.empty() && name.back() == '/') {
+      is_ok = builder.add_directory(name, mtime, ec);
+    }
+    else if ((flags & 0x0001) || method != 0) {
+      // encrypted or compressed
+      ec = std::make_error_code(std::errc::not_supported);
+      return false;
+    }
+    else {
+      if (compressed_size != uncompressed_size || local_offset > size
+          || size - local_offset < 30
+          || read_le(data + local_offset, 4) != k_zip_local_header) {
+        return bad_archive();
+      }
+      const auto* local = data + local_offset;
+      const auto header_size = 30 + read_le(local + 26, 2) + read_le(local + 28, 2);
+      if (header_size > size - local_offset
+          || compressed_size > size - local_offset - header_size) {
+        return bad_archive();
+      }
+      is_ok = builder.add_file(name, local + header_size, compressed_size, mtime, ec);
+    }
+
+    if (!is_ok) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace
+
+
+std::unique_ptr<IFilesystem>
+make_archive_filesystem(const path& p, std::error_code& ec)
+{
+  auto archive = std::make_shared<ImageMapping>(p, ec);
+  if (!archive->data()) {
+    return nullptr;
+  }
+
+  auto fs = estd::make_unique<MemoryFilesystem>();
+  ArchiveBuilder builder(*fs, archive);
+  const auto is_zip = archive->size() >= 4 && std::memcmp(archive->data(), "PK", 2) == 0;
+  if (!(is_zip ? read_zip(builder, ec) : read_tar(builder, ec))) {
+    return nullptr;
+  }
+
+  ec.clear();
+  return fs->snapshot();
+}
+
+
+std::unique_ptr<IFilesystem>
+make_archive_filesystem(const path& p)
+{
+  std::error_code ec;
+  auto fs = make_archive_filesystem(p, ec);
+  if (ec) {
+    throw filesystem_error("can't open archive", p, ec);
+  }
+  return fs;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
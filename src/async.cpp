@@ -0,0 +1,537 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "async_private.hpp"
+#include "vfs_private.hpp"
+
+#include "fspp/details/async.hpp"
+#include "fspp/details/filesystem_error.hpp"
+#include "fspp/details/operations.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/utility/scope.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+
+namespace {
+
+class ThreadPoolExecutor : public IExecutor
+{
+public:
+  explicit ThreadPoolExecutor(std::size_t threads)
+  {
+    _threads.reserve(threads);
+    for (auto i = std::size_t(0); i < threads; ++i) {
+      _threads.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~ThreadPoolExecutor() override
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _wakeup.notify_all();
+    for (auto& thread : _threads) {
+      thread.join();
+    }
+  }
+
+  void post(std::function<void()> work) override
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.push_back(std::move(work));
+    }
+    _wakeup.notify_one();
+  }
+
+private:
+  void run()
+  {
+    for (;;) {
+      auto work = std::function<void()>();
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wakeup.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+        if (_queue.empty()) {
+          return;
+        }
+        work = std::move(_queue.front());
+        _queue.pop_front();
+      }
+      work();
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  std::deque<std::function<void()>> _queue;
+  bool _stopping = false;
+  std::vector<std::thread> _threads;
+};
+
+
+bool
+is_async_operation(Operation op)
+{
+  switch (op) {
+  case Operation::status:
+  case Operation::symlink_status:
+  case Operation::file_size:
+  case Operation::last_write_time:
+  case Operation::create_directory:
+  case Operation::create_directories:
+  case Operation::copy_file:
+  case Operation::rename:
+  case Operation::remove:
+  case Operation::remove_all:
+    return true;
+  default:
+    return false;
+  }
+}
+
+
+// Runs @p request with the synchronous functions.
+AsyncResult
+run_request(const AsyncRequest& request)
+{
+  auto result = AsyncResult();
+  auto& ec = result.ec;
+
+  switch (request.op) {
+  case Operation::status:
+    result.status = status(request.p, ec);
+    break;
+  case Operation::symlink_status:
+    result.status = symlink_status(request.p, ec);
+    break;
+  case Operation::file_size:
+    result.count = file_size(request.p, ec);
+    break;
+  case Operation::last_write_time:
+    result.time = last_write_time(request.p, ec);
+    break;
+  case Operation::create_directory:
+    result.flag = create_directory(request.p, ec);
+    break;
+  case Operation::create_directories:
+    result.flag = create_directories(request.p, ec);
+    break;
+  case Operation::copy_file:
+    result.flag = copy_file(request.p, request.p2, request.options, ec);
+    break;
+  case Operation::rename:
+    rename(request.p, request.p2, ec);
+    break;
+  case Operation::remove:
+    result.flag = remove(request.p, ec);
+    break;
+  case Operation::remove_all:
+    result.count = remove_all(request.p, ec);
+    break;
+  default:
+    ec = std::make_error_code(std::errc::operation_not_supported);
+    break;
+  }
+
+  return result;
+}
+
+
+std::exception_ptr
+make_error(const char* what, const AsyncRequest& request, const std::error_code& ec)
+{
+  if (request.p2.empty()) {
+    return std::make_exception_ptr(filesystem_error(what, request.p, ec));
+  }
+  return std::make_exception_ptr(filesystem_error(what, request.p, request.p2, ec));
+}
+
+
+template <typename T, typename Extract>
+std::future<T>
+start_future(AsyncFilesystem& afs,
+             const AsyncRequest& request,
+             const char* what,
+             Extract extract)
+{
+  auto promise = std::make_shared<std::promise<T>>();
+  auto future = promise->get_future();
+  afs.start(request, [promise, request, what, extract](const AsyncResult& result) {
+    if (result.ec) {
+      promise->set_exception(make_error(what, request, result.ec));
+    }
+    else {
+      promise->set_value(extract(result));
+    }
+  });
+  return future;
+}
+
+
+template <typename T, typename Extract>
+void
+start_handler(AsyncFilesystem& afs,
+              const AsyncRequest& request,
+              AsyncFilesystem::Handler<T> handler,
+              Extract extract)
+{
+  afs.start(request, [handler, extract](const AsyncResult& result) {
+    handler(extract(result), result.ec);
+  });
+}
+
+
+AsyncRequest
+make_request(Operation op, const path& p, const path& p2 = path())
+{
+  auto request = AsyncRequest();
+  request.op = op;
+  request.p = p;
+  request.p2 = p2;
+  return request;
+}
+
+
+file_status
+status_of(const AsyncResult& result)
+{
+  return result.status;
+}
+
+
+std::uintmax_t
+count_of(const AsyncResult& result)
+{
+  return result.count;
+}
+
+
+bool
+flag_of(const AsyncResult& result)
+{
+  return result.flag;
+}
+
+
+file_time_type
+time_of(const AsyncResult& result)
+{
+  return result.time;
+}
+
+}  // namespace
+
+
+std::shared_ptr<IExecutor>
+make_thread_pool_executor(std::size_t threads)
+{
+  if (threads == 0) {
+    threads = std::max(std::size_t(std::thread::hardware_concurrency()), std::size_t(1));
+  }
+  return std::make_shared<ThreadPoolExecutor>(threads);
+}
+
+
+class AsyncFilesystem::Impl
+{
+public:
+  void enter()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_pending;
+  }
+
+  void leave()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_pending == 0) {
+      _idle.notify_all();
+    }
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _pending == 0; });
+  }
+
+  std::shared_ptr<IExecutor> _executor;
+  std::unique_ptr<IAsyncEngine> _engine;
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _idle;
+  std::size_t _pending = 0;
+};
+
+
+AsyncFilesystem::AsyncFilesystem(const AsyncOptions& options)
+  : _impl(new Impl)
+{
+  _impl->_executor = options.executor ? options.executor : make_thread_pool_executor();
+  if (options.use_io_uring && options.queue_depth > 0) {
+    _impl->_engine = make_native_async_engine(options.queue_depth);
+  }
+}
+
+
+AsyncFilesystem::~AsyncFilesystem()
+{
+  _impl->wait();
+  // stop the engine before the executor, which might be shared
+  _impl->_engine.reset();
+}
+
+
+bool
+AsyncFilesystem::uses_io_uring() const NOEXCEPT
+{
+  return _impl->_engine != nullptr;
+}
+
+
+void
+AsyncFilesystem::start(const AsyncRequest& request, AsyncHandler done)
+{
+  auto* impl = _impl.get();
+  auto finish = AsyncHandler([impl, done](const AsyncResult& result) {
+    // leave even if the handler throws, or wait() would block forever
+    auto guard = utility::make_scope([impl]() { impl->leave(); });
+    done(result);
+  });
+
+  impl->enter();
+
+  // operations across roots are refused by the synchronous ones run below
+  if (is_async_operation(request.op)
+      && (request.p2.empty() || vfs::is_same_vfs_root(request.p.native(),
+                                                      request.p2.native()))) {
+    const auto& str = request.p.native();
+    if (auto rootlen = vfs::vfs_root_name_length(str)) {
+      auto* fs = vfs::any_vfs_registered() ? vfs::find_vfs(str.data(), rootlen) : nullptr;
+      if (auto* async_fs = dynamic_cast<vfs::IAsyncFilesystem*>(fs)) {
+        auto derooted = request;
+        derooted.p = vfs::deroot(request.p, rootlen);
+        if (!request.p2.empty()) {
+          derooted.p2 = vfs::deroot(request.p2, rootlen);
+        }
+        if (async_fs->start_async(derooted, finish)) {
+          return;
+        }
+      }
+    }
+    else if (impl->_engine && impl->_engine->start(request, finish)) {
+      return;
+    }
+  }
+
+  try {
+    impl->_executor->post([request, finish]() { finish(run_request(request)); });
+  }
+  catch (...) {
+    impl->leave();
+    throw;
+  }
+}
+
+
+void
+AsyncFilesystem::wait()
+{
+  _impl->wait();
+}
+
+
+std::future<file_status>
+AsyncFilesystem::status(const path& p)
+{
+  return start_future<file_status>(*this, make_request(Operation::status, p),
+                                   "can't read file status", status_of);
+}
+
+
+void
+AsyncFilesystem::status(const path& p, Handler<file_status> handler)
+{
+  start_handler(*this, make_request(Operation::status, p), std::move(handler),
+                status_of);
+}
+
+
+std::future<file_status>
+AsyncFilesystem::symlink_status(const path& p)
+{
+  return start_future<file_status>(*this, make_request(Operation::symlink_status, p),
+                                   "can't read file status", status_of);
+}
+
+
+void
+AsyncFilesystem::symlink_status(const path& p, Handler<file_status> handler)
+{
+  start_handler(*this, make_request(Operation::symlink_status, p), std::move(handler),
+                status_of);
+}
+
+
+std::future<file_size_type>
+AsyncFilesystem::file_size(const path& p)
+{
+  return start_future<file_size_type>(*this, make_request(Operation::file_size, p),
+                                      "can't determine file size", count_of);
+}
+
+
+void
+AsyncFilesystem::file_size(const path& p, Handler<file_size_type> handler)
+{
+  start_handler(*this, make_request(Operation::file_size, p), std::move(handler),
+                count_of);
+}
+
+
+std::future<file_time_type>
+AsyncFilesystem::last_write_time(const path& p)
+{
+  return start_future<file_time_type>(*this, make_request(Operation::last_write_time, p),
+                                      "can't determine last write time", time_of);
+}
+
+
+void
+AsyncFilesystem::last_write_time(const path& p, Handler<file_time_type> handler)
+{
+  start_handler(*this, make_request(Operation::last_write_time, p), std::move(handler),
+                time_of);
+}
+
+
+std::future<bool>
+AsyncFilesystem::create_directory(const path& p)
+{
+  return start_future<bool>(*this, make_request(Operation::create_directory, p),
+                            "can't create directory", flag_of);
+}
+
+
+void
+AsyncFilesystem::create_directory(const path& p, Handler<bool> handler)
+{
+  start_handler(*this, make_request(Operation::create_directory, p), std::move(handler),
+                flag_of);
+}
+
+
+std::future<bool>
+AsyncFilesystem::create_directories(const path& p)
+{
+  return start_future<bool>(*this, make_request(Operation::create_directories, p),
+                            "can't create directory", flag_of);
+}
+
+
+void
+AsyncFilesystem::create_directories(const path& p, Handler<bool> handler)
+{
+  start_handler(*this, make_request(Operation::create_directories, p),
+                std::move(handler), flag_of);
+}
+
+
+std::future<bool>
+AsyncFilesystem::copy_file(const path& from, const path& to, copy_options options)
+{
+  auto request = make_request(Operation::copy_file, from, to);
+  request.options = options;
+  return start_future<bool>(*this, request, "can't copy file", flag_of);
+}
+
+
+void
+AsyncFilesystem::copy_file(const path& from,
+                           const path& to,
+                           copy_options options,
+                           Handler<bool> handler)
+{
+  auto request = make_request(Operation::copy_file, from, to);
+  request.options = options;
+  start_handler(*this, request, std::move(handler), flag_of);
+}
+
+
+std::future<void>
+AsyncFilesystem::rename(const path& old_p, const path& new_p)
+{
+  const auto request = make_request(Operation::rename, old_p, new_p);
+  auto promise = std::make_shared<std::promise<void>>();
+  auto future = promise->get_future();
+  start(request, [promise, request](const AsyncResult& result) {
+    if (result.ec) {
+      promise->set_exception(make_error("failed to rename", request, result.ec));
+    }
+    else {
+      promise->set_value();
+    }
+  });
+  return future;
+}
+
+
+void
+AsyncFilesystem::rename(const path& old_p, const path& new_p, VoidHandler handler)
+{
+  start(make_request(Operation::rename, old_p, new_p),
+        [handler](const AsyncResult& result) { handler(result.ec); });
+}
+
+
+std::future<bool>
+AsyncFilesystem::remove(const path& p)
+{
+  return start_future<bool>(*this, make_request(Operation::remove, p),
+                            "failed to remove path", flag_of);
+}
+
+
+void
+AsyncFilesystem::remove(const path& p, Handler<bool> handler)
+{
+  start_handler(*this, make_request(Operation::remove, p), std::move(handler), flag_of);
+}
+
+
+std::future<std::uintmax_t>
+AsyncFilesystem::remove_all(const path& p)
+{
+  return start_future<std::uintmax_t>(*this, make_request(Operation::remove_all, p),
+                                      "failed to remove path recursively", count_of);
+}
+
+
+void
+AsyncFilesystem::remove_all(const path& p, Handler<std::uintmax_t> handler)
+{
+  start_handler(*this, make_request(Operation::remove_all, p), std::move(handler),
+                count_of);
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,38 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/async.hpp"
+
+#include <memory>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! Runs operations on native paths with the platform's asynchronous I/O interface. */
+class IAsyncEngine
+{
+public:
+  virtual ~IAsyncEngine() = default;
+
+  /*! Starts @p request and returns true if the engine supports its operation and has
+   *  room for it; @p done is then called from the engine's thread when it is finished.
+   *  Returns false without calling @p done otherwise. */
+  virtual bool start(const AsyncRequest& request, const AsyncHandler& done) = 0;
+};
+
+
+/*! Returns the platform's engine with room for @p queue_depth operations or nullptr if
+ *  the platform (or the running kernel) has none. */
+std::unique_ptr<IAsyncEngine>
+make_native_async_engine(unsigned queue_depth);
+
+}  // namespace filesystem
+}  // namespace eyestep
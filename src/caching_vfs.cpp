@@ -0,0 +1,682 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "dir_iterator_private.hpp"
+#include "vfs_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+
+struct CacheEntry
+{
+  file_status status;
+  file_size_type size = 0;
+  file_time_type mtime = 0;
+  // when the metadata has been read from the directory
+  Clock::time_point validated;
+  std::shared_ptr<const std::string> content;
+  std::shared_ptr<const std::vector<std::string>> listing;
+  // the entry's position in the LRU list and the bytes it is accounted with
+  std::list<std::string>::iterator lru;
+  std::uintmax_t charge = 0;
+};
+
+
+bool
+is_same_version(const CacheEntry& lhs, const CacheEntry& rhs)
+{
+  return lhs.status.type() == rhs.status.type() && lhs.mtime == rhs.mtime
+         && lhs.size == rhs.size;
+}
+
+
+/*! A filesystem caching the metadata, listings and small files of a directory.
+ *
+ * Entries are kept by path key in a map (to drop all entries below a path at once) and
+ * in a list ordered by their last use, from which the least recently used ones are
+ * evicted when the cache grows beyond its capacity.  An entry's content and listing
+ * belong to the version of the file its metadata describes; revalidating an entry drops
+ * them if the modification time or size changed.  Modification times have a resolution
+ * of one second, so changes keeping the size within the second of the last change are
+ * missed until the cache is cleared.
+ *
+ * The cache is protected by a mutex, which is not held while accessing the directory.
+ */
+class CachingFilesystem : public ICachingFilesystem
+{
+public:
+  CachingFilesystem(const path& dir, const CacheOptions& options)
+    : _dir(dir)
+    , _options(options)
+    , _revalidate_after(std::chrono::milliseconds(options.revalidate_after_ms))
+  {
+  }
+
+  CacheStatistics statistics() override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto result = _statistics;
+    result.size = _size;
+    return result;
+  }
+
+  void clear_cache() override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.clear();
+    _lru.clear();
+    _size = 0;
+  }
+
+  std::unique_ptr<detail::IFileImpl> make_file_impl() override;
+
+  std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
+    const path& p, std::error_code& ec) override
+  {
+    const auto names = listing(path_key(vfs::deroot(p)), ec);
+    if (!names) {
+      return {};
+    }
+    return estd::make_unique<ListingDirIter>(p, *names);
+  }
+
+  void dump(std::ostream& os) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    os << "-----------------------------------------------------------------\n";
+    for (const auto& entry : _entries) {
+      const auto& st = entry.second.status;
+      os << entry.first << " ["
+         << (is_directory(st) ? "dir" : exists(st) ? "file" : "missing") << ", "
+         << entry.second.mtime << ", " << entry.second.size << "by";
+      if (entry.second.content) {
+        os << ", content";
+      }
+      if (entry.second.listing) {
+        os << ", " << entry.second.listing->size() << " entries";
+      }
+      os << "]\n";
+    }
+    os << "-----------------------------------------------------------------\n";
+  }
+
+  path canonical(const path& p, const path& base, std::error_code& ec) override
+  {
+    (void)p;
+    (void)base;
+    ec = std::make_error_code(std::errc::function_not_supported);
+    return path();
+  }
+
+  bool copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 std::error_code& ec) override
+  {
+    const auto key = path_key(to);
+    const auto result =
+      filesystem::copy_file(native_path(path_key(from)), native_path(key), options, ec);
+    forget(key);
+    return result;
+  }
+
+  void copy_symlink(const path& from, const path& to, std::error_code& ec) override
+  {
+    const auto key = path_key(to);
+    filesystem::copy_symlink(native_path(path_key(from)), native_path(key), ec);
+    forget(key);
+  }
+
+  bool create_directory(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto result = filesystem::create_directory(native_path(key), ec);
+    forget(key);
+    return result;
+  }
+
+  bool create_directory(const path& p,
+                        const path& existing_p,
+                        std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto result = filesystem::create_directory(
+      native_path(key), native_path(path_key(existing_p)), ec);
+    forget(key);
+    return result;
+  }
+
+  bool create_directories(const path& p, std::error_code& ec) override
+  {
+    auto key = path_key(p);
+    const auto result = filesystem::create_directories(native_path(key), ec);
+    for (; key != "/"; key = parent_key(key)) {
+      forget(key);
+    }
+    return result;
+  }
+
+  void create_hard_link(const path& target,
+                        const path& link,
+                        std::error_code& ec) override
+  {
+    const auto key = path_key(link);
+    filesystem::create_hard_link(native_path(path_key(target)), native_path(key), ec);
+    forget(key);
+  }
+
+  void create_symlink(const path& target, const path& link, std::error_code& ec) override
+  {
+    const auto key = path_key(link);
+    filesystem::create_symlink(target, native_path(key), ec);
+    forget(key);
+  }
+
+  void create_directory_symlink(const path& target,
+                                const path& link,
+                                std::error_code& ec) override
+  {
+    const auto key = path_key(link);
+    filesystem::create_directory_symlink(target, native_path(key), ec);
+    forget(key);
+  }
+
+  bool equivalent(const path& p1, const path& p2, std::error_code& ec) override
+  {
+    return filesystem::equivalent(native_path(path_key(p1)), native_path(path_key(p2)),
+                                  ec);
+  }
+
+  file_size_type file_size(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto entry = lookup(key, ec);
+    if (ec) {
+      return file_size_type();
+    }
+    if (is_regular_file(entry.status)) {
+      return entry.size;
+    }
+    // let the directory report the error
+    return filesystem::file_size(native_path(key), ec);
+  }
+
+  file_id file_identity(const path& p, std::error_code& ec) override
+  {
+    return filesystem::file_identity(native_path(path_key(p)), ec);
+  }
+
+  std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override
+  {
+    return filesystem::hard_link_count(native_path(path_key(p)), ec);
+  }
+
+  file_time_type last_write_time(const path& p, std::error_code& ec) override
+  {
+    const auto entry = lookup(path_key(p), ec);
+    if (!ec && !exists(entry.status)) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    }
+    return ec ? file_time_type() : entry.mtime;
+  }
+
+  void last_write_time(const path& p,
+                       file_time_type new_time,
+                       std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    filesystem::last_write_time(native_path(key), new_time, ec);
+    forget(key);
+  }
+
+  void permissions(const path& p, perms prms, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    filesystem::permissions(native_path(key), prms, ec);
+    forget(key);
+  }
+
+  path read_symlink(const path& p, std::error_code& ec) override
+  {
+    return filesystem::read_symlink(native_path(path_key(p)), ec);
+  }
+
+  bool remove(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto result = filesystem::remove(native_path(key), ec);
+    forget_tree(key);
+    return result;
+  }
+
+  std::uintmax_t remove_all(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto result = filesystem::remove_all(native_path(key), ec);
+    forget_tree(key);
+    return result;
+  }
+
+  void rename(const path& old_p, const path& new_p, std::error_code& ec) override
+  {
+    const auto old_key = path_key(old_p);
+    const auto new_key = path_key(new_p);
+    filesystem::rename(native_path(old_key), native_path(new_key), ec);
+    forget_tree(old_key);
+    forget_tree(new_key);
+  }
+
+  void resize_file(const path& p, file_size_type new_size, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    filesystem::resize_file(native_path(key), new_size, ec);
+    forget(key);
+  }
+
+  space_info space(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return filesystem::space(native_path(path_key(p)), ec);
+  }
+
+  file_status status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    const auto entry = lookup(path_key(p), ec);
+    return ec ? file_status() : entry.status;
+  }
+
+  file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return filesystem::symlink_status(native_path(path_key(p)), ec);
+  }
+
+  path native_path(const std::string& key) const
+  {
+    return key == "/" ? _dir : _dir / u8path(key.substr(1));
+  }
+
+  /*! Returns the content of file @p key, or null if it is too large to be cached. */
+  std::shared_ptr<const std::string> content(const std::string& key, std::error_code& ec)
+  {
+    const auto entry = lookup(key, ec);
+    if (ec) {
+      return {};
+    }
+    if (!is_regular_file(entry.status)) {
+      ec = std::make_error_code(exists(entry.status)
+                                  ? std::errc::is_a_directory
+                                  : std::errc::no_such_file_or_directory);
+      return {};
+    }
+    if (entry.size > _options.max_file_size) {
+      return {};
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (entry.content) {
+        ++_statistics.content_hits;
+        return entry.content;
+      }
+      ++_statistics.content_misses;
+    }
+
+    auto data = std::string();
+    auto file = File(native_path(key));
+    auto& is = file.open(std::ios::in | std::ios::binary, ec);
+    if (ec) {
+      return {};
+    }
+    data.reserve(static_cast<std::size_t>(entry.size));
+    for (char buffer[16 * 1024]; is.read(buffer, sizeof(buffer)) || is.gcount() > 0;) {
+      data.append(buffer, static_cast<std::size_t>(is.gcount()));
+    }
+    file.close(ec);
+    if (ec) {
+      return {};
+    }
+
+    auto result = std::make_shared<const std::string>(std::move(data));
+    if (result->size() == entry.size) {
+      update(key, entry, [&](CacheEntry& cached) { cached.content = result; });
+    }
+    return result;
+  }
+
+  /*! Returns the names in directory @p key or null (with @p ec set). */
+  std::shared_ptr<const std::vector<std::string>> listing(const std::string& key,
+                                                          std::error_code& ec)
+  {
+    const auto entry = lookup(key, ec);
+    if (ec) {
+      return {};
+    }
+    if (!is_directory(entry.status)) {
+      ec = std::make_error_code(exists(entry.status)
+                                  ? std::errc::not_a_directory
+                                  : std::errc::no_such_file_or_directory);
+      return {};
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (entry.listing) {
+        ++_statistics.listing_hits;
+        return entry.listing;
+      }
+      ++_statistics.listing_misses;
+    }
+
+    auto names = std::vector<std::string>();
+    auto iter = directory_iterator(native_path(key), ec);
+    if (ec || !for_each_entry(iter, ec, [&](const directory_entry& e) {
+          names.push_back(e.path().filename().generic_u8string());
+          return true;
+        })) {
+      return {};
+    }
+
+    auto result = std::make_shared<const std::vector<std::string>>(std::move(names));
+    update(key, entry, [&](CacheEntry& cached) { cached.listing = result; });
+    return result;
+  }
+
+  /*! Drops the entries of @p key and its parent directory. */
+  void forget(const std::string& key)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    erase(_entries.find(key));
+    erase(_entries.find(parent_key(key)));
+  }
+
+  /*! Drops the entries of @p key, all paths below it and its parent directory. */
+  void forget_tree(const std::string& key)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    erase(_entries.find(key));
+    erase(_entries.find(parent_key(key)));
+
+    const auto prefix = key == "/" ? key : key + "/";
+    auto i_entry = _entries.lower_bound(prefix);
+    while (i_entry != _entries.end()
+           && i_entry->first.compare(0, prefix.size(), prefix) == 0) {
+      erase(i_entry++);
+    }
+  }
+
+private:
+  using Entries = std::map<std::string, CacheEntry>;
+
+  /*! Returns the entry of @p key, reading and caching it if it isn't cached or is
+   *  stale.  Missing files have entries, too, with a status of file_type::not_found. */
+  CacheEntry lookup(const std::string& key, std::error_code& ec)
+  {
+    const auto now = Clock::now();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      const auto i_entry = _entries.find(key);
+      if (i_entry != _entries.end()
+          && now - i_entry->second.validated < _revalidate_after) {
+        ++_statistics.metadata_hits;
+        _lru.splice(_lru.begin(), _lru, i_entry->second.lru);
+        ec.clear();
+        return i_entry->second;
+      }
+    }
+
+    auto fresh = CacheEntry();
+    const auto p = native_path(key);
+    fresh.status = filesystem::status(p, ec);
+    if (!ec && exists(fresh.status)) {
+      fresh.mtime = filesystem::last_write_time(p, ec);
+      if (!ec && is_regular_file(fresh.status)) {
+        fresh.size = filesystem::file_size(p, ec);
+      }
+    }
+    if (ec) {
+      return CacheEntry();
+    }
+    fresh.validated = now;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_statistics.metadata_misses;
+
+    auto i_entry = _entries.find(key);
+    if (i_entry != _entries.end()) {
+      ++_statistics.revalidations;
+      if (is_same_version(i_entry->second, fresh)) {
+        fresh.content = i_entry->second.content;
+        fresh.listing = i_entry->second.listing;
+      }
+      fresh.lru = i_entry->second.lru;
+      fresh.charge = i_entry->second.charge;
+      i_entry->second = std::move(fresh);
+      _lru.splice(_lru.begin(), _lru, i_entry->second.lru);
+    }
+    else {
+      i_entry = _entries.emplace(key, std::move(fresh)).first;
+      i_entry->second.lru = _lru.insert(_lru.begin(), key);
+    }
+    recharge(i_entry);
+
+    const auto result = i_entry->second;
+    evict();
+    return result;
+  }
+
+  /*! Calls @p functor with the cached entry of @p key if it still describes the same
+   *  version of the file as @p entry. */
+  template <typename Functor>
+  void update(const std::string& key, const CacheEntry& entry, Functor functor)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto i_entry = _entries.find(key);
+    if (i_entry != _entries.end() && is_same_version(i_entry->second, entry)) {
+      functor(i_entry->second);
+      recharge(i_entry);
+      evict();
+    }
+  }
+
+  // requires _mutex to be held
+  void recharge(Entries::iterator i_entry)
+  {
+    auto& entry = i_entry->second;
+    auto charge = std::uintmax_t(sizeof(CacheEntry) + 2 * i_entry->first.size());
+    if (entry.content) {
+      charge += entry.content->size();
+    }
+    if (entry.listing) {
+      for (const auto& name : *entry.listing) {
+        charge += sizeof(std::string) + name.size();
+      }
+    }
+
+    _size = _size - entry.charge + charge;
+    entry.charge = charge;
+  }
+
+  // requires _mutex to be held
+  void erase(Entries::iterator i_entry)
+  {
+    if (i_entry != _entries.end()) {
+      _size -= i_entry->second.charge;
+      _lru.erase(i_entry->second.lru);
+      _entries.erase(i_entry);
+    }
+  }
+
+  // requires _mutex to be held
+  void evict()
+  {
+    while (_size > _options.capacity && !_lru.empty()) {
+      erase(_entries.find(_lru.back()));
+      ++_statistics.evictions;
+    }
+  }
+
+  const path _dir;
+  const CacheOptions _options;
+  const Clock::duration _revalidate_after;
+
+  std::mutex _mutex;
+  Entries _entries;
+  // the keys of all entries, most recently used first
+  std::list<std::string> _lru;
+  std::uintmax_t _size = 0;
+  CacheStatistics _statistics;
+};
+
+
+class CachingFileImpl : public detail::IFileImpl
+{
+public:
+  explicit CachingFileImpl(CachingFilesystem* fs)
+    : _fs(fs)
+    , _stream(&_buf)
+  {
+  }
+
+  ~CachingFileImpl() override
+  {
+    if (is_open()) {
+      std::error_code ec;
+      close(ec);
+    }
+  }
+
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    assert(!is_open());
+
+    _key = path_key(vfs::deroot(p));
+    if ((mode & (std::ios::out | std::ios::app)) == 0) {
+      auto content = _fs->content(_key, ec);
+      if (ec) {
+        _stream.setstate(std::ios::failbit);
+        return _stream;
+      }
+      if (content) {
+        _buf.assign(std::move(content));
+        _stream.clear();
+        _is_cached = true;
+        return _stream;
+      }
+    }
+    else {
+      _is_written = true;
+      _fs->forget(_key);
+    }
+
+    _file = File(_fs->native_path(_key));
+    return _file.open(mode, ec);
+  }
+
+  std::iostream& stream() override
+  {
+    return _is_cached || !_file.is_valid() ? _stream : _file.stream();
+  }
+
+  bool is_open() const override
+  {
+    return _is_cached || (_file.is_valid() && _file.is_open());
+  }
+
+  void close(std::error_code& ec) override
+  {
+    if (_is_cached) {
+      _is_cached = false;
+      _buf.assign(nullptr);
+      ec.clear();
+    }
+    else if (_file.is_valid() && _file.is_open()) {
+      _file.close(ec);
+      if (_is_written) {
+        _is_written = false;
+        _fs->forget(_key);
+      }
+    }
+    else {
+      ec = std::make_error_code(std::errc::bad_file_descriptor);
+    }
+  }
+
+private:
+  CachingFilesystem* _fs;
+  SharedContentBuf _buf;
+  std::iostream _stream;
+  // the file in the directory, if it isn't read from the cache
+  File _file;
+  std::string _key;
+  bool _is_cached = false;
+  bool _is_written = false;
+};
+
+
+std::unique_ptr<detail::IFileImpl>
+CachingFilesystem::make_file_impl()
+{
+  return estd::make_unique<CachingFileImpl>(this);
+}
+
+}  // namespace
+
+
+std::unique_ptr<ICachingFilesystem>
+make_caching_filesystem(const path& dir, const CacheOptions& options, std::error_code& ec)
+{
+  if (!is_directory(dir, ec)) {
+    if (!ec) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+    }
+    return nullptr;
+  }
+
+  ec.clear();
+  return estd::make_unique<CachingFilesystem>(dir, options);
+}
+
+
+std::unique_ptr<ICachingFilesystem>
+make_caching_filesystem(const path& dir, const CacheOptions& options)
+{
+  std::error_code ec;
+  auto fs = make_caching_filesystem(dir, options, ec);
+  if (ec) {
+    throw filesystem_error("can't create caching filesystem", dir, ec);
+  }
+  return fs;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,1112 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "dir_iterator_private.hpp"
+#include "sha256.hpp"
+#include "vfs_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utils.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ios>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+file_time_type
+now()
+{
+  return static_cast<file_time_type>(
+    std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+}
+
+
+bool
+is_digest(const std::string& name)
+{
+  return name.size() == 64
+         && name.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+
+/*! Keeps blobs of file content by their digest.  Implementations are thread safe; putting
+ *  a blob which is there already does nothing. */
+class BlobStore
+{
+public:
+  virtual ~BlobStore() = default;
+
+  virtual void put(const std::string& digest,
+                   const std::string& content,
+                   std::error_code& ec) = 0;
+  virtual std::shared_ptr<const std::string> get(const std::string& digest,
+                                                 std::error_code& ec) = 0;
+  virtual void erase(const std::string& digest, std::error_code& ec) = 0;
+};
+
+
+class MemoryBlobStore : public BlobStore
+{
+public:
+  void put(const std::string& digest,
+           const std::string& content,
+           std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_blobs.find(digest) == _blobs.end()) {
+      _blobs[digest] = std::make_shared<const std::string>(content);
+    }
+    ec.clear();
+  }
+
+  std::shared_ptr<const std::string> get(const std::string& digest,
+                                         std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto i = _blobs.find(digest);
+    if (i == _blobs.end()) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return nullptr;
+    }
+    ec.clear();
+    return i->second;
+  }
+
+  void erase(const std::string& digest, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _blobs.erase(digest);
+    ec.clear();
+  }
+
+private:
+  std::mutex _mutex;
+  std::unordered_map<std::string, std::shared_ptr<const std::string>> _blobs;
+};
+
+
+/*! Keeps each blob as file named by its digest in one directory.  Blobs are written to
+ *  a temporary file first and renamed, so a blob file is always complete. */
+class DirectoryBlobStore : public BlobStore
+{
+public:
+  explicit DirectoryBlobStore(const path& dir)
+    : _dir(dir)
+  {
+  }
+
+  void put(const std::string& digest,
+           const std::string& content,
+           std::error_code& ec) override
+  {
+    const auto blob_p = _dir / digest;
+    if (exists(blob_p, ec) || ec) {
+      return;
+    }
+
+    const auto tmp_p = _dir / (digest + ".tmp" + std::to_string(_next_tmp_id++));
+    {
+      auto file = File(tmp_p);
+      file.open(std::ios::out | std::ios::binary, ec)
+        .write(content.data(), static_cast<std::streamsize>(content.size()));
+      if (ec) {
+        return;
+      }
+      file.close(ec);
+    }
+    if (!ec) {
+      rename(tmp_p, blob_p, ec);
+    }
+    if (ec) {
+      std::error_code ec2;
+      remove(tmp_p, ec2);
+    }
+  }
+
+  std::shared_ptr<const std::string> get(const std::string& digest,
+                                         std::error_code& ec) override
+  {
+    auto content = std::make_shared<std::string>();
+    auto file = File(_dir / digest);
+    auto& is = file.open(std::ios::in | std::ios::binary, ec);
+    if (ec) {
+      return nullptr;
+    }
+    std::ostringstream buffer;
+    buffer << is.rdbuf();
+    *content = buffer.str();
+    file.close(ec);
+    return ec ? nullptr : content;
+  }
+
+  void erase(const std::string& digest, std::error_code& ec) override
+  {
+    remove(_dir / digest, ec);
+  }
+
+  /*! Returns the digests and sizes of the blobs in the directory; temporary files left
+   *  behind by a crash are removed. */
+  std::vector<std::pair<std::string, std::uintmax_t>> scan(std::error_code& ec)
+  {
+    auto result = std::vector<std::pair<std::string, std::uintmax_t>>();
+    auto garbage = std::vector<path>();
+    for (auto it = directory_iterator(_dir, ec); !ec && it != directory_iterator();
+         it.increment(ec)) {
+      const auto name = it->path().filename().string();
+      if (is_digest(name)) {
+        const auto size = file_size(it->path(), ec);
+        if (ec) {
+          return {};
+        }
+        result.emplace_back(name, size);
+      }
+      else if (name.size() > 64 && is_digest(name.substr(0, 64))) {
+        garbage.push_back(it->path());
+      }
+    }
+    for (const auto& p : garbage) {
+      std::error_code ec2;
+      remove(p, ec2);
+    }
+    return result;
+  }
+
+private:
+  path _dir;
+  std::atomic<std::uint64_t> _next_tmp_id{0};
+};
+
+
+struct Node
+{
+  file_type type = file_type::regular;
+  perms prms = perms::all;
+  file_time_type mtime = 0;
+  // the content's digest; empty for empty files
+  std::string digest;
+  file_size_type size = 0;
+  std::uint64_t id = 0;
+  std::uintmax_t links = 1;
+};
+
+
+struct Blob
+{
+  std::uintmax_t size = 0;
+  // the files referring to the blob plus the readers and writers using it right now
+  std::uint64_t refs = 0;
+};
+
+
+/*! A filesystem storing file content in a blob store by its SHA-256 digest.
+ *
+ * The tree is kept in a map from path key to node (hard links share the node), such
+ * that the nodes below a directory are a range in it.  Each blob counts the nodes
+ * referring to it; blobs are only removed by collect_garbage().  Reads and writes pin
+ * the blob they use while accessing the store without holding the mutex, so collecting
+ * garbage never removes a blob in use.
+ */
+class DedupFilesystem : public IDedupFilesystem
+{
+public:
+  explicit DedupFilesystem(std::unique_ptr<BlobStore> store)
+    : _store(std::move(store))
+  {
+    auto root = std::make_shared<Node>();
+    root->type = file_type::directory;
+    root->mtime = now();
+    root->id = ++_last_id;
+    _nodes["/"] = root;
+  }
+
+  void add_existing_blob(const std::string& digest, std::uintmax_t size)
+  {
+    _blobs[digest].size = size;
+  }
+
+  DedupStatistics statistics() override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto result = DedupStatistics();
+
+    auto seen = std::map<std::uint64_t, bool>();
+    for (const auto& entry : _nodes) {
+      const auto& node = *entry.second;
+      if (node.type == file_type::regular && !seen[node.id]) {
+        seen[node.id] = true;
+        ++result.files;
+        result.logical_size += node.size;
+      }
+    }
+    for (const auto& entry : _blobs) {
+      ++result.blobs;
+      result.stored_size += entry.second.size;
+      if (entry.second.refs == 0) {
+        result.garbage_size += entry.second.size;
+      }
+    }
+    return result;
+  }
+
+  std::uintmax_t collect_garbage(std::error_code& ec) override
+  {
+    // take the garbage out of the table, such that the store is accessed without
+    // holding the mutex.  Writers storing one of these blobs again wait until it is
+    // erased.
+    auto garbage = std::vector<std::pair<std::string, Blob>>();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto i = _blobs.begin(); i != _blobs.end();) {
+        if (i->second.refs == 0) {
+          garbage.emplace_back(i->first, i->second);
+          _collecting.insert(i->first);
+          i = _blobs.erase(i);
+        }
+        else {
+          ++i;
+        }
+      }
+    }
+
+    std::uintmax_t freed = 0;
+    ec.clear();
+    auto erased = std::size_t(0);
+    for (; erased < garbage.size(); ++erased) {
+      _store->erase(garbage[erased].first, ec);
+      if (ec) {
+        break;
+      }
+      freed += garbage[erased].second.size;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto i = std::size_t(0); i < garbage.size(); ++i) {
+        if (i >= erased) {
+          // still stored; keep it for the next collection
+          auto& blob = _blobs[garbage[i].first];
+          blob.size = garbage[i].second.size;
+        }
+        _collecting.erase(garbage[i].first);
+      }
+    }
+    _collected.notify_all();
+    return freed;
+  }
+
+  /*! Returns the content of file @p key. */
+  std::shared_ptr<const std::string> read(const std::string& key, std::error_code& ec)
+  {
+    auto digest = std::string();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      const auto node = find(key, ec);
+      if (!node) {
+        return nullptr;
+      }
+      if (node->type == file_type::directory) {
+        ec = std::make_error_code(std::errc::is_a_directory);
+        return nullptr;
+      }
+      if (node->digest.empty()) {
+        return std::make_shared<const std::string>();
+      }
+      digest = node->digest;
+      ++_blobs[digest].refs;
+    }
+
+    auto content = _store->get(digest, ec);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    --_blobs[digest].refs;
+    return content;
+  }
+
+  /*! Creates file @p key, if it doesn't exist, for writing to it. */
+  void prepare_write(const std::string& key, std::error_code& ec)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto i = _nodes.find(key);
+    if (i != _nodes.end()) {
+      ec.clear();
+      if (i->second->type == file_type::directory) {
+        ec = std::make_error_code(std::errc::is_a_directory);
+      }
+      return;
+    }
+    if (!check_parent(key, ec)) {
+      return;
+    }
+
+    auto node = std::make_shared<Node>();
+    node->mtime = now();
+    node->id = ++_last_id;
+    _nodes[key] = node;
+  }
+
+  /*! Replaces the content of file @p key by @p content. */
+  void write(const std::string& key, const std::string& content, std::error_code& ec)
+  {
+    const auto digest = content.empty() ? std::string() : sha256_hex(content);
+
+    if (!digest.empty()) {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _collected.wait(lock, [&]() { return _collecting.count(digest) == 0; });
+        auto& blob = _blobs[digest];
+        blob.size = content.size();
+        ++blob.refs;
+      }
+
+      _store->put(digest, content, ec);
+      if (ec) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        --_blobs[digest].refs;
+        return;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto node = find(key, ec);
+    if (!node) {
+      // removed while being written
+      if (!digest.empty()) {
+        --_blobs[digest].refs;
+      }
+      return;
+    }
+    // the pin taken above becomes the node's reference
+    release(node->digest);
+    node->digest = digest;
+    node->size = content.size();
+    node->mtime = now();
+  }
+
+  std::unique_ptr<detail::IFileImpl> make_file_impl() override;
+
+  std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
+    const path& p, std::error_code& ec) override
+  {
+    auto names = std::vector<std::string>();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      const auto key = path_key(vfs::deroot(p));
+      const auto node = find(key, ec);
+      if (!node) {
+        return {};
+      }
+      if (node->type != file_type::directory) {
+        ec = std::make_error_code(std::errc::not_a_directory);
+        return {};
+      }
+      for_each_child(key, [&](const std::string& child_key) {
+        names.push_back(child_key.substr(child_key.rfind('/') + 1));
+      });
+    }
+    return estd::make_unique<ListingDirIter>(p, std::move(names));
+  }
+
+  void dump(std::ostream& os) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto& entry : _nodes) {
+      const auto& node = *entry.second;
+      os << entry.first;
+      if (node.type == file_type::directory) {
+        os << " (dir)" << std::endl;
+      }
+      else {
+        os << " (" << node.size << " bytes, "
+           << (node.digest.empty() ? std::string("empty") : node.digest.substr(0, 12))
+           << ")" << std::endl;
+      }
+    }
+  }
+
+  path canonical(const path& p, const path& base, std::error_code& ec) override
+  {
+    (void)p;
+    (void)base;
+    ec = std::make_error_code(std::errc::function_not_supported);
+    return path();
+  }
+
+  bool copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto from_node = find(path_key(from), ec);
+    if (!from_node) {
+      return false;
+    }
+    if (from_node->type == file_type::directory) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return false;
+    }
+
+    const auto to_key = path_key(to);
+    const auto i = _nodes.find(to_key);
+    if (i != _nodes.end()) {
+      const auto& to_node = i->second;
+      if (to_node == from_node) {
+        ec = std::error_code(EINVAL, std::generic_category());
+        return false;
+      }
+      else if ((options & copy_options::skip_existing) != 0) {
+        ec.clear();
+        return false;
+      }
+      else if ((options & copy_options::overwrite_existing) != 0
+               || ((options & copy_options::update_existing) != 0
+                   && from_node->mtime > to_node->mtime)) {
+        if (to_node->type == file_type::directory) {
+          ec = std::make_error_code(std::errc::is_a_directory);
+          return false;
+        }
+        // sharing the blob is all a copy takes
+        if (!from_node->digest.empty()) {
+          ++_blobs[from_node->digest].refs;
+        }
+        release(to_node->digest);
+        to_node->digest = from_node->digest;
+        to_node->size = from_node->size;
+        to_node->mtime = now();
+        ec.clear();
+        return true;
+      }
+      else if ((options & copy_options::update_existing) != 0) {
+        ec.clear();
+        return false;
+      }
+
+      ec = std::error_code(EINVAL, std::generic_category());
+      return false;
+    }
+
+    if (!check_parent(to_key, ec)) {
+      return false;
+    }
+
+    auto node = std::make_shared<Node>(*from_node);
+    node->id = ++_last_id;
+    node->links = 1;
+    node->mtime = now();
+    if (!node->digest.empty()) {
+      ++_blobs[node->digest].refs;
+    }
+    _nodes[to_key] = node;
+    return true;
+  }
+
+  void copy_symlink(const path&, const path&, std::error_code& ec) override
+  {
+    ec = std::make_error_code(std::errc::operation_not_supported);
+  }
+
+  bool create_directory(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return make_directory(path_key(p), perms::all, ec);
+  }
+
+  bool create_directory(const path& p,
+                        const path& existing_p,
+                        std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto existing = find(path_key(existing_p), ec);
+    if (!existing) {
+      return false;
+    }
+    if (existing->type != file_type::directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+      return false;
+    }
+    return make_directory(path_key(p), existing->prms, ec);
+  }
+
+  bool create_directories(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto key = path_key(p);
+    auto created = false;
+    ec.clear();
+
+    for (auto pos = key.find('/', 1); key != "/"; pos = key.find('/', pos + 1)) {
+      created = make_directory(key.substr(0, pos), perms::all, ec);
+      if (ec) {
+        return false;
+      }
+      if (pos == std::string::npos) {
+        break;
+      }
+    }
+    return created;
+  }
+
+  void create_hard_link(const path& target,
+                        const path& link,
+                        std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node = find(path_key(target), ec);
+    if (!node) {
+      return;
+    }
+    if (node->type == file_type::directory) {
+      ec = std::make_error_code(std::errc::operation_not_permitted);
+      return;
+    }
+
+    const auto link_key = path_key(link);
+    if (_nodes.find(link_key) != _nodes.end()) {
+      ec = std::make_error_code(std::errc::file_exists);
+      return;
+    }
+    if (!check_parent(link_key, ec)) {
+      return;
+    }
+    ++node->links;
+    _nodes[link_key] = node;
+  }
+
+  void create_symlink(const path&, const path&, std::error_code& ec) override
+  {
+    ec = std::make_error_code(std::errc::operation_not_supported);
+  }
+
+  void create_directory_symlink(const path&, const path&, std::error_code& ec) override
+  {
+    ec = std::make_error_code(std::errc::operation_not_supported);
+  }
+
+  bool equivalent(const path& p1, const path& p2, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node1 = find(path_key(p1), ec);
+    if (!node1) {
+      return false;
+    }
+    const auto node2 = find(path_key(p2), ec);
+    return node2 && node1 == node2;
+  }
+
+  file_size_type file_size(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node = find(path_key(p), ec);
+    if (!node) {
+      return static_cast<file_size_type>(-1);
+    }
+    if (node->type == file_type::directory) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return static_cast<file_size_type>(-1);
+    }
+    return node->size;
+  }
+
+  file_id file_identity(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node = find(path_key(p), ec);
+    if (!node) {
+      return file_id();
+    }
+    return file_id(reinterpret_cast<std::uintptr_t>(this), node->id);
+  }
+
+  std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node = find(path_key(p), ec);
+    return node ? node->links : static_cast<std::uintmax_t>(-1);
+  }
+
+  file_time_type last_write_time(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node = find(path_key(p), ec);
+    return node ? node->mtime : file_time_type();
+  }
+
+  void last_write_time(const path& p,
+                       file_time_type new_time,
+                       std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (const auto node = find(path_key(p), ec)) {
+      node->mtime = new_time;
+    }
+  }
+
+  void permissions(const path& p, perms prms, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto node = find(path_key(p), ec);
+    if (!node) {
+      return;
+    }
+
+    if ((prms & perms::add_perms) != 0 && (prms & perms::remove_perms) != 0) {
+      ec = std::error_code(EINVAL, std::generic_category());
+    }
+    else if ((prms & perms::add_perms) != 0) {
+      node->prms = node->prms | (prms & perms::mask);
+    }
+    else if ((prms & perms::remove_perms) != 0) {
+      node->prms = node->prms & ~(prms & perms::mask);
+    }
+    else {
+      node->prms = prms & perms::mask;
+    }
+  }
+
+  path read_symlink(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (find(path_key(p), ec)) {
+      ec = std::make_error_code(std::errc::invalid_argument);
+    }
+    return path();
+  }
+
+  bool remove(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto key = path_key(p);
+    const auto i = _nodes.find(key);
+    ec.clear();
+    if (i == _nodes.end()) {
+      return false;
+    }
+    if (key == "/") {
+      ec = std::make_error_code(std::errc::device_or_resource_busy);
+      return false;
+    }
+
+    auto has_children = false;
+    for_each_child(key, [&](const std::string&) { has_children = true; });
+    if (has_children) {
+      ec = std::make_error_code(std::errc::directory_not_empty);
+      return false;
+    }
+
+    unlink(i);
+    return true;
+  }
+
+  std::uintmax_t remove_all(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto key = path_key(p);
+    ec.clear();
+    if (_nodes.find(key) == _nodes.end()) {
+      return 0;
+    }
+
+    std::uintmax_t count = 0;
+    const auto prefix = key == "/" ? key : key + "/";
+    for (auto i = _nodes.lower_bound(prefix);
+         i != _nodes.end() && i->first.compare(0, prefix.size(), prefix) == 0;) {
+      if (i->first == "/") {
+        ++i;
+        continue;
+      }
+      i = unlink(i);
+      ++count;
+    }
+    if (key != "/") {
+      unlink(_nodes.find(key));
+      ++count;
+    }
+    return count;
+  }
+
+  void rename(const path& old_p, const path& new_p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto old_key = path_key(old_p);
+    const auto new_key = path_key(new_p);
+    const auto node = find(old_key, ec);
+    if (!node) {
+      return;
+    }
+    if (old_key == new_key) {
+      return;
+    }
+    if (old_key == "/" || new_key.compare(0, old_key.size() + 1, old_key + "/") == 0) {
+      ec = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+    if (!check_parent(new_key, ec)) {
+      return;
+    }
+
+    const auto target = _nodes.find(new_key);
+    if (target != _nodes.end()) {
+      if (target->second == node) {
+        // both are links to the same file; POSIX leaves them alone
+        return;
+      }
+      const auto is_dir = node->type == file_type::directory;
+      if (is_dir != (target->second->type == file_type::directory)) {
+        ec = std::make_error_code(is_dir ? std::errc::not_a_directory
+                                         : std::errc::is_a_directory);
+        return;
+      }
+      auto has_children = false;
+      for_each_child(new_key, [&](const std::string&) { has_children = true; });
+      if (has_children) {
+        ec = std::make_error_code(std::errc::directory_not_empty);
+        return;
+      }
+      unlink(target);
+    }
+
+    // move the node and everything below it
+    auto moved = std::vector<std::pair<std::string, std::shared_ptr<Node>>>();
+    moved.emplace_back(new_key, node);
+    const auto prefix = old_key + "/";
+    auto i = _nodes.lower_bound(prefix);
+    while (i != _nodes.end() && i->first.compare(0, prefix.size(), prefix) == 0) {
+      moved.emplace_back(new_key + i->first.substr(old_key.size()), i->second);
+      i = _nodes.erase(i);
+    }
+    _nodes.erase(old_key);
+    for (auto& entry : moved) {
+      _nodes[entry.first] = std::move(entry.second);
+    }
+  }
+
+  void resize_file(const path& p,
+                   file_size_type new_size,
+                   std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto content = read(key, ec);
+    if (!content) {
+      return;
+    }
+
+    auto resized = *content;
+    resized.resize(static_cast<std::size_t>(new_size), '\0');
+    write(key, resized, ec);
+  }
+
+  space_info space(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    (void)p;
+    space_info result;
+    result.capacity = static_cast<std::uintmax_t>(-1);
+    result.free = static_cast<std::uintmax_t>(-1);
+    result.available = static_cast<std::uintmax_t>(-1);
+    ec.clear();
+    return result;
+  }
+
+  file_status status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    try {
+      std::lock_guard<std::mutex> lock(_mutex);
+      const auto i = _nodes.find(path_key(p));
+      ec.clear();
+      if (i == _nodes.end()) {
+        return file_status(file_type::not_found);
+      }
+      return file_status(i->second->type, i->second->prms);
+    }
+    catch (const std::bad_alloc&) {
+      ec = std::make_error_code(std::errc::not_enough_memory);
+    }
+    return file_status(file_type::none);
+  }
+
+  file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return status(p, ec);
+  }
+
+private:
+  using Nodes = std::map<std::string, std::shared_ptr<Node>>;
+
+  std::shared_ptr<Node> find(const std::string& key, std::error_code& ec)
+  {
+    const auto i = _nodes.find(key);
+    if (i == _nodes.end()) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return nullptr;
+    }
+    ec.clear();
+    return i->second;
+  }
+
+  bool check_parent(const std::string& key, std::error_code& ec)
+  {
+    const auto parent = find(parent_key(key), ec);
+    if (!parent) {
+      return false;
+    }
+    if (parent->type != file_type::directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+      return false;
+    }
+    return true;
+  }
+
+  bool make_directory(const std::string& key, perms prms, std::error_code& ec)
+  {
+    const auto i = _nodes.find(key);
+    if (i != _nodes.end()) {
+      if (i->second->type != file_type::directory) {
+        ec = std::make_error_code(std::errc::file_exists);
+        return false;
+      }
+      ec.clear();
+      return false;
+    }
+    if (!check_parent(key, ec)) {
+      return false;
+    }
+
+    auto node = std::make_shared<Node>();
+    node->type = file_type::directory;
+    node->prms = prms;
+    node->mtime = now();
+    node->id = ++_last_id;
+    _nodes[key] = node;
+    return true;
+  }
+
+  template <typename Functor>
+  void for_each_child(const std::string& key, Functor functor)
+  {
+    const auto prefix = key == "/" ? key : key + "/";
+    for (auto i = _nodes.upper_bound(prefix);
+         i != _nodes.end() && i->first.compare(0, prefix.size(), prefix) == 0; ++i) {
+      if (i->first.find('/', prefix.size()) == std::string::npos) {
+        functor(i->first);
+      }
+    }
+  }
+
+  void release(const std::string& digest)
+  {
+    if (!digest.empty()) {
+      --_blobs[digest].refs;
+    }
+  }
+
+  Nodes::iterator unlink(Nodes::iterator i)
+  {
+    auto& node = *i->second;
+    if (--node.links == 0) {
+      release(node.digest);
+    }
+    return _nodes.erase(i);
+  }
+
+  std::unique_ptr<BlobStore> _store;
+  std::mutex _mutex;
+  std::condition_variable _collected;
+  Nodes _nodes;
+  std::unordered_map<std::string, Blob> _blobs;
+  // the digests of blobs collect_garbage() is erasing from the store
+  std::unordered_set<std::string> _collecting;
+  std::uint64_t _last_id = 0;
+};
+
+
+class DedupFileImpl : public detail::IFileImpl
+{
+public:
+  explicit DedupFileImpl(DedupFilesystem* fs)
+    : _fs(fs)
+    , _stream(nullptr)
+  {
+  }
+
+  ~DedupFileImpl() override
+  {
+    if (is_open()) {
+      std::error_code ec;
+      close(ec);
+    }
+  }
+
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    assert(!is_open());
+
+    _key = path_key(vfs::deroot(p));
+    if ((mode & (std::ios::out | std::ios::app)) == 0) {
+      auto content = _fs->read(_key, ec);
+      if (!content) {
+        _stream.setstate(std::ios::failbit);
+        return _stream;
+      }
+      _read_buf.assign(std::move(content));
+      _stream.rdbuf(&_read_buf);
+      _is_open = true;
+      return _stream;
+    }
+
+    _fs->prepare_write(_key, ec);
+    if (ec) {
+      _stream.setstate(std::ios::failbit);
+      return _stream;
+    }
+
+    auto content = std::string();
+    const auto keeps_content = (mode & std::ios::trunc) == 0
+                               && (mode & (std::ios::in | std::ios::app)) != 0;
+    if (keeps_content) {
+      const auto old_content = _fs->read(_key, ec);
+      if (!old_content) {
+        _stream.setstate(std::ios::failbit);
+        return _stream;
+      }
+      content = *old_content;
+    }
+
+    _write_buf = estd::make_unique<std::stringbuf>(
+      content, std::ios::in | std::ios::out | (mode & std::ios::app));
+    if ((mode & (std::ios::app | std::ios::ate)) != 0) {
+      _write_buf->pubseekoff(0, std::ios::end, std::ios::in | std::ios::out);
+    }
+    _stream.rdbuf(_write_buf.get());
+    _is_open = true;
+    return _stream;
+  }
+
+  std::iostream& stream() override
+  {
+    return _stream;
+  }
+
+  bool is_open() const override
+  {
+    return _is_open;
+  }
+
+  void close(std::error_code& ec) override
+  {
+    if (!_is_open) {
+      ec = std::make_error_code(std::errc::bad_file_descriptor);
+      return;
+    }
+
+    _is_open = false;
+    ec.clear();
+    if (_write_buf) {
+      _fs->write(_key, _write_buf->str(), ec);
+      _write_buf.reset();
+    }
+    else {
+      _read_buf.assign(nullptr);
+    }
+    _stream.rdbuf(nullptr);
+  }
+
+private:
+  DedupFilesystem* _fs;
+  std::string _key;
+  SharedContentBuf _read_buf;
+  std::unique_ptr<std::stringbuf> _write_buf;
+  std::iostream _stream;
+  bool _is_open = false;
+};
+
+
+std::unique_ptr<detail::IFileImpl>
+DedupFilesystem::make_file_impl()
+{
+  return estd::make_unique<DedupFileImpl>(this);
+}
+
+}  // namespace
+
+
+std::uintmax_t
+IDedupFilesystem::collect_garbage()
+{
+  std::error_code ec;
+  const auto freed = collect_garbage(ec);
+  if (ec) {
+    throw filesystem_error("can't collect garbage", ec);
+  }
+  return freed;
+}
+
+
+std::unique_ptr<IDedupFilesystem>
+make_dedup_filesystem()
+{
+  return estd::make_unique<DedupFilesystem>(estd::make_unique<MemoryBlobStore>());
+}
+
+
+std::unique_ptr<IDedupFilesystem>
+make_dedup_filesystem(const path& blob_dir, std::error_code& ec)
+{
+  if (!is_directory(blob_dir, ec)) {
+    if (!ec) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+    }
+    return nullptr;
+  }
+
+  auto store = estd::make_unique<DirectoryBlobStore>(blob_dir);
+  const auto existing = store->scan(ec);
+  if (ec) {
+    return nullptr;
+  }
+
+  auto fs = estd::make_unique<DedupFilesystem>(std::move(store));
+  for (const auto& blob : existing) {
+    fs->add_existing_blob(blob.first, blob.second);
+  }
+  return fs;
+}
+
+
+std::unique_ptr<IDedupFilesystem>
+make_dedup_filesystem(const path& blob_dir)
+{
+  std::error_code ec;
+  auto fs = make_dedup_filesystem(blob_dir, ec);
+  if (ec) {
+    throw filesystem_error("can't create dedup filesystem", blob_dir, ec);
+  }
+  return fs;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
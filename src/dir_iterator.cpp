@@ -8,10 +8,15 @@
 #include "fspp/estd/memory.hpp"
 
 #include "dir_iterator_private.hpp"
+#include "instrumentation_private.hpp"
 #include "vfs_private.hpp"
 
+#include <algorithm>
+#include <cstddef>
+#include <string>
 #include <system_error>
 #include <utility>
+#include <vector>
 
 namespace eyestep {
 namespace filesystem {
@@ -28,6 +33,7 @@ make_dir_iter_impl(const path& p, std::error_code& ec)
     return std::move(val.value());
   }
 
+  ScopedTiming timing(native_recorder(), Operation::make_dir_iterator, ec);
   return impl::make_dir_iterator(p, ec);
 }
 
@@ -47,6 +53,86 @@ make_dir_iter_impl(const path& p)
 }  // anon namespace
 
 
+std::size_t
+directory_iterator::IDirIterImpl::next_batch(directory_entry* entries,
+                                             std::size_t n,
+                                             std::error_code& ec)
+{
+  auto count = std::size_t(0);
+  ec.clear();
+  while (count < n && !is_end()) {
+    entries[count++] = object();
+    increment(ec);
+    if (ec) {
+      break;
+    }
+  }
+  return count;
+}
+
+
+ListingDirIter::ListingDirIter(const path& p, std::vector<std::string> names)
+  : _parent_path(p)
+  , _names(std::move(names))
+{
+}
+
+
+void
+ListingDirIter::increment(std::error_code& ec)
+{
+  if (!is_end()) {
+    ++_pos;
+    _is_store_set = false;
+  }
+  ec.clear();
+}
+
+
+const directory_entry&
+ListingDirIter::object() const
+{
+  if (!_is_store_set) {
+    _is_store_set = true;
+    _store.assign(_parent_path / u8path(_names[_pos]));
+  }
+  return _store;
+}
+
+
+bool
+ListingDirIter::equal(const IDirIterImpl* other) const
+{
+  const auto other_listing = dynamic_cast<const ListingDirIter*>(other);
+  if (other_listing) {
+    return _parent_path == other_listing->_parent_path && _pos == other_listing->_pos;
+  }
+
+  return false;
+}
+
+
+bool
+ListingDirIter::is_end() const
+{
+  return _pos == _names.size();
+}
+
+
+std::size_t
+ListingDirIter::next_batch(directory_entry* entries, std::size_t n, std::error_code& ec)
+{
+  const auto count = std::min(n, _names.size() - _pos);
+  for (auto i = std::size_t(0); i < count; ++i) {
+    entries[i].assign(_parent_path / u8path(_names[_pos + i]));
+  }
+  _pos += count;
+  _is_store_set = false;
+  ec.clear();
+  return count;
+}
+
+
 directory_iterator::~directory_iterator() = default;
 
 
@@ -115,6 +201,19 @@ directory_iterator::increment(std::error_code& ec) NOEXCEPT
 }
 
 
+std::size_t
+directory_iterator::next_batch(directory_entry* entries,
+                               std::size_t n,
+                               std::error_code& ec) NOEXCEPT
+{
+  if (!_impl) {
+    ec.clear();
+    return 0;
+  }
+  return _impl->next_batch(entries, n, ec);
+}
+
+
 bool
 directory_iterator::operator==(const directory_iterator& rhs) const
 {
@@ -10,8 +10,11 @@
 
 #include "fspp/details/dir_iterator.hpp"
 
+#include <cstddef>
 #include <memory>
+#include <string>
 #include <system_error>
+#include <vector>
 
 namespace eyestep {
 namespace filesystem {
@@ -26,12 +29,83 @@ public:
   virtual bool equal(const IDirIterImpl* other) const = 0;
   virtual bool is_end() const = 0;
 
+  /*! Stores up to @p n entries in @p entries, starting with the current one, and
+   *  advances past them.  Returns the number of entries stored, which is less than @p n
+   *  only at the end or on error.
+   *
+   * The default implementation calls object() and increment() per entry; backends
+   * override it to read many entries at once. */
+  virtual std::size_t next_batch(directory_entry* entries,
+                                 std::size_t n,
+                                 std::error_code& ec);
+
 protected:
   IDirIterImpl() = default;
   IDirIterImpl(const IDirIterImpl&) = default;
 };
 
 
+/*! Iterates over a list of names read before, as VFS backends keeping directory
+ *  listings do.  The entries are the names appended to the directory's path. */
+class ListingDirIter : public directory_iterator::IDirIterImpl
+{
+public:
+  ListingDirIter(const path& p, std::vector<std::string> names);
+
+  void increment(std::error_code& ec) override;
+  const directory_entry& object() const override;
+  bool equal(const IDirIterImpl* other) const override;
+  bool is_end() const override;
+  std::size_t next_batch(directory_entry* entries,
+                         std::size_t n,
+                         std::error_code& ec) override;
+
+private:
+  mutable directory_entry _store;
+  mutable bool _is_store_set = false;
+  path _parent_path;
+  std::vector<std::string> _names;
+  std::size_t _pos = 0;
+};
+
+
+/*! The number of entries bulk consumers read per next_batch() call at most.  They
+ *  start with smaller batches, such that small directories stay cheap. */
+const std::size_t k_dir_batch_size = 256;
+
+
+/*! Calls @p functor with each remaining entry of @p iter, which is a directory_iterator
+ *  or an IDirIterImpl, reading up to k_dir_batch_size entries at a time.  Stops early
+ *  when @p functor returns false.  Returns false if reading failed (with @p ec set) or
+ *  @p functor stopped. */
+template <typename Iter, typename Functor>
+bool
+for_each_entry(Iter& iter, std::error_code& ec, Functor functor)
+{
+  auto batch = std::vector<directory_entry>(16);
+  for (;;) {
+    std::error_code read_ec;
+    const auto count = iter.next_batch(batch.data(), batch.size(), read_ec);
+    for (auto i = std::size_t(0); i < count; ++i) {
+      if (!functor(batch[i])) {
+        return false;
+      }
+    }
+    if (read_ec) {
+      ec = read_ec;
+      return false;
+    }
+    if (count < batch.size()) {
+      ec.clear();
+      return true;
+    }
+    if (batch.size() < k_dir_batch_size) {
+      batch.resize(batch.size() * 2);
+    }
+  }
+}
+
+
 namespace impl {
 
 std::unique_ptr<directory_iterator::IDirIterImpl>
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "epoch_domain.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+std::size_t
+this_thread_slot()
+{
+  static std::atomic<std::size_t> s_next_slot(0);
+  thread_local const auto slot = s_next_slot.fetch_add(1);
+  return slot;
+}
+
+
+const std::size_t EpochDomain::k_slot_count;
+
+
+EpochDomain::EpochDomain()
+  : _phase(0)
+{
+  for (auto& slot : _slots) {
+    slot.count[0].store(0);
+    slot.count[1].store(0);
+  }
+}
+
+
+std::size_t
+EpochDomain::enter()
+{
+  const auto idx = this_thread_slot() % k_slot_count;
+  const auto phase = _phase.load();
+  _slots[idx].count[phase].fetch_add(1);
+  return idx * 2 + phase;
+}
+
+
+void
+EpochDomain::leave(std::size_t token)
+{
+  _slots[token / 2].count[token % 2].fetch_sub(1);
+}
+
+
+bool
+EpochDomain::try_flip()
+{
+  const auto other = _phase.load() ^ 1;
+  for (const auto& slot : _slots) {
+    if (slot.count[other].load() != 0) {
+      return false;
+    }
+  }
+
+  _phase.store(other);
+  return true;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,83 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+/*! Returns a small number identifying the calling thread.  Numbers are handed out in
+ *  the order threads ask for them first. */
+std::size_t
+this_thread_slot();
+
+
+/*! Tracks which operations on a data structure may still be running, such that memory
+ *  unlinked from it can be reused safely.
+ *
+ * Each operation brackets its access with enter() and leave() (see Guard), which counts
+ * it in one of two phases.  Something unlinked during phase p may still be referred to
+ * by operations counted in either phase; it can be reused once the phase has been
+ * flipped away from p and the operations counted in p are drained.  The owner of the
+ * retired items drives this by calling try_flip() (serialized by the owner).
+ */
+class EpochDomain
+{
+public:
+  static const std::size_t k_slot_count = 64;
+
+  class Guard
+  {
+  public:
+    explicit Guard(EpochDomain& domain)
+      : _domain(domain)
+      , _token(domain.enter())
+    {
+    }
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+    ~Guard() { _domain.leave(_token); }
+
+  private:
+    EpochDomain& _domain;
+    std::size_t _token;
+  };
+
+  EpochDomain();
+  EpochDomain(const EpochDomain&) = delete;
+  EpochDomain& operator=(const EpochDomain&) = delete;
+
+  std::size_t enter();
+  void leave(std::size_t token);
+
+  /*! Returns the current phase (0 or 1). */
+  std::uint32_t phase() const { return _phase.load(); }
+  /*! Flips the phase if no operation counted in the other phase is running anymore.
+   *  Returns true if it did: items retired before the previous flip can be reused. */
+  bool try_flip();
+
+private:
+  struct Slot
+  {
+    std::atomic<std::uint32_t> count[2];
+    char padding[64 - 2 * sizeof(std::atomic<std::uint32_t>)];
+  };
+
+  Slot _slots[k_slot_count];
+  std::atomic<std::uint32_t> _phase;
+};
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,578 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "dir_iterator_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/instrumentation.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <streambuf>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+
+/*! Limits the bytes passing per second.  Callers are queued: each one waits until the
+ *  bytes of all callers before have passed. */
+class Throttle
+{
+public:
+  explicit Throttle(std::uint64_t bytes_per_second)
+    : _bytes_per_second(bytes_per_second)
+  {
+  }
+
+  bool is_limited() const
+  {
+    return _bytes_per_second != 0;
+  }
+
+  void pass(std::size_t bytes)
+  {
+    if (!is_limited() || bytes == 0) {
+      return;
+    }
+
+    const auto duration = std::chrono::nanoseconds(
+      std::uint64_t(bytes) * 1000000000u / _bytes_per_second);
+    auto until = Clock::time_point();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _next = std::max(_next, Clock::now()) + duration;
+      until = _next;
+    }
+    std::this_thread::sleep_until(until);
+  }
+
+private:
+  const std::uint64_t _bytes_per_second;
+  std::mutex _mutex;
+  Clock::time_point _next;
+};
+
+
+/*! Passes reads and writes through to another stream buffer in blocks, letting each
+ *  block pass a throttle first. */
+class ThrottledBuf : public std::streambuf
+{
+public:
+  ThrottledBuf(Throttle* read_throttle, Throttle* write_throttle)
+    : _read_throttle(read_throttle)
+    , _write_throttle(write_throttle)
+    , _buffer(4096)
+  {
+  }
+
+  void attach(std::streambuf* inner)
+  {
+    _inner = inner;
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+  }
+
+  bool is_attached() const
+  {
+    return _inner != nullptr;
+  }
+
+  int detach()
+  {
+    const auto result = sync();
+    _inner = nullptr;
+    return result;
+  }
+
+protected:
+  int_type underflow() override
+  {
+    if (flush_output() != 0) {
+      return traits_type::eof();
+    }
+
+    const auto bytes_read =
+      _inner->sgetn(_buffer.data(), static_cast<std::streamsize>(_buffer.size()));
+    if (bytes_read <= 0) {
+      setg(nullptr, nullptr, nullptr);
+      return traits_type::eof();
+    }
+
+    _read_throttle->pass(std::size_t(bytes_read));
+    setg(_buffer.data(), _buffer.data(), _buffer.data() + bytes_read);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  int_type overflow(int_type c) override
+  {
+    if (drop_input() != 0 || flush_output() != 0) {
+      return traits_type::eof();
+    }
+
+    setp(_buffer.data(), _buffer.data() + _buffer.size());
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override
+  {
+    if (flush_output() != 0 || drop_input() != 0) {
+      return -1;
+    }
+    return _inner->pubsync();
+  }
+
+  pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override
+  {
+    if (flush_output() != 0) {
+      return pos_type(off_type(-1));
+    }
+    if (dir == std::ios::cur) {
+      // the inner position is ahead by the input read, but not consumed yet
+      off -= egptr() - gptr();
+    }
+    setg(nullptr, nullptr, nullptr);
+    return _inner->pubseekoff(off, dir, which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios::openmode which) override
+  {
+    if (flush_output() != 0) {
+      return pos_type(off_type(-1));
+    }
+    setg(nullptr, nullptr, nullptr);
+    return _inner->pubseekpos(pos, which);
+  }
+
+private:
+  int flush_output()
+  {
+    const auto count = pptr() - pbase();
+    if (count > 0) {
+      _write_throttle->pass(std::size_t(count));
+      if (_inner->sputn(pbase(), count) != count) {
+        return -1;
+      }
+    }
+    setp(nullptr, nullptr);
+    return 0;
+  }
+
+  int drop_input()
+  {
+    if (gptr() < egptr()
+        && _inner->pubseekoff(gptr() - egptr(), std::ios::cur, std::ios::in)
+             == pos_type(off_type(-1))) {
+      return -1;
+    }
+    setg(nullptr, nullptr, nullptr);
+    return 0;
+  }
+
+  Throttle* _read_throttle;
+  Throttle* _write_throttle;
+  std::streambuf* _inner = nullptr;
+  std::vector<char> _buffer;
+};
+
+
+class FaultInjectingFilesystem : public IFilesystem
+{
+public:
+  FaultInjectingFilesystem(std::unique_ptr<IFilesystem> fs, const FaultOptions& options)
+    : _fs(std::move(fs))
+    , _options(options)
+    , _random(options.seed)
+    , _read_throttle(options.read_bytes_per_second)
+    , _write_throttle(options.write_bytes_per_second)
+  {
+  }
+
+  /*! Delays a call of @p op and returns true with @p ec set if it is to fail. */
+  bool inject(Operation op, std::error_code& ec)
+  {
+    const auto i = _options.operations.find(op);
+    const auto& faults = i != _options.operations.end() ? i->second : _options.defaults;
+
+    auto delay_us = faults.latency.base_us;
+    auto fails = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (faults.latency.jitter_us > 0) {
+        auto jitter =
+          std::exponential_distribution<double>(1.0 / double(faults.latency.jitter_us));
+        delay_us += std::uint64_t(jitter(_random));
+      }
+      if (faults.error_rate > 0) {
+        fails = std::uniform_real_distribution<double>(0.0, 1.0)(_random)
+                < faults.error_rate;
+      }
+    }
+    if (faults.latency.max_us > 0) {
+      delay_us = std::min(delay_us, faults.latency.max_us);
+    }
+
+    if (delay_us > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+    }
+    if (fails) {
+      ec = std::make_error_code(faults.error);
+      return true;
+    }
+    return false;
+  }
+
+  Throttle* read_throttle()
+  {
+    return &_read_throttle;
+  }
+
+  Throttle* write_throttle()
+  {
+    return &_write_throttle;
+  }
+
+  std::unique_ptr<detail::IFileImpl> make_file_impl() override;
+
+  std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
+    const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::make_dir_iterator, ec)) {
+      return {};
+    }
+    return _fs->make_dir_iterator(p, ec);
+  }
+
+  void dump(std::ostream& os) override
+  {
+    _fs->dump(os);
+  }
+
+  path canonical(const path& p, const path& base, std::error_code& ec) override
+  {
+    if (inject(Operation::canonical, ec)) {
+      return path();
+    }
+    return _fs->canonical(p, base, ec);
+  }
+
+  bool copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 std::error_code& ec) override
+  {
+    if (inject(Operation::copy_file, ec)) {
+      return false;
+    }
+    return _fs->copy_file(from, to, options, ec);
+  }
+
+  void copy_symlink(const path& from, const path& to, std::error_code& ec) override
+  {
+    if (!inject(Operation::copy_symlink, ec)) {
+      _fs->copy_symlink(from, to, ec);
+    }
+  }
+
+  bool create_directory(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::create_directory, ec)) {
+      return false;
+    }
+    return _fs->create_directory(p, ec);
+  }
+
+  bool create_directory(const path& p,
+                        const path& existing_p,
+                        std::error_code& ec) override
+  {
+    if (inject(Operation::create_directory, ec)) {
+      return false;
+    }
+    return _fs->create_directory(p, existing_p, ec);
+  }
+
+  bool create_directories(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::create_directories, ec)) {
+      return false;
+    }
+    return _fs->create_directories(p, ec);
+  }
+
+  void create_hard_link(const path& target,
+                        const path& link,
+                        std::error_code& ec) override
+  {
+    if (!inject(Operation::create_hard_link, ec)) {
+      _fs->create_hard_link(target, link, ec);
+    }
+  }
+
+  void create_symlink(const path& target,
+                      const path& link,
+                      std::error_code& ec) override
+  {
+    if (!inject(Operation::create_symlink, ec)) {
+      _fs->create_symlink(target, link, ec);
+    }
+  }
+
+  void create_directory_symlink(const path& target,
+                                const path& link,
+                                std::error_code& ec) override
+  {
+    if (!inject(Operation::create_directory_symlink, ec)) {
+      _fs->create_directory_symlink(target, link, ec);
+    }
+  }
+
+  bool equivalent(const path& p1, const path& p2, std::error_code& ec) override
+  {
+    if (inject(Operation::equivalent, ec)) {
+      return false;
+    }
+    return _fs->equivalent(p1, p2, ec);
+  }
+
+  file_size_type file_size(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::file_size, ec)) {
+      return static_cast<file_size_type>(-1);
+    }
+    return _fs->file_size(p, ec);
+  }
+
+  file_id file_identity(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::file_identity, ec)) {
+      return {};
+    }
+    return _fs->file_identity(p, ec);
+  }
+
+  std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::hard_link_count, ec)) {
+      return static_cast<std::uintmax_t>(-1);
+    }
+    return _fs->hard_link_count(p, ec);
+  }
+
+  file_time_type last_write_time(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::last_write_time, ec)) {
+      return {};
+    }
+    return _fs->last_write_time(p, ec);
+  }
+
+  void last_write_time(const path& p,
+                       file_time_type new_time,
+                       std::error_code& ec) override
+  {
+    if (!inject(Operation::set_last_write_time, ec)) {
+      _fs->last_write_time(p, new_time, ec);
+    }
+  }
+
+  void permissions(const path& p, perms prms, std::error_code& ec) override
+  {
+    if (!inject(Operation::permissions, ec)) {
+      _fs->permissions(p, prms, ec);
+    }
+  }
+
+  path read_symlink(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::read_symlink, ec)) {
+      return path();
+    }
+    return _fs->read_symlink(p, ec);
+  }
+
+  bool remove(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::remove, ec)) {
+      return false;
+    }
+    return _fs->remove(p, ec);
+  }
+
+  std::uintmax_t remove_all(const path& p, std::error_code& ec) override
+  {
+    if (inject(Operation::remove_all, ec)) {
+      return 0;
+    }
+    return _fs->remove_all(p, ec);
+  }
+
+  void rename(const path& old_p, const path& new_p, std::error_code& ec) override
+  {
+    if (!inject(Operation::rename, ec)) {
+      _fs->rename(old_p, new_p, ec);
+    }
+  }
+
+  void resize_file(const path& p,
+                   file_size_type new_size,
+                   std::error_code& ec) override
+  {
+    if (!inject(Operation::resize_file, ec)) {
+      _fs->resize_file(p, new_size, ec);
+    }
+  }
+
+  space_info space(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    if (inject(Operation::space, ec)) {
+      space_info result;
+      result.capacity = static_cast<std::uintmax_t>(-1);
+      result.free = static_cast<std::uintmax_t>(-1);
+      result.available = static_cast<std::uintmax_t>(-1);
+      return result;
+    }
+    return _fs->space(p, ec);
+  }
+
+  file_status status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    if (inject(Operation::status, ec)) {
+      return file_status(file_type::none);
+    }
+    return _fs->status(p, ec);
+  }
+
+  file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    if (inject(Operation::symlink_status, ec)) {
+      return file_status(file_type::none);
+    }
+    return _fs->symlink_status(p, ec);
+  }
+
+private:
+  std::unique_ptr<IFilesystem> _fs;
+  const FaultOptions _options;
+  std::mutex _mutex;
+  std::mt19937_64 _random;
+  Throttle _read_throttle;
+  Throttle _write_throttle;
+};
+
+
+class FaultInjectingFileImpl : public detail::IFileImpl
+{
+public:
+  FaultInjectingFileImpl(FaultInjectingFilesystem* fs,
+                         std::unique_ptr<detail::IFileImpl> impl)
+    : _fs(fs)
+    , _impl(std::move(impl))
+    , _buf(fs->read_throttle(), fs->write_throttle())
+    , _stream(&_buf)
+  {
+  }
+
+  ~FaultInjectingFileImpl() override
+  {
+    if (is_open()) {
+      std::error_code ec;
+      close(ec);
+    }
+  }
+
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    assert(!is_open());
+
+    if (_fs->inject(Operation::open_file, ec)) {
+      _stream.setstate(std::ios::failbit);
+      return _stream;
+    }
+
+    auto& inner = _impl->open(p, mode, ec);
+    const auto is_throttled =
+      _fs->read_throttle()->is_limited() || _fs->write_throttle()->is_limited();
+    if (ec || !_impl->is_open() || !is_throttled) {
+      return inner;
+    }
+
+    _buf.attach(inner.rdbuf());
+    _stream.clear();
+    return _stream;
+  }
+
+  std::iostream& stream() override
+  {
+    return _buf.is_attached() ? _stream : _impl->stream();
+  }
+
+  bool is_open() const override
+  {
+    return _impl->is_open();
+  }
+
+  void close(std::error_code& ec) override
+  {
+    if (_buf.is_attached() && _buf.detach() != 0) {
+      _impl->close(ec);
+      ec = std::make_error_code(std::errc::io_error);
+      return;
+    }
+    _impl->close(ec);
+  }
+
+private:
+  FaultInjectingFilesystem* _fs;
+  std::unique_ptr<detail::IFileImpl> _impl;
+  ThrottledBuf _buf;
+  std::iostream _stream;
+};
+
+
+std::unique_ptr<detail::IFileImpl>
+FaultInjectingFilesystem::make_file_impl()
+{
+  return estd::make_unique<FaultInjectingFileImpl>(this, _fs->make_file_impl());
+}
+
+}  // namespace
+
+
+std::unique_ptr<IFilesystem>
+make_fault_injecting_filesystem(std::unique_ptr<IFilesystem> fs,
+                                const FaultOptions& options)
+{
+  assert(fs);
+  return estd::make_unique<FaultInjectingFilesystem>(std::move(fs), options);
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
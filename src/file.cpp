@@ -5,6 +5,7 @@
 #include "fspp/details/filesystem_error.hpp"
 #include "fspp/details/path.hpp"
 
+#include "instrumentation_private.hpp"
 #include "vfs_private.hpp"
 
 #include <cassert>
@@ -40,6 +41,7 @@ public:
   {
     assert(!is_open());
 
+    ScopedTiming timing(native_recorder(), Operation::open_file, ec);
     _stream.open(p.c_str(), mode);
     if (_stream.fail()) {
       ec = std::make_error_code(std::errc::io_error);
@@ -0,0 +1,187 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/instrumentation.hpp"
+#include "fspp/details/path.hpp"
+#include "fspp/details/platform.hpp"
+#include "fspp/details/types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! Runs the work of asynchronous operations, see AsyncFilesystem. */
+class IExecutor
+{
+public:
+  virtual ~IExecutor() = default;
+
+  /*! Runs @p work later, usually on another thread. */
+  virtual void post(std::function<void()> work) = 0;
+};
+
+
+/*! Returns an executor running work on @p threads threads (0 for one per core) in the
+ *  order it is posted.  Destroying the executor runs the work still pending first. */
+FSPP_API std::shared_ptr<IExecutor>
+make_thread_pool_executor(std::size_t threads = 0);
+
+
+/*! An operation started on an AsyncFilesystem.  Members which don't apply to @c op are
+ *  ignored. */
+struct AsyncRequest
+{
+  Operation op = Operation::status;
+  path p;
+  /*! The target of copy_file and rename */
+  path p2;
+  copy_options options = copy_options::none;
+};
+
+
+/*! The result of an AsyncRequest.  Only the members which apply to the operation are
+ *  set. */
+struct AsyncResult
+{
+  std::error_code ec;
+  file_status status;
+  /*! The result of file_size and remove_all */
+  std::uintmax_t count = 0;
+  /*! The result of copy_file, create_directory, create_directories and remove */
+  bool flag = false;
+  file_time_type time = 0;
+};
+
+
+using AsyncHandler = std::function<void(const AsyncResult&)>;
+
+
+namespace vfs {
+
+/*! Implemented by VFS backends (in addition to IFilesystem) which run operations of an
+ *  AsyncFilesystem natively, i.e. without taking an executor thread. */
+class IAsyncFilesystem
+{
+public:
+  virtual ~IAsyncFilesystem() = default;
+
+  /*! Starts @p request, whose paths are relative to the filesystem's root, and returns
+   *  true if the filesystem runs the operation natively.  It must then call @p done
+   *  exactly once, from any thread, when the operation is finished.  Otherwise returns
+   *  false without calling @p done and the operation runs on the executor. */
+  virtual bool start_async(const AsyncRequest& request, const AsyncHandler& done) = 0;
+};
+
+}  // namespace vfs
+
+
+/*! Settings of an AsyncFilesystem. */
+struct AsyncOptions
+{
+  /*! Runs the operations which don't run natively.  A thread pool with a thread per
+   *  core is used if not set. */
+  std::shared_ptr<IExecutor> executor;
+  /*! Submit operations on native paths to io_uring on Linux kernels supporting them */
+  bool use_io_uring = true;
+  /*! The number of operations in flight in io_uring at most; further operations run
+   *  on the executor. */
+  unsigned queue_depth = 256;
+};
+
+
+/*! Runs filesystem operations without blocking the calling thread.
+ *
+ * Every operation comes in two overloads: one returns a future, which throws
+ * filesystem_error like the synchronous function in case of an error; the other calls
+ * a handler with the result and the error code.
+ *
+ * On Linux status(), symlink_status(), file_size(), last_write_time(),
+ * create_directory(), remove() and rename() on native paths are submitted to io_uring
+ * where the kernel supports them.  VFS backends implementing vfs::IAsyncFilesystem run
+ * operations natively, too.  All other operations call the synchronous function on the
+ * executor.  Handlers are called on the thread completing the operation, i.e. an
+ * executor thread, the io_uring completion thread or a backend's thread, and must
+ * neither block nor throw.
+ */
+class FSPP_API AsyncFilesystem
+{
+public:
+  template <typename T>
+  using Handler = std::function<void(T, std::error_code)>;
+  using VoidHandler = std::function<void(std::error_code)>;
+
+  explicit AsyncFilesystem(const AsyncOptions& options = AsyncOptions());
+  /*! Waits for all operations to finish. */
+  ~AsyncFilesystem();
+
+  AsyncFilesystem(const AsyncFilesystem&) = delete;
+  AsyncFilesystem& operator=(const AsyncFilesystem&) = delete;
+
+  /*! Indicates whether operations on native paths are submitted to io_uring. */
+  bool uses_io_uring() const NOEXCEPT;
+
+  /*! Starts @p request and calls @p done with its result.  Fails with
+   *  std::errc::operation_not_supported for operations not listed in the class
+   *  documentation besides copy_file, create_directories and remove_all. */
+  void start(const AsyncRequest& request, AsyncHandler done);
+
+  /*! Waits until all operations started so far are finished. */
+  void wait();
+
+  std::future<file_status> status(const path& p);
+  void status(const path& p, Handler<file_status> handler);
+
+  std::future<file_status> symlink_status(const path& p);
+  void symlink_status(const path& p, Handler<file_status> handler);
+
+  std::future<file_size_type> file_size(const path& p);
+  void file_size(const path& p, Handler<file_size_type> handler);
+
+  std::future<file_time_type> last_write_time(const path& p);
+  void last_write_time(const path& p, Handler<file_time_type> handler);
+
+  std::future<bool> create_directory(const path& p);
+  void create_directory(const path& p, Handler<bool> handler);
+
+  std::future<bool> create_directories(const path& p);
+  void create_directories(const path& p, Handler<bool> handler);
+
+  std::future<bool> copy_file(const path& from,
+                              const path& to,
+                              copy_options options = copy_options::none);
+  void copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 Handler<bool> handler);
+
+  std::future<void> rename(const path& old_p, const path& new_p);
+  void rename(const path& old_p, const path& new_p, VoidHandler handler);
+
+  std::future<bool> remove(const path& p);
+  void remove(const path& p, Handler<bool> handler);
+
+  std::future<std::uintmax_t> remove_all(const path& p);
+  void remove_all(const path& p, Handler<std::uintmax_t> handler);
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> _impl;
+};
+
+}  // namespace filesystem
+}  // namespace eyestep
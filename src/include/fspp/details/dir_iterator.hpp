@@ -8,11 +8,13 @@
 #include "fspp/details/fspp-config.hpp"
 #endif
 
+#include "fspp/details/file_id.hpp"
 #include "fspp/details/file_status.hpp"
 #include "fspp/details/path.hpp"
 #include "fspp/details/types.hpp"
 #include "fspp/estd/optional.hpp"
 
+#include <cstddef>
 #include <iterator>
 #include <memory>
 #include <system_error>
@@ -72,11 +74,24 @@ public:
   file_size_type file_size() const;
   file_size_type file_size(std::error_code& ec) const NOEXCEPT;
 
+  /*! Returns the identity of the file this entry refers to
+   *
+   * @returns if *this contains a cached file id, return it.  Otherwise return
+   * file_identity(path()) or file_identity(path(), ec) respectively and cache the result.
+   *
+   * Extension to ISO/IEC TS 18822:2015. */
+  filesystem::file_id file_id() const;
+  filesystem::file_id file_id(std::error_code& ec) const NOEXCEPT;
+
   /*! Assigns new content to the directory entry object. Sets the path to p. */
   void assign(const filesystem::path& p);
 
   void assign(const filesystem::path& p, file_size_type file_size);
 
+  void assign(const filesystem::path& p,
+              file_size_type file_size,
+              const filesystem::file_id& id);
+
   /*! Changes the filename of the directory entry.
    *
    * This function does not commit any changes to the filesystem. */
@@ -93,6 +108,7 @@ public:
 private:
   filesystem::path _path;
   estd::optional<file_size_type> _file_size;
+  mutable estd::optional<filesystem::file_id> _file_id;
 };
 
 
@@ -165,6 +181,19 @@ public:
    * In case of an error @p ec is set.  If successful @p ec is cleared. */
   directory_iterator& increment(std::error_code& ec) NOEXCEPT;
 
+  /*! Stores up to @p n entries in @p entries, starting with the pointed-to one, and
+   *  advances the iterator past them.
+   *
+   * Returns the number of entries stored.  It is less than @p n only if the iterator
+   * reached the end or an error occurred, in which case @p ec is set.  Backends read
+   * many entries at once this way, which is considerably cheaper for large directories
+   * than one increment() per entry.  Calling it on the end iterator returns 0.
+   *
+   * Extension to ISO/IEC TS 18822:2015. */
+  std::size_t next_batch(directory_entry* entries,
+                         std::size_t n,
+                         std::error_code& ec) NOEXCEPT;
+
   bool operator==(const directory_iterator& rhs) const;
   bool operator!=(const directory_iterator& rhs) const;
 
@@ -23,6 +23,7 @@ inline directory_entry::directory_entry(const filesystem::path& p)
 inline directory_entry::directory_entry(directory_entry&& rhs)
   : _path(std::move(rhs._path))
   , _file_size(std::move(rhs._file_size))
+  , _file_id(std::move(rhs._file_id))
 {
 }
 
@@ -32,6 +33,7 @@ directory_entry::operator=(directory_entry&& rhs)
 {
   _path = std::move(rhs._path);
   _file_size = std::move(rhs._file_size);
+  _file_id = std::move(rhs._file_id);
   return *this;
 }
 #endif
@@ -92,11 +94,38 @@ directory_entry::file_size(std::error_code& ec) const NOEXCEPT
 }
 
 
+inline file_id
+directory_entry::file_id() const
+{
+  if (!_file_id) {
+    _file_id = filesystem::file_identity(path());
+  }
+  return _file_id.value();
+}
+
+
+inline file_id
+directory_entry::file_id(std::error_code& ec) const NOEXCEPT
+{
+  if (_file_id) {
+    ec.clear();
+    return _file_id.value();
+  }
+
+  const auto id = filesystem::file_identity(path(), ec);
+  if (!ec) {
+    _file_id = id;
+  }
+  return id;
+}
+
+
 inline void
 directory_entry::assign(const filesystem::path& p)
 {
   _path = p;
   _file_size.reset();
+  _file_id.reset();
 }
 
 
@@ -105,6 +134,18 @@ directory_entry::assign(const filesystem::path& p, file_size_type file_size)
 {
   _path = p;
   _file_size = file_size;
+  _file_id.reset();
+}
+
+
+inline void
+directory_entry::assign(const filesystem::path& p,
+                        file_size_type file_size,
+                        const filesystem::file_id& id)
+{
+  _path = p;
+  _file_size = file_size;
+  _file_id = id;
 }
 
 
@@ -113,6 +154,7 @@ directory_entry::replace_filename(const filesystem::path& p)
 {
   _path = _path.parent_path() / p;
   _file_size.reset();
+  _file_id.reset();
 }
 
 
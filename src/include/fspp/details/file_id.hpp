@@ -0,0 +1,97 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/platform.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! Identifies a filesystem object independent of the path(s) it is reached by.
+ *
+ * Two paths refer to the same file (they are equivalent()) iff their file_ids compare
+ * equal.  On POSIX systems this is the pair of `st_dev` and `st_ino` as reported by
+ * `stat()`, on Windows the volume serial number and the file index.  Virtual filesystems
+ * provide their own unique pairs.
+ *
+ * file_id is hashable and ordered, i.e. it can be used as key in std::unordered_set or
+ * std::set to detect hard links or directory loops from one stat per file.
+ */
+class file_id
+{
+public:
+  /*! Constructs an invalid file_id.  Invalid ids compare equal to each other. */
+  file_id() = default;
+
+  file_id(std::uintmax_t device, std::uintmax_t inode)
+    : _device(device)
+    , _inode(inode)
+    , _is_valid(true)
+  {
+  }
+
+  /*! @returns the id of the device (or volume) the file lives on. */
+  std::uintmax_t device() const { return _device; }
+  /*! @returns the id of the file on its device. */
+  std::uintmax_t inode() const { return _inode; }
+
+  /*! Indicates whether this is a valid id.  The default c'tor returns an invalid one. */
+  bool is_valid() const { return _is_valid; }
+
+  friend bool operator==(const file_id& lhs, const file_id& rhs)
+  {
+    return lhs._device == rhs._device && lhs._inode == rhs._inode
+           && lhs._is_valid == rhs._is_valid;
+  }
+
+  friend bool operator!=(const file_id& lhs, const file_id& rhs) { return !(lhs == rhs); }
+
+  friend bool operator<(const file_id& lhs, const file_id& rhs)
+  {
+    return lhs._device != rhs._device
+             ? lhs._device < rhs._device
+             : lhs._inode != rhs._inode ? lhs._inode < rhs._inode
+                                        : lhs._is_valid < rhs._is_valid;
+  }
+
+private:
+  std::uintmax_t _device = 0;
+  std::uintmax_t _inode = 0;
+  bool _is_valid = false;
+};
+
+
+/*! Returns a hash value for @p id. */
+inline std::size_t
+hash_value(const file_id& id) NOEXCEPT
+{
+  const auto h1 = std::hash<std::uintmax_t>()(id.device());
+  const auto h2 = std::hash<std::uintmax_t>()(id.inode());
+  return h1 ^ (h2 + 0x9e3779b9 + (h1 << 6) + (h1 >> 2));
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
+
+
+namespace std {
+template <>
+struct hash<eyestep::filesystem::file_id>
+{
+  std::size_t operator()(const eyestep::filesystem::file_id& id) const NOEXCEPT
+  {
+    return eyestep::filesystem::hash_value(id);
+  }
+};
+}  // namespace std
@@ -0,0 +1,117 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/platform.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! The filesystem operations statistics are recorded for.  Operations which are
+ *  composed of others (e.g. copy() or create_directories() on the native filesystem) are
+ *  recorded as the operations they are made of. */
+enum class Operation : int
+{
+  make_dir_iterator,
+  open_file,
+  canonical,
+  copy_file,
+  copy_symlink,
+  create_directory,
+  create_directories,
+  create_hard_link,
+  create_symlink,
+  create_directory_symlink,
+  equivalent,
+  file_size,
+  file_identity,
+  hard_link_count,
+  last_write_time,
+  set_last_write_time,
+  permissions,
+  read_symlink,
+  remove,
+  remove_all,
+  rename,
+  resize_file,
+  space,
+  status,
+  symlink_status,
+};
+
+/*! The number of values of Operation. */
+const std::size_t k_operation_count = std::size_t(Operation::symlink_status) + 1;
+
+/*! The number of buckets of a latency histogram.  Bucket 0 counts calls taking less than
+ *  one microsecond, bucket i > 0 calls taking less than 2^i but at least 2^(i-1)
+ *  microseconds.  The last bucket also counts all slower calls. */
+const std::size_t k_latency_buckets = 24;
+
+
+/*! Returns the name of operation @p op, e.g. "status". */
+FSPP_API const char*
+operation_name(Operation op);
+
+
+/*! The calls recorded for one operation. */
+struct OperationStatistics
+{
+  std::uint64_t calls = 0;
+  /*! The calls which set an error code */
+  std::uint64_t errors = 0;
+  /*! The sum of the calls' durations */
+  std::uint64_t total_ns = 0;
+  std::array<std::uint64_t, k_latency_buckets> latency = {};
+};
+
+
+/*! A snapshot of the statistics recorded for all operations. */
+struct FilesystemStatistics
+{
+  std::array<OperationStatistics, k_operation_count> operations = {};
+
+  const OperationStatistics& operator[](Operation op) const
+  {
+    return operations[std::size_t(op)];
+  }
+};
+
+
+/*! Writes @p statistics to @p os, one line per operation which has been called:
+ *
+ * @code
+ * status calls=12 errors=1 total_ns=40210 latency_us=<1:3,<2:5,<4:4
+ * @endcode
+ *
+ * The histogram lists the non-empty buckets by their upper limit; the last one is given
+ * as ">=" its lower limit. */
+FSPP_API void
+write_statistics(std::ostream& os, const FilesystemStatistics& statistics);
+
+
+/*! Starts or stops recording statistics for the operations going to the native
+ *  filesystem.  Recording is off by default; while it's off it costs a relaxed atomic
+ *  load per operation.  Calls are counted per thread without locks and summed up by
+ *  native_statistics(). */
+FSPP_API void
+set_native_instrumentation(bool enabled);
+
+/*! Returns the statistics recorded for the native filesystem since the start of the
+ *  process. */
+FSPP_API FilesystemStatistics
+native_statistics();
+
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,167 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/path.hpp"
+#include "fspp/details/platform.hpp"
+#include "fspp/details/types.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! How a mapped_file accesses the file. */
+enum class map_mode
+{
+  read_only,
+  read_write,
+};
+
+
+/*! Hints passed to mapped_file::advise() on how the mapped bytes are going to be
+ *  accessed. */
+enum class map_advice
+{
+  normal,
+  sequential,
+  random,
+  will_need,
+  dont_need,
+};
+
+
+/*! Maps the content of a file, or a range of it, into memory.
+ *
+ * The mapped bytes are one contiguous range from data() to data() + size(), which can
+ * be parsed in place instead of being copied through a std::iostream.  Native files are
+ * mapped with mmap() (MapViewOfFile() on Windows) and shared with the file: writing to
+ * a read_write mapping changes the file, and it is unspecified when changes done to the
+ * file otherwise become visible in the mapping.
+ *
+ * VFS backends implementing vfs::IMappableFilesystem give access to their storage
+ * directly; a memory filesystem hands out a file's content without copying it whenever
+ * the range is stored in one piece.  The range of files in other backends is read into
+ * a buffer, which for read_write mappings is written back by flush() and when the
+ * mapping ends.
+ *
+ * Mapping never changes the size of a file; the range is limited to the end of the
+ * file.
+ *
+ * @code
+ * auto m = mapped_file(u8path("big.csv"));
+ * m.advise(map_advice::sequential);
+ * auto lines = std::count(m.begin(), m.end(), '\n');
+ * @endcode
+ *
+ * Extension to ISO/IEC TS 18822:2015.
+ */
+class FSPP_API mapped_file
+{
+public:
+  class IMappingImpl;
+
+  /*! The length to map everything from the offset to the end of the file. */
+  static const file_size_type k_to_end = static_cast<file_size_type>(-1);
+
+  /*! Constructs an instance not mapping anything */
+  mapped_file() NOEXCEPT;
+
+  /*! Maps @p length bytes of the file @p p starting at @p offset for @p mode
+   *
+   * The file must exist.  @p offset must not be beyond the end of the file.
+   *
+   * @throws filesystem_error in case of an error
+   */
+  explicit mapped_file(const path& p,
+                       map_mode mode = map_mode::read_only,
+                       file_size_type offset = 0,
+                       file_size_type length = k_to_end);
+  /*! Maps @p length bytes of the file @p p starting at @p offset for @p mode
+   *
+   * If an error occurs sets @p ec accordingly and is_mapped() returns false.  If
+   * successful @p ec is cleared.
+   */
+  mapped_file(const path& p,
+              map_mode mode,
+              file_size_type offset,
+              file_size_type length,
+              std::error_code& ec) NOEXCEPT;
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  /*! Moves the mapping of @p other into a new instance.  @p other does not map anything
+   *  afterwards. */
+  mapped_file(mapped_file&& other) NOEXCEPT;
+  mapped_file& operator=(mapped_file&& rhs) NOEXCEPT;
+
+  /*! Ends the mapping as if by unmap(), ignoring errors. */
+  ~mapped_file();
+
+  bool is_mapped() const NOEXCEPT;
+  map_mode mode() const NOEXCEPT;
+
+  const char* data() const NOEXCEPT;
+  /*! Returns the mapped bytes.  Writing to them is undefined unless mode() is
+   *  map_mode::read_write. */
+  char* data() NOEXCEPT;
+  std::size_t size() const NOEXCEPT;
+
+  const char* begin() const NOEXCEPT { return data(); }
+  const char* end() const NOEXCEPT { return data() + size(); }
+
+  /*! Tells the system how the mapped bytes are going to be accessed, like madvise()
+   *  does.  Backends may ignore hints.
+   *
+   * @throws filesystem_error in case of an error
+   */
+  void advise(map_advice advice);
+  void advise(map_advice advice, std::error_code& ec) NOEXCEPT;
+
+  /*! Writes the changes to a read_write mapping to the file and waits until they are
+   *  stored.  Does nothing for read_only mappings.
+   *
+   * @throws filesystem_error in case of an error
+   */
+  void flush();
+  void flush(std::error_code& ec) NOEXCEPT;
+
+  /*! Flushes the mapping and ends it.  Does nothing if is_mapped() returns false.
+   *
+   * @throws filesystem_error in case of an error
+   */
+  void unmap();
+  void unmap(std::error_code& ec) NOEXCEPT;
+
+private:
+  std::unique_ptr<IMappingImpl> _impl;
+  map_mode _mode = map_mode::read_only;
+};
+
+
+/*! The mapping of a mapped_file as created by a backend. */
+class mapped_file::IMappingImpl
+{
+public:
+  virtual ~IMappingImpl() = default;
+
+  virtual char* data() = 0;
+  virtual std::size_t size() const = 0;
+
+  /*! Backends ignoring @p advice clear @p ec. */
+  virtual void advise(map_advice advice, std::error_code& ec) = 0;
+  virtual void flush(std::error_code& ec) = 0;
+};
+
+}  // namespace filesystem
+}  // namespace eyestep
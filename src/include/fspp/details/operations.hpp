@@ -8,11 +8,13 @@
 #include "fspp/details/fspp-config.hpp"
 #endif
 
+#include "fspp/details/file_id.hpp"
 #include "fspp/details/file_status.hpp"
 #include "fspp/details/path.hpp"
 #include "fspp/details/platform.hpp"
 #include "fspp/details/types.hpp"
 
+#include <cstddef>
 #include <system_error>
 
 
@@ -297,6 +299,21 @@ file_size(const path& p);
 FSPP_API file_size_type
 file_size(const path& p, std::error_code& ec) NOEXCEPT;
 
+/*! Returns the identity of the filesystem object @p p resolves to, as determined by
+ *  POSIX `stat()` (symlinks are followed).
+ *
+ * Two paths are equivalent() iff their identities compare equal.  Since file_id is
+ * hashable this allows to detect hard links or directory loops from a single stat per
+ * file.
+ *
+ * The non-throwing overload returns an invalid file_id on errors.
+ *
+ * Extension to ISO/IEC TS 18822:2015. */
+FSPP_API file_id
+file_identity(const path& p);
+FSPP_API file_id
+file_identity(const path& p, std::error_code& ec) NOEXCEPT;
+
 /* Returns the number of hard links for the filesystem object identified by path p. */
 FSPP_API std::uintmax_t
 hard_link_count(const path& p);
@@ -400,6 +417,26 @@ status(const path& p);
 FSPP_API file_status
 status(const path& p, std::error_code& ec) NOEXCEPT;
 
+/*! Determines the status of @p count paths at once, as if by calling status(paths[i],
+ *  ecs[i]) (or symlink_status() if options.follow_symlinks is false) for each of them.
+ *
+ * The stat calls for paths on the native filesystem are spread over up to
+ * options.max_threads worker threads, which hides most of the metadata latency of
+ * network filesystems.  Paths on a virtual filesystem are handled on the calling thread.
+ *
+ * The result for @p paths[i] is stored in @p results[i] and its error code in @p ecs[i],
+ * i.e. errors are reported per item.  @p results and @p ecs must point to at least @p
+ * count elements.
+ *
+ * Extension to ISO/IEC TS 18822:2015.
+ */
+FSPP_API void
+status_many(const path* paths,
+            std::size_t count,
+            file_status* results,
+            std::error_code* ecs,
+            const status_many_options& options = status_many_options()) NOEXCEPT;
+
 /*! Same as status() except that the behavior is as if the POSIX `lstat()` is used
  *  (symlinks are not followed).
  *
@@ -10,6 +10,7 @@
 
 #include "fspp/utility/bitmask_type.hpp"
 
+#include <cstddef>
 #include <cstdint>
 #include <ctime>
 
@@ -155,6 +156,20 @@ struct space_info
 };
 
 
+/*! Options controlling status_many(). */
+struct status_many_options
+{
+  /*! Maximum number of worker threads to spread the status calls over.  0 picks the
+   * number of hardware threads. */
+  unsigned max_threads = 0;
+  /*! Number of paths a worker picks up at once.  Each worker handles at least this many
+   * paths, i.e. small batches are done on the calling thread. */
+  std::size_t batch_size = 256;
+  /*! If false behave like symlink_status() (symlinks are not followed). */
+  bool follow_symlinks = true;
+};
+
+
 /*! Indicates a type of a file or directory a path refers to. */
 enum class file_type
 {
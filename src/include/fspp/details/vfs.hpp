@@ -9,12 +9,16 @@
 #endif
 
 #include "fspp/details/dir_iterator.hpp"
+#include "fspp/details/instrumentation.hpp"
 #include "fspp/filesystem.hpp"
 
 #include <cstdint>
+#include <map>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <system_error>
+#include <vector>
 
 
 namespace eyestep {
@@ -98,6 +102,11 @@ public:
 
   virtual file_size_type file_size(const path& p, std::error_code& ec) = 0;
 
+  /*! Returns the identity of the object @p p refers to.  The device part should be
+   * unique for the filesystem instance, such that ids from different VFSes (and the
+   * native filesystem) never compare equal. */
+  virtual file_id file_identity(const path& p, std::error_code& ec) = 0;
+
   virtual std::uintmax_t hard_link_count(const path& p, std::error_code& ec) = 0;
 
   virtual file_time_type last_write_time(const path& p, std::error_code& ec) = 0;
@@ -124,17 +133,403 @@ public:
   virtual file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT = 0;
 };
 
+
+/*! Implemented by VFS backends (in addition to IFilesystem) which give mapped_file
+ *  direct access to their storage.  The files of other backends are read into a
+ *  buffer. */
+class IMappableFilesystem
+{
+public:
+  virtual ~IMappableFilesystem() = default;
+
+  /*! Maps @p length bytes of the file @p p at @p offset like mapped_file does.  Returns
+   *  null with @p ec cleared to leave the mapping to a buffer, e.g. for modes the
+   *  backend can't map directly. */
+  virtual std::unique_ptr<mapped_file::IMappingImpl> map_file(const path& p,
+                                                              map_mode mode,
+                                                              file_size_type offset,
+                                                              file_size_type length,
+                                                              std::error_code& ec) = 0;
+};
+
+/*! Counters of the compressed files of a memory filesystem (see
+ *  IMemoryFilesystem::set_compression()).  Hard links count as one file. */
+struct CompressionStatistics
+{
+  std::uint64_t files = 0;
+  /*! The size of the files */
+  std::uintmax_t logical_size = 0;
+  /*! The bytes their content takes up */
+  std::uintmax_t stored_size = 0;
+
+  /*! Returns how many bytes of files are stored per byte taken up. */
+  double ratio() const
+  {
+    return stored_size == 0 ? 1.0 : double(logical_size) / double(stored_size);
+  }
+};
+
+
+/*! A filesystem held completely in memory as created by make_memory_filesystem().
+ *
+ * All operations can be called from many threads at once.  Lookups don't block each
+ * other; operations changing a directory only block those accessing the same nodes.
+ * Data written to a file becomes visible to others when the stream is flushed or
+ * closed, all at once.
+ */
+class IMemoryFilesystem : public IFilesystem
+{
+public:
+  /*! Returns a new filesystem with the same content as this one.
+   *
+   * The new filesystem shares all nodes and file data with this one.  Both copy only
+   * what they change, lazily on the first write, so forking takes constant time and a
+   * change costs time proportional to the depth of the changed path.
+   *
+   * Forks can be used independently from different threads, but fork() itself must not
+   * run concurrently with other operations on this filesystem.  Data written to files
+   * still open for writing here and not flushed yet does not show up in the fork. */
+  virtual std::unique_ptr<IMemoryFilesystem> fork() = 0;
+
+  /*! Like fork(), but the returned filesystem is read only: all operations modifying it
+   *  fail with std::errc::read_only_file_system.  fork() it to continue from the
+   *  snapshot. */
+  virtual std::unique_ptr<IMemoryFilesystem> snapshot() = 0;
+
+  /*! Writes all files and directories to @p os as an image, which load_image() loads
+   *  again.
+   *
+   * The image is a compact binary format, which can be used in place when mapped into
+   * memory.  Files sharing their content (like copies) share it in the image, too.  The
+   * filesystem must not be changed while it is saved; save a snapshot() of it if it is
+   * in use. */
+  virtual void save_image(std::ostream& os, std::error_code& ec) = 0;
+  void save_image(std::ostream& os);
+
+  /*! Turns compressing the content of the file or directory @p p on or off.
+   *
+   * The content of a compressed file is kept compressed in chunks of 64 KiB with a fast
+   * LZ codec.  Content written to it is compressed when the file is closed; reading
+   * unpacks one chunk at a time into a buffer of the reading stream.  file_size() and
+   * the space counted against the capacity stay the uncompressed size.  Files
+   * created in a directory take over its setting, so turning it on for "/" compresses
+   * all files created afterwards.  Turning it on for a file compresses its current
+   * content right away; turning it off keeps the content compressed until it is
+   * written to.  Content spilled to disk is not compressed.
+   *
+   * @p p is a path in this filesystem, with or without the root name it is registered
+   * for.
+   *
+   * @throws filesystem_error in case of an error */
+  virtual void set_compression(const path& p, bool enabled, std::error_code& ec) = 0;
+  void set_compression(const path& p, bool enabled);
+
+  /*! Returns the size of the files compression is turned on for and of their
+   *  compressed content. */
+  virtual CompressionStatistics compression_statistics() = 0;
+};
+
+
+/*! Settings of a filesystem created by make_caching_filesystem(). */
+struct CacheOptions
+{
+  /*! The bytes the cache may take up at most, counting cached content, listings and
+   *  some overhead per path.  The least recently used entries are evicted beyond. */
+  std::uintmax_t capacity = 64 * 1024 * 1024;
+  /*! Files up to this size are cached; larger ones are always read from the directory. */
+  std::uintmax_t max_file_size = 256 * 1024;
+  /*! The milliseconds a cached entry is used without looking at the directory.  Older
+   *  entries are revalidated: their modification time and size are read again, and the
+   *  content and listing are dropped if they changed. */
+  std::uint64_t revalidate_after_ms = 1000;
+};
+
+
+/*! Counters of a caching filesystem.  Each lookup answered from the cache counts as
+ *  hit, each one which had to go to the directory (including revalidations) as miss. */
+struct CacheStatistics
+{
+  std::uint64_t metadata_hits = 0;
+  std::uint64_t metadata_misses = 0;
+  std::uint64_t listing_hits = 0;
+  std::uint64_t listing_misses = 0;
+  std::uint64_t content_hits = 0;
+  std::uint64_t content_misses = 0;
+  /*! The stale entries checked against the directory */
+  std::uint64_t revalidations = 0;
+  std::uint64_t evictions = 0;
+  /*! The bytes taken up by the cache currently */
+  std::uintmax_t size = 0;
+};
+
+
+/*! A filesystem caching a directory of another one as created by
+ *  make_caching_filesystem(). */
+class ICachingFilesystem : public IFilesystem
+{
+public:
+  virtual CacheStatistics statistics() = 0;
+  /*! Drops all cached entries.  Use it when the directory has been changed behind the
+   *  cache's back. */
+  virtual void clear_cache() = 0;
+};
+
+
+/*! A filesystem recording statistics of the operations on another one as created by
+ *  make_instrumenting_filesystem(). */
+class IInstrumentingFilesystem : public IFilesystem
+{
+public:
+  /*! Returns the statistics recorded since the filesystem has been created. */
+  virtual FilesystemStatistics statistics() = 0;
+};
+
+
+/*! The latency added to a call by a filesystem created by
+ *  make_fault_injecting_filesystem(): @c base_us plus an exponentially distributed
+ *  random part with mean @c jitter_us, limited to @c max_us if that is not 0. */
+struct LatencyDistribution
+{
+  std::uint64_t base_us = 0;
+  std::uint64_t jitter_us = 0;
+  std::uint64_t max_us = 0;
+};
+
+
+/*! The faults injected into calls of one operation. */
+struct OperationFaults
+{
+  LatencyDistribution latency;
+  /*! The probability (0 to 1) a call fails with @c error after its latency, without
+   *  being passed on. */
+  double error_rate = 0.0;
+  std::errc error = std::errc::io_error;
+};
+
+
+/*! Settings of a filesystem created by make_fault_injecting_filesystem(). */
+struct FaultOptions
+{
+  /*! Seeds the random numbers drawn for latencies and errors. */
+  std::uint64_t seed = 0;
+  /*! The faults of all operations not listed in @c operations */
+  OperationFaults defaults;
+  std::map<Operation, OperationFaults> operations;
+  /*! The bytes per second read from respectively written to all open files together;
+   *  0 is unlimited. */
+  std::uint64_t read_bytes_per_second = 0;
+  std::uint64_t write_bytes_per_second = 0;
+};
+
+
+/*! Counters of a deduplicating filesystem.  Hard links count as one file. */
+struct DedupStatistics
+{
+  std::uint64_t files = 0;
+  std::uint64_t blobs = 0;
+  /*! The size of all files */
+  std::uintmax_t logical_size = 0;
+  /*! The size of all blobs, including garbage */
+  std::uintmax_t stored_size = 0;
+  /*! The size of the blobs no file refers to anymore */
+  std::uintmax_t garbage_size = 0;
+
+  /*! Returns how many bytes of files are stored per byte of blobs. */
+  double ratio() const
+  {
+    return stored_size == 0 ? 1.0 : double(logical_size) / double(stored_size);
+  }
+};
+
+
+/*! A filesystem storing file content by its hash as created by
+ *  make_dedup_filesystem(). */
+class IDedupFilesystem : public IFilesystem
+{
+public:
+  virtual DedupStatistics statistics() = 0;
+
+  /*! Removes the blobs no file refers to anymore and returns the bytes freed.  Blobs are
+   *  kept when files are removed or overwritten until this is called.  It can run while
+   *  the filesystem is in use; blobs being read or written are kept. */
+  virtual std::uintmax_t collect_garbage(std::error_code& ec) = 0;
+  std::uintmax_t collect_garbage();
+};
+
+
 /*! Create a new memory filesystem.  The filesystem is empty except for the root directory
  *  ("/"). */
-FSPP_API std::unique_ptr<IFilesystem>
+FSPP_API std::unique_ptr<IMemoryFilesystem>
 make_memory_filesystem();
 
+/*! Create a new memory filesystem holding at most @p capacity bytes.
+ *
+ * Files count with their size, and every file and directory with some bytes of
+ * overhead.  Operations which would exceed the capacity fail with
+ * std::errc::no_space_on_device; streams writing to a file go bad and report the error
+ * when closed.  space() reports the capacity and the bytes still free. */
+FSPP_API std::unique_ptr<IMemoryFilesystem>
+make_memory_filesystem(std::uintmax_t capacity);
+
+/*! Create a new memory filesystem holding at most @p capacity bytes, which keeps the
+ *  content of files larger than @p spill_threshold bytes in an anonymous temporary file.
+ *
+ * The file is created in @p spill_directory (by default temp_directory_path()) and is
+ * not visible in there.  The system pages its content in and out as needed, so large
+ * files don't take up process memory while not being read or written.  The filesystem
+ * behaves the same otherwise; spilled content counts against @p capacity as well.
+ * Writing fails with no_space_on_device when the file system holding the temporary file
+ * is full.
+ *
+ * @throws filesystem_error if the temporary file can't be created. */
+FSPP_API std::unique_ptr<IMemoryFilesystem>
+make_memory_filesystem(std::uintmax_t capacity,
+                       std::uintmax_t spill_threshold,
+                       const path& spill_directory = path());
+
+
+/*! Loads a memory filesystem from the image file @p p written by
+ *  IMemoryFilesystem::save_image().
+ *
+ * @p p must be a file of the native filesystem.  It is mapped into memory and the
+ * returned filesystem reads file content straight from the mapping; only content
+ * written to is copied (chunk wise).  The file must not be changed as long as the
+ * filesystem (or a fork of it) exists.  Loading fails with std::errc::bad_message if
+ * @p p is not a valid image.
+ *
+ * @throws filesystem_error in case of an error */
+FSPP_API std::unique_ptr<IMemoryFilesystem>
+load_image(const path& p);
+FSPP_API std::unique_ptr<IMemoryFilesystem>
+load_image(const path& p, std::error_code& ec);
+
+
+/*! Creates a read only filesystem with the members of the archive file @p p.
+ *
+ * @p p must be a file of the native filesystem holding a tar archive (ustar, GNU or pax
+ * format) or a zip archive whose members are all stored uncompressed.  The archive is
+ * mapped into memory and indexed once; files are read straight from the mapping.  The
+ * archive must not be changed as long as the filesystem exists.  Symlinks and special
+ * files in tar archives are skipped.  Fails with std::errc::bad_message for damaged
+ * archives and std::errc::not_supported for compressed or encrypted zip members.
+ *
+ * @throws filesystem_error in case of an error */
+FSPP_API std::unique_ptr<IFilesystem>
+make_archive_filesystem(const path& p);
+FSPP_API std::unique_ptr<IFilesystem>
+make_archive_filesystem(const path& p, std::error_code& ec);
+
+
+/*! Creates a filesystem showing the directories @p lower_layers with the writable
+ *  filesystem @p upper on top.
+ *
+ * @p lower_layers are given top most first and can be native directories or directories
+ * in other registered VFSes (but not in the returned one).  Paths resolve top down;
+ * directories of the same name are merged.  The lower layers are never written to and
+ * must not change while the filesystem exists.  A file of a lower layer is copied to
+ * @p upper when it is opened for writing or changed otherwise; removing it records a
+ * whiteout hiding it.  If @p upper is null a new memory filesystem is used.  Fails with
+ * std::errc::not_a_directory if one of @p lower_layers is not a directory.
+ *
+ * @throws filesystem_error in case of an error */
+FSPP_API std::unique_ptr<IFilesystem>
+make_overlay_filesystem(const std::vector<path>& lower_layers,
+                        std::unique_ptr<IFilesystem> upper = nullptr);
+FSPP_API std::unique_ptr<IFilesystem>
+make_overlay_filesystem(const std::vector<path>& lower_layers,
+                        std::unique_ptr<IFilesystem> upper,
+                        std::error_code& ec);
+
+
+/*! Creates a filesystem showing the directory @p dir, which caches the status of files,
+ *  directory listings and the content of small files in memory.
+ *
+ * @p dir can be a native directory or a directory in another registered VFS; it is
+ * meant for slow ones like network mounts which are read repeatedly.  Cached entries are
+ * used without accessing @p dir for @p options.revalidate_after_ms and revalidated by
+ * their modification time and size afterwards.  Changes through the returned
+ * filesystem go to @p dir directly and drop the entries they affect.  Paths are resolved
+ * lexically below @p dir, i.e. ".." never leaves it.  Fails with
+ * std::errc::not_a_directory if @p dir is not a directory.
+ *
+ * @throws filesystem_error in case of an error */
+FSPP_API std::unique_ptr<ICachingFilesystem>
+make_caching_filesystem(const path& dir, const CacheOptions& options = CacheOptions());
+FSPP_API std::unique_ptr<ICachingFilesystem>
+make_caching_filesystem(const path& dir,
+                        const CacheOptions& options,
+                        std::error_code& ec);
+
+
+/*! Creates a filesystem showing the native directory @p dir, confined to it.
+ *
+ * @p dir is opened once and all operations resolve their paths relative to that
+ * descriptor using the *at() system calls, so the filesystem keeps showing the same
+ * directory when it's renamed or replaced.  Paths are resolved lexically below @p dir,
+ * i.e. ".." never leaves it.  On Linux 5.6 and later lookups use openat2() with
+ * RESOLVE_BENEATH, so symlinks pointing outside of @p dir fail with
+ * std::errc::operation_not_permitted; elsewhere symlinks are followed wherever they
+ * point.  Fails with std::errc::function_not_supported on Windows.
+ *
+ * @throws filesystem_error in case of an error */
+FSPP_API std::unique_ptr<IFilesystem>
+make_subtree_filesystem(const path& dir);
+FSPP_API std::unique_ptr<IFilesystem>
+make_subtree_filesystem(const path& dir, std::error_code& ec);
+
+
+/*! Creates a filesystem passing all operations on to @p fs and recording their calls,
+ *  errors and latencies.
+ *
+ * Recording is lock free; concurrent callers each count into their own per thread
+ * counters.  Only opening files (Operation::open_file) and creating directory iterators
+ * is recorded; reading, writing and iterating them go to @p fs directly. */
+FSPP_API std::unique_ptr<IInstrumentingFilesystem>
+make_instrumenting_filesystem(std::unique_ptr<IFilesystem> fs);
+
+
+/*! Creates a filesystem passing all operations on to @p fs after delaying them and
+ *  failing some of them as configured by @p options.
+ *
+ * It stands in for slow or unreliable storage, like a network filesystem, in tests and
+ * benchmarks.  Opening files counts as Operation::open_file; reading and writing them
+ * is slowed down to the bandwidths given instead.  Random numbers are drawn from one
+ * generator seeded with @p options.seed, so the same sequence of calls sees the same
+ * latencies and errors each time; with several threads the sequence depends on their
+ * interleaving. */
+FSPP_API std::unique_ptr<IFilesystem>
+make_fault_injecting_filesystem(std::unique_ptr<IFilesystem> fs,
+                                const FaultOptions& options);
+
+
+/*! Creates a filesystem storing the content of files in a content addressed blob store:
+ *  each distinct content is stored once under its SHA-256 hash.
+ *
+ * Files with the same content share one blob, and copy_file() only makes the target
+ * refer to the source's blob.  The tree of files and directories and their attributes
+ * is kept in memory; the blobs are kept in memory, too, or as files named by their hash
+ * in the directory @p blob_dir.  Blobs found in @p blob_dir already are reused for
+ * files of the same content and are garbage until then.  Content written to a file is
+ * hashed and stored when the file is closed.  Symlinks are not supported.
+ *
+ * @throws filesystem_error in case of an error */
+FSPP_API std::unique_ptr<IDedupFilesystem>
+make_dedup_filesystem();
+FSPP_API std::unique_ptr<IDedupFilesystem>
+make_dedup_filesystem(const path& blob_dir);
+FSPP_API std::unique_ptr<IDedupFilesystem>
+make_dedup_filesystem(const path& blob_dir, std::error_code& ec);
+
 
 /*! Registers a virtual filesystem @p fs for the root name @p name.
  *
  * @p name has the exact form as it would be returned from path::root_name(),
  * e.g. "//<vfs>".  To avoid name clashes with real existing UNC notated path the function
  * only accepts name which begin with "//<".
+ *
+ * Registration and unregistration are thread safe and can happen while other threads do
+ * I/O through other registered filesystems.  It is up to the caller though not to
+ * unregister (and destroy) a filesystem while it is still in use.
  */
 FSPP_API void
 register_vfs(const std::string& name, std::unique_ptr<IFilesystem> fs);
@@ -9,6 +9,7 @@
 #endif
 
 #include "fspp/details/dir_iterator.hpp"
+#include "fspp/details/file_id.hpp"
 #include "fspp/details/file_status.hpp"
 #include "fspp/details/filesystem_error.hpp"
 #include "fspp/details/operations.hpp"
@@ -17,3 +18,4 @@
 #include "fspp/details/types.hpp"
 
 #include "fspp/details/file.hpp"
+#include "fspp/details/mapped_file.hpp"
@@ -0,0 +1,281 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "instrumentation_private.hpp"
+
+#include "fspp/details/instrumentation.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+
+namespace {
+
+std::atomic<std::uint64_t> s_next_recorder_id(1);
+
+
+std::size_t
+latency_bucket(std::uint64_t ns)
+{
+  auto us = ns / 1000;
+  auto bucket = std::size_t(0);
+  while (us > 0 && bucket < k_latency_buckets - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+
+// Adds @p n to a counter only ever written by the calling thread.
+void
+bump(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+
+struct Recorder::Block
+{
+  struct Counters
+  {
+    std::atomic<std::uint64_t> calls;
+    std::atomic<std::uint64_t> errors;
+    std::atomic<std::uint64_t> total_ns;
+    std::atomic<std::uint64_t> latency[k_latency_buckets];
+  };
+
+  Block()
+  {
+    for (auto& c : counters) {
+      c.calls.store(0, std::memory_order_relaxed);
+      c.errors.store(0, std::memory_order_relaxed);
+      c.total_ns.store(0, std::memory_order_relaxed);
+      for (auto& bucket : c.latency) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Counters counters[k_operation_count];
+  Block* next = nullptr;
+};
+
+
+Recorder::Recorder()
+  : _id(s_next_recorder_id.fetch_add(1))
+  , _blocks(nullptr)
+{
+}
+
+
+Recorder::~Recorder()
+{
+  auto* block = _blocks.load();
+  while (block) {
+    auto* next = block->next;
+    delete block;
+    block = next;
+  }
+}
+
+
+Recorder::Block*
+Recorder::local_block()
+{
+  // the blocks of the recorders used by this thread.  Entries of destroyed recorders
+  // are never looked up again since recorder ids aren't reused.
+  thread_local std::vector<std::pair<std::uint64_t, Block*>> blocks;
+
+  for (const auto& entry : blocks) {
+    if (entry.first == _id) {
+      return entry.second;
+    }
+  }
+
+  auto* block = new Block();
+  block->next = _blocks.load(std::memory_order_relaxed);
+  while (!_blocks.compare_exchange_weak(block->next, block, std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+  }
+  blocks.emplace_back(_id, block);
+  return block;
+}
+
+
+void
+Recorder::record(Operation op, bool failed, std::uint64_t ns) NOEXCEPT
+{
+  Block* block;
+  try {
+    block = local_block();
+  }
+  catch (const std::bad_alloc&) {
+    return;
+  }
+
+  auto& c = block->counters[std::size_t(op)];
+  bump(c.calls);
+  if (failed) {
+    bump(c.errors);
+  }
+  bump(c.total_ns, ns);
+  bump(c.latency[latency_bucket(ns)]);
+}
+
+
+FilesystemStatistics
+Recorder::statistics() const
+{
+  auto result = FilesystemStatistics();
+
+  for (auto* block = _blocks.load(std::memory_order_acquire); block;
+       block = block->next) {
+    for (auto i = std::size_t(0); i < k_operation_count; ++i) {
+      const auto& c = block->counters[i];
+      auto& stats = result.operations[i];
+      stats.calls += c.calls.load(std::memory_order_relaxed);
+      stats.errors += c.errors.load(std::memory_order_relaxed);
+      stats.total_ns += c.total_ns.load(std::memory_order_relaxed);
+      for (auto j = std::size_t(0); j < k_latency_buckets; ++j) {
+        stats.latency[j] += c.latency[j].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  return result;
+}
+
+
+std::atomic<bool> g_native_instrumentation(false);
+
+
+Recorder&
+native_recorder_instance()
+{
+  // never destroyed; threads may still record while static objects are destroyed
+  static auto* s_recorder = new Recorder();
+  return *s_recorder;
+}
+
+
+const char*
+operation_name(Operation op)
+{
+  switch (op) {
+  case Operation::make_dir_iterator:
+    return "make_dir_iterator";
+  case Operation::open_file:
+    return "open_file";
+  case Operation::canonical:
+    return "canonical";
+  case Operation::copy_file:
+    return "copy_file";
+  case Operation::copy_symlink:
+    return "copy_symlink";
+  case Operation::create_directory:
+    return "create_directory";
+  case Operation::create_directories:
+    return "create_directories";
+  case Operation::create_hard_link:
+    return "create_hard_link";
+  case Operation::create_symlink:
+    return "create_symlink";
+  case Operation::create_directory_symlink:
+    return "create_directory_symlink";
+  case Operation::equivalent:
+    return "equivalent";
+  case Operation::file_size:
+    return "file_size";
+  case Operation::file_identity:
+    return "file_identity";
+  case Operation::hard_link_count:
+    return "hard_link_count";
+  case Operation::last_write_time:
+    return "last_write_time";
+  case Operation::set_last_write_time:
+    return "set_last_write_time";
+  case Operation::permissions:
+    return "permissions";
+  case Operation::read_symlink:
+    return "read_symlink";
+  case Operation::remove:
+    return "remove";
+  case Operation::remove_all:
+    return "remove_all";
+  case Operation::rename:
+    return "rename";
+  case Operation::resize_file:
+    return "resize_file";
+  case Operation::space:
+    return "space";
+  case Operation::status:
+    return "status";
+  case Operation::symlink_status:
+    return "symlink_status";
+  }
+
+  return "unknown";
+}
+
+
+void
+write_statistics(std::ostream& os, const FilesystemStatistics& statistics)
+{
+  for (auto i = std::size_t(0); i < k_operation_count; ++i) {
+    const auto& stats = statistics.operations[i];
+    if (stats.calls == 0) {
+      continue;
+    }
+
+    os << operation_name(Operation(i)) << " calls=" << stats.calls
+       << " errors=" << stats.errors << " total_ns=" << stats.total_ns << " latency_us=";
+
+    auto is_first = true;
+    for (auto j = std::size_t(0); j < k_latency_buckets; ++j) {
+      if (stats.latency[j] == 0) {
+        continue;
+      }
+      os << (is_first ? "" : ",");
+      if (j < k_latency_buckets - 1) {
+        os << "<" << (std::uint64_t(1) << j);
+      }
+      else {
+        os << ">=" << (std::uint64_t(1) << (j - 1));
+      }
+      os << ":" << stats.latency[j];
+      is_first = false;
+    }
+    os << std::endl;
+  }
+}
+
+
+void
+set_native_instrumentation(bool enabled)
+{
+  if (enabled) {
+    // construct the recorder before the first operation uses it
+    native_recorder_instance();
+  }
+  g_native_instrumentation.store(enabled, std::memory_order_relaxed);
+}
+
+
+FilesystemStatistics
+native_statistics()
+{
+  return native_recorder_instance().statistics();
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
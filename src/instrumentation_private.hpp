@@ -0,0 +1,101 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/instrumentation.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! Records operation statistics into a block of counters per thread.  Only the owning
+ *  thread writes to a block, so recording takes neither locks nor atomic
+ *  read-modify-write operations; statistics() sums up the blocks of all threads. */
+class Recorder
+{
+public:
+  Recorder();
+  ~Recorder();
+
+  Recorder(const Recorder&) = delete;
+  Recorder& operator=(const Recorder&) = delete;
+
+  void record(Operation op, bool failed, std::uint64_t ns) NOEXCEPT;
+  FilesystemStatistics statistics() const;
+
+private:
+  struct Block;
+
+  Block* local_block();
+
+  // unique over the lifetime of the process; identifies the recorder in the threads'
+  // block caches
+  const std::uint64_t _id;
+  std::atomic<Block*> _blocks;
+};
+
+
+extern std::atomic<bool> g_native_instrumentation;
+
+Recorder&
+native_recorder_instance();
+
+/*! Returns the recorder for native operations or nullptr if recording is off. */
+inline Recorder*
+native_recorder() NOEXCEPT
+{
+  return g_native_instrumentation.load(std::memory_order_relaxed)
+           ? &native_recorder_instance()
+           : nullptr;
+}
+
+
+/*! Records the duration of the enclosing scope as a call of @p op to @p recorder, unless
+ *  that is nullptr.  The call failed if @p ec is set when the scope is left. */
+class ScopedTiming
+{
+public:
+  ScopedTiming(Recorder* recorder, Operation op, const std::error_code& ec) NOEXCEPT
+    : _recorder(recorder)
+    , _op(op)
+    , _ec(ec)
+  {
+    if (_recorder) {
+      _start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ScopedTiming(const ScopedTiming&) = delete;
+  ScopedTiming& operator=(const ScopedTiming&) = delete;
+
+  ~ScopedTiming()
+  {
+    if (_recorder) {
+      const auto elapsed = std::chrono::steady_clock::now() - _start;
+      _recorder->record(
+        _op, bool(_ec),
+        std::uint64_t(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+  }
+
+private:
+  Recorder* _recorder;
+  Operation _op;
+  const std::error_code& _ec;
+  std::chrono::steady_clock::time_point _start;
+};
+
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,284 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "dir_iterator_private.hpp"
+#include "instrumentation_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/instrumentation.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <ios>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <system_error>
+#include <utility>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+class InstrumentingFilesystem : public IInstrumentingFilesystem
+{
+public:
+  explicit InstrumentingFilesystem(std::unique_ptr<IFilesystem> fs)
+    : _fs(std::move(fs))
+  {
+  }
+
+  FilesystemStatistics statistics() override
+  {
+    return _recorder.statistics();
+  }
+
+  std::unique_ptr<detail::IFileImpl> make_file_impl() override;
+
+  std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
+    const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::make_dir_iterator, ec);
+    return _fs->make_dir_iterator(p, ec);
+  }
+
+  void dump(std::ostream& os) override
+  {
+    _fs->dump(os);
+  }
+
+  path canonical(const path& p, const path& base, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::canonical, ec);
+    return _fs->canonical(p, base, ec);
+  }
+
+  bool copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::copy_file, ec);
+    return _fs->copy_file(from, to, options, ec);
+  }
+
+  void copy_symlink(const path& from, const path& to, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::copy_symlink, ec);
+    _fs->copy_symlink(from, to, ec);
+  }
+
+  bool create_directory(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::create_directory, ec);
+    return _fs->create_directory(p, ec);
+  }
+
+  bool create_directory(const path& p,
+                        const path& existing_p,
+                        std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::create_directory, ec);
+    return _fs->create_directory(p, existing_p, ec);
+  }
+
+  bool create_directories(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::create_directories, ec);
+    return _fs->create_directories(p, ec);
+  }
+
+  void create_hard_link(const path& target,
+                        const path& link,
+                        std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::create_hard_link, ec);
+    _fs->create_hard_link(target, link, ec);
+  }
+
+  void create_symlink(const path& target,
+                      const path& link,
+                      std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::create_symlink, ec);
+    _fs->create_symlink(target, link, ec);
+  }
+
+  void create_directory_symlink(const path& target,
+                                const path& link,
+                                std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::create_directory_symlink, ec);
+    _fs->create_directory_symlink(target, link, ec);
+  }
+
+  bool equivalent(const path& p1, const path& p2, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::equivalent, ec);
+    return _fs->equivalent(p1, p2, ec);
+  }
+
+  file_size_type file_size(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::file_size, ec);
+    return _fs->file_size(p, ec);
+  }
+
+  file_id file_identity(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::file_identity, ec);
+    return _fs->file_identity(p, ec);
+  }
+
+  std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::hard_link_count, ec);
+    return _fs->hard_link_count(p, ec);
+  }
+
+  file_time_type last_write_time(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::last_write_time, ec);
+    return _fs->last_write_time(p, ec);
+  }
+
+  void last_write_time(const path& p,
+                       file_time_type new_time,
+                       std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::set_last_write_time, ec);
+    _fs->last_write_time(p, new_time, ec);
+  }
+
+  void permissions(const path& p, perms prms, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::permissions, ec);
+    _fs->permissions(p, prms, ec);
+  }
+
+  path read_symlink(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::read_symlink, ec);
+    return _fs->read_symlink(p, ec);
+  }
+
+  bool remove(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::remove, ec);
+    return _fs->remove(p, ec);
+  }
+
+  std::uintmax_t remove_all(const path& p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::remove_all, ec);
+    return _fs->remove_all(p, ec);
+  }
+
+  void rename(const path& old_p, const path& new_p, std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::rename, ec);
+    _fs->rename(old_p, new_p, ec);
+  }
+
+  void resize_file(const path& p,
+                   file_size_type new_size,
+                   std::error_code& ec) override
+  {
+    ScopedTiming timing(&_recorder, Operation::resize_file, ec);
+    _fs->resize_file(p, new_size, ec);
+  }
+
+  space_info space(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    ScopedTiming timing(&_recorder, Operation::space, ec);
+    return _fs->space(p, ec);
+  }
+
+  file_status status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    ScopedTiming timing(&_recorder, Operation::status, ec);
+    return _fs->status(p, ec);
+  }
+
+  file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    ScopedTiming timing(&_recorder, Operation::symlink_status, ec);
+    return _fs->symlink_status(p, ec);
+  }
+
+  Recorder* recorder()
+  {
+    return &_recorder;
+  }
+
+private:
+  std::unique_ptr<IFilesystem> _fs;
+  Recorder _recorder;
+};
+
+
+/*! Records opening files of the wrapped filesystem; reading and writing them goes to
+ *  the wrapped file's stream directly. */
+class InstrumentingFileImpl : public detail::IFileImpl
+{
+public:
+  InstrumentingFileImpl(InstrumentingFilesystem* fs,
+                        std::unique_ptr<detail::IFileImpl> impl)
+    : _fs(fs)
+    , _impl(std::move(impl))
+  {
+  }
+
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    ScopedTiming timing(_fs->recorder(), Operation::open_file, ec);
+    return _impl->open(p, mode, ec);
+  }
+
+  std::iostream& stream() override
+  {
+    return _impl->stream();
+  }
+
+  bool is_open() const override
+  {
+    return _impl->is_open();
+  }
+
+  void close(std::error_code& ec) override
+  {
+    _impl->close(ec);
+  }
+
+private:
+  InstrumentingFilesystem* _fs;
+  std::unique_ptr<detail::IFileImpl> _impl;
+};
+
+
+std::unique_ptr<detail::IFileImpl>
+InstrumentingFilesystem::make_file_impl()
+{
+  return estd::make_unique<InstrumentingFileImpl>(this, _fs->make_file_impl());
+}
+
+}  // namespace
+
+
+std::unique_ptr<IInstrumentingFilesystem>
+make_instrumenting_filesystem(std::unique_ptr<IFilesystem> fs)
+{
+  assert(fs);
+  return estd::make_unique<InstrumentingFilesystem>(std::move(fs));
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,219 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "lz_codec.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace eyestep {
+namespace filesystem {
+
+namespace {
+
+const std::size_t k_min_match = 4;
+const std::size_t k_max_offset = 65535;
+// the last bytes of a block are always literals, like in LZ4
+const std::size_t k_last_literals = 5;
+const std::size_t k_match_margin = 12;
+const int k_hash_bits = 12;
+
+
+std::uint32_t
+read32(const std::uint8_t* p)
+{
+  auto value = std::uint32_t(0);
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+
+std::size_t
+hash32(std::uint32_t value)
+{
+  return (value * 2654435761u) >> (32 - k_hash_bits);
+}
+
+
+// Writes the continuation bytes of a length beyond a nibble of 15.
+std::uint8_t*
+put_length(std::uint8_t* op, std::size_t len)
+{
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = static_cast<std::uint8_t>(len);
+  return op;
+}
+
+
+// Reads the continuation bytes of a length; returns false at the end of input.
+bool
+get_length(const std::uint8_t*& ip, const std::uint8_t* end, std::size_t& len)
+{
+  for (;;) {
+    if (ip == end) {
+      return false;
+    }
+    const auto byte = *ip++;
+    len += byte;
+    if (byte != 255) {
+      return true;
+    }
+  }
+}
+
+
+// Writes a token with @p literal_len literals at @p literals and, if @p match_len is
+// not 0, a match at @p offset.  Returns null if it doesn't fit before @p oend.
+std::uint8_t*
+put_sequence(std::uint8_t* op,
+             std::uint8_t* oend,
+             const std::uint8_t* literals,
+             std::size_t literal_len,
+             std::size_t offset,
+             std::size_t match_len)
+{
+  // token, literals, offset and the length continuation bytes at most
+  const auto needed = 1 + literal_len + literal_len / 255 + 1 + 2 + match_len / 255 + 1;
+  if (std::size_t(oend - op) < needed) {
+    return nullptr;
+  }
+
+  auto* token = op++;
+  *token = static_cast<std::uint8_t>(std::min(literal_len, std::size_t(15)) << 4);
+  if (literal_len >= 15) {
+    op = put_length(op, literal_len - 15);
+  }
+  if (literal_len > 0) {
+    std::memcpy(op, literals, literal_len);
+    op += literal_len;
+  }
+
+  if (match_len > 0) {
+    *op++ = static_cast<std::uint8_t>(offset & 0xff);
+    *op++ = static_cast<std::uint8_t>(offset >> 8);
+    const auto len = match_len - k_min_match;
+    *token |= static_cast<std::uint8_t>(std::min(len, std::size_t(15)));
+    if (len >= 15) {
+      op = put_length(op, len - 15);
+    }
+  }
+  return op;
+}
+
+}  // namespace
+
+
+std::size_t
+lz_compress(const char* src, std::size_t size, char* dst, std::size_t capacity)
+{
+  const auto* base = reinterpret_cast<const std::uint8_t*>(src);
+  const auto* end = base + size;
+  auto* op = reinterpret_cast<std::uint8_t*>(dst);
+  auto* oend = op + capacity;
+
+  const auto* ip = base;
+  const auto* anchor = base;
+
+  if (size > k_match_margin) {
+    // positions of the last 4 byte sequences seen per hash
+    auto table = std::array<std::uint32_t, std::size_t(1) << k_hash_bits>();
+    table.fill(0);
+
+    const auto* match_limit = end - k_match_margin;
+    const auto* extend_limit = end - k_last_literals;
+    while (ip < match_limit) {
+      const auto sequence = read32(ip);
+      auto& slot = table[hash32(sequence)];
+      const auto* ref = base + slot;
+      slot = static_cast<std::uint32_t>(ip - base);
+
+      if (ref >= ip || std::size_t(ip - ref) > k_max_offset || read32(ref) != sequence) {
+        ++ip;
+        continue;
+      }
+
+      auto match_len = k_min_match;
+      while (ip + match_len < extend_limit && ref[match_len] == ip[match_len]) {
+        ++match_len;
+      }
+
+      op = put_sequence(op, oend, anchor, std::size_t(ip - anchor),
+                        std::size_t(ip - ref), match_len);
+      if (!op) {
+        return 0;
+      }
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+
+  op = put_sequence(op, oend, anchor, std::size_t(end - anchor), 0, 0);
+  if (!op) {
+    return 0;
+  }
+  return std::size_t(op - reinterpret_cast<std::uint8_t*>(dst));
+}
+
+
+bool
+lz_decompress(const char* src, std::size_t size, char* dst, std::size_t dst_size)
+{
+  const auto* ip = reinterpret_cast<const std::uint8_t*>(src);
+  const auto* end = ip + size;
+  auto* base = reinterpret_cast<std::uint8_t*>(dst);
+  auto* op = base;
+  auto* oend = base + dst_size;
+
+  while (ip < end) {
+    const auto token = *ip++;
+
+    auto literal_len = std::size_t(token >> 4);
+    if (literal_len == 15 && !get_length(ip, end, literal_len)) {
+      return false;
+    }
+    if (std::size_t(end - ip) < literal_len || std::size_t(oend - op) < literal_len) {
+      return false;
+    }
+    if (literal_len > 0) {
+      std::memcpy(op, ip, literal_len);
+      ip += literal_len;
+      op += literal_len;
+    }
+
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return false;
+    }
+    const auto offset = std::size_t(ip[0]) | (std::size_t(ip[1]) << 8);
+    ip += 2;
+    auto match_len = std::size_t(token & 0x0f);
+    if (match_len == 15 && !get_length(ip, end, match_len)) {
+      return false;
+    }
+    match_len += k_min_match;
+    if (offset == 0 || offset > std::size_t(op - base)
+        || std::size_t(oend - op) < match_len) {
+      return false;
+    }
+
+    // matches may overlap the bytes they produce
+    const auto* ref = op - offset;
+    for (auto i = std::size_t(0); i < match_len; ++i) {
+      op[i] = ref[i];
+    }
+    op += match_len;
+  }
+
+  return op == oend;
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
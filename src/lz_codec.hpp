@@ -0,0 +1,32 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#include <cstddef>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! A fast LZ77 style codec for blocks of up to 64 KiB in the LZ4 block format.
+ *
+ * A block is a sequence of tokens, each followed by a run of literal bytes and a
+ * reference to a match within the last 64 KiB of output.  The high nibble of a token
+ * gives the number of literals, the low nibble the length of the match minus 4; a
+ * nibble of 15 is continued in further bytes (each adding up to 255).  The last token
+ * has literals only.
+ */
+
+/*! Compresses the @p size bytes at @p src into @p dst, which has room for @p capacity
+ *  bytes.  Returns the size of the compressed data or 0 if it doesn't fit. */
+std::size_t
+lz_compress(const char* src, std::size_t size, char* dst, std::size_t capacity);
+
+/*! Decompresses the @p size bytes at @p src into the @p dst_size bytes at @p dst.
+ *  Returns false if the data is damaged or doesn't decompress to exactly @p dst_size
+ *  bytes. */
+bool
+lz_decompress(const char* src, std::size_t size, char* dst, std::size_t dst_size);
+
+}  // namespace filesystem
+}  // namespace eyestep
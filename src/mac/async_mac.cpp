@@ -0,0 +1,19 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "async_private.hpp"
+
+#include <memory>
+
+
+namespace eyestep {
+namespace filesystem {
+
+std::unique_ptr<IAsyncEngine>
+make_native_async_engine(unsigned)
+{
+  // operations run on the executor
+  return nullptr;
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
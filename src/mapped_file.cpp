@@ -0,0 +1,298 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "operations_impl.hpp"
+#include "vfs_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/filesystem_error.hpp"
+#include "fspp/details/mapped_file.hpp"
+#include "fspp/details/operations.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <ios>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+
+namespace {
+
+/*! Holds a copy of the mapped range of a file read through its stream.  Changes to a
+ *  read_write mapping are written back by flush(), which mapped_file calls when the
+ *  mapping ends, too. */
+class BufferedMapping : public mapped_file::IMappingImpl
+{
+public:
+  BufferedMapping(path p, file_size_type offset)
+    : _path(std::move(p))
+    , _offset(offset)
+  {
+  }
+
+  void read(file_size_type length, std::error_code& ec)
+  {
+    const auto st = status(_path, ec);
+    if (ec) {
+      return;
+    }
+    if (is_directory(st)) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return;
+    }
+
+    const auto file_size = filesystem::file_size(_path, ec);
+    if (ec) {
+      return;
+    }
+    if (_offset > file_size) {
+      ec = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+
+    _buffer.resize(static_cast<std::size_t>(std::min(length, file_size - _offset)));
+    if (_buffer.empty()) {
+      return;
+    }
+
+    auto file = File(_path);
+    auto& is = file.open(std::ios::in | std::ios::binary, ec);
+    if (ec) {
+      return;
+    }
+    is.seekg(static_cast<std::streamoff>(_offset));
+    is.read(_buffer.data(), static_cast<std::streamsize>(_buffer.size()));
+    if (!is) {
+      ec = std::make_error_code(std::errc::io_error);
+    }
+    close_keeping_error(file, ec);
+  }
+
+  char* data() override { return _buffer.empty() ? nullptr : _buffer.data(); }
+  std::size_t size() const override { return _buffer.size(); }
+
+  void advise(map_advice, std::error_code& ec) override { ec.clear(); }
+
+  void flush(std::error_code& ec) override
+  {
+    ec.clear();
+    if (_buffer.empty()) {
+      return;
+    }
+
+    auto file = File(_path);
+    auto& os = file.open(std::ios::in | std::ios::out | std::ios::binary, ec);
+    if (ec) {
+      return;
+    }
+    os.seekp(static_cast<std::streamoff>(_offset));
+    os.write(_buffer.data(), static_cast<std::streamsize>(_buffer.size()));
+    os.flush();
+    if (!os) {
+      ec = std::make_error_code(std::errc::io_error);
+    }
+    close_keeping_error(file, ec);
+  }
+
+private:
+  // Closes @p file, reporting a failure to close only if @p ec holds no error yet.
+  static void close_keeping_error(File& file, std::error_code& ec)
+  {
+    std::error_code close_ec;
+    file.close(close_ec);
+    if (!ec) {
+      ec = close_ec;
+    }
+  }
+
+  path _path;
+  file_size_type _offset;
+  std::vector<char> _buffer;
+};
+
+}  // namespace
+
+
+mapped_file::mapped_file() NOEXCEPT = default;
+
+
+mapped_file::mapped_file(const path& p,
+                         map_mode mode,
+                         file_size_type offset,
+                         file_size_type length)
+{
+  std::error_code ec;
+  *this = mapped_file(p, mode, offset, length, ec);
+  if (ec) {
+    throw filesystem_error("can't map file", p, ec);
+  }
+}
+
+
+mapped_file::mapped_file(const path& p,
+                         map_mode mode,
+                         file_size_type offset,
+                         file_size_type length,
+                         std::error_code& ec) NOEXCEPT
+  : _mode(mode)
+{
+  const auto& str = p.native();
+  const auto rootlen = vfs::vfs_root_name_length(str);
+  if (rootlen == 0) {
+    _impl = impl::map_file(p, mode, offset, length, ec);
+    return;
+  }
+
+  auto* fs = vfs::any_vfs_registered() ? vfs::find_vfs(str.data(), rootlen) : nullptr;
+  if (!fs) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return;
+  }
+
+  if (auto* mappable = dynamic_cast<vfs::IMappableFilesystem*>(fs)) {
+    _impl = mappable->map_file(vfs::deroot(p, rootlen), mode, offset, length, ec);
+    if (_impl || ec) {
+      return;
+    }
+  }
+
+  auto buffered = estd::make_unique<BufferedMapping>(p, offset);
+  buffered->read(length, ec);
+  if (!ec) {
+    _impl = std::move(buffered);
+  }
+}
+
+
+mapped_file::mapped_file(mapped_file&& other) NOEXCEPT
+  : _impl(std::move(other._impl))
+  , _mode(other._mode)
+{
+}
+
+
+mapped_file&
+mapped_file::operator=(mapped_file&& rhs) NOEXCEPT
+{
+  std::error_code ec;
+  unmap(ec);
+  _impl = std::move(rhs._impl);
+  _mode = rhs._mode;
+  return *this;
+}
+
+
+mapped_file::~mapped_file()
+{
+  std::error_code ec;
+  unmap(ec);
+}
+
+
+bool
+mapped_file::is_mapped() const NOEXCEPT
+{
+  return _impl != nullptr;
+}
+
+
+map_mode
+mapped_file::mode() const NOEXCEPT
+{
+  return _mode;
+}
+
+
+const char*
+mapped_file::data() const NOEXCEPT
+{
+  return _impl ? _impl->data() : nullptr;
+}
+
+
+char*
+mapped_file::data() NOEXCEPT
+{
+  return _impl ? _impl->data() : nullptr;
+}
+
+
+std::size_t
+mapped_file::size() const NOEXCEPT
+{
+  return _impl ? _impl->size() : 0;
+}
+
+
+void
+mapped_file::advise(map_advice advice)
+{
+  std::error_code ec;
+  advise(advice, ec);
+  if (ec) {
+    throw filesystem_error("can't advise mapping", ec);
+  }
+}
+
+
+void
+mapped_file::advise(map_advice advice, std::error_code& ec) NOEXCEPT
+{
+  if (_impl) {
+    _impl->advise(advice, ec);
+  }
+  else {
+    ec.clear();
+  }
+}
+
+
+void
+mapped_file::flush()
+{
+  std::error_code ec;
+  flush(ec);
+  if (ec) {
+    throw filesystem_error("can't flush mapping", ec);
+  }
+}
+
+
+void
+mapped_file::flush(std::error_code& ec) NOEXCEPT
+{
+  if (_impl && _mode == map_mode::read_write) {
+    _impl->flush(ec);
+  }
+  else {
+    ec.clear();
+  }
+}
+
+
+void
+mapped_file::unmap()
+{
+  std::error_code ec;
+  unmap(ec);
+  if (ec) {
+    throw filesystem_error("can't unmap file", ec);
+  }
+}
+
+
+void
+mapped_file::unmap(std::error_code& ec) NOEXCEPT
+{
+  flush(ec);
+  _impl.reset();
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
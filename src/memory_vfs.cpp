@@ -12,13 +12,20 @@
 #include "fspp/details/vfs.hpp"
 #include "fspp/filesystem.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
-#include <ctime>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <ostream>
 #include <string>
 #include <system_error>
-#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -29,212 +36,221 @@ namespace vfs {
 
 namespace {
 
-std::shared_ptr<FSNode>
-create_regular_file_node(const std::shared_ptr<FSNode>& parent, std::string name)
+inline bool
+is_separator(path::value_type c)
 {
-  assert(parent->_type == file_type::directory);
-  assert(name != k_dot.string() && name != k_dotdot.string());
-  parent->_children[name] = std::make_shared<FSNode>(file_type::regular);
-  return parent->_children[name];
+  return c == '/' || c == path::preferred_separator;
 }
 
 
-std::shared_ptr<FSNode>
-create_directory_node(const std::shared_ptr<FSNode>& parent, std::string name)
+std::string
+component_string(const path::value_type* str, std::size_t len)
 {
-  assert(parent->_type == file_type::directory);
-  if (name != k_dot.string() && name != k_dotdot.string()) {
-    parent->_children[name] = std::make_shared<FSNode>(file_type::directory);
-    return parent->_children[name];
-  }
-  return parent;
+#if defined(FSPP_IS_WIN)
+  return path(path::string_type(str, len)).string();
+#else
+  return std::string(str, len);
+#endif
 }
 
 
-void
-remove_node(FSNode& parent, const std::string& name)
+/*! Looks up the name given by @p len characters at @p str in @p names. */
+name_handle
+find_name(const NameTable& names, const path::value_type* str, std::size_t len)
 {
-  assert(parent._type == file_type::directory);
-  parent._children.erase(name);
+#if defined(FSPP_IS_WIN)
+  return names.find(component_string(str, len));
+#else
+  return names.find(str, len);
+#endif
 }
 
 
-void
-move_node(FSNode& srcparent,
-          const std::string& srcname,
-          FSNode& dstparent,
-          const std::string& dstname)
+std::uintmax_t
+device_id(const MemoryFilesystem* fs)
 {
-  if (!(&srcparent == &dstparent && srcname == dstname)) {
-    assert(srcparent._children.find(srcname) != end(srcparent._children));
-    assert(dstparent._children.find(dstname) == end(dstparent._children));
-
-    dstparent._children[dstname] = srcparent._children[srcname];
-    srcparent._children.erase(srcname);
-  }
+  return reinterpret_cast<std::uintptr_t>(fs);
 }
 
 
-void
-replace_node(FSNode& srcparent,
-             const std::string& srcname,
-             FSNode& dstparent,
-             const std::string& dstname)
+std::uint64_t
+next_filesystem_id()
 {
-  if (!(&srcparent == &dstparent && srcname == dstname)) {
-    assert(dstparent._children.find(dstname) != end(dstparent._children));
-
-    remove_node(dstparent, dstname);
-    move_node(srcparent, srcname, dstparent, dstname);
-  }
+  static std::atomic<std::uint64_t> s_next_id(0);
+  return ++s_next_id;
 }
 
 
-std::shared_ptr<FSNode>
-find_node(const std::shared_ptr<FSNode>& base,
-          const path& path,
-          std::error_code& ec,
-          bool create_nodes = false)
+/*! Returns the calling thread's cache of parent directories for the filesystem
+ *  @p fs_id.  The cache is cleared if it has been filled in another generation than
+ *  @p generation. */
+PathCache&
+thread_dir_cache(std::uint64_t fs_id, std::uint64_t generation)
 {
-  using std::begin;
-  using std::end;
-
-  std::vector<std::shared_ptr<FSNode>> stack;
-
-  std::shared_ptr<FSNode> node = base;
-  stack.push_back(node);
-
-  auto i_path = begin(path);
-  auto i_pathend = end(path);
-  while (i_path != i_pathend) {
-    if (node->_type == file_type::directory) {
-      auto nd_name = i_path->string();
-      if (nd_name == k_dot.string()) {
-        ++i_path;
-      }
-      else if (nd_name == k_dotdot.string()) {
-        if (!stack.empty()) {
-          node = stack.back();
-          stack.pop_back();
-          ++i_path;
-        }
-        else {
-          ec = std::make_error_code(std::errc::no_such_file_or_directory);
-          return nullptr;
-        }
-      }
-      else {
-        auto i_sub = node->_children.find(nd_name);
-        if (i_sub != node->_children.end()) {
-          stack.push_back(node);
-          node = i_sub->second;
-          ++i_path;
-        }
-        else {
-          if (create_nodes) {
-            stack.push_back(node);
-            node = create_directory_node(node, nd_name);
-            ++i_path;
-          }
-          else {
-            ec = std::make_error_code(std::errc::no_such_file_or_directory);
-            return nullptr;
-          }
-        }
-      }
-    }
-    else {
-      ec = std::make_error_code(std::errc::not_a_directory);
-      return nullptr;
+  struct Entry
+  {
+    std::uint64_t fs_id;
+    std::uint64_t generation;
+    PathCache cache;
+  };
+
+  // threads rarely work on more than a few filesystems at once; most recently used
+  // first.
+  const auto k_max_caches = std::size_t(4);
+  thread_local std::vector<std::unique_ptr<Entry>> caches;
+
+  auto i_find = std::find_if(
+    begin(caches), end(caches),
+    [&](const std::unique_ptr<Entry>& entry) { return entry->fs_id == fs_id; });
+  if (i_find == end(caches)) {
+    if (caches.size() == k_max_caches) {
+      caches.pop_back();
     }
+    auto entry = estd::make_unique<Entry>();
+    entry->fs_id = fs_id;
+    entry->generation = generation;
+    caches.insert(begin(caches), std::move(entry));
+  }
+  else if (i_find != begin(caches)) {
+    std::rotate(begin(caches), i_find, std::next(i_find));
   }
 
-  ec.clear();
-  return node;
+  auto& entry = *caches.front();
+  if (entry.generation != generation) {
+    entry.cache.clear();
+    entry.generation = generation;
+  }
+  return entry.cache;
 }
 
 
-std::uintmax_t
-count_descendants(const FSNode& node)
+/*! Holds the locks of up to four nodes exclusively. */
+class ExclusiveNodeLock
 {
-  std::uintmax_t result = 0;
-  if (node._type == file_type::directory) {
-    result = node._children.size();
-    for (const auto& childp : node._children) {
-      result += count_descendants(*childp.second);
+public:
+  ExclusiveNodeLock(NodeLocks& locks, std::initializer_list<node_handle> nodes)
+    : _locks(locks)
+  {
+    for (const auto nd : nodes) {
+      if (nd != k_no_node) {
+        assert(_count < k_max_nodes);
+        _stripes[_count++] = NodeLocks::stripe(nd);
+      }
     }
-  }
-
-  return result;
-}
-
 
-void
-dump_node(const FSNode& node, std::ostream& os, size_t level)
-{
-  auto indent = std::string(level * 2, ' ');
+    std::sort(_stripes, _stripes + _count);
+    const auto* last = std::unique(_stripes, _stripes + _count);
+    _count = static_cast<std::size_t>(last - _stripes);
+    for (auto i = std::size_t(0); i < _count; ++i) {
+      _locks.lock(_stripes[i]).lock();
+    }
+  }
 
-  if (node._type == file_type::directory) {
-    os << "/\n";
+  ExclusiveNodeLock(const ExclusiveNodeLock&) = delete;
+  ExclusiveNodeLock& operator=(const ExclusiveNodeLock&) = delete;
 
-    for (const auto& f : node._children) {
-      os << indent << f.first;
-      dump_node(*f.second, os, level + 1);
+  ~ExclusiveNodeLock()
+  {
+    for (auto i = _count; i > 0; --i) {
+      _locks.lock(_stripes[i - 1]).unlock();
     }
   }
-  else {
-    os << " [" << node._last_write_time << ", " << node._file_size << "by"
-       << "]\n";
-  }
-}
+
+private:
+  static const std::size_t k_max_nodes = 4;
+
+  NodeLocks& _locks;
+  std::size_t _stripes[k_max_nodes];
+  std::size_t _count = 0;
+};
 
 
 class MemoryVfsDirIter : public directory_iterator::IDirIterImpl
 {
 public:
-  MemoryVfsDirIter(const path& p, FSNode* parent)
-    : _iter(parent->_children.begin())
-    , _parent(parent)
+  // @p dir has to be acquired by the caller.  Iterates over a snapshot of the entries,
+  // such that removing entries meanwhile doesn't move the others under the iterator.
+  MemoryVfsDirIter(const path& p, MemoryFilesystem* fs, node_handle dir)
+    : _fs(fs)
+    , _dir(dir)
+    , _children(fs->children(dir))
     , _parent_path(p)
   {
+    seek(0);
   }
 
+  ~MemoryVfsDirIter() override { _fs->release_node(_dir); }
+
   void increment(std::error_code& ec) override
   {
     if (!is_end()) {
-      ++_iter;
+      seek(_pos + 1);
       ec.clear();
-      _is_store_set = false;
     }
   }
 
-  const directory_entry& object() const override
-  {
-    if (!_is_store_set) {
-      _is_store_set = true;
-      _store.assign(_parent_path / _iter->first, _iter->second->_file_size);
-    }
-    return _store;
-  }
+  const directory_entry& object() const override { return _store; }
 
-  bool is_end() const override { return _iter == _parent->_children.end(); }
+  bool is_end() const override { return _pos == MemoryFilesystem::k_no_slot; }
 
   bool equal(const IDirIterImpl* other) const override
   {
     const auto otherMfs = dynamic_cast<const MemoryVfsDirIter*>(other);
     if (otherMfs) {
-      return _iter == otherMfs->_iter;
+      return _dir == otherMfs->_dir && _pos == otherMfs->_pos;
     }
 
     return false;
   }
 
+  std::size_t next_batch(directory_entry* entries,
+                         std::size_t n,
+                         std::error_code& ec) override
+  {
+    ec.clear();
+    if (n == 0 || is_end()) {
+      return 0;
+    }
+
+    const auto next = _fs->children_from(_dir, *_children, _pos, n, _batch);
+    for (auto i = std::size_t(0); i < _batch.size(); ++i) {
+      const auto& child = _batch[i];
+      entries[i].assign(_parent_path / child.name, child.size,
+                        file_id(device_id(_fs), child.node));
+    }
+    seek(next);
+    return _batch.size();
+  }
+
 private:
-  mutable directory_entry _store;
-  mutable bool _is_store_set = false;
-  std::unordered_map<std::string, std::shared_ptr<FSNode>>::const_iterator _iter;
-  FSNode* _parent;
+  // Moves to the first entry in a slot at or after @p pos which is still in the
+  // directory.
+  void seek(std::size_t pos)
+  {
+    if (_children && pos != MemoryFilesystem::k_no_slot) {
+      auto name = std::string();
+      auto size = file_size_type(0);
+      for (pos = _children->next_slot(pos); pos < _children->slot_count();
+           pos = _children->next_slot(pos + 1)) {
+        const auto& entry = _children->slot(pos);
+        if (_fs->read_child(_dir, entry, name, size)) {
+          _store.assign(_parent_path / name, size, file_id(device_id(_fs), entry.node));
+          _pos = pos;
+          return;
+        }
+      }
+    }
+    _pos = MemoryFilesystem::k_no_slot;
+  }
+
+  directory_entry _store;
+  MemoryFilesystem* _fs;
+  node_handle _dir;
+  std::shared_ptr<const ChildTable> _children;
+  std::size_t _pos = MemoryFilesystem::k_no_slot;
   path _parent_path;
+  // reused by next_batch()
+  std::vector<MemoryFilesystem::Child> _batch;
 };
 
 }  // namespace
@@ -242,498 +258,1911 @@ private:
 
 //----------------------------------------------------------------------------------------
 
-MemoryFilesystem::MemoryFilesystem()
-  : _root(std::make_shared<FSNode>(file_type::directory))
+const std::uintmax_t MemoryFilesystem::k_unlimited;
+const std::uintmax_t MemoryFilesystem::k_node_overhead;
+const std::size_t MemoryFilesystem::k_no_slot;
+
+
+MemoryFilesystem::MemoryFilesystem(std::uintmax_t capacity,
+                                   std::shared_ptr<SpillStore> spill_store)
+  : _names(std::make_shared<NameTable>())
+  , _top(_nodes.allocate())
+  , _id(next_filesystem_id())
+  , _dir_generation(0)
+  // leave room for the root directory at least
+  , _capacity(std::max(capacity, k_node_overhead))
+  , _used(0)
+  , _reserved(0)
+  , _spill_store(std::move(spill_store))
 {
-  create_directory_node(_root, "/");
+  auto& top = _nodes.writable(_top);
+  top._type = file_type::directory;
+  top._links = 1;
+
+  auto created = false;
+  std::error_code ec;
+  create_node(_top, "/", file_type::directory, created, ec);
+  assert(created);
 }
 
 
-std::shared_ptr<FSNode>
-MemoryFilesystem::root_node()
+MemoryFilesystem::MemoryFilesystem(MemoryFilesystem& other, bool read_only)
+  : _names(other._names)
+  , _nodes(other._nodes)
+  , _top(other._top)
+  , _id(next_filesystem_id())
+  , _dir_generation(0)
+  , _capacity(other._capacity)
+  // space reserved by files open in other is not used here
+  , _used(other._used - other._reserved)
+  , _reserved(0)
+  , _spill_store(other._spill_store)
+  , _read_only(read_only)
 {
-  return _root;
 }
 
 
-std::unique_ptr<detail::IFileImpl>
-MemoryFilesystem::make_file_impl()
+std::unique_ptr<IMemoryFilesystem>
+MemoryFilesystem::fork()
 {
-  return estd::make_unique<MemoryVfsFileImpl>(this);
+  return std::unique_ptr<IMemoryFilesystem>(new MemoryFilesystem(*this, false));
 }
 
 
-std::unique_ptr<directory_iterator::IDirIterImpl>
-MemoryFilesystem::make_dir_iterator(const path& p, std::error_code& ec)
+std::unique_ptr<IMemoryFilesystem>
+MemoryFilesystem::snapshot()
 {
-  if (auto nd = find_node(root_node(), vfs::deroot(p), ec)) {
-    if (nd->_type == file_type::directory) {
-      ec.clear();
+  return std::unique_ptr<IMemoryFilesystem>(new MemoryFilesystem(*this, true));
+}
 
-      // pass the non-derooted p in here
-      return std::unique_ptr<directory_iterator::IDirIterImpl>(
-        new MemoryVfsDirIter(p, nd.get()));
-    }
-    else {
-      ec = std::make_error_code(std::errc::not_a_directory);
+
+bool
+MemoryFilesystem::check_writable(std::error_code& ec) const
+{
+  if (_read_only) {
+    ec = std::make_error_code(std::errc::read_only_file_system);
+    return false;
+  }
+  return true;
+}
+
+
+// Adds @p bytes to the space used if they fit into the capacity.
+bool
+MemoryFilesystem::charge(std::uintmax_t bytes)
+{
+  auto used = _used.load();
+  do {
+    // settle_space() may have pushed the used space above the capacity
+    if (used > _capacity || bytes > _capacity - used) {
+      return false;
     }
+  } while (!_used.compare_exchange_weak(used, used + bytes));
+  return true;
+}
+
+
+// Changes the space used by @p added - @p removed bytes, regardless of the capacity
+// (used for changes covered by reservations or freeing space).
+void
+MemoryFilesystem::settle_space(std::uintmax_t added, std::uintmax_t removed)
+{
+  if (added >= removed) {
+    _used += added - removed;
+  }
+  else {
+    _used -= removed - added;
   }
+}
 
-  return {};
+
+std::uintmax_t
+MemoryFilesystem::reserve_space(std::uintmax_t bytes)
+{
+  auto used = _used.load();
+  auto granted = std::uintmax_t(0);
+  do {
+    granted = used < _capacity ? std::min(bytes, _capacity - used) : 0;
+    if (granted == 0) {
+      return 0;
+    }
+  } while (!_used.compare_exchange_weak(used, used + granted));
+
+  _reserved += granted;
+  return granted;
 }
 
 
 void
-MemoryFilesystem::dump(std::ostream& os)
+MemoryFilesystem::release_space(std::uintmax_t bytes)
 {
-  os << "-----------------------------------------------------------------\n";
-  std::error_code ec;
-  dump_node(*find_node(_root, "/", ec), os, 1);
-  os << "-----------------------------------------------------------------\n";
+  _reserved -= bytes;
+  _used -= bytes;
 }
 
 
-path
-MemoryFilesystem::canonical(const path& p, const path& base, std::error_code& ec)
+node_handle
+MemoryFilesystem::find_node(const path& p, std::error_code& ec, bool create_nodes)
 {
-  (void)p;
-  (void)base;
-  ec = std::make_error_code(std::errc::function_not_supported);
-  return path();
+  EpochDomain::Guard guard(epochs());
+  auto type = file_type::none;
+  return lookup(p, ec, create_nodes, type);
 }
 
 
-bool
-MemoryFilesystem::copy_file(const path& from,
-                            const path& to,
-                            copy_options options,
-                            std::error_code& ec)
+node_handle
+MemoryFilesystem::lookup(const path& p,
+                         std::error_code& ec,
+                         bool create_nodes,
+                         file_type& type)
 {
-  if (auto srcnode = find_node(_root, from, ec)) {
-    if (srcnode->_type == file_type::regular) {
-      auto ds = status(to, ec);
-      if (ds.type() == file_type::not_found) {
-        auto dstparent = find_node(_root, to.parent_path(), ec);
-        auto newnode = create_regular_file_node(dstparent, to.filename().string());
-        newnode->copy_from_other(*srcnode);
-        ec.clear();
-        return true;
-      }
-      else if (ds.type() == file_type::regular) {
-        if ((options & copy_options::overwrite_existing) != 0) {
-          auto dstnode = find_node(_root, to, ec);
-          dstnode->copy_from_other(*srcnode);
-          ec.clear();
-          return true;
-        }
-        else if ((options & copy_options::skip_existing) != 0) {
-          ec.clear();
-          return false;
+  const auto& str = p.native();
+  const auto* data = str.data();
+
+  // split off the last component (and trailing separators); the rest names the
+  // parent directory, which is looked up in the cache.
+  auto dir_len = str.size();
+  while (dir_len > 0 && is_separator(data[dir_len - 1])) {
+    --dir_len;
+  }
+  while (dir_len > 0 && !is_separator(data[dir_len - 1])) {
+    --dir_len;
+  }
+
+  if (dir_len <= 1 || create_nodes) {
+    return resolve(_top, data, str.size(), ec, create_nodes, type);
+  }
+
+  // read the generation before resolving: should a directory be removed meanwhile, the
+  // entry added below is dropped by the next lookup.
+  auto& cache = thread_dir_cache(_id, _dir_generation.load());
+  auto dir = cache.find(data, dir_len);
+  if (dir == k_no_node) {
+    dir = resolve(_top, data, dir_len, ec, false, type);
+    if (dir == k_no_node) {
+      return k_no_node;
+    }
+    if (type == file_type::directory) {
+      cache.insert(data, dir_len, dir);
+    }
+  }
+
+  return resolve(dir, data + dir_len, str.size() - dir_len, ec, false, type);
+}
+
+
+node_handle
+MemoryFilesystem::resolve(node_handle base,
+                          const path::value_type* data,
+                          std::size_t len,
+                          std::error_code& ec,
+                          bool create_nodes,
+                          file_type& type)
+{
+  type = file_type::none;
+
+  auto nd = base;
+  auto i = std::size_t(0);
+  while (i < len) {
+    // a leading separator names the root directory, all others only separate
+    const auto is_root = i == 0 && is_separator(data[0]);
+    const auto first = i;
+    auto last = i + 1;
+    while (!is_root && last < len && !is_separator(data[last])) {
+      ++last;
+    }
+    i = last;
+    while (i < len && is_separator(data[i])) {
+      ++i;
+    }
+
+    const auto comp_len = last - first;
+    auto next = k_no_node;
+    {
+      SharedNodeLock lock(_locks, nd);
+      const auto& node = _nodes[nd];
+      if (node._type == file_type::none) {
+        if (nd != base) {
+          // replaced or removed since found in its parent; look again
+          return resolve(base, data, len, ec, create_nodes, type);
         }
-        else if ((options & copy_options::update_existing) != 0) {
-          ec.clear();
-          auto dstnode = find_node(_root, to, ec);
-          if (srcnode->_last_write_time > dstnode->_last_write_time) {
-            dstnode->copy_from_other(*srcnode);
-            return true;
-          }
-          else {
-            return false;
-          }
+        ec = std::make_error_code(std::errc::no_such_file_or_directory);
+        return k_no_node;
+      }
+      if (node._type != file_type::directory) {
+        ec = std::make_error_code(std::errc::not_a_directory);
+        return k_no_node;
+      }
+
+      if (comp_len == 1 && data[first] == '.') {
+        next = nd;
+      }
+      else if (comp_len == 2 && data[first] == '.' && data[first + 1] == '.') {
+        if (node._parent == k_no_node) {
+          ec = std::make_error_code(std::errc::no_such_file_or_directory);
+          return k_no_node;
         }
-        else  // if (options & copy_options::none)
-        {
-          ec = std::make_error_code(std::errc::file_exists);
+        next = node._parent;
+      }
+      else if (const auto* children = node._children.get()) {
+        const auto name =
+          is_root ? _names->find("/", 1) : find_name(*_names, data + first, comp_len);
+        if (name != k_no_name) {
+          next = children->find(name);
         }
       }
-      else {
-        ec = std::make_error_code(std::errc::is_a_directory);
+    }
+
+    if (next == k_no_node && create_nodes) {
+      auto created = false;
+      next = create_node(nd, is_root ? "/" : component_string(data + first, comp_len),
+                         file_type::directory, created, ec);
+      if (next == k_no_node) {
+        return k_no_node;
       }
     }
-    else {
-      ec = std::make_error_code(std::errc::is_a_directory);
+    if (next == k_no_node) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return k_no_node;
     }
+
+    nd = next;
   }
-  else {
+
+  {
+    SharedNodeLock lock(_locks, nd);
+    type = _nodes[nd]._type;
+  }
+  if (type == file_type::none) {
+    if (nd != base) {
+      // replaced or removed since found in its parent; look again
+      return resolve(base, data, len, ec, create_nodes, type);
+    }
     ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return k_no_node;
   }
 
-  return false;
+  ec.clear();
+  return nd;
+}
+
+
+// requires a lock on dir
+node_handle
+MemoryFilesystem::find_child_locked(node_handle dir, const std::string& name) const
+{
+  const auto* children = _nodes[dir]._children.get();
+  if (children) {
+    const auto nm = _names->find(name);
+    if (nm != k_no_name) {
+      return children->find(nm);
+    }
+  }
+  return k_no_node;
+}
+
+
+// Returns the existing entry @p name in @p parent or a new node of @p type linked as
+// @p name.  Fails with no_such_file_or_directory if @p parent is not a directory
+// (anymore) or no_space_on_device.
+node_handle
+MemoryFilesystem::create_node(node_handle parent,
+                              const std::string& name,
+                              file_type type,
+                              bool& created,
+                              std::error_code& ec)
+{
+  assert(name != k_dot.string() && name != k_dotdot.string());
+
+  created = false;
+
+  // allocate outside of the node locks, see NodeArena.  If there is no space left we
+  // still check for an existing entry.
+  const auto has_space = charge(k_node_overhead);
+  const auto nd = has_space ? _nodes.allocate() : k_no_node;
+  auto is_dir = false;
+  auto result = k_no_node;
+  {
+    ExclusiveNodeLock lock(_locks, {parent, nd});
+    is_dir = _nodes[parent]._type == file_type::directory;
+    if (is_dir) {
+      result = find_child_locked(parent, name);
+      if (result == k_no_node && nd != k_no_node) {
+        auto& node = _nodes.writable(nd);
+        node._type = type;
+        node._links = 1;
+        node._parent = parent;
+        node._compress = _nodes[parent]._compress;
+        if (type == file_type::regular) {
+          node.touch();
+        }
+        _nodes.writable(parent).writable_children(*_names).insert(_names->intern(name),
+                                                                  nd);
+        result = nd;
+        created = true;
+      }
+    }
+  }
+
+  if (!created) {
+    // parent is gone, someone else has been faster, or the filesystem is full
+    if (nd != k_no_node) {
+      ExclusiveNodeLock lock(_locks, {nd});
+      _nodes.free(nd);
+    }
+    if (has_space) {
+      settle_space(0, k_node_overhead);
+    }
+  }
+
+  if (result == k_no_node) {
+    ec = std::make_error_code(is_dir ? std::errc::no_space_on_device
+                                     : std::errc::no_such_file_or_directory);
+  }
+  else {
+    ec.clear();
+  }
+  return result;
+}
+
+
+node_handle
+MemoryFilesystem::create_regular_file_node(node_handle parent,
+                                           const std::string& name,
+                                           std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+  auto created = false;
+  return create_node(parent, name, file_type::regular, created, ec);
+}
+
+
+file_type
+MemoryFilesystem::node_type(node_handle nd)
+{
+  EpochDomain::Guard guard(epochs());
+  SharedNodeLock lock(_locks, nd);
+  return _nodes[nd]._type;
 }
 
 
+// requires exclusive locks on parent and nd
 void
-MemoryFilesystem::copy_symlink(const path& from, const path& to, std::error_code& ec)
+MemoryFilesystem::link_node_locked(node_handle parent,
+                                   const std::string& name,
+                                   node_handle nd)
 {
-  (void)from;
-  (void)to;
-  ec = std::make_error_code(std::errc::function_not_supported);
+  assert(_nodes[parent]._type == file_type::directory);
+  assert(find_child_locked(parent, name) == k_no_node);
+
+  ++_nodes.writable(nd)._links;
+  _nodes.writable(parent).writable_children(*_names).insert(_names->intern(name), nd);
+}
+
+
+// requires an exclusive lock on parent.  Doesn't change the link count of the entry's
+// node.
+void
+MemoryFilesystem::unlink_entry_locked(node_handle parent, const std::string& name)
+{
+  auto& dir = _nodes.writable(parent);
+  dir.writable_children(*_names).erase(_names->find(name));
+  if (dir._children->empty()) {
+    dir._children.reset();
+  }
+}
+
+
+// requires an exclusive lock on nd.  Frees nd if this was its last link and it is not
+// open anymore; returns its entries then, which the caller has to pass to
+// release_children() after giving up the lock.
+std::shared_ptr<ChildTable>
+MemoryFilesystem::drop_link_locked(node_handle nd)
+{
+  auto& node = _nodes.writable(nd);
+  assert(node._links > 0);
+  if (--node._links == 0 && !is_open_locked(nd)) {
+    auto children = std::move(node._children);
+    free_node_locked(nd);
+    return children;
+  }
+  return {};
+}
+
+
+// requires an exclusive lock on nd
+void
+MemoryFilesystem::free_node_locked(node_handle nd)
+{
+  settle_space(0, k_node_overhead + _nodes[nd].file_size());
+  _nodes.free(nd);
+}
+
+
+void
+MemoryFilesystem::release_children(const std::shared_ptr<ChildTable>& children)
+{
+  // the table is not reachable anymore, nobody changes it meanwhile.  The table's names
+  // are released when the last reference to it is dropped.
+  if (children) {
+    children->for_each([&](const ChildEntry& entry) {
+      auto orphans = std::shared_ptr<ChildTable>();
+      {
+        ExclusiveNodeLock lock(_locks, {entry.node});
+        orphans = drop_link_locked(entry.node);
+      }
+      release_children(orphans);
+    });
+  }
+}
+
+
+// requires an exclusive lock on nd
+bool
+MemoryFilesystem::is_open_locked(node_handle nd)
+{
+  const auto& opens = _locks.opens(NodeLocks::stripe(nd));
+  return opens.find(nd) != end(opens);
+}
+
+
+bool
+MemoryFilesystem::acquire_node(node_handle nd)
+{
+  EpochDomain::Guard guard(epochs());
+  ExclusiveNodeLock lock(_locks, {nd});
+  if (_nodes[nd]._type == file_type::none) {
+    return false;
+  }
+
+  ++_locks.opens(NodeLocks::stripe(nd))[nd];
+  return true;
 }
 
 
-bool
-MemoryFilesystem::create_directory(const path& p, std::error_code& ec)
-{
-  auto s = status(p, ec);
-  if (s.type() == file_type::not_found) {
-    if (auto parent = find_node(_root, p.parent_path(), ec)) {
-      create_directory_node(parent, p.filename().string());
-      ec.clear();
-      return true;
-    }
-    else {
-      ec = std::make_error_code(std::errc::not_a_directory);
-    }
+void
+MemoryFilesystem::release_node(node_handle nd)
+{
+  EpochDomain::Guard guard(epochs());
+
+  auto orphans = std::shared_ptr<ChildTable>();
+  {
+    ExclusiveNodeLock lock(_locks, {nd});
+    auto& opens = _locks.opens(NodeLocks::stripe(nd));
+    auto i_find = opens.find(nd);
+    assert(i_find != end(opens));
+    if (--i_find->second == 0) {
+      opens.erase(i_find);
+      if (_nodes[nd]._links == 0) {
+        orphans = std::move(_nodes.writable(nd)._children);
+        free_node_locked(nd);
+      }
+    }
+  }
+  release_children(orphans);
+}
+
+
+std::shared_ptr<FileContent>
+MemoryFilesystem::open_content(node_handle nd, bool truncate)
+{
+  EpochDomain::Guard guard(epochs());
+
+  if (truncate) {
+    ExclusiveNodeLock lock(_locks, {nd});
+    const auto old_size = _nodes[nd].file_size();
+    if (old_size > 0) {
+      // others may still read the old content
+      auto& node = _nodes.writable(nd);
+      node._content.reset();
+      node.touch();
+      settle_space(0, old_size);
+    }
+    return _nodes[nd]._content;
+  }
+
+  SharedNodeLock lock(_locks, nd);
+  return _nodes[nd]._content;
+}
+
+
+void
+MemoryFilesystem::publish_content(node_handle nd,
+                                  const std::shared_ptr<FileContent>& content,
+                                  std::uintmax_t reserved)
+{
+  EpochDomain::Guard guard(epochs());
+  ExclusiveNodeLock lock(_locks, {nd});
+
+  _reserved -= reserved;
+  if (_nodes[nd]._type == file_type::regular) {
+    auto& node = _nodes.writable(nd);
+    settle_space(content ? content->size() : 0, node.file_size() + reserved);
+    node._content = content;
+    node.touch();
+  }
+  else {
+    // removed meanwhile
+    settle_space(0, reserved);
+  }
+}
+
+
+bool
+MemoryFilesystem::compresses(node_handle nd)
+{
+  EpochDomain::Guard guard(epochs());
+  SharedNodeLock lock(_locks, nd);
+  return _nodes[nd]._compress;
+}
+
+
+void
+MemoryFilesystem::compress_content(node_handle nd,
+                                   const std::shared_ptr<FileContent>& content)
+{
+  if (!content || content->size() == 0) {
+    return;
+  }
+
+  // the copy shares the chunks which don't compress
+  auto packed = std::make_shared<FileContent>(*content);
+  if (!packed->pack()) {
+    return;
+  }
+
+  EpochDomain::Guard guard(epochs());
+  ExclusiveNodeLock lock(_locks, {nd});
+  if (_nodes[nd]._type == file_type::regular && _nodes[nd]._content == content) {
+    _nodes.writable(nd)._content = std::move(packed);
+  }
+}
+
+
+void
+MemoryFilesystem::set_compression(const path& p, bool enabled, std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  auto type = file_type::none;
+  const auto nd = lookup(vfs::deroot(p), ec, false, type);
+  if (nd == k_no_node) {
+    return;
+  }
+
+  auto content = std::shared_ptr<FileContent>();
+  {
+    ExclusiveNodeLock lock(_locks, {nd});
+    if (_nodes[nd]._type == file_type::none) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return;
+    }
+    _nodes.writable(nd)._compress = enabled;
+    content = _nodes[nd]._content;
+  }
+
+  if (enabled) {
+    compress_content(nd, content);
+  }
+}
+
+
+void
+MemoryFilesystem::collect_compression_statistics(node_handle nd,
+                                                 std::unordered_set<node_handle>& visited,
+                                                 CompressionStatistics& statistics)
+{
+  auto children = std::vector<node_handle>();
+  {
+    SharedNodeLock lock(_locks, nd);
+    const auto& node = _nodes[nd];
+    if (node._type == file_type::regular) {
+      if (node._compress && visited.insert(nd).second) {
+        ++statistics.files;
+        if (node._content) {
+          statistics.logical_size += node._content->size();
+          statistics.stored_size += node._content->stored_size();
+        }
+      }
+      return;
+    }
+    if (const auto* table = node._children.get()) {
+      table->for_each([&](const ChildEntry& entry) { children.push_back(entry.node); });
+    }
+  }
+
+  for (const auto child : children) {
+    collect_compression_statistics(child, visited, statistics);
+  }
+}
+
+
+CompressionStatistics
+MemoryFilesystem::compression_statistics()
+{
+  EpochDomain::Guard guard(epochs());
+
+  auto result = CompressionStatistics();
+  auto visited = std::unordered_set<node_handle>();
+  collect_compression_statistics(_top, visited, result);
+  return result;
+}
+
+
+std::shared_ptr<const ChildTable>
+MemoryFilesystem::children(node_handle dir)
+{
+  EpochDomain::Guard guard(epochs());
+  SharedNodeLock lock(_locks, dir);
+  // writers copy the table as long as the snapshot shares it
+  return _nodes[dir]._children;
+}
+
+
+bool
+MemoryFilesystem::read_child(node_handle dir,
+                             const ChildEntry& entry,
+                             std::string& name,
+                             file_size_type& size)
+{
+  EpochDomain::Guard guard(epochs());
+  {
+    SharedNodeLock lock(_locks, dir);
+    const auto* children = _nodes[dir]._children.get();
+    if (!children || children->find(entry.name) != entry.node) {
+      return false;
+    }
+    name = _names->str(entry.name);
+  }
+
+  SharedNodeLock lock(_locks, entry.node);
+  size = _nodes[entry.node].file_size();
+  return true;
+}
+
+
+std::size_t
+MemoryFilesystem::children_from(node_handle dir,
+                                const ChildTable& snapshot,
+                                std::size_t pos,
+                                std::size_t n,
+                                std::vector<Child>& children)
+{
+  EpochDomain::Guard guard(epochs());
+
+  children.clear();
+  auto next = k_no_slot;
+  {
+    SharedNodeLock lock(_locks, dir);
+    const auto* table = _nodes[dir]._children.get();
+    for (auto slot = snapshot.next_slot(pos); slot < snapshot.slot_count();
+         slot = snapshot.next_slot(slot + 1)) {
+      if (children.size() == n) {
+        next = slot;
+        break;
+      }
+      // skip the entries removed since the snapshot was taken
+      const auto& entry = snapshot.slot(slot);
+      if (table && table->find(entry.name) == entry.node) {
+        children.push_back(Child{_names->str(entry.name), entry.node, 0});
+      }
+    }
+  }
+
+  for (auto& child : children) {
+    SharedNodeLock lock(_locks, child.node);
+    child.size = _nodes[child.node].file_size();
+  }
+  return next;
+}
+
+
+bool
+MemoryFilesystem::is_ancestor(node_handle dir, node_handle nd)
+{
+  while (nd != k_no_node) {
+    if (nd == dir) {
+      return true;
+    }
+    SharedNodeLock lock(_locks, nd);
+    nd = _nodes[nd]._parent;
+  }
+  return false;
+}
+
+
+std::uintmax_t
+MemoryFilesystem::count_descendants(node_handle nd)
+{
+  std::uintmax_t result = 0;
+  auto children = std::vector<node_handle>();
+  {
+    SharedNodeLock lock(_locks, nd);
+    if (const auto* table = _nodes[nd]._children.get()) {
+      children.reserve(table->size());
+      table->for_each([&](const ChildEntry& entry) { children.push_back(entry.node); });
+    }
+  }
+
+  result = children.size();
+  for (const auto child : children) {
+    result += count_descendants(child);
+  }
+
+  return result;
+}
+
+
+bool
+MemoryFilesystem::remove_entry(node_handle parent,
+                               const std::string& name,
+                               bool recursive,
+                               std::error_code& ec)
+{
+  for (;;) {
+    auto nd = k_no_node;
+    {
+      SharedNodeLock lock(_locks, parent);
+      nd = find_child_locked(parent, name);
+    }
+    if (nd == k_no_node) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return false;
+    }
+
+    auto orphans = std::shared_ptr<ChildTable>();
+    {
+      ExclusiveNodeLock lock(_locks, {parent, nd});
+      if (find_child_locked(parent, name) != nd) {
+        // changed meanwhile
+        continue;
+      }
+
+      if (_nodes[nd]._type == file_type::directory) {
+        if (!recursive && _nodes[nd]._children) {
+          ec = std::make_error_code(std::errc::directory_not_empty);
+          return false;
+        }
+        _dir_generation.fetch_add(1);
+      }
+
+      unlink_entry_locked(parent, name);
+      orphans = drop_link_locked(nd);
+    }
+    release_children(orphans);
+
+    ec.clear();
+    return true;
+  }
+}
+
+
+void
+MemoryFilesystem::dump_node(node_handle nd, std::ostream& os, std::size_t level)
+{
+  auto indent = std::string(level * 2, ' ');
+
+  auto type = file_type::none;
+  auto last_write_time = file_time_type(0);
+  auto size = file_size_type(0);
+  auto children = std::vector<std::pair<std::string, node_handle>>();
+  {
+    SharedNodeLock lock(_locks, nd);
+    const auto& node = _nodes[nd];
+    type = node._type;
+    last_write_time = node._last_write_time;
+    size = node.file_size();
+    if (const auto* table = node._children.get()) {
+      table->for_each([&](const ChildEntry& entry) {
+        children.emplace_back(_names->str(entry.name), entry.node);
+      });
+    }
+  }
+
+  if (type == file_type::directory) {
+    os << "/\n";
+
+    for (const auto& child : children) {
+      os << indent << child.first;
+      dump_node(child.second, os, level + 1);
+    }
+  }
+  else {
+    os << " [" << last_write_time << ", " << size << "by"
+       << "]\n";
+  }
+}
+
+
+std::unique_ptr<detail::IFileImpl>
+MemoryFilesystem::make_file_impl()
+{
+  return estd::make_unique<MemoryVfsFileImpl>(this);
+}
+
+
+std::unique_ptr<directory_iterator::IDirIterImpl>
+MemoryFilesystem::make_dir_iterator(const path& p, std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+
+  auto type = file_type::none;
+  const auto nd = lookup(vfs::deroot(p), ec, false, type);
+  if (nd != k_no_node) {
+    if (type != file_type::directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+    }
+    else if (!acquire_node(nd)) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    }
+    else {
+      ec.clear();
+
+      // pass the non-derooted p in here
+      return std::unique_ptr<directory_iterator::IDirIterImpl>(
+        new MemoryVfsDirIter(p, this, nd));
+    }
+  }
+
+  return {};
+}
+
+
+void
+MemoryFilesystem::dump(std::ostream& os)
+{
+  EpochDomain::Guard guard(epochs());
+
+  os << "-----------------------------------------------------------------\n";
+  std::error_code ec;
+  const auto root = find_node("/", ec);
+  if (root != k_no_node) {
+    dump_node(root, os, 1);
+  }
+  os << "-----------------------------------------------------------------\n";
+}
+
+
+path
+MemoryFilesystem::canonical(const path& p, const path& base, std::error_code& ec)
+{
+  (void)p;
+  (void)base;
+  ec = std::make_error_code(std::errc::function_not_supported);
+  return path();
+}
+
+
+bool
+MemoryFilesystem::copy_file(const path& from,
+                            const path& to,
+                            copy_options options,
+                            std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return false;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  // copies the content of src to dst.  Returns false if either is gone meanwhile or
+  // there is no space for the copy.
+  const auto copy_node = [&](node_handle src, node_handle dst, bool only_if_newer) {
+    ExclusiveNodeLock lock(_locks, {src, dst});
+    if (_nodes[src]._type != file_type::regular
+        || _nodes[dst]._type != file_type::regular) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return false;
+    }
+    ec.clear();
+    if (only_if_newer && _nodes[src]._last_write_time <= _nodes[dst]._last_write_time) {
+      return false;
+    }
+
+    const auto src_size = _nodes[src].file_size();
+    const auto dst_size = _nodes[dst].file_size();
+    if (src_size > dst_size && !charge(src_size - dst_size)) {
+      ec = std::make_error_code(std::errc::no_space_on_device);
+      return false;
+    }
+    settle_space(0, src_size > dst_size ? 0 : dst_size - src_size);
+
+    _nodes.writable(dst).copy_from_other(_nodes[src]);
+    return true;
+  };
+
+  auto srctype = file_type::none;
+  const auto srcnode = lookup(from, ec, false, srctype);
+  if (srcnode == k_no_node) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return false;
+  }
+  if (srctype != file_type::regular) {
+    ec = std::make_error_code(std::errc::is_a_directory);
+    return false;
+  }
+
+  std::error_code dec;
+  auto dsttype = file_type::none;
+  const auto dstnode = lookup(to, dec, false, dsttype);
+  if (dstnode == k_no_node) {
+    auto parenttype = file_type::none;
+    const auto dstparent = lookup(to.parent_path(), ec, false, parenttype);
+    if (dstparent == k_no_node) {
+      return false;
+    }
+
+    const auto name = to.filename().string();
+    auto created = false;
+    const auto newnode = create_node(dstparent, name, file_type::regular, created, ec);
+    if (newnode == k_no_node) {
+      if (ec == std::errc::no_such_file_or_directory) {
+        ec = std::make_error_code(std::errc::not_a_directory);
+      }
+      return false;
+    }
+    if (!created) {
+      ec = std::make_error_code(std::errc::file_exists);
+      return false;
+    }
+    if (!copy_node(srcnode, newnode, false)) {
+      remove_entry(dstparent, name, false, dec);
+      return false;
+    }
+    return true;
+  }
+  else if (dsttype == file_type::regular) {
+    if (dstnode == srcnode) {
+      ec = std::make_error_code(std::errc::file_exists);
+    }
+    else if ((options & copy_options::overwrite_existing) != 0) {
+      return copy_node(srcnode, dstnode, false);
+    }
+    else if ((options & copy_options::skip_existing) != 0) {
+      ec.clear();
+      return false;
+    }
+    else if ((options & copy_options::update_existing) != 0) {
+      return copy_node(srcnode, dstnode, true);
+    }
+    else  // if (options & copy_options::none)
+    {
+      ec = std::make_error_code(std::errc::file_exists);
+    }
+  }
+  else {
+    ec = std::make_error_code(std::errc::is_a_directory);
+  }
+
+  return false;
+}
+
+
+void
+MemoryFilesystem::copy_symlink(const path& from, const path& to, std::error_code& ec)
+{
+  (void)from;
+  (void)to;
+  ec = std::make_error_code(std::errc::function_not_supported);
+}
+
+
+bool
+MemoryFilesystem::create_directory(const path& p, std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return false;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  auto type = file_type::none;
+  if (lookup(p, ec, false, type) != k_no_node) {
+    if (type == file_type::directory) {
+      ec.clear();
+    }
+    else {
+      ec = std::make_error_code(std::errc::file_exists);
+    }
+    return false;
+  }
+
+  const auto parent = lookup(p.parent_path(), ec, false, type);
+  if (parent == k_no_node || type != file_type::directory) {
+    ec = std::make_error_code(std::errc::not_a_directory);
+    return false;
+  }
+
+  const auto name = p.filename().string();
+  if (name == k_dot.string() || name == k_dotdot.string()) {
+    ec.clear();
+    return true;
+  }
+
+  auto created = false;
+  const auto nd = create_node(parent, name, file_type::directory, created, ec);
+  if (nd == k_no_node) {
+    if (ec == std::errc::no_such_file_or_directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+    }
+    return false;
+  }
+  if (!created) {
+    // created by someone else meanwhile
+    if (node_type(nd) == file_type::directory) {
+      ec.clear();
+    }
+    else {
+      ec = std::make_error_code(std::errc::file_exists);
+    }
+    return false;
+  }
+
+  ec.clear();
+  return true;
+}
+
+
+bool
+MemoryFilesystem::create_directory(const path& p,
+                                   const path& existing_p,
+                                   std::error_code& ec)
+{
+  // TODO: we don't support dir attributes in the memory vfs currently
+  (void)existing_p;
+  return create_directory(p, ec);
+}
+
+
+bool
+MemoryFilesystem::create_directories(const path& path, std::error_code& ec)
+{
+  return check_writable(ec) && find_node(path, ec, true) != k_no_node;
+}
+
+
+void
+MemoryFilesystem::create_hard_link(const path& target,
+                                   const path& link,
+                                   std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  auto type = file_type::none;
+  const auto nd = lookup(target, ec, false, type);
+  if (nd == k_no_node) {
+    return;
+  }
+  if (type == file_type::directory) {
+    ec = std::make_error_code(std::errc::operation_not_permitted);
+    return;
+  }
+
+  const auto parent = lookup(link.parent_path(), ec, false, type);
+  if (parent == k_no_node) {
+    return;
+  }
+  if (type != file_type::directory) {
+    ec = std::make_error_code(std::errc::not_a_directory);
+    return;
+  }
+
+  const auto name = link.filename().string();
+  if (name.empty() || name == k_dot.string() || name == k_dotdot.string()) {
+    ec = std::make_error_code(std::errc::file_exists);
+    return;
+  }
+
+  ExclusiveNodeLock lock(_locks, {parent, nd});
+  if (_nodes[parent]._type != file_type::directory || _nodes[nd]._links == 0) {
+    // removed meanwhile
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+  }
+  else if (find_child_locked(parent, name) != k_no_node) {
+    ec = std::make_error_code(std::errc::file_exists);
+  }
+  else {
+    link_node_locked(parent, name, nd);
+    ec.clear();
+  }
+}
+
+
+void
+MemoryFilesystem::create_symlink(const path& target,
+                                 const path& link,
+                                 std::error_code& ec)
+{
+  (void)target;
+  (void)link;
+  ec = std::make_error_code(std::errc::function_not_supported);
+}
+
+
+void
+MemoryFilesystem::create_directory_symlink(const path& target,
+                                           const path& link,
+                                           std::error_code& ec)
+{
+  (void)target;
+  (void)link;
+  ec = std::make_error_code(std::errc::function_not_supported);
+}
+
+
+bool
+MemoryFilesystem::equivalent(const path& p1, const path& p2, std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+
+  const auto n1 = find_node(p1, ec);
+  if (n1 != k_no_node) {
+    const auto n2 = find_node(p2, ec);
+    if (n2 != k_no_node) {
+      ec.clear();
+      return (n1 == n2);
+    }
+  }
+
+  ec = std::make_error_code(std::errc::no_such_file_or_directory);
+  return false;
+}
+
+
+file_size_type
+MemoryFilesystem::file_size(const path& p, std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+
+  const auto nd = find_node(p, ec);
+  if (nd != k_no_node) {
+    SharedNodeLock lock(_locks, nd);
+    return _nodes[nd].file_size();
+  }
+  return file_size_type();
+}
+
+
+file_id
+MemoryFilesystem::file_identity(const path& p, std::error_code& ec)
+{
+  const auto nd = find_node(p, ec);
+  if (nd != k_no_node) {
+    return file_id(device_id(this), nd);
+  }
+  return file_id();
+}
+
+
+std::uintmax_t
+MemoryFilesystem::hard_link_count(const path& p, std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+
+  const auto nd = find_node(p, ec);
+  if (nd != k_no_node) {
+    SharedNodeLock lock(_locks, nd);
+    return _nodes[nd]._links;
+  }
+  return std::uintmax_t();
+}
+
+
+file_time_type
+MemoryFilesystem::last_write_time(const path& p, std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+
+  const auto nd = find_node(p, ec);
+  if (nd != k_no_node) {
+    SharedNodeLock lock(_locks, nd);
+    return _nodes[nd]._last_write_time;
+  }
+
+  return file_time_type();
+}
+
+
+void
+MemoryFilesystem::last_write_time(const path& p,
+                                  file_time_type new_time,
+                                  std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  const auto nd = find_node(p, ec);
+  if (nd != k_no_node) {
+    ExclusiveNodeLock lock(_locks, {nd});
+    if (_nodes[nd]._type != file_type::none) {
+      _nodes.writable(nd)._last_write_time = new_time;
+    }
+  }
+}
+
+
+void
+MemoryFilesystem::permissions(const path& p, perms prms, std::error_code& ec)
+{
+  (void)p;
+  (void)prms;
+  ec = std::make_error_code(std::errc::function_not_supported);
+}
+
+
+path
+MemoryFilesystem::read_symlink(const path& p, std::error_code& ec)
+{
+  (void)p;
+  ec = std::make_error_code(std::errc::function_not_supported);
+  return path();
+}
+
+
+bool
+MemoryFilesystem::remove(const path& p, std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return false;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  const auto parent = find_node(p.parent_path(), ec);
+  if (parent == k_no_node) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return false;
+  }
+
+  return remove_entry(parent, p.filename().string(), false, ec);
+}
+
+
+std::uintmax_t
+MemoryFilesystem::remove_all(const path& p, std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return static_cast<std::uintmax_t>(-1);
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  auto type = file_type::none;
+  const auto nd = lookup(p, ec, false, type);
+  const auto parent = nd != k_no_node ? find_node(p.parent_path(), ec) : k_no_node;
+  if (parent == k_no_node) {
+    ec.clear();
+    return 0;
+  }
+
+  const auto descs = type == file_type::directory ? count_descendants(nd) : 0;
+  if (!remove_entry(parent, p.filename().string(), true, ec)) {
+    if (ec == std::errc::no_such_file_or_directory) {
+      // removed by someone else meanwhile
+      ec.clear();
+      return 0;
+    }
+    // In case of error the standard requires this:
+    return static_cast<std::uintmax_t>(-1);
+  }
+
+  return 1 + descs;
+}
+
+
+void
+MemoryFilesystem::rename(const path& old_p, const path& new_p, std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  const auto srcname = old_p.filename().string();
+  const auto dstname = new_p.filename().string();
+
+  // renaming directories changes the ancestry of nodes, which is_ancestor() has to see
+  // consistently.
+  std::unique_lock<std::mutex> rename_lock(_rename_mutex, std::defer_lock);
+
+  // look up all nodes involved, check them, lock them and retry if anything has
+  // changed meanwhile.
+  for (;;) {
+    auto srctype = file_type::none;
+    const auto src = lookup(old_p, ec, false, srctype);
+    if (src == k_no_node) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return;
+    }
+    if (srctype == file_type::directory && !rename_lock.owns_lock()) {
+      rename_lock.lock();
+      continue;
+    }
+    const auto srcparent = find_node(old_p.parent_path(), ec);
+
+    std::error_code dec;
+    auto dsttype = file_type::none;
+    const auto dst = lookup(new_p, dec, false, dsttype);
+    auto parenttype = file_type::none;
+    const auto dstparent = lookup(new_p.parent_path(), dec, false, parenttype);
+
+    if (srctype == file_type::directory) {
+      if (dsttype == file_type::directory) {
+        // POSIX allows to replace an empty directory, but Windows doesn't.  Maybe we
+        // should fail here?
+        ec = std::make_error_code(std::errc::directory_not_empty);
+        return;
+      }
+      else if (dsttype == file_type::regular) {
+        ec = std::make_error_code(std::errc::not_a_directory);
+        return;
+      }
+    }
+    else if (srctype == file_type::regular) {
+      if (dsttype == file_type::regular && dst == src) {
+        // both are links to the same file; POSIX leaves them alone
+        ec.clear();
+        return;
+      }
+      else if (dsttype != file_type::regular && dst != k_no_node) {
+        // a better error code?
+        ec = std::make_error_code(std::errc::not_supported);
+        return;
+      }
+    }
+    else {
+      ec = std::make_error_code(std::errc::not_supported);
+      return;
+    }
+
+    if (srcparent == k_no_node || dstparent == k_no_node) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return;
+    }
+    if (parenttype != file_type::directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+      return;
+    }
+    if (srctype == file_type::directory && is_ancestor(src, dstparent)) {
+      ec = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+
+    auto orphans = std::shared_ptr<ChildTable>();
+    {
+      ExclusiveNodeLock lock(_locks, {srcparent, dstparent, src, dst});
+      if (find_child_locked(srcparent, srcname) != src
+          || find_child_locked(dstparent, dstname) != dst
+          || _nodes[dstparent]._type != file_type::directory) {
+        continue;
+      }
+
+      if (dst != k_no_node) {
+        // replace dst with src
+        unlink_entry_locked(dstparent, dstname);
+        orphans = drop_link_locked(dst);
+      }
+
+      unlink_entry_locked(srcparent, srcname);
+      _nodes.writable(dstparent)
+        .writable_children(*_names)
+        .insert(_names->intern(dstname), src);
+      _nodes.writable(src)._parent = dstparent;
+
+      if (srctype == file_type::directory) {
+        _dir_generation.fetch_add(1);
+      }
+    }
+    release_children(orphans);
+
+    ec.clear();
+    return;
+  }
+}
+
+
+void
+MemoryFilesystem::resize_file(const path& p, file_size_type new_size, std::error_code& ec)
+{
+  if (!check_writable(ec)) {
+    return;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  const auto nd = find_node(p, ec);
+  if (nd != k_no_node) {
+    ExclusiveNodeLock lock(_locks, {nd});
+    const auto old_size = _nodes[nd].file_size();
+    if (_nodes[nd]._type != file_type::regular) {
+      ec = std::make_error_code(std::errc::not_supported);
+    }
+    else if (new_size > old_size && !charge(new_size - old_size)) {
+      ec = std::make_error_code(std::errc::no_space_on_device);
+    }
+    else {
+      ec.clear();
+      if (new_size != old_size) {
+        auto& node = _nodes.writable(nd);
+        try {
+          node.writable_content(_spill_store).resize(new_size);
+        }
+        catch (const std::system_error& e) {
+          // the spill file can't grow
+          settle_space(0, new_size > old_size ? new_size - old_size : 0);
+          ec = e.code();
+          return;
+        }
+        settle_space(0, new_size > old_size ? 0 : old_size - new_size);
+        node.touch();
+      }
+    }
+  }
+  else {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+  }
+}
+
+
+space_info
+MemoryFilesystem::space(const path& p, std::error_code& ec) NOEXCEPT
+{
+  space_info result;
+
+  if (find_node(p, ec) == k_no_node) {
+    result.capacity = static_cast<std::uintmax_t>(-1);
+    result.free = static_cast<std::uintmax_t>(-1);
+    result.available = static_cast<std::uintmax_t>(-1);
+    return result;
+  }
+
+  const auto used = _used.load();
+  result.capacity = _capacity;
+  result.free = _capacity > used ? _capacity - used : 0;
+  result.available = result.free;
+  return result;
+}
+
+
+file_status
+MemoryFilesystem::status(const path& p, std::error_code& ec) NOEXCEPT
+{
+  EpochDomain::Guard guard(epochs());
+
+  auto type = file_type::none;
+  if (lookup(p, ec, false, type) != k_no_node) {
+    return file_status(type);
+  }
+
+  ec.clear();
+  return file_status(file_type::not_found);
+}
+
+
+file_status
+MemoryFilesystem::symlink_status(const path& p, std::error_code& ec) NOEXCEPT
+{
+  // we don't support symlinks (yet), so this is equivalent to status()
+  return status(p, ec);
+}
+
+
+namespace {
+
+/*! A read only view of a snapshot of file content.  The content doesn't change as long
+ *  as it is referred to, since writers copy shared content first. */
+class MemoryMapping : public mapped_file::IMappingImpl
+{
+public:
+  MemoryMapping(std::shared_ptr<const FileContent> content,
+                file_size_type offset,
+                std::size_t size)
+    : _content(std::move(content))
+    , _offset(offset)
+    , _size(size)
+  {
+    if (_size == 0) {
+      return;
+    }
+
+    _data = _content->contiguous_at(_offset, _size);
+    if (!_data) {
+      _copy.resize(_size);
+      auto unpacked = UnpackedChunk();
+      for (auto pos = std::size_t(0); pos < _size;) {
+        auto len = std::size_t(0);
+        const auto* data = _content->data_at(_offset + pos, len, unpacked);
+        len = std::min(len, _size - pos);
+        std::memcpy(_copy.data() + pos, data, len);
+        pos += len;
+      }
+      _data = _copy.data();
+    }
+  }
+
+  char* data() override { return const_cast<char*>(_data); }
+  std::size_t size() const override { return _size; }
+
+  void advise(map_advice advice, std::error_code& ec) override
+  {
+    // only spilled content can be paged out
+    if (advice == map_advice::dont_need) {
+      const auto end = _offset + _size;
+      for (auto pos = _offset; pos < end; pos += FileContent::k_chunk_size) {
+        _content->evict(pos);
+      }
+    }
+    ec.clear();
+  }
+
+  void flush(std::error_code& ec) override { ec.clear(); }
+
+private:
+  std::shared_ptr<const FileContent> _content;
+  file_size_type _offset;
+  std::size_t _size;
+  const char* _data = nullptr;
+  // the bytes of content not stored in one piece
+  std::vector<char> _copy;
+};
+
+}  // namespace
+
+
+std::unique_ptr<mapped_file::IMappingImpl>
+MemoryFilesystem::map_file(const path& p,
+                           map_mode mode,
+                           file_size_type offset,
+                           file_size_type length,
+                           std::error_code& ec)
+{
+  ec.clear();
+  if (mode != map_mode::read_only) {
+    return nullptr;
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  const auto nd = find_node(p, ec);
+  if (ec) {
+    return nullptr;
   }
-  else if (s.type() == file_type::directory) {
-    ec.clear();
+
+  auto content = std::shared_ptr<const FileContent>();
+  {
+    SharedNodeLock lock(_locks, nd);
+    if (_nodes[nd]._type != file_type::regular) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return nullptr;
+    }
+    content = _nodes[nd]._content;
   }
-  else {
-    ec = std::make_error_code(std::errc::file_exists);
+
+  const auto file_size = content ? content->size() : file_size_type(0);
+  if (offset > file_size) {
+    ec = std::make_error_code(std::errc::invalid_argument);
+    return nullptr;
   }
 
-  return false;
+  const auto size = static_cast<std::size_t>(std::min(length, file_size - offset));
+  return estd::make_unique<MemoryMapping>(std::move(content), offset, size);
 }
 
 
 bool
-MemoryFilesystem::create_directory(const path& p,
-                                   const path& existing_p,
-                                   std::error_code& ec)
+MemoryFilesystem::start_async(const AsyncRequest& request, const AsyncHandler& done)
 {
-  // TODO: we don't support dir attributes in the memory vfs currently
-  (void)existing_p;
-  return create_directory(p, ec);
-}
+  auto result = AsyncResult();
+  auto& ec = result.ec;
 
+  switch (request.op) {
+  case Operation::status:
+    result.status = status(request.p, ec);
+    break;
+  case Operation::symlink_status:
+    result.status = symlink_status(request.p, ec);
+    break;
+  case Operation::file_size:
+    result.count = file_size(request.p, ec);
+    break;
+  case Operation::last_write_time:
+    result.time = last_write_time(request.p, ec);
+    break;
+  case Operation::create_directory:
+    result.flag = create_directory(request.p, ec);
+    break;
+  case Operation::create_directories:
+    result.flag = create_directories(request.p, ec);
+    break;
+  case Operation::rename:
+    rename(request.p, request.p2, ec);
+    break;
+  case Operation::remove:
+    result.flag = remove(request.p, ec);
+    break;
+  default:
+    return false;
+  }
 
-bool
-MemoryFilesystem::create_directories(const path& path, std::error_code& ec)
-{
-  return find_node(_root, path, ec, true) != nullptr;
+  done(result);
+  return true;
 }
 
 
-void
-MemoryFilesystem::create_hard_link(const path& target,
-                                   const path& link,
-                                   std::error_code& ec)
-{
-  (void)target;
-  (void)link;
-  ec = std::make_error_code(std::errc::function_not_supported);
-}
-
+//----------------------------------------------------------------------------------------
 
-void
-MemoryFilesystem::create_symlink(const path& target,
-                                 const path& link,
-                                 std::error_code& ec)
+std::unique_ptr<vfs::IMemoryFilesystem>
+make_memory_filesystem()
 {
-  (void)target;
-  (void)link;
-  ec = std::make_error_code(std::errc::function_not_supported);
+  return estd::make_unique<MemoryFilesystem>();
 }
 
 
-void
-MemoryFilesystem::create_directory_symlink(const path& target,
-                                           const path& link,
-                                           std::error_code& ec)
+std::unique_ptr<vfs::IMemoryFilesystem>
+make_memory_filesystem(std::uintmax_t capacity)
 {
-  (void)target;
-  (void)link;
-  ec = std::make_error_code(std::errc::function_not_supported);
+  return estd::make_unique<MemoryFilesystem>(capacity);
 }
 
 
-bool
-MemoryFilesystem::equivalent(const path& p1, const path& p2, std::error_code& ec)
+std::unique_ptr<vfs::IMemoryFilesystem>
+make_memory_filesystem(std::uintmax_t capacity,
+                       std::uintmax_t spill_threshold,
+                       const path& spill_directory)
 {
-  auto n1 = find_node(_root, p1, ec);
-  if (n1 && !ec) {
-    auto n2 = find_node(_root, p2, ec);
-    if (n2 && !ec) {
-      ec.clear();
-      return (n1 == n2);
-    }
+  auto directory = spill_directory.empty() ? temp_directory_path() : spill_directory;
+
+  std::error_code ec;
+  auto store = SpillStore::create(directory, spill_threshold, ec);
+  if (!store) {
+    throw filesystem_error("can't create spill file", directory, ec);
   }
 
-  ec = std::make_error_code(std::errc::no_such_file_or_directory);
-  return false;
+  return estd::make_unique<MemoryFilesystem>(capacity, std::move(store));
 }
 
 
-file_size_type
-MemoryFilesystem::file_size(const path& p, std::error_code& ec)
+void
+IMemoryFilesystem::set_compression(const path& p, bool enabled)
 {
-  if (auto nd = find_node(_root, p, ec)) {
-    ec.clear();
-    return nd->_file_size;
+  std::error_code ec;
+  set_compression(p, enabled, ec);
+  if (ec) {
+    throw filesystem_error("can't set compression", p, ec);
   }
-  return file_size_type();
 }
 
 
-std::uintmax_t
-MemoryFilesystem::hard_link_count(const path& p, std::error_code& ec)
+//----------------------------------------------------------------------------------------
+
+void
+MemoryFileBuf::open(MemoryFilesystem* fs, node_handle nd, std::ios::openmode mode)
 {
-  if (auto nd = find_node(_root, p, ec)) {
-    // TODO: we don't support hard-links yet.  Hardcode to 1 for now
-    (void)nd;
-    ec.clear();
-    return 1;
+  _fs = fs;
+  _node = nd;
+  _can_read = (mode & std::ios::in) != 0;
+  _can_write = (mode & (std::ios::out | std::ios::app)) != 0;
+  _append = (mode & std::ios::app) != 0;
+  _is_dirty = false;
+  _is_written = false;
+  _out_of_space = false;
+  _area_pos = 0;
+  setg(nullptr, nullptr, nullptr);
+  setp(nullptr, nullptr);
+
+  // like std::filebuf "out" and "out|trunc" truncate, while "in|out" and "app" don't.
+  const auto is_trunc =
+    _can_write && !_append && ((mode & std::ios::trunc) != 0 || !_can_read);
+  _content = fs->open_content(nd, is_trunc);
+  _reserved = 0;
+  _reserved_end = _content ? _content->size() : 0;
+
+  if ((mode & std::ios::ate) != 0 && _content) {
+    _area_pos = _content->size();
   }
-  return std::uintmax_t();
 }
 
 
-file_time_type
-MemoryFilesystem::last_write_time(const path& p, std::error_code& ec)
+void
+MemoryFileBuf::close()
 {
-  if (auto nd = find_node(_root, p, ec)) {
-    ec.clear();
-    return nd->_last_write_time;
+  settle_position();
+  publish();
+  if (_reserved > 0) {
+    _fs->release_space(_reserved);
+    _reserved = 0;
+  }
+  if (_is_written && _fs->compresses(_node)) {
+    _fs->compress_content(_node, _content);
   }
 
-  return file_time_type();
+  _fs = nullptr;
+  _node = k_no_node;
+  _content.reset();
+  _unpacked = UnpackedChunk();
+  _can_read = false;
+  _can_write = false;
+  _append = false;
+  _area_pos = 0;
 }
 
 
 void
-MemoryFilesystem::last_write_time(const path& p,
-                                  file_time_type new_time,
-                                  std::error_code& ec)
+MemoryFileBuf::settle_position()
 {
-  if (auto nd = find_node(_root, p, ec)) {
-    nd->_last_write_time = new_time;
-    ec.clear();
+  if (pbase()) {
+    const auto written = static_cast<file_size_type>(pptr() - pbase());
+    if (written > 0) {
+      _content->commit(_area_pos + written);
+      _is_dirty = true;
+    }
+    if (pptr() == epptr()) {
+      // moving on to the next chunk
+      _content->evict(_area_pos);
+    }
+    _area_pos += written;
+    setp(nullptr, nullptr);
+  }
+  else if (eback()) {
+    if (gptr() == egptr()) {
+      _content->evict(_area_pos);
+    }
+    _area_pos += static_cast<file_size_type>(gptr() - eback());
+    setg(nullptr, nullptr, nullptr);
   }
 }
 
 
 void
-MemoryFilesystem::permissions(const path& p, perms prms, std::error_code& ec)
-{
-  (void)p;
-  (void)prms;
-  ec = std::make_error_code(std::errc::function_not_supported);
-}
-
-
-path
-MemoryFilesystem::read_symlink(const path& p, std::error_code& ec)
+MemoryFileBuf::publish()
 {
-  (void)p;
-  ec = std::make_error_code(std::errc::function_not_supported);
-  return path();
+  if (_is_dirty) {
+    _fs->publish_content(_node, _content, _reserved);
+    _is_dirty = false;
+    _is_written = true;
+    _reserved = 0;
+    _reserved_end = _content->size();
+  }
 }
 
 
-bool
-MemoryFilesystem::remove(const path& p, std::error_code& ec)
+FileContent&
+MemoryFileBuf::writable_content()
 {
-  auto s = status(p, ec);
-  if (s.type() == file_type::regular) {
-    if (auto parent = find_node(_root, p.parent_path(), ec)) {
-      remove_node(*parent, p.filename().string());
-      ec.clear();
-      return true;
-    }
-  }
-  else if (s.type() == file_type::directory) {
-    auto parent = find_node(_root, p.parent_path(), ec);
-    auto dir = find_node(parent, p.filename(), ec);
-    if (dir->_children.empty()) {
-      remove_node(*parent, p.filename().string());
-      ec.clear();
-      return true;
-    }
-    else {
-      ec = std::make_error_code(std::errc::directory_not_empty);
-    }
+  // content shared with the node (or anyone else) is not changed anymore
+  if (!_content) {
+    _content = std::make_shared<FileContent>(_fs->spill_store());
   }
-  else {
-    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+  else if (_content.use_count() > 1) {
+    _content = std::make_shared<FileContent>(*_content);
   }
-  return false;
+
+  return *_content;
 }
 
 
-std::uintmax_t
-MemoryFilesystem::remove_all(const path& p, std::error_code& ec)
+MemoryFileBuf::int_type
+MemoryFileBuf::underflow()
 {
-  auto s = status(p, ec);
-  if (s.type() == file_type::regular) {
-    if (auto parent = find_node(_root, p.parent_path(), ec)) {
-      remove_node(*parent, p.filename().string());
-      ec.clear();
-      return 1;
-    }
-  }
-  else if (s.type() == file_type::directory) {
-    auto parent = find_node(_root, p.parent_path(), ec);
-    auto descs = count_descendants(*find_node(parent, p.filename(), ec));
-    remove_node(*parent, p.filename().string());
-    ec.clear();
-    return 1 + descs;
-  }
-  else if (s.type() == file_type::not_found) {
-    ec.clear();
-    return 0;
+  if (!_can_read) {
+    return traits_type::eof();
   }
-  else {
-    ec = std::make_error_code(std::errc::not_supported);
+
+  settle_position();
+  if (!_content || _area_pos >= _content->size()) {
+    return traits_type::eof();
   }
 
-  // In case of error the standard requires this:
-  return static_cast<std::uintmax_t>(-1);
+  auto len = std::size_t(0);
+  auto* data = const_cast<char*>(_content->data_at(_area_pos, len, _unpacked));
+  setg(data, data, data + len);
+
+  return traits_type::to_int_type(*data);
 }
 
 
-void
-MemoryFilesystem::rename(const path& old_p, const path& new_p, std::error_code& ec)
+MemoryFileBuf::int_type
+MemoryFileBuf::overflow(int_type c)
 {
-  auto s = status(old_p, ec);
-  if (s.type() == file_type::directory) {
-    auto srcparent = find_node(_root, old_p.parent_path(), ec);
-
-    auto ds = status(new_p, ec);
-    if (ds.type() == file_type::directory) {
-      // POSIX allows to replace an empty directory, but Windows doesn't.  Maybe we
-      // should fail here?
-      ec = std::make_error_code(std::errc::directory_not_empty);
-    }
-    else if (ds.type() == file_type::not_found) {
-      if (auto dstparent = find_node(_root, new_p.parent_path(), ec)) {
-        if (dstparent->_type == file_type::directory) {
-          move_node(
-            *srcparent, old_p.filename().string(), *dstparent, new_p.filename().string());
-          ec.clear();
-        }
-        else {
-          ec = std::make_error_code(std::errc::not_a_directory);
-        }
-      }
-      else {
-        ec = std::make_error_code(std::errc::no_such_file_or_directory);
-      }
-    }
-    else if (ds.type() == file_type::regular) {
-      ec = std::make_error_code(std::errc::not_a_directory);
-    }
-    else {
-      // a better error code?
-      ec = std::make_error_code(std::errc::not_supported);
-    }
+  if (!_can_write) {
+    return traits_type::eof();
   }
-  else if (s.type() == file_type::regular) {
-    auto srcparent = find_node(_root, old_p.parent_path(), ec);
-    auto dstparent = find_node(_root, new_p.parent_path(), ec);
 
-    auto ds = status(new_p, ec);
-    if (ds.type() == file_type::regular) {
-      if (dstparent) {
-        // replace dst with src
-        replace_node(
-          *srcparent, old_p.filename().string(), *dstparent, new_p.filename().string());
-        ec.clear();
-      }
-      else {
-        ec = std::make_error_code(std::errc::no_such_file_or_directory);
-      }
-    }
-    else if (ds.type() == file_type::not_found) {
-      if (dstparent) {
-        if (dstparent->_type == file_type::directory) {
-          // move src to dst
-          move_node(
-            *srcparent, old_p.filename().string(), *dstparent, new_p.filename().string());
-          ec.clear();
-        }
-        else {
-          ec = std::make_error_code(std::errc::not_a_directory);
-        }
-      }
-      else if (ds.type() == file_type::directory) {
-        ec = std::make_error_code(std::errc::is_a_directory);
-      }
-      else {
-        ec = std::make_error_code(std::errc::no_such_file_or_directory);
-      }
-    }
-    else {
-      // a better error code?
-      ec = std::make_error_code(std::errc::not_supported);
-    }
-  }
-  else if (s.type() == file_type::not_found) {
-    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+  settle_position();
+  if (traits_type::eq_int_type(c, traits_type::eof())) {
+    return traits_type::not_eof(c);
   }
-  else {
-    ec = std::make_error_code(std::errc::not_supported);
+
+  if (_append) {
+    _area_pos = _content ? _content->size() : 0;
   }
-}
 
+  auto len = std::size_t(0);
+  char* data;
+  try {
+    data = writable_content().writable_at(_area_pos, len);
+  }
+  catch (const std::system_error&) {
+    // the spill file can't grow
+    _out_of_space = true;
+    return traits_type::eof();
+  }
 
-void
-MemoryFilesystem::resize_file(const path& p, file_size_type new_size, std::error_code& ec)
-{
-  auto nd = find_node(_root, p, ec);
-  if (nd) {
-    if (nd->_type == file_type::regular) {
-      ec.clear();
-      if (new_size != nd->_file_size) {
-        nd->_file_size = new_size;
-        nd->_data.resize(static_cast<size_t>(new_size), '\0');
-        nd->touch();
-      }
-    }
-    else {
-      ec = std::make_error_code(std::errc::not_supported);
+  // reserve the space the put area may add to the file, or shrink the area to what is
+  // left.
+  if (_area_pos + len > _reserved_end) {
+    const auto granted = _fs->reserve_space(_area_pos + len - _reserved_end);
+    _reserved += granted;
+    _reserved_end += granted;
+    if (_reserved_end <= _area_pos) {
+      _out_of_space = true;
+      return traits_type::eof();
     }
+    len = static_cast<std::size_t>(
+      std::min(static_cast<file_size_type>(len), _reserved_end - _area_pos));
   }
-  else {
-    ec = std::make_error_code(std::errc::no_such_file_or_directory);
-  }
-}
+  setp(data, data + len);
 
+  *pptr() = traits_type::to_char_type(c);
+  pbump(1);
 
-space_info
-MemoryFilesystem::space(const path& p, std::error_code& ec) NOEXCEPT
-{
-  (void)p;
-  ec = std::make_error_code(std::errc::function_not_supported);
-  return space_info();
+  return c;
 }
 
 
-file_status
-MemoryFilesystem::status(const path& p, std::error_code& ec) NOEXCEPT
+MemoryFileBuf::pos_type
+MemoryFileBuf::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
 {
-  if (auto nd = find_node(_root, p, ec)) {
-    return file_status(nd->_type);
+  (void)which;
+
+  if (!_can_read && !_can_write) {
+    return pos_type(off_type(-1));
   }
 
-  ec.clear();
-  return file_status(file_type::not_found);
+  settle_position();
+
+  auto base = off_type(0);
+  if (dir == std::ios::cur) {
+    base = static_cast<off_type>(_area_pos);
+  }
+  else if (dir == std::ios::end) {
+    base = _content ? static_cast<off_type>(_content->size()) : 0;
+  }
+
+  if (base + off < 0) {
+    return pos_type(off_type(-1));
+  }
+
+  _area_pos = static_cast<file_size_type>(base + off);
+  return pos_type(base + off);
 }
 
 
-file_status
-MemoryFilesystem::symlink_status(const path& p, std::error_code& ec) NOEXCEPT
+MemoryFileBuf::pos_type
+MemoryFileBuf::seekpos(pos_type pos, std::ios::openmode which)
 {
-  // we don't support symlinks (yet), so this is equivalent to status()
-  return status(p, ec);
+  return seekoff(off_type(pos), std::ios::beg, which);
 }
 
 
-//----------------------------------------------------------------------------------------
-
-std::unique_ptr<vfs::IFilesystem>
-make_memory_filesystem()
+int
+MemoryFileBuf::sync()
 {
-  return estd::make_unique<MemoryFilesystem>();
+  settle_position();
+  publish();
+  return 0;
 }
 
 
@@ -741,7 +2170,7 @@ make_memory_filesystem()
 
 MemoryVfsFileImpl::MemoryVfsFileImpl(MemoryFilesystem* fs)
   : _fs(fs)
-  , _stream(std::ios::in)
+  , _stream(&_buf)
 {
 }
 
@@ -760,66 +2189,31 @@ MemoryVfsFileImpl::open(const path& vpath, std::ios::openmode mode, std::error_c
 {
   assert(!is_open());
 
+  EpochDomain::Guard guard(_fs->epochs());
+
   const auto p = vfs::deroot(vpath);
 
   const bool is_read = (mode & std::ios::in) != 0;
   const bool is_write = (mode & (std::ios::out | std::ios::app)) != 0;
 
+  auto nd = k_no_node;
   if (is_read && !is_write) {
-    auto nd = find_node(_fs->root_node(), p, ec);
-    if (!ec) {
-      if (nd->_type == file_type::regular) {
-#if defined(FSPP_HAVE_STD_STRINGSTREAM_COPYASSIGN)
-        _stream = std::stringstream(nd->_data, mode);
-#else
-        _stream.clear();
-        _stream.str(nd->_data);
-#endif
-        ec.clear();
-        _node = nd;
-        _filemode = k_read;
-      }
-      else {
-        ec = std::make_error_code(std::errc::is_a_directory);
-      }
-    }
-    else {
+    nd = _fs->find_node(p, ec);
+    if (ec) {
       ec = std::make_error_code(std::errc::no_such_file_or_directory);
     }
   }
+  else if (is_write && _fs->is_read_only()) {
+    ec = std::make_error_code(std::errc::read_only_file_system);
+  }
   else if (is_write) {
-    auto nd = find_node(_fs->root_node(), p, ec);
-    if (!ec) {
-      if (nd->_type == file_type::regular) {
-        ec.clear();
-#if defined(FSPP_HAVE_STD_STRINGSTREAM_COPYASSIGN)
-        _stream = std::stringstream(mode & std::ios::trunc ? "" : nd->_data, mode);
-#else
-        _stream.str(mode & std::ios::trunc ? "" : nd->_data);
-        _stream.clear();
-#endif
-        _node = nd;
-        _filemode = is_read ? k_readwrite : k_write;
-      }
-      else {
-        ec = std::make_error_code(std::errc::is_a_directory);
-      }
-    }
-    else {
-      auto dstparent = find_node(_fs->root_node(), p.parent_path(), ec);
+    nd = _fs->find_node(p, ec);
+    if (ec) {
+      const auto dstparent = _fs->find_node(p.parent_path(), ec);
       if (!ec) {
-        if (dstparent->_type == file_type::directory) {
-          ec.clear();
-          _node = create_regular_file_node(dstparent, p.filename().string());
-#if defined(FSPP_HAVE_STD_STRINGSTREAM_COPYASSIGN)
-          _stream = std::stringstream(mode);
-#else
-          _stream.str("");
-          _stream.clear();
-#endif
-          _filemode = is_read ? k_readwrite : k_write;
-        }
-        else {
+        // returns the file if someone else has created it meanwhile
+        nd = _fs->create_regular_file_node(dstparent, p.filename().string(), ec);
+        if (ec == std::errc::no_such_file_or_directory) {
           ec = std::make_error_code(std::errc::not_a_directory);
         }
       }
@@ -832,6 +2226,27 @@ MemoryVfsFileImpl::open(const path& vpath, std::ios::openmode mode, std::error_c
     ec = std::make_error_code(std::errc::function_not_supported);
   }
 
+  if (ec) {
+    return _stream;
+  }
+
+  // The node is checked only once acquired: until then a rename or remove can free it
+  // even though p keeps referring to a file.
+  if (!_fs->acquire_node(nd)) {
+    // replaced or removed meanwhile; try again with what p refers to now
+    return open(vpath, mode, ec);
+  }
+  if (_fs->node_type(nd) != file_type::regular) {
+    _fs->release_node(nd);
+    ec = std::make_error_code(std::errc::is_a_directory);
+    return _stream;
+  }
+
+  _node = nd;
+  _filemode = !is_write ? k_read : is_read ? k_readwrite : k_write;
+  _buf.open(_fs, _node, mode);
+  _stream.clear();
+
   return _stream;
 }
 
@@ -855,30 +2270,22 @@ MemoryVfsFileImpl::close(std::error_code& ec)
   switch (_filemode) {
   case k_not_open:
     ec = std::make_error_code(std::errc::bad_file_descriptor);
-    break;
+    return;
   case k_read:
-    ec.clear();
-    break;
   case k_write:
   case k_readwrite:
-    assert(_node);
-    _node->set_data(_stream.str());
     ec.clear();
     break;
   }
 
-// There's no way to close a stringstream.  And std::ios::openmode doesn't seem to have
-// an "invalid" state.  0 is actually "std::ios::app" in libc++, so that doesn't work.
-// The best we can try here is to "open" the stringstream in "input" format.  So you
-// could read from it (which always eof()s, because it's empty), but you can't write to
-// it.
-#if defined(FSPP_HAVE_STD_STRINGSTREAM_COPYASSIGN)
-  _stream = std::stringstream(std::ios::in);
-#else
-  _stream.str("");
-  _stream.clear();
-#endif
-  _node = nullptr;
+  if (_buf.is_out_of_space()) {
+    ec = std::make_error_code(std::errc::no_space_on_device);
+  }
+
+  // After closing the stream reads as empty and can't be written to.
+  _buf.close();
+  _fs->release_node(_node);
+  _node = k_no_node;
   _filemode = k_not_open;
 }
 
@@ -8,73 +8,93 @@
 #include "fspp/details/fspp-config.hpp"
 #endif
 
+#include "memory_vfs_image.hpp"
+#include "memory_vfs_nodes.hpp"
+
+#include "fspp/details/async.hpp"
 #include "fspp/details/dir_iterator.hpp"
 #include "fspp/details/file.hpp"
 #include "fspp/details/vfs.hpp"
 #include "fspp/filesystem.hpp"
 
-#include <chrono>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <ctime>
 #include <memory>
-#include <sstream>
+#include <mutex>
+#include <ios>
+#include <iostream>
+#include <limits>
+#include <ostream>
+#include <streambuf>
 #include <string>
-#include <unordered_map>
-#include <utility>
+#include <unordered_set>
+#include <vector>
 
 
 namespace eyestep {
 namespace filesystem {
 namespace vfs {
 
-class FSNode
+/*! A filesystem completely held in memory.
+ *
+ * Nodes live in a NodeArena and are referred to by node_handle; directories map
+ * interned names (see NameTable) to node handles.  A node is freed when it is neither
+ * linked from a directory nor in use by an open file or directory iterator.  Hard links
+ * are directory entries referring to the same node.  Copied files share their content
+ * with the original until one of them is written to.
+ *
+ * Forks share the name table and, copy on write, the node arena's pages, the directory
+ * tables and the file contents.  Which nodes are open is tracked per filesystem;
+ * nodes only kept alive by open files at fork time stay unreachable in the fork.
+ *
+ * Lookups of a path resolve its parent directory through a PathCache, so looking up
+ * files in a recently used directory takes about one hash probe regardless of depth.
+ *
+ * The filesystem can be used from many threads at once.  Nodes are protected by the
+ * lock of their arena page (see NodeLocks); operations hold at most one of these locks
+ * shared at a time while reading, and lock all nodes they change exclusively.  Renames
+ * of directories are serialized in addition, as they change the ancestry of nodes.
+ * Every operation runs in the arena's EpochDomain, such that handles it looked up are
+ * not reused meanwhile.  File content is never changed once it is visible to others;
+ * writers work on a private copy (see MemoryFileBuf).
+ *
+ * The space used is accounted as k_node_overhead bytes per node plus the size of each
+ * file, and limited to a capacity given at construction.  Files open for writing reserve
+ * space before they grow (see reserve_space()), so writing fails once the limit is
+ * reached rather than on publishing.
+ *
+ * Given a SpillStore, the content of files growing beyond its threshold is moved out of
+ * the heap into the store's temporary file (see FileContent).  Forks share the store.
+ *
+ * Files with FSNode::_compress set get their content packed after it has been written
+ * (see compress_content()).  The packed content replaces the node's content only if
+ * that hasn't changed meanwhile, so compressing never needs a lock while it runs.
+ */
+class MemoryFilesystem : public vfs::IMemoryFilesystem,
+                         public vfs::IAsyncFilesystem,
+                         public vfs::IMappableFilesystem
 {
 public:
-  FSNode() = default;
-  explicit FSNode(file_type type)
-    : _type(type)
-  {
-  }
-
-  FSNode(const FSNode& other) = default;
-  FSNode& operator=(const FSNode& other) = default;
-
-  void set_data(std::string data)
-  {
-    _data = std::move(data);
-    _file_size = _data.size();
-    touch();
-  }
+  static const std::uintmax_t k_unlimited = std::numeric_limits<std::uintmax_t>::max();
+  /*! The space accounted for each node besides its content. */
+  static const std::uintmax_t k_node_overhead = sizeof(FSNode) + sizeof(ChildEntry);
 
-  void copy_from_other(const FSNode& other)
-  {
-    _data = other._data;
-    _file_size = other._file_size;
-    _last_write_time = other._last_write_time;
-  }
+  explicit MemoryFilesystem(std::uintmax_t capacity = k_unlimited,
+                            std::shared_ptr<SpillStore> spill_store = nullptr);
 
-  void touch()
-  {
-    _last_write_time =
-      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  }
-
-  file_type _type = file_type::none;
-  file_time_type _last_write_time;
-  file_size_type _file_size = 0;
-  perms _perms;
-  // if _type == // directory_file
-  std::unordered_map<std::string, std::shared_ptr<FSNode>> _children;
-  // if _type == regular_file
-  std::string _data;
-};
+  std::unique_ptr<IMemoryFilesystem> fork() override;
+  std::unique_ptr<IMemoryFilesystem> snapshot() override;
 
+  using IMemoryFilesystem::save_image;
+  void save_image(std::ostream& os, std::error_code& ec) override;
+  /*! Creates a filesystem from the image file @p p (see memory_vfs_image.hpp).  File
+   *  content is viewed in the mapped image.  Returns null (with @p ec set) on failure. */
+  static std::unique_ptr<MemoryFilesystem> load_image(const path& p, std::error_code& ec);
 
-class MemoryFilesystem : public vfs::IFilesystem
-{
-public:
-  MemoryFilesystem();
-  std::shared_ptr<FSNode> root_node();
+  using IMemoryFilesystem::set_compression;
+  void set_compression(const path& p, bool enabled, std::error_code& ec) override;
+  CompressionStatistics compression_statistics() override;
 
   std::unique_ptr<detail::IFileImpl> make_file_impl() override;
   std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
@@ -101,6 +121,7 @@ public:
                                 std::error_code& ec) override;
   bool equivalent(const path& p1, const path& p2, std::error_code& ec) override;
   file_size_type file_size(const path& p, std::error_code& ec) override;
+  file_id file_identity(const path& p, std::error_code& ec) override;
   std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override;
   file_time_type last_write_time(const path& p, std::error_code& ec) override;
   void last_write_time(const path& p,
@@ -116,13 +137,215 @@ public:
   file_status status(const path& p, std::error_code& ec) NOEXCEPT override;
   file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override;
 
+  /*! Completes the operations on single nodes right away on the calling thread, since
+   *  they never wait for I/O.  Copies and removing trees are left to the executor. */
+  bool start_async(const AsyncRequest& request, const AsyncHandler& done) override;
+
+  /*! Maps files read only to a snapshot of their content, viewed in place if the range
+   *  is stored in one piece and copied otherwise.  Writable mappings are left to a
+   *  buffer written back through a stream, as content is only changed by copying it. */
+  std::unique_ptr<mapped_file::IMappingImpl> map_file(const path& p,
+                                                      map_mode mode,
+                                                      file_size_type offset,
+                                                      file_size_type length,
+                                                      std::error_code& ec) override;
+
+  bool is_read_only() const { return _read_only; }
+
+  /*! The domain all operations enter.  Node handles returned by the functions below
+   *  stay valid only as long as the caller is in it, too (see EpochDomain::Guard). */
+  EpochDomain& epochs() { return _nodes.epochs(); }
+
+  /*! Returns the node @p p refers to or k_no_node (with @p ec set).  If @p create_nodes
+   *  is true missing directories are created on the way. */
+  node_handle find_node(const path& p, std::error_code& ec, bool create_nodes = false);
+  /*! Returns the type of @p nd or file_type::none if it has been freed meanwhile. */
+  file_type node_type(node_handle nd);
+  /*! Returns the regular file @p name in @p parent, creating it if needed.  Returns
+   *  k_no_node (with @p ec set) if @p parent is not a directory (anymore) or there is no
+   *  space left. */
+  node_handle create_regular_file_node(node_handle parent,
+                                       const std::string& name,
+                                       std::error_code& ec);
+
+  /*! Keeps @p nd alive even when it is removed from its directory meanwhile.  Returns
+   *  false if @p nd has been freed already. */
+  bool acquire_node(node_handle nd);
+  void release_node(node_handle nd);
+
+  /*! Returns the content of file @p nd, after truncating it if @p truncate is true. */
+  std::shared_ptr<FileContent> open_content(node_handle nd, bool truncate);
+  /*! Makes @p content the content of file @p nd.  @p content must not be changed
+   *  anymore afterwards.  Takes over @p reserved bytes reserved by reserve_space() for
+   *  the growth of the file. */
+  void publish_content(node_handle nd,
+                       const std::shared_ptr<FileContent>& content,
+                       std::uintmax_t reserved);
+
+  /*! Returns true if the content of file @p nd is to be compressed. */
+  bool compresses(node_handle nd);
+  /*! Replaces @p content, if it is (still) the content of file @p nd, by a packed copy
+   *  of it. */
+  void compress_content(node_handle nd, const std::shared_ptr<FileContent>& content);
+
+  /*! The store large file content is spilled to or null. */
+  const std::shared_ptr<SpillStore>& spill_store() const { return _spill_store; }
+
+  /*! Reserves up to @p bytes of the free space and returns the number of bytes
+   *  actually reserved. */
+  std::uintmax_t reserve_space(std::uintmax_t bytes);
+  /*! Gives back @p bytes reserved by reserve_space(). */
+  void release_space(std::uintmax_t bytes);
+
+  /*! Returns a snapshot of directory @p dir's entries, which is null if the directory
+   *  is empty.  The snapshot doesn't change when entries are added or removed later. */
+  std::shared_ptr<const ChildTable> children(node_handle dir);
+  /*! Reads the name and the file size of @p entry, taken from a snapshot of directory
+   *  @p dir's entries.  Returns false if the entry has been removed meanwhile. */
+  bool read_child(node_handle dir,
+                  const ChildEntry& entry,
+                  std::string& name,
+                  file_size_type& size);
+
+  /*! An entry of a directory as read by children_from(). */
+  struct Child
+  {
+    std::string name;
+    node_handle node;
+    file_size_type size;
+  };
+
+  /*! Reads up to @p n entries of directory @p dir from slot @p pos of @p snapshot on
+   *  into @p children, taking its lock once.  Entries removed since @p snapshot was
+   *  taken are skipped.  Returns the slot of the entry following them or k_no_slot. */
+  std::size_t children_from(node_handle dir,
+                            const ChildTable& snapshot,
+                            std::size_t pos,
+                            std::size_t n,
+                            std::vector<Child>& children);
+
+  static const std::size_t k_no_slot = std::size_t(-1);
+
 private:
-  std::shared_ptr<FSNode> _root;
+  MemoryFilesystem(MemoryFilesystem& other, bool read_only);
+
+  bool check_writable(std::error_code& ec) const;
+  bool populate(const std::shared_ptr<const ImageMapping>& image, std::error_code& ec);
+  bool charge(std::uintmax_t bytes);
+  void settle_space(std::uintmax_t added, std::uintmax_t removed);
+  void free_node_locked(node_handle nd);
+  node_handle lookup(const path& p,
+                     std::error_code& ec,
+                     bool create_nodes,
+                     file_type& type);
+  node_handle resolve(node_handle base,
+                      const path::value_type* data,
+                      std::size_t len,
+                      std::error_code& ec,
+                      bool create_nodes,
+                      file_type& type);
+  node_handle find_child_locked(node_handle dir, const std::string& name) const;
+  node_handle create_node(node_handle parent,
+                          const std::string& name,
+                          file_type type,
+                          bool& created,
+                          std::error_code& ec);
+  void link_node_locked(node_handle parent, const std::string& name, node_handle nd);
+  void unlink_entry_locked(node_handle parent, const std::string& name);
+  std::shared_ptr<ChildTable> drop_link_locked(node_handle nd);
+  void release_children(const std::shared_ptr<ChildTable>& children);
+  bool is_open_locked(node_handle nd);
+  bool is_ancestor(node_handle dir, node_handle nd);
+  std::uintmax_t count_descendants(node_handle nd);
+  void collect_compression_statistics(node_handle nd,
+                                      std::unordered_set<node_handle>& visited,
+                                      CompressionStatistics& statistics);
+  bool remove_entry(node_handle parent,
+                    const std::string& name,
+                    bool recursive,
+                    std::error_code& ec);
+  void dump_node(node_handle nd, std::ostream& os, std::size_t level);
+
+  // declared before _nodes: the arena's directory tables release their names on
+  // destruction.
+  std::shared_ptr<NameTable> _names;
+  NodeArena _nodes;
+  NodeLocks _locks;
+  // the hidden top node; holds the root directory "/" as only child.
+  node_handle _top;
+  // identifies this filesystem's entries in the per thread path caches
+  std::uint64_t _id;
+  // changes whenever a directory is removed or moved, invalidating the path caches
+  std::atomic<std::uint64_t> _dir_generation;
+  // serializes directory renames
+  std::mutex _rename_mutex;
+  const std::uintmax_t _capacity;
+  // the space used by nodes, their content and reservations
+  std::atomic<std::uintmax_t> _used;
+  // the part of _used reserved by files open for writing
+  std::atomic<std::uintmax_t> _reserved;
+  std::shared_ptr<SpillStore> _spill_store;
+  bool _read_only = false;
 };
 
 
 //----------------------------------------------------------------------------------------
 
+/*! A stream buffer reading from and writing to the content of a memory VFS file
+ * directly.
+ *
+ * A file keeps the content as it was when opening it.  Writing goes to a private copy
+ * of it (which shares all chunks not written to), which becomes the node's content on
+ * sync() (e.g. by flushing the stream) and close().  Space for growing the file is
+ * reserved from the filesystem before writing; when there is none left, writing fails
+ * and the stream goes bad.  Content written to a compressed file is packed on close().
+ * Packed chunks are read through a buffer holding the chunk read last unpacked.
+ *
+ * The open modes are interpreted like std::basic_filebuf does.
+ */
+class MemoryFileBuf : public std::streambuf
+{
+public:
+  void open(MemoryFilesystem* fs, node_handle nd, std::ios::openmode mode);
+  void close();
+
+  /*! Returns true if writing failed since the file system is full. */
+  bool is_out_of_space() const { return _out_of_space; }
+
+protected:
+  int_type underflow() override;
+  int_type overflow(int_type c) override;
+  pos_type seekoff(off_type off,
+                   std::ios::seekdir dir,
+                   std::ios::openmode which) override;
+  pos_type seekpos(pos_type pos, std::ios::openmode which) override;
+  int sync() override;
+
+private:
+  void settle_position();
+  void publish();
+  FileContent& writable_content();
+
+  MemoryFilesystem* _fs = nullptr;
+  node_handle _node = k_no_node;
+  std::shared_ptr<FileContent> _content;
+  bool _can_read = false;
+  bool _can_write = false;
+  bool _append = false;
+  // true if _content has changes not published yet
+  bool _is_dirty = false;
+  // true if _content has been published since opening
+  bool _is_written = false;
+  bool _out_of_space = false;
+  // the space reserved for growing the file and the file size it covers
+  std::uintmax_t _reserved = 0;
+  file_size_type _reserved_end = 0;
+  // the file position of the current get or put area
+  file_size_type _area_pos = 0;
+  UnpackedChunk _unpacked;
+};
+
+
 class MemoryVfsFileImpl : public detail::IFileImpl
 {
   enum FileMode
@@ -134,9 +357,10 @@ class MemoryVfsFileImpl : public detail::IFileImpl
   };
 
   MemoryFilesystem* _fs;
-  std::stringstream _stream;
+  MemoryFileBuf _buf;
+  std::iostream _stream;
   FileMode _filemode = k_not_open;
-  std::shared_ptr<FSNode> _node;
+  node_handle _node = k_no_node;
 
 public:
   explicit MemoryVfsFileImpl(MemoryFilesystem* fs);
@@ -0,0 +1,377 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs_image.hpp"
+#include "memory_vfs.hpp"
+
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+const std::uint32_t ImageHeader::k_version;
+const std::uint32_t ImageHeader::k_byte_order;
+const std::uint32_t ImageNode::k_directory;
+const std::uint32_t ImageNode::k_regular;
+
+
+namespace {
+
+const char k_image_magic[8] = {'F', 'S', 'P', 'P', 'I', 'M', 'G', '\0'};
+
+
+template <typename T>
+void
+write_items(std::ostream& os, const std::vector<T>& items)
+{
+  os.write(reinterpret_cast<const char*>(items.data()),
+           static_cast<std::streamsize>(items.size() * sizeof(T)));
+}
+
+
+template <typename T>
+T
+read_item(const char* data, std::size_t idx)
+{
+  T item;
+  std::memcpy(&item, data + idx * sizeof(T), sizeof(T));
+  return item;
+}
+
+
+// Returns true if @p count items of @p item_size bytes fit into the @p avail bytes.
+bool
+fits(std::uint64_t count, std::size_t item_size, std::uint64_t avail)
+{
+  return count <= avail / item_size;
+}
+
+
+bool
+is_valid_name(const char* name, std::size_t len)
+{
+  if (len == 0 || (len == 1 && name[0] == '.')
+      || (len == 2 && name[0] == '.' && name[1] == '.')) {
+    return false;
+  }
+  return std::memchr(name, '/', len) == nullptr
+         && std::memchr(name, '\0', len) == nullptr;
+}
+
+}  // namespace
+
+
+void
+MemoryFilesystem::save_image(std::ostream& os, std::error_code& ec)
+{
+  EpochDomain::Guard guard(epochs());
+
+  const auto root = find_node("/", ec);
+  if (root == k_no_node) {
+    return;
+  }
+
+  auto nodes = std::vector<ImageNode>();
+  auto entries = std::vector<ImageEntry>();
+  auto names = std::string();
+  auto data_size = std::uint64_t(0);
+  // the content to write to the data area, in order
+  auto contents = std::vector<std::shared_ptr<FileContent>>();
+  auto data_offsets = std::unordered_map<const FileContent*, std::uint64_t>();
+
+  // number the nodes breadth first, such that the root gets index 0
+  auto order = std::vector<node_handle>{root};
+  auto indices = std::unordered_map<node_handle, std::uint32_t>{{root, 0}};
+
+  for (auto i = std::size_t(0); i < order.size(); ++i) {
+    auto record = ImageNode();
+    auto children = std::vector<std::pair<std::string, node_handle>>();
+    auto content = std::shared_ptr<FileContent>();
+    {
+      SharedNodeLock lock(_locks, order[i]);
+      const auto& node = _nodes[order[i]];
+      record.type = node._type == file_type::directory ? ImageNode::k_directory
+                                                        : ImageNode::k_regular;
+      record.perms = static_cast<std::uint32_t>(node._perms);
+      record.last_write_time = static_cast<std::int64_t>(node._last_write_time);
+      if (const auto* table = node._children.get()) {
+        table->for_each([&](const ChildEntry& entry) {
+          children.emplace_back(_names->str(entry.name), entry.node);
+        });
+      }
+      content = node._content;
+    }
+
+    if (record.type == ImageNode::k_directory) {
+      record.first = entries.size();
+      record.count = children.size();
+      for (const auto& child : children) {
+        const auto next = static_cast<std::uint32_t>(order.size());
+        const auto i_index = indices.emplace(child.second, next).first;
+        if (i_index->second == next) {
+          order.push_back(child.second);
+        }
+        entries.push_back(ImageEntry{names.size(),
+                                     static_cast<std::uint32_t>(child.first.size()),
+                                     i_index->second});
+        names += child.first;
+      }
+    }
+    else if (content && content->size() > 0) {
+      auto i_offset = data_offsets.find(content.get());
+      if (i_offset == data_offsets.end()) {
+        i_offset = data_offsets.emplace(content.get(), data_size).first;
+        data_size += content->size();
+        contents.push_back(content);
+      }
+      record.first = i_offset->second;
+      record.count = content->size();
+    }
+
+    nodes.push_back(record);
+  }
+
+  auto header = ImageHeader();
+  std::memcpy(header.magic, k_image_magic, sizeof(header.magic));
+  header.version = ImageHeader::k_version;
+  header.byte_order = ImageHeader::k_byte_order;
+  header.node_count = nodes.size();
+  header.entry_count = entries.size();
+  header.names_size = names.size();
+  header.data_size = data_size;
+
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  write_items(os, nodes);
+  write_items(os, entries);
+  os.write(names.data(), static_cast<std::streamsize>(names.size()));
+  auto unpacked = UnpackedChunk();
+  for (const auto& content : contents) {
+    for (auto pos = file_size_type(0); pos < content->size() && os;) {
+      auto len = std::size_t(0);
+      const auto* data = content->data_at(pos, len, unpacked);
+      os.write(data, static_cast<std::streamsize>(len));
+      pos += len;
+    }
+  }
+
+  os.flush();
+  if (!os) {
+    ec = std::make_error_code(std::errc::io_error);
+  }
+  else {
+    ec.clear();
+  }
+}
+
+
+std::unique_ptr<MemoryFilesystem>
+MemoryFilesystem::load_image(const path& p, std::error_code& ec)
+{
+  auto image = std::make_shared<ImageMapping>(p, ec);
+  if (!image->data()) {
+    return nullptr;
+  }
+
+  auto fs = estd::make_unique<MemoryFilesystem>();
+  if (!fs->populate(image, ec)) {
+    return nullptr;
+  }
+  return fs;
+}
+
+
+// Creates the nodes of @p image in this filesystem, which must be empty and not in use
+// yet.  The image is validated completely before, such that a damaged image can't
+// break the filesystem's invariants.
+bool
+MemoryFilesystem::populate(const std::shared_ptr<const ImageMapping>& image,
+                           std::error_code& ec)
+{
+  const auto bad_image = [&ec]() {
+    ec = std::make_error_code(std::errc::bad_message);
+    return false;
+  };
+
+  if (image->size() < sizeof(ImageHeader)) {
+    return bad_image();
+  }
+  const auto header = read_item<ImageHeader>(image->data(), 0);
+  if (std::memcmp(header.magic, k_image_magic, sizeof(header.magic)) != 0
+      || header.version != ImageHeader::k_version
+      || header.byte_order != ImageHeader::k_byte_order) {
+    return bad_image();
+  }
+
+  auto avail = static_cast<std::uint64_t>(image->size() - sizeof(ImageHeader));
+  if (header.node_count == 0 || header.node_count > k_no_node
+      || !fits(header.node_count, sizeof(ImageNode), avail)) {
+    return bad_image();
+  }
+  avail -= header.node_count * sizeof(ImageNode);
+  if (!fits(header.entry_count, sizeof(ImageEntry), avail)) {
+    return bad_image();
+  }
+  avail -= header.entry_count * sizeof(ImageEntry);
+  if (header.names_size > avail || header.data_size > avail - header.names_size) {
+    return bad_image();
+  }
+
+  const auto node_count = static_cast<std::size_t>(header.node_count);
+  const auto* node_table = image->data() + sizeof(ImageHeader);
+  const auto* entry_table = node_table + node_count * sizeof(ImageNode);
+  const auto* name_pool =
+    entry_table + static_cast<std::size_t>(header.entry_count) * sizeof(ImageEntry);
+  const auto* data_area = name_pool + static_cast<std::size_t>(header.names_size);
+
+  // the root replaces the filesystem's root directory
+  if (read_item<ImageNode>(node_table, 0).type != ImageNode::k_directory) {
+    ec = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+
+  // check the references and that the directories form a tree rooted in node 0 with
+  // every node in it.
+  auto links = std::vector<std::uint32_t>(node_count, 0);
+  auto order = std::vector<std::uint32_t>{0};
+  for (auto i = std::size_t(0); i < order.size(); ++i) {
+    const auto record = read_item<ImageNode>(node_table, order[i]);
+    if (record.type == ImageNode::k_regular) {
+      if (record.first > header.data_size
+          || record.count > header.data_size - record.first) {
+        return bad_image();
+      }
+      continue;
+    }
+    if (record.type != ImageNode::k_directory || record.first > header.entry_count
+        || record.count > header.entry_count - record.first) {
+      return bad_image();
+    }
+
+    for (auto e = record.first; e < record.first + record.count; ++e) {
+      const auto entry = read_item<ImageEntry>(entry_table, static_cast<std::size_t>(e));
+      if (entry.node == 0 || entry.node >= node_count
+          || entry.name_offset > header.names_size
+          || entry.name_size > header.names_size - entry.name_offset
+          || !is_valid_name(name_pool + entry.name_offset, entry.name_size)) {
+        return bad_image();
+      }
+      if (links[entry.node]++ == 0) {
+        order.push_back(entry.node);
+      }
+      else if (read_item<ImageNode>(node_table, entry.node).type
+               == ImageNode::k_directory) {
+        // directories can't be hard linked
+        return bad_image();
+      }
+    }
+  }
+  if (order.size() != node_count) {
+    return bad_image();
+  }
+
+  EpochDomain::Guard guard(epochs());
+
+  auto handles = std::vector<node_handle>(node_count);
+  handles[0] = find_node("/", ec);
+  for (auto i = std::size_t(1); i < node_count; ++i) {
+    handles[i] = _nodes.allocate();
+  }
+
+  auto used = k_node_overhead * node_count;
+  for (auto i = std::size_t(0); i < node_count; ++i) {
+    const auto record = read_item<ImageNode>(node_table, i);
+    auto& node = _nodes.writable(handles[i]);
+    node._perms = static_cast<perms>(record.perms);
+    node._last_write_time = static_cast<file_time_type>(record.last_write_time);
+
+    if (record.type == ImageNode::k_directory) {
+      node._type = file_type::directory;
+      if (record.count > 0) {
+        auto& children = node.writable_children(*_names);
+        for (auto e = record.first; e < record.first + record.count; ++e) {
+          const auto entry =
+            read_item<ImageEntry>(entry_table, static_cast<std::size_t>(e));
+          const auto name =
+            _names->intern(std::string(name_pool + entry.name_offset, entry.name_size));
+          if (children.find(name) != k_no_node) {
+            _names->release(name);
+            return bad_image();
+          }
+          children.insert(name, handles[entry.node]);
+
+          auto& child = _nodes.writable(handles[entry.node]);
+          if (child._parent == k_no_node) {
+            child._parent = handles[i];
+          }
+        }
+      }
+    }
+    else {
+      node._type = file_type::regular;
+      if (record.count > 0) {
+        node._content = std::make_shared<FileContent>(
+          image, data_area + record.first, static_cast<file_size_type>(record.count));
+        used += record.count;
+      }
+    }
+
+    if (i > 0) {
+      node._links = links[i];
+    }
+  }
+
+  _used = used;
+  ec.clear();
+  return true;
+}
+
+
+//----------------------------------------------------------------------------------------
+
+void
+IMemoryFilesystem::save_image(std::ostream& os)
+{
+  std::error_code ec;
+  save_image(os, ec);
+  if (ec) {
+    throw filesystem_error("can't save image", ec);
+  }
+}
+
+
+std::unique_ptr<IMemoryFilesystem>
+load_image(const path& p)
+{
+  std::error_code ec;
+  auto fs = load_image(p, ec);
+  if (ec) {
+    throw filesystem_error("can't load image", p, ec);
+  }
+  return fs;
+}
+
+
+std::unique_ptr<IMemoryFilesystem>
+load_image(const path& p, std::error_code& ec)
+{
+  return MemoryFilesystem::load_image(p, ec);
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
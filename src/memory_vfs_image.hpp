@@ -0,0 +1,93 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "fspp/details/path.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+/*! The layout of a memory filesystem image (see MemoryFilesystem::save_image()).
+ *
+ * An image is a header followed by the node table (node_count ImageNodes), the entry
+ * table (entry_count ImageEntries), the name pool (names_size bytes) and the data area
+ * (data_size bytes).  All references are indices into these tables or offsets into the
+ * pool and the data area, so an image can be mapped at any address.  Numbers are stored
+ * in the byte order of the writing machine; images written on a machine of another byte
+ * order are rejected.
+ *
+ * Node 0 is the root directory.  The entries of a directory are stored one after the
+ * other; the data of a file is stored in one piece.  Files sharing their content share
+ * their data in the image, too.
+ */
+struct ImageHeader
+{
+  static const std::uint32_t k_version = 1;
+  static const std::uint32_t k_byte_order = 0x01020304;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint64_t node_count;
+  std::uint64_t entry_count;
+  std::uint64_t names_size;
+  std::uint64_t data_size;
+};
+
+
+struct ImageNode
+{
+  static const std::uint32_t k_directory = 1;
+  static const std::uint32_t k_regular = 2;
+
+  std::uint32_t type;
+  std::uint32_t perms;
+  std::int64_t last_write_time;
+  // the first entry of a directory or the offset of a file's data in the data area
+  std::uint64_t first;
+  // the number of entries of a directory or the size of a file
+  std::uint64_t count;
+};
+
+
+struct ImageEntry
+{
+  std::uint64_t name_offset;
+  std::uint32_t name_size;
+  std::uint32_t node;
+};
+
+
+/*! A file mapped into memory read only.  Implemented per platform. */
+class ImageMapping
+{
+public:
+  /*! Maps the file @p p.  On failure data() is null and @p ec tells why. */
+  ImageMapping(const path& p, std::error_code& ec);
+  ImageMapping(const ImageMapping&) = delete;
+  ImageMapping& operator=(const ImageMapping&) = delete;
+  ~ImageMapping();
+
+  const char* data() const { return _data; }
+  std::size_t size() const { return _size; }
+
+private:
+  const char* _data = nullptr;
+  std::size_t _size = 0;
+};
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,1202 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs_nodes.hpp"
+
+#include "lz_codec.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+// FNV-1a
+std::size_t
+hash_name(const char* str, std::size_t len)
+{
+  auto h = std::uint64_t(14695981039346656037ull);
+  for (auto i = std::size_t(0); i < len; ++i) {
+    h ^= static_cast<unsigned char>(str[i]);
+    h *= 1099511628211ull;
+  }
+  return static_cast<std::size_t>(h);
+}
+
+
+std::size_t
+hash_path(const path::value_type* str, std::size_t len)
+{
+  auto h = std::uint64_t(14695981039346656037ull);
+  for (auto i = std::size_t(0); i < len; ++i) {
+    h ^= static_cast<std::uint64_t>(str[i]);
+    h *= 1099511628211ull;
+  }
+  return static_cast<std::size_t>(h);
+}
+
+
+std::size_t
+hash_handle(std::uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x45d9f3bu;
+  h ^= h >> 16;
+  return h;
+}
+
+
+std::size_t
+capacity_for(std::size_t count)
+{
+  // keep the load factor of the open addressing tables below 0.5
+  auto capacity = std::size_t(16);
+  while (capacity < count * 2) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+
+bool
+is_less_by_name(const ChildEntry& lhs, const ChildEntry& rhs)
+{
+  return lhs.name < rhs.name;
+}
+
+}  // namespace
+
+
+//----------------------------------------------------------------------------------------
+
+const std::uint32_t RwLock::k_writer;
+const std::uint32_t RwLock::k_writer_waiting;
+
+
+void
+RwLock::lock_shared()
+{
+  auto state = _state.load(std::memory_order_relaxed);
+  for (;;) {
+    if ((state & (k_writer | k_writer_waiting)) == 0) {
+      if (_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire,
+                                       std::memory_order_relaxed)) {
+        return;
+      }
+    }
+    else {
+      std::this_thread::yield();
+      state = _state.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+
+void
+RwLock::lock()
+{
+  auto state = _state.load(std::memory_order_relaxed);
+  for (;;) {
+    if ((state & ~k_writer_waiting) == 0) {
+      if (_state.compare_exchange_weak(state, k_writer, std::memory_order_acquire,
+                                       std::memory_order_relaxed)) {
+        return;
+      }
+    }
+    else {
+      if ((state & k_writer_waiting) == 0) {
+        _state.fetch_or(k_writer_waiting, std::memory_order_relaxed);
+      }
+      std::this_thread::yield();
+      state = _state.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+
+const std::size_t DistributedRwLock::k_stripe_count;
+
+
+void
+DistributedRwLock::lock()
+{
+  for (auto& stripe : _stripes) {
+    stripe.lock.lock();
+  }
+}
+
+
+void
+DistributedRwLock::unlock()
+{
+  for (auto& stripe : _stripes) {
+    stripe.lock.unlock();
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+
+std::size_t
+NameTable::slot_for(const char* str, std::size_t len) const
+{
+  const auto mask = _index.size() - 1;
+  auto slot = hash_name(str, len) & mask;
+
+  while (_index[slot] != k_no_name) {
+    const auto& entry = _entries[_index[slot]].str;
+    if (entry.size() == len && std::memcmp(entry.data(), str, len) == 0) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+
+name_handle
+NameTable::find(const char* str, std::size_t len) const
+{
+  const auto token = _lock.lock_shared();
+  const auto name = _index.empty() ? k_no_name : _index[slot_for(str, len)];
+  _lock.unlock_shared(token);
+  return name;
+}
+
+
+name_handle
+NameTable::intern(const std::string& str)
+{
+  std::lock_guard<DistributedRwLock> lock(_lock);
+
+  if (_index.size() < (_count + 1) * 2) {
+    grow_index();
+  }
+
+  const auto slot = slot_for(str.data(), str.size());
+  if (_index[slot] != k_no_name) {
+    _entries[_index[slot]].refs.fetch_add(1);
+    return _index[slot];
+  }
+
+  auto name = k_no_name;
+  if (!_free.empty()) {
+    name = _free.back();
+    _free.pop_back();
+  }
+  else {
+    name = static_cast<name_handle>(_entries.size());
+    _entries.emplace_back();
+  }
+
+  _entries[name].str = str;
+  _entries[name].refs = 1;
+  _index[slot] = name;
+  ++_count;
+
+  return name;
+}
+
+
+void
+NameTable::add_ref(name_handle name)
+{
+  const auto token = _lock.lock_shared();
+  assert(_entries[name].refs > 0);
+  _entries[name].refs.fetch_add(1);
+  _lock.unlock_shared(token);
+}
+
+
+void
+NameTable::release(name_handle name)
+{
+  const auto token = _lock.lock_shared();
+  assert(_entries[name].refs > 0);
+  const auto is_last = _entries[name].refs.fetch_sub(1) == 1;
+  _lock.unlock_shared(token);
+
+  if (is_last) {
+    std::lock_guard<DistributedRwLock> lock(_lock);
+
+    // the name might have been interned again or removed by another thread meanwhile
+    auto& entry = _entries[name];
+    if (entry.refs == 0 && !entry.str.empty()) {
+      erase_from_index(name);
+      std::string().swap(entry.str);
+      _free.push_back(name);
+      --_count;
+    }
+  }
+}
+
+
+const std::string&
+NameTable::str(name_handle name) const
+{
+  const auto token = _lock.lock_shared();
+  const auto& result = _entries[name].str;
+  _lock.unlock_shared(token);
+  return result;
+}
+
+
+std::size_t
+NameTable::size() const
+{
+  std::lock_guard<DistributedRwLock> lock(const_cast<DistributedRwLock&>(_lock));
+  return _count;
+}
+
+
+void
+NameTable::grow_index()
+{
+  auto index = std::vector<name_handle>(capacity_for(_count + 1), k_no_name);
+  const auto mask = index.size() - 1;
+
+  for (auto name : _index) {
+    if (name != k_no_name) {
+      const auto& str = _entries[name].str;
+      auto slot = hash_name(str.data(), str.size()) & mask;
+      while (index[slot] != k_no_name) {
+        slot = (slot + 1) & mask;
+      }
+      index[slot] = name;
+    }
+  }
+
+  _index.swap(index);
+}
+
+
+void
+NameTable::erase_from_index(name_handle name)
+{
+  const auto mask = _index.size() - 1;
+  const auto& str = _entries[name].str;
+  auto hole = slot_for(str.data(), str.size());
+  assert(_index[hole] == name);
+
+  // backward shift deletion: move following entries of the probe sequence into the
+  // hole unless they would land before their home slot.
+  auto slot = (hole + 1) & mask;
+  while (_index[slot] != k_no_name) {
+    const auto& other = _entries[_index[slot]].str;
+    const auto home = hash_name(other.data(), other.size()) & mask;
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      _index[hole] = _index[slot];
+      hole = slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  _index[hole] = k_no_name;
+}
+
+
+//----------------------------------------------------------------------------------------
+
+const std::size_t ChildTable::k_max_sorted;
+const std::size_t ChildTable::k_min_hashed;
+
+
+ChildTable::ChildTable(const ChildTable& other)
+  : _names(other._names)
+  , _slots(other._slots)
+  , _count(other._count)
+  , _is_hashed(other._is_hashed)
+{
+  for_each([&](const ChildEntry& entry) { _names->add_ref(entry.name); });
+}
+
+
+ChildTable::~ChildTable()
+{
+  for_each([&](const ChildEntry& entry) { _names->release(entry.name); });
+}
+
+
+std::size_t
+ChildTable::home_slot(name_handle name) const
+{
+  return hash_handle(name) & (_slots.size() - 1);
+}
+
+
+std::size_t
+ChildTable::find_slot(name_handle name) const
+{
+  const auto mask = _slots.size() - 1;
+  auto slot = home_slot(name);
+  while (_slots[slot].name != k_no_name && _slots[slot].name != name) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+
+node_handle
+ChildTable::find(name_handle name) const
+{
+  if (_is_hashed) {
+    return _slots[find_slot(name)].node;
+  }
+
+  auto i_entry = std::lower_bound(
+    begin(_slots), end(_slots), ChildEntry{name, k_no_node}, is_less_by_name);
+  return i_entry != end(_slots) && i_entry->name == name ? i_entry->node : k_no_node;
+}
+
+
+void
+ChildTable::insert(name_handle name, node_handle node)
+{
+  assert(find(name) == k_no_node);
+
+  if (_is_hashed) {
+    if (_slots.size() < (_count + 1) * 2) {
+      rehash(capacity_for(_count + 1));
+    }
+    insert_hashed(name, node);
+  }
+  else if (_count + 1 > k_max_sorted) {
+    rehash(capacity_for(_count + 1));
+    insert_hashed(name, node);
+  }
+  else {
+    auto entry = ChildEntry{name, node};
+    _slots.insert(std::upper_bound(begin(_slots), end(_slots), entry, is_less_by_name),
+                  entry);
+    ++_count;
+  }
+}
+
+
+void
+ChildTable::insert_hashed(name_handle name, node_handle node)
+{
+  auto slot = find_slot(name);
+  assert(_slots[slot].name == k_no_name);
+  _slots[slot] = ChildEntry{name, node};
+  ++_count;
+}
+
+
+node_handle
+ChildTable::erase(name_handle name)
+{
+  auto result = k_no_node;
+
+  if (_is_hashed) {
+    const auto mask = _slots.size() - 1;
+    auto hole = find_slot(name);
+    if (_slots[hole].name == k_no_name) {
+      return k_no_node;
+    }
+    result = _slots[hole].node;
+    _names->release(name);
+
+    auto slot = (hole + 1) & mask;
+    while (_slots[slot].name != k_no_name) {
+      const auto home = home_slot(_slots[slot].name);
+      if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+        _slots[hole] = _slots[slot];
+        hole = slot;
+      }
+      slot = (slot + 1) & mask;
+    }
+    _slots[hole] = ChildEntry{k_no_name, k_no_node};
+    --_count;
+
+    if (_count < k_min_hashed) {
+      to_sorted();
+    }
+  }
+  else {
+    auto i_entry = std::lower_bound(
+      begin(_slots), end(_slots), ChildEntry{name, k_no_node}, is_less_by_name);
+    if (i_entry != end(_slots) && i_entry->name == name) {
+      result = i_entry->node;
+      _names->release(name);
+      _slots.erase(i_entry);
+      --_count;
+    }
+  }
+
+  return result;
+}
+
+
+std::size_t
+ChildTable::next_slot(std::size_t pos) const
+{
+  while (pos < _slots.size() && _slots[pos].name == k_no_name) {
+    ++pos;
+  }
+  return pos;
+}
+
+
+void
+ChildTable::rehash(std::size_t capacity)
+{
+  auto slots = std::vector<ChildEntry>(capacity, ChildEntry{k_no_name, k_no_node});
+  slots.swap(_slots);
+  _is_hashed = true;
+  _count = 0;
+
+  for (const auto& entry : slots) {
+    if (entry.name != k_no_name) {
+      insert_hashed(entry.name, entry.node);
+    }
+  }
+}
+
+
+void
+ChildTable::to_sorted()
+{
+  auto slots = std::vector<ChildEntry>();
+  slots.reserve(_count);
+  for_each([&](const ChildEntry& entry) { slots.push_back(entry); });
+  std::sort(begin(slots), end(slots), is_less_by_name);
+
+  _slots.swap(slots);
+  _is_hashed = false;
+}
+
+
+//----------------------------------------------------------------------------------------
+
+const std::size_t SpillFile::k_region_size;
+const std::size_t SpillStore::k_region_size;
+
+
+std::shared_ptr<SpillStore>
+SpillStore::create(const path& directory, std::uintmax_t threshold, std::error_code& ec)
+{
+  auto store = std::make_shared<SpillStore>(directory, threshold, ec);
+  return ec ? nullptr : store;
+}
+
+
+SpillStore::SpillStore(const path& directory,
+                       std::uintmax_t threshold,
+                       std::error_code& ec)
+  : _file(directory, ec)
+  , _threshold(threshold)
+{
+}
+
+
+SpillStore::~SpillStore()
+{
+  for (auto* window : _windows) {
+    _file.unmap_window(window);
+  }
+}
+
+
+char*
+SpillStore::allocate(std::error_code& ec)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto is_reused = !_free.empty();
+  auto offset = _file_size;
+  if (is_reused) {
+    offset = _free.back();
+    _free.pop_back();
+  }
+  else {
+    const auto idx = static_cast<std::size_t>(offset / SpillFile::k_window_size);
+    if (idx == _windows.size()) {
+      auto* window = _file.map_window(offset, ec);
+      if (!window) {
+        return nullptr;
+      }
+      _windows.push_back(window);
+    }
+    if (!_file.resize(_file_size + k_region_size, ec)) {
+      return nullptr;
+    }
+    _file_size += k_region_size;
+  }
+
+  auto* region = _windows[static_cast<std::size_t>(offset / SpillFile::k_window_size)]
+                 + static_cast<std::size_t>(offset % SpillFile::k_window_size);
+  if (is_reused) {
+    std::memset(region, 0, k_region_size);
+  }
+  _offsets[region] = offset;
+  ec.clear();
+  return region;
+}
+
+
+void
+SpillStore::free(char* region)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto i_offset = _offsets.find(region);
+  assert(i_offset != _offsets.end());
+  // the window stays mapped; only give back the region's pages
+  _file.evict(region);
+  _free.push_back(i_offset->second);
+  _offsets.erase(i_offset);
+}
+
+
+//----------------------------------------------------------------------------------------
+
+FileChunk::FileChunk(const std::shared_ptr<SpillStore>& store, const FileChunk* other)
+  : _owner(store)
+{
+  std::error_code ec;
+  _data = store->allocate(ec);
+  if (!_data) {
+    throw std::system_error(ec);
+  }
+  if (other) {
+    other->copy_to(data());
+  }
+}
+
+
+FileChunk::FileChunk(const FileChunk& other)
+  : _heap(other._heap)
+{
+  if (other.is_packed()) {
+    _heap.resize(other.size());
+    other.copy_to(_heap.data());
+  }
+  else if (other.is_spilled()) {
+    std::error_code ec;
+    auto* region = other.store()->allocate(ec);
+    if (!region) {
+      throw std::system_error(ec);
+    }
+    _owner = other._owner;
+    _data = region;
+    std::memcpy(_data, other._data, SpillStore::k_region_size);
+  }
+  else if (other.is_view()) {
+    _heap.assign(other._data, other._data + other._view_size);
+  }
+}
+
+
+FileChunk::~FileChunk()
+{
+  if (is_spilled()) {
+    store()->free(_data);
+  }
+}
+
+
+std::shared_ptr<FileChunk>
+FileChunk::pack() const
+{
+  assert(!_data && !is_packed());
+
+  const auto len = size();
+  // keeping less than 7/8 of the bytes pays for unpacking them on each read
+  auto packed = std::vector<char>(len - len / 8);
+  const auto packed_len = lz_compress(_heap.data(), len, packed.data(), packed.size());
+  if (packed_len == 0) {
+    return nullptr;
+  }
+
+  packed.resize(packed_len);
+  packed.shrink_to_fit();
+  auto result = std::shared_ptr<FileChunk>(new FileChunk());
+  result->_heap = std::move(packed);
+  result->_packed_size = static_cast<std::uint32_t>(len);
+  return result;
+}
+
+
+void
+FileChunk::copy_to(char* dst) const
+{
+  if (is_packed()) {
+    const auto is_ok = lz_decompress(_heap.data(), _heap.size(), dst, _packed_size);
+    // packed chunks are only made by pack()
+    assert(is_ok);
+    (void)is_ok;
+  }
+  else {
+    std::memcpy(dst, data(), size());
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+
+const std::size_t FileContent::k_chunk_size;
+const std::size_t FileContent::k_segment_size;
+
+
+namespace {
+
+const std::shared_ptr<FileChunk>&
+zero_chunk()
+{
+  static const auto chunk = std::make_shared<FileChunk>(FileContent::k_chunk_size);
+  return chunk;
+}
+
+}  // namespace
+
+
+FileContent::FileContent(std::shared_ptr<const void> owner,
+                         const char* data,
+                         file_size_type size)
+  : _size(size)
+{
+  for (auto pos = file_size_type(0); pos < size; pos += k_chunk_size) {
+    const auto len = static_cast<std::size_t>(
+      std::min(static_cast<file_size_type>(k_chunk_size), size - pos));
+    push_chunk(std::make_shared<Chunk>(owner, data + pos, len));
+  }
+}
+
+
+const char*
+FileContent::data_at(file_size_type pos,
+                     std::size_t& len,
+                     UnpackedChunk& unpacked) const
+{
+  assert(pos < _size);
+
+  const auto idx = static_cast<std::size_t>(pos / k_chunk_size);
+  const auto offset = static_cast<std::size_t>(pos % k_chunk_size);
+  const auto& data = (*_segments[idx / k_segment_size])[idx % k_segment_size];
+  assert(offset < data->size());
+
+  len = static_cast<std::size_t>(
+    std::min(static_cast<file_size_type>(data->size() - offset), _size - pos));
+  if (!data->is_packed()) {
+    return data->data() + offset;
+  }
+
+  if (unpacked.chunk != data) {
+    unpacked.bytes.resize(data->size());
+    data->copy_to(unpacked.bytes.data());
+    unpacked.chunk = data;
+  }
+  return unpacked.bytes.data() + offset;
+}
+
+
+const char*
+FileContent::contiguous_at(file_size_type pos, std::size_t len) const
+{
+  assert(len > 0 && pos + len <= _size);
+
+  const char* first = nullptr;
+  const char* next = nullptr;
+  for (const auto end = pos + len; pos < end;) {
+    const auto idx = static_cast<std::size_t>(pos / k_chunk_size);
+    const auto offset = static_cast<std::size_t>(pos % k_chunk_size);
+    const auto& data = chunk(idx);
+    if (data.is_packed() || (next && data.data() + offset != next)) {
+      return nullptr;
+    }
+
+    const auto piece =
+      std::min(static_cast<file_size_type>(data.size() - offset), end - pos);
+    if (!first) {
+      first = data.data() + offset;
+    }
+    next = data.data() + offset + piece;
+    pos += piece;
+  }
+  return first;
+}
+
+
+FileContent::Segment&
+FileContent::writable_segment(std::size_t idx)
+{
+  auto& segment = _segments[idx];
+  if (segment.use_count() > 1) {
+    segment = std::make_shared<Segment>(*segment);
+  }
+  return *segment;
+}
+
+
+FileContent::Chunk&
+FileContent::writable_chunk(std::size_t idx)
+{
+  auto& chunk = writable_segment(idx / k_segment_size)[idx % k_segment_size];
+  if (chunk.use_count() > 1 || chunk->is_view() || chunk->is_packed()) {
+    // the zero chunk lives on the heap
+    chunk = _is_spilled ? std::make_shared<Chunk>(_store, chunk.get())
+                        : std::make_shared<Chunk>(*chunk);
+  }
+  return *chunk;
+}
+
+
+void
+FileContent::push_chunk(std::shared_ptr<Chunk> chunk)
+{
+  if (_chunk_count % k_segment_size == 0) {
+    _segments.push_back(std::make_shared<Segment>());
+  }
+  writable_segment(_segments.size() - 1).push_back(std::move(chunk));
+  ++_chunk_count;
+}
+
+
+void
+FileContent::fill_last_chunk()
+{
+  // all but the last chunk have to be complete.
+  if (_chunk_count > 0 && chunk(_chunk_count - 1).size() < k_chunk_size) {
+    writable_chunk(_chunk_count - 1).grow(k_chunk_size);
+  }
+}
+
+
+void
+FileContent::spill_if_large(std::size_t chunk_count)
+{
+  if (_is_spilled || !_store
+      || static_cast<std::uintmax_t>(chunk_count) * k_chunk_size <= _store->threshold()) {
+    return;
+  }
+
+  _is_spilled = true;
+  fill_last_chunk();
+  for (auto idx = std::size_t(0); idx < _chunk_count; ++idx) {
+    const auto& current = chunk(idx);
+    if (&current != zero_chunk().get() && !current.is_spilled() && !current.is_view()) {
+      writable_segment(idx / k_segment_size)[idx % k_segment_size] =
+        std::make_shared<Chunk>(_store, &current);
+    }
+  }
+}
+
+
+char*
+FileContent::writable_at(file_size_type pos, std::size_t& len)
+{
+  const auto idx = static_cast<std::size_t>(pos / k_chunk_size);
+  const auto offset = static_cast<std::size_t>(pos % k_chunk_size);
+
+  if (idx >= _chunk_count) {
+    spill_if_large(idx + 1);
+    fill_last_chunk();
+    while (_chunk_count < idx) {
+      push_chunk(zero_chunk());
+    }
+    push_chunk(_is_spilled ? std::make_shared<Chunk>(_store, nullptr)
+                           : std::make_shared<Chunk>(idx == 0 ? std::size_t(0)
+                                                              : k_chunk_size));
+  }
+
+  auto& chunk = writable_chunk(idx);
+  if (offset >= chunk.size()) {
+    // only the first chunk grows; it doubles in size.
+    const auto grown = std::max(chunk.size() * 2, std::size_t(256));
+    chunk.grow(std::min(k_chunk_size, std::max(offset + 1, grown)));
+  }
+
+  len = chunk.size() - offset;
+  return chunk.data() + offset;
+}
+
+
+void
+FileContent::commit(file_size_type end)
+{
+  assert(end <= _chunk_count * k_chunk_size);
+  _size = std::max(_size, end);
+}
+
+
+void
+FileContent::resize(file_size_type new_size)
+{
+  const auto chunk_count =
+    static_cast<std::size_t>((new_size + k_chunk_size - 1) / k_chunk_size);
+
+  if (new_size < _size) {
+    // keep the invariant that bytes beyond the end of file are zero.  Done first, since
+    // unsharing the chunk may fail.
+    const auto offset = static_cast<std::size_t>(new_size % k_chunk_size);
+    if (offset > 0) {
+      auto& chunk = writable_chunk(chunk_count - 1);
+      std::fill(chunk.data() + offset, chunk.data() + chunk.size(), '\0');
+    }
+
+    _segments.resize((chunk_count + k_segment_size - 1) / k_segment_size);
+    if (chunk_count % k_segment_size != 0) {
+      writable_segment(_segments.size() - 1).resize(chunk_count % k_segment_size);
+    }
+    _chunk_count = chunk_count;
+  }
+  else if (new_size > _size) {
+    if (chunk_count > _chunk_count) {
+      fill_last_chunk();
+      while (_chunk_count < chunk_count) {
+        push_chunk(zero_chunk());
+      }
+    }
+    else {
+      const auto needed =
+        static_cast<std::size_t>(new_size - (chunk_count - 1) * k_chunk_size);
+      if (chunk(chunk_count - 1).size() < needed) {
+        writable_chunk(chunk_count - 1).grow(needed);
+      }
+    }
+    spill_if_large(chunk_count);
+  }
+
+  _size = new_size;
+}
+
+
+void
+FileContent::evict(file_size_type pos) const
+{
+  const auto idx = static_cast<std::size_t>(pos / k_chunk_size);
+  if (_is_spilled && idx < _chunk_count) {
+    chunk(idx).evict();
+  }
+}
+
+
+bool
+FileContent::pack()
+{
+  if (_is_spilled) {
+    return false;
+  }
+
+  auto has_packed = false;
+  for (auto idx = std::size_t(0); idx < _chunk_count; ++idx) {
+    const auto& current = chunk(idx);
+    if (&current == zero_chunk().get() || current.is_spilled() || current.is_view()
+        || current.is_packed()) {
+      continue;
+    }
+
+    if (auto packed = current.pack()) {
+      writable_segment(idx / k_segment_size)[idx % k_segment_size] = std::move(packed);
+      has_packed = true;
+    }
+  }
+  return has_packed;
+}
+
+
+std::uintmax_t
+FileContent::stored_size() const
+{
+  auto result = std::uintmax_t(0);
+  for (auto idx = std::size_t(0); idx < _chunk_count; ++idx) {
+    const auto& current = chunk(idx);
+    if (&current != zero_chunk().get()) {
+      result += current.stored_size();
+    }
+  }
+  return result;
+}
+
+
+//----------------------------------------------------------------------------------------
+
+const std::uint32_t NodeArena::k_page_bits;
+const std::uint32_t NodeArena::k_page_size;
+
+
+NodeArena::Page::Page(const Page& other)
+  : refs(1)
+{
+  std::copy(std::begin(other.nodes), std::end(other.nodes), std::begin(nodes));
+}
+
+
+NodeArena::PageTable::PageTable(std::size_t cap)
+  : refs(1)
+  , capacity(cap)
+  , pages(new std::atomic<Page*>[cap])
+{
+  for (auto i = std::size_t(0); i < cap; ++i) {
+    pages[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+
+NodeArena::NodeArena()
+  : _table(new PageTable(16))
+  , _live(0)
+{
+}
+
+
+NodeArena::NodeArena(const NodeArena& other)
+  : _table(other._table.load())
+  , _live(other._live.load())
+  , _free(other._free)
+  , _next(other._next)
+{
+  _table.load()->refs.fetch_add(1);
+
+  // nobody can refer to the retired nodes of other in here
+  for (const auto& retired : other._retired_nodes) {
+    _free.insert(end(_free), begin(retired), end(retired));
+  }
+}
+
+
+NodeArena::~NodeArena()
+{
+  for (auto& retired : _retired_tables) {
+    for (auto* table : retired) {
+      release_table(table);
+    }
+  }
+  release_table(_table.load());
+}
+
+
+void
+NodeArena::release_page(Page* page)
+{
+  if (page->refs.fetch_sub(1) == 1) {
+    delete page;
+  }
+}
+
+
+void
+NodeArena::release_table(PageTable* table)
+{
+  if (table->refs.fetch_sub(1) == 1) {
+    if (table->owns_pages) {
+      for (auto i = std::size_t(0); i < table->count; ++i) {
+        release_page(table->pages[i].load());
+      }
+    }
+    delete table;
+  }
+}
+
+
+// requires _mutex to be held
+void
+NodeArena::retire_table(PageTable* table)
+{
+  _retired_tables[_epochs.phase()].push_back(table);
+}
+
+
+// requires _mutex to be held
+NodeArena::PageTable*
+NodeArena::writable_table(std::size_t min_capacity)
+{
+  auto* table = _table.load();
+  const auto is_shared = table->refs.load() > 1;
+  if (!is_shared && table->capacity >= min_capacity) {
+    return table;
+  }
+
+  auto capacity = table->capacity;
+  while (capacity < min_capacity) {
+    capacity *= 2;
+  }
+
+  auto* copy = new PageTable(capacity);
+  copy->count = table->count;
+  for (auto i = std::size_t(0); i < table->count; ++i) {
+    auto* page = table->pages[i].load();
+    if (is_shared) {
+      page->refs.fetch_add(1);
+    }
+    copy->pages[i].store(page, std::memory_order_relaxed);
+  }
+  // an unshared table hands its pages over to the copy
+  table->owns_pages = is_shared;
+
+  _table.store(copy, std::memory_order_release);
+  retire_table(table);
+  return copy;
+}
+
+
+FSNode&
+NodeArena::writable(node_handle nd)
+{
+  const auto idx = nd >> k_page_bits;
+
+  auto* table = _table.load(std::memory_order_acquire);
+  auto* page = table->pages[idx].load(std::memory_order_acquire);
+  if (table->refs.load() > 1 || page->refs.load() > 1) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    table = writable_table(0);
+    page = table->pages[idx].load();
+    if (page->refs.load() > 1) {
+      auto* copy = new Page(*page);
+      table->pages[idx].store(copy, std::memory_order_release);
+      release_page(page);
+      page = copy;
+    }
+  }
+
+  return page->nodes[nd & (k_page_size - 1)];
+}
+
+
+// requires _mutex to be held
+void
+NodeArena::try_reclaim()
+{
+  const auto other = _epochs.phase() ^ 1;
+  if (_epochs.try_flip()) {
+    _free.insert(end(_free), begin(_retired_nodes[other]), end(_retired_nodes[other]));
+    _retired_nodes[other].clear();
+
+    for (auto* table : _retired_tables[other]) {
+      release_table(table);
+    }
+    _retired_tables[other].clear();
+  }
+}
+
+
+node_handle
+NodeArena::allocate()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  const auto has_retired_nodes = !_retired_nodes[0].empty() || !_retired_nodes[1].empty();
+  const auto has_retired_tables =
+    !_retired_tables[0].empty() || !_retired_tables[1].empty();
+  if ((_free.empty() && has_retired_nodes) || has_retired_tables) {
+    try_reclaim();
+  }
+
+  auto nd = k_no_node;
+  if (!_free.empty()) {
+    nd = _free.back();
+    _free.pop_back();
+  }
+  else {
+    nd = _next++;
+    const auto idx = std::size_t(nd >> k_page_bits);
+    if (idx >= _table.load()->count) {
+      auto* table = writable_table(idx + 1);
+      table->pages[idx].store(new Page, std::memory_order_release);
+      table->count = idx + 1;
+    }
+  }
+
+  _live.fetch_add(1);
+  return nd;
+}
+
+
+void
+NodeArena::free(node_handle nd)
+{
+  writable(nd) = FSNode();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _retired_nodes[_epochs.phase()].push_back(nd);
+  _live.fetch_sub(1);
+}
+
+
+//----------------------------------------------------------------------------------------
+
+const std::size_t PathCache::k_max_entries;
+
+
+node_handle
+PathCache::find(const path::value_type* str, std::size_t len) const
+{
+  using traits_type = path::string_type::traits_type;
+
+  if (_count == 0) {
+    return k_no_node;
+  }
+
+  const auto hash = hash_path(str, len);
+  const auto mask = _slots.size() - 1;
+  for (auto slot = hash & mask; _slots[slot].generation == _generation;
+       slot = (slot + 1) & mask) {
+    const auto& entry = _slots[slot];
+    if (entry.hash == hash && entry.key.size() == len
+        && traits_type::compare(entry.key.data(), str, len) == 0) {
+      return entry.node;
+    }
+  }
+
+  return k_no_node;
+}
+
+
+void
+PathCache::insert(const path::value_type* str, std::size_t len, node_handle nd)
+{
+  if (_slots.empty()) {
+    _slots.resize(capacity_for(k_max_entries));
+  }
+  if (_count == k_max_entries) {
+    clear();
+  }
+
+  const auto hash = hash_path(str, len);
+  const auto mask = _slots.size() - 1;
+  auto slot = hash & mask;
+  while (_slots[slot].generation == _generation) {
+    slot = (slot + 1) & mask;
+  }
+
+  auto& entry = _slots[slot];
+  entry.key.assign(str, len);
+  entry.hash = hash;
+  entry.node = nd;
+  entry.generation = _generation;
+  ++_count;
+}
+
+
+void
+PathCache::clear()
+{
+  _count = 0;
+  if (++_generation == 0) {
+    // don't let entries from the first generations come back to life
+    for (auto& entry : _slots) {
+      entry.generation = 0;
+    }
+    _generation = 1;
+  }
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
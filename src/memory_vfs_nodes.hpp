@@ -0,0 +1,786 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#if defined(USE_FSPP_CONFIG_HPP)
+#include "fspp-config.hpp"
+#else
+#include "fspp/details/fspp-config.hpp"
+#endif
+
+#include "epoch_domain.hpp"
+
+#include "fspp/details/path.hpp"
+#include "fspp/details/types.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+/*! Refers to a node in a NodeArena. */
+using node_handle = std::uint32_t;
+/*! Refers to a name in a NameTable. */
+using name_handle = std::uint32_t;
+
+const node_handle k_no_node = std::numeric_limits<node_handle>::max();
+const name_handle k_no_name = std::numeric_limits<name_handle>::max();
+
+
+/*! A reader/writer spin lock.
+ *
+ * Critical sections protected by it are short; waiting threads yield.  A waiting writer
+ * keeps new readers out, so a thread must not acquire a shared lock it already holds.
+ */
+class RwLock
+{
+public:
+  RwLock()
+    : _state(0)
+  {
+  }
+  RwLock(const RwLock&) = delete;
+  RwLock& operator=(const RwLock&) = delete;
+
+  void lock_shared();
+  void unlock_shared() { _state.fetch_sub(1, std::memory_order_release); }
+  void lock();
+  void unlock() { _state.store(0, std::memory_order_release); }
+
+private:
+  static const std::uint32_t k_writer = 1u << 31;
+  static const std::uint32_t k_writer_waiting = 1u << 30;
+
+  std::atomic<std::uint32_t> _state;
+};
+
+
+/*! A reader/writer lock for data read by many threads and changed rarely.
+ *
+ * Readers lock one of k_stripe_count RwLocks picked by thread, so readers on different
+ * threads don't contend for one cache line; writers lock all of them.
+ */
+class DistributedRwLock
+{
+public:
+  static const std::size_t k_stripe_count = 16;
+
+  /*! Returns a token to pass to unlock_shared(). */
+  std::size_t lock_shared()
+  {
+    const auto idx = this_thread_slot() % k_stripe_count;
+    _stripes[idx].lock.lock_shared();
+    return idx;
+  }
+  void unlock_shared(std::size_t token) { _stripes[token].lock.unlock_shared(); }
+
+  void lock();
+  void unlock();
+
+private:
+  struct Stripe
+  {
+    RwLock lock;
+    // keep the stripes on different cache lines
+    char padding[64 - sizeof(RwLock)];
+  };
+
+  Stripe _stripes[k_stripe_count];
+};
+
+
+/*! Interns file names.
+ *
+ * Each distinct name is stored only once and referred to by a name_handle.  Names are
+ * reference counted; a name is dropped when its last reference is released and its
+ * handle is reused later.  Lookups are done by an open addressing hash index.
+ *
+ * A name table is shared by all filesystems forked from each other (see
+ * MemoryFilesystem::fork()) and is used from many threads.  All functions are thread
+ * safe; lookups and reference counting only take a shared lock.
+ */
+class NameTable
+{
+public:
+  /*! Returns the handle for @p len characters at @p str or k_no_name if this name is not
+   *  known.  Does not change the reference count. */
+  name_handle find(const char* str, std::size_t len) const;
+  name_handle find(const std::string& str) const { return find(str.data(), str.size()); }
+
+  /*! Returns the handle for @p str and adds a reference to it.  Inserts @p str if it
+   *  was not known yet. */
+  name_handle intern(const std::string& str);
+
+  /*! Adds a reference to @p name. */
+  void add_ref(name_handle name);
+  /*! Drops a reference to @p name.  Removes the name when this was the last one. */
+  void release(name_handle name);
+
+  /*! Returns the string for @p name.  The reference stays valid as long as the caller
+   *  holds a reference to @p name. */
+  const std::string& str(name_handle name) const;
+
+  /*! Returns the number of names in the table. */
+  std::size_t size() const;
+
+private:
+  struct Entry
+  {
+    std::string str;
+    std::atomic<std::uint32_t> refs{0};
+  };
+
+  std::size_t slot_for(const char* str, std::size_t len) const;
+  void grow_index();
+  void erase_from_index(name_handle name);
+
+  mutable DistributedRwLock _lock;
+  // a deque, such that strings don't move when the table grows
+  std::deque<Entry> _entries;
+  std::vector<name_handle> _free;
+  std::vector<name_handle> _index;
+  std::size_t _count = 0;
+};
+
+
+struct ChildEntry
+{
+  name_handle name;
+  node_handle node;
+};
+
+
+/*! The entries of a directory node.
+ *
+ * Small directories keep their entries in a vector sorted by name handle, which is
+ * searched binary.  When a directory grows above k_max_sorted entries the table is
+ * turned into an open addressing hash table (with linear probing) keyed by name handle;
+ * it turns back into a sorted vector when it shrinks below k_min_hashed entries.
+ *
+ * Entries are visited by slot position: slot_count() slots, of which only those with
+ * a name different from k_no_name are occupied.
+ *
+ * The table owns one reference to the name of each of its entries.  Copies add their
+ * own references, so a table can be shared between forked filesystems and copied when
+ * one of them changes it.
+ */
+class ChildTable
+{
+public:
+  static const std::size_t k_max_sorted = 32;
+  static const std::size_t k_min_hashed = 16;
+
+  explicit ChildTable(NameTable& names)
+    : _names(&names)
+  {
+  }
+  ChildTable(const ChildTable& other);
+  ChildTable& operator=(const ChildTable& other) = delete;
+  ~ChildTable();
+
+  std::size_t size() const { return _count; }
+  bool empty() const { return _count == 0; }
+
+  /*! Returns the node registered for @p name or k_no_node. */
+  node_handle find(name_handle name) const;
+  /*! Adds an entry @p name -> @p node.  @p name must not be in the table yet.  Takes
+   *  over one reference to @p name from the caller. */
+  void insert(name_handle name, node_handle node);
+  /*! Removes the entry for @p name and returns its node or k_no_node.  Releases the
+   *  reference to @p name held by the entry. */
+  node_handle erase(name_handle name);
+
+  std::size_t slot_count() const { return _slots.size(); }
+  const ChildEntry& slot(std::size_t pos) const { return _slots[pos]; }
+  /*! Returns the first occupied slot at or after @p pos or slot_count(). */
+  std::size_t next_slot(std::size_t pos) const;
+
+  template <typename Functor>
+  void for_each(Functor functor) const
+  {
+    for (auto pos = next_slot(0); pos < slot_count(); pos = next_slot(pos + 1)) {
+      functor(_slots[pos]);
+    }
+  }
+
+private:
+  std::size_t home_slot(name_handle name) const;
+  std::size_t find_slot(name_handle name) const;
+  void insert_hashed(name_handle name, node_handle node);
+  void rehash(std::size_t capacity);
+  void to_sorted();
+
+  NameTable* _names;
+  std::vector<ChildEntry> _slots;
+  std::uint32_t _count = 0;
+  bool _is_hashed = false;
+};
+
+
+/*! An anonymous temporary file which is mapped into memory in windows.
+ *
+ * The file has no name in the filesystem (or loses it right after creation) and is gone
+ * when it is closed.  Implemented per platform.
+ */
+class SpillFile
+{
+public:
+  /*! The size and alignment of the regions handed out by a SpillStore. */
+  static const std::size_t k_region_size = 64 * 1024;
+  /*! The size and alignment of mapped windows.  Mapping many regions at once keeps the
+   *  number of mappings low, which the system limits (vm.max_map_count on Linux). */
+  static const std::size_t k_window_size = 1024 * k_region_size;
+
+  /*! Creates the file in @p directory.  On failure is_open() returns false and @p ec
+   *  tells why. */
+  SpillFile(const path& directory, std::error_code& ec);
+  SpillFile(const SpillFile&) = delete;
+  SpillFile& operator=(const SpillFile&) = delete;
+  ~SpillFile();
+
+  bool is_open() const;
+
+  /*! Grows the file to @p size bytes.  Returns false with @p ec set (to
+   *  no_space_on_device if the file system is full) on failure. */
+  bool resize(std::uintmax_t size, std::error_code& ec);
+
+  /*! Maps the window at @p offset (a multiple of k_window_size) for reading and
+   *  writing.  Only the part of the window inside the file may be accessed; it grows
+   *  with the file.  Returns nullptr with @p ec set on failure. */
+  char* map_window(std::uintmax_t offset, std::error_code& ec);
+  void unmap_window(char* window);
+
+  /*! Hints that the pages of the region at @p region are not needed in memory soon.
+   *  Their content is kept. */
+  void evict(char* region);
+
+private:
+  // a file descriptor or HANDLE
+  std::intptr_t _handle;
+};
+
+
+/*! Hands out regions of an anonymous SpillFile for the content of large files.
+ *
+ * Regions are zero filled when handed out and reused when freed.  All functions are
+ * thread safe.
+ */
+class SpillStore
+{
+public:
+  static const std::size_t k_region_size = SpillFile::k_region_size;
+
+  /*! Creates a store in @p directory for the content of files larger than
+   *  @p threshold bytes.  Returns null if the file can't be created. */
+  static std::shared_ptr<SpillStore> create(const path& directory,
+                                            std::uintmax_t threshold,
+                                            std::error_code& ec);
+
+  SpillStore(const path& directory, std::uintmax_t threshold, std::error_code& ec);
+  SpillStore(const SpillStore&) = delete;
+  SpillStore& operator=(const SpillStore&) = delete;
+  ~SpillStore();
+
+  std::uintmax_t threshold() const { return _threshold; }
+
+  /*! Returns a zero filled region of k_region_size bytes.  Returns nullptr with @p ec
+   *  set (to no_space_on_device if the file can't grow anymore) on failure. */
+  char* allocate(std::error_code& ec);
+  void free(char* region);
+  void evict(char* region) { _file.evict(region); }
+
+private:
+  SpillFile _file;
+  std::uintmax_t _threshold;
+
+  // protects all of the following
+  std::mutex _mutex;
+  std::uintmax_t _file_size = 0;
+  std::vector<std::uintmax_t> _free;
+  // the mapped windows by their index in the file
+  std::vector<char*> _windows;
+  std::unordered_map<const char*, std::uintmax_t> _offsets;
+};
+
+
+/*! A chunk of FileContent.
+ *
+ * The bytes are kept on the heap or, for chunks of large files, in a region of a
+ * SpillStore.  Spilled chunks always have the size of a region.  A chunk can also be a
+ * read only view of bytes owned by someone else (like a loaded image, see
+ * MemoryFilesystem::load_image()), which must be copied before writing to it.  Packed
+ * chunks keep their bytes compressed (see lz_codec.hpp); they are read with unpack()
+ * and copied to the heap before writing to them.
+ */
+class FileChunk
+{
+public:
+  /*! Creates a chunk of @p size zero bytes on the heap. */
+  explicit FileChunk(std::size_t size)
+    : _heap(size, '\0')
+  {
+  }
+  /*! Creates a chunk of SpillStore::k_region_size bytes in @p store holding a copy of
+   *  @p other, if given.
+   *
+   * @throws std::system_error if @p store can't hand out a region */
+  FileChunk(const std::shared_ptr<SpillStore>& store, const FileChunk* other);
+  /*! Creates a view of @p size bytes at @p data, which @p owner keeps alive. */
+  FileChunk(std::shared_ptr<const void> owner, const char* data, std::size_t size)
+    : _owner(std::move(owner))
+    , _data(const_cast<char*>(data))
+    , _view_size(static_cast<std::uint32_t>(size))
+  {
+  }
+  /*! Copies @p other into the same kind of storage; views and packed chunks are copied
+   *  to the heap.
+   *
+   * @throws std::system_error if the store of a spilled chunk can't hand out a region */
+  FileChunk(const FileChunk& other);
+  FileChunk& operator=(const FileChunk&) = delete;
+  ~FileChunk();
+
+  bool is_spilled() const { return _data && _view_size == 0; }
+  bool is_view() const { return _view_size > 0; }
+  bool is_packed() const { return _packed_size > 0; }
+
+  std::size_t size() const
+  {
+    return is_packed() ? _packed_size
+                       : !_data ? _heap.size()
+                                : is_view() ? _view_size : SpillStore::k_region_size;
+  }
+  /*! The bytes the chunk takes up in memory or the spill store. */
+  std::size_t stored_size() const { return is_packed() ? _heap.size() : size(); }
+
+  /*! Not for packed chunks. */
+  const char* data() const { return _data ? _data : _heap.data(); }
+  /*! Not for views and packed chunks. */
+  char* data() { return _data ? _data : _heap.data(); }
+
+  /*! Returns a packed copy of this heap chunk or null if it doesn't compress by an
+   *  eighth at least. */
+  std::shared_ptr<FileChunk> pack() const;
+  /*! Copies the size() bytes of the chunk to @p dst, unpacking them if needed. */
+  void copy_to(char* dst) const;
+
+  /*! Zero extends the chunk to @p size bytes.  Spilled chunks are complete already;
+   *  not for views. */
+  void grow(std::size_t size)
+  {
+    if (!_data) {
+      _heap.resize(size, '\0');
+    }
+  }
+
+  /*! Hints that the bytes of a spilled chunk are not needed in memory soon. */
+  void evict() const
+  {
+    if (is_spilled()) {
+      store()->evict(_data);
+    }
+  }
+
+private:
+  SpillStore* store() const
+  {
+    return static_cast<SpillStore*>(const_cast<void*>(_owner.get()));
+  }
+
+  FileChunk() = default;
+
+  // the bytes of a heap chunk or the compressed bytes of a packed one
+  std::vector<char> _heap;
+  // the SpillStore of a spilled chunk or the owner of a view
+  std::shared_ptr<const void> _owner;
+  // the region of a spilled chunk or the bytes of a view; null for heap chunks
+  char* _data = nullptr;
+  std::uint32_t _view_size = 0;
+  // the size of a packed chunk's bytes when unpacked; 0 for other chunks
+  std::uint32_t _packed_size = 0;
+};
+
+
+/*! Holds the bytes of the packed chunk read last from a FileContent (see
+ *  FileContent::data_at()), such that reading on in the same chunk doesn't unpack it
+ *  again. */
+struct UnpackedChunk
+{
+  std::shared_ptr<const FileChunk> chunk;
+  std::vector<char> bytes;
+};
+
+
+/*! The content of a regular file.
+ *
+ * The content is stored in chunks of k_chunk_size bytes (only the first chunk of a
+ * small file is allocated smaller), so appending, truncating and writing take time
+ * proportional to the bytes touched.  Copies of a FileContent share their chunks, which
+ * are copied only when written to.  Ranges which have never been written to (like after
+ * resize()) share one chunk of zeros.
+ *
+ * Chunks are grouped in segments of k_segment_size chunks, which are shared and copied
+ * the same way, so copying the content of even a large file is cheap.
+ *
+ * If the content has a SpillStore and grows beyond its threshold, the chunks are moved
+ * into the store, as are all chunks written later, so the process keeps only the parts
+ * of large files in memory which are in use.
+ *
+ * Content is shared between a node and the files opened on it and must only be changed
+ * by an owner holding the only reference (see FSNode::writable_content()).
+ *
+ * Storage may be larger than size(): writers are handed out space beyond the end of
+ * file, which becomes part of the file only when commit()ed.  Bytes stored beyond size()
+ * are always zero.
+ *
+ * The heap chunks of content can be packed (see pack()), which keeps them compressed
+ * until they are read or written.  Readers unpack one chunk at a time into a buffer of
+ * their own, so packed content stays packed while being read.
+ */
+class FileContent
+{
+public:
+  static const std::size_t k_chunk_size = SpillStore::k_region_size;
+  static const std::size_t k_segment_size = 64;
+
+  /*! Creates empty content, which is spilled to @p store when it gets large. */
+  explicit FileContent(std::shared_ptr<SpillStore> store = nullptr)
+    : _store(std::move(store))
+  {
+  }
+  /*! Creates content viewing @p size bytes at @p data, which @p owner keeps alive.  The
+   *  bytes are copied chunk by chunk when written to. */
+  FileContent(std::shared_ptr<const void> owner, const char* data, file_size_type size);
+
+  file_size_type size() const { return _size; }
+
+  /*! Returns the bytes at @p pos and sets @p len to the number of bytes readable there
+   *  in one piece.  @p pos must be less than size().  Packed chunks are unpacked into
+   *  @p unpacked, which must stay unchanged as long as the bytes are read. */
+  const char* data_at(file_size_type pos,
+                      std::size_t& len,
+                      UnpackedChunk& unpacked) const;
+
+  /*! Returns the @p len bytes at @p pos if they are stored in one piece, i.e. in one
+   *  chunk or in chunks adjacent in memory (like the views of an image), and not packed.
+   *  Returns null otherwise.  @p len must be greater than 0. */
+  const char* contiguous_at(file_size_type pos, std::size_t len) const;
+
+  /*! Returns writable space at @p pos and sets @p len to its size (at least one byte).
+   *  Writing to it does not change size() before commit().
+   *
+   * @throws std::system_error if spilled content can't be stored */
+  char* writable_at(file_size_type pos, std::size_t& len);
+  /*! Extends the file up to @p end after data has been written to writable_at(). */
+  void commit(file_size_type end);
+
+  /*! Truncates or zero extends the content to @p new_size bytes.
+   *
+   * @throws std::system_error if spilled content can't be stored; size() and the bytes
+   *   are unchanged then */
+  void resize(file_size_type new_size);
+
+  /*! Hints that the bytes around @p pos are not needed in memory soon. */
+  void evict(file_size_type pos) const;
+
+  /*! Replaces the heap chunks by packed ones where they compress.  Returns false if
+   *  none did.  Spilled content is not packed. */
+  bool pack();
+  /*! The bytes the chunks take up in memory, the spill store or an image, not counting
+   *  the chunk of zeros shared by all contents. */
+  std::uintmax_t stored_size() const;
+
+private:
+  using Chunk = FileChunk;
+  using Segment = std::vector<std::shared_ptr<Chunk>>;
+
+  const Chunk& chunk(std::size_t idx) const
+  {
+    return *(*_segments[idx / k_segment_size])[idx % k_segment_size];
+  }
+  Chunk& writable_chunk(std::size_t idx);
+  Segment& writable_segment(std::size_t idx);
+  void push_chunk(std::shared_ptr<Chunk> chunk);
+  void fill_last_chunk();
+  void spill_if_large(std::size_t chunk_count);
+
+  std::vector<std::shared_ptr<Segment>> _segments;
+  std::size_t _chunk_count = 0;
+  file_size_type _size = 0;
+  std::shared_ptr<SpillStore> _store;
+  // true once the chunks have been moved to _store
+  bool _is_spilled = false;
+};
+
+
+class FSNode
+{
+public:
+  FSNode() = default;
+  explicit FSNode(file_type type)
+    : _type(type)
+  {
+  }
+
+  file_size_type file_size() const { return _content ? _content->size() : 0; }
+
+  /*! Returns the entries of this directory node for modification, creating or
+   *  unsharing them if needed. */
+  ChildTable& writable_children(NameTable& names)
+  {
+    if (!_children) {
+      _children = std::make_shared<ChildTable>(names);
+    }
+    else if (_children.use_count() > 1) {
+      _children = std::make_shared<ChildTable>(*_children);
+    }
+    return *_children;
+  }
+
+  /*! Returns the content of this node for modification, unsharing it if needed.  New
+   *  content is spilled to @p store when it gets large. */
+  FileContent& writable_content(const std::shared_ptr<SpillStore>& store)
+  {
+    if (!_content) {
+      _content = std::make_shared<FileContent>(store);
+    }
+    else if (_content.use_count() > 1) {
+      _content = std::make_shared<FileContent>(*_content);
+    }
+    return *_content;
+  }
+
+  /*! Makes this node a copy of @p other.  The content is shared until one of the nodes
+   *  is written to. */
+  void copy_from_other(const FSNode& other)
+  {
+    _content = other._content;
+    _last_write_time = other._last_write_time;
+  }
+
+  void touch()
+  {
+    _last_write_time =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  }
+
+  file_type _type = file_type::none;
+  perms _perms = perms::unknown;
+  // the number of directory entries referring to this node
+  std::uint32_t _links = 0;
+  // the directory this node has been created in
+  node_handle _parent = k_no_node;
+  file_time_type _last_write_time = 0;
+  // if _type == directory; null as long as the directory is empty
+  std::shared_ptr<ChildTable> _children;
+  // if _type == regular; null as long as the file has never been written to
+  std::shared_ptr<FileContent> _content;
+  // whether the content of this file (or of files created in this directory) is packed
+  // when written
+  bool _compress = false;
+};
+
+
+/*! Stores FSNodes in pages of k_page_size nodes and refers to them by index.
+ *
+ * Copies of an arena share all pages and copy them only when a node in them is
+ * changed: writable() unshares the page of the node it returns.  Pages are looked up
+ * through a page table, which is shared and copied the same way.
+ *
+ * The arena is thread safe given that the nodes of a page are only accessed under a
+ * lock for that page (see NodeLocks): operator[] requires a shared lock, writable() and
+ * free() an exclusive one.  Node references are valid while the lock is held.
+ * allocate() and free() synchronize on an internal mutex.
+ *
+ * Freed handles are reused only after all operations running when they were freed have
+ * left (see EpochDomain), so a handle found in an operation never refers to another
+ * node while that operation runs; freed nodes have the type file_type::none.
+ */
+class NodeArena
+{
+public:
+  static const std::uint32_t k_page_bits = 10;
+  static const std::uint32_t k_page_size = 1u << k_page_bits;
+
+  NodeArena();
+  /*! Creates an arena sharing all nodes with @p other.  No operation must be running on
+   *  @p other. */
+  NodeArena(const NodeArena& other);
+  NodeArena& operator=(const NodeArena&) = delete;
+  ~NodeArena();
+
+  /*! Returns a handle to a free node (of type file_type::none). */
+  node_handle allocate();
+  void free(node_handle nd);
+
+  const FSNode& operator[](node_handle nd) const
+  {
+    const auto* table = _table.load(std::memory_order_acquire);
+    const auto* page = table->pages[nd >> k_page_bits].load(std::memory_order_acquire);
+    return page->nodes[nd & (k_page_size - 1)];
+  }
+
+  /*! Returns node @p nd for modification. */
+  FSNode& writable(node_handle nd);
+
+  /*! Returns the number of live nodes. */
+  std::size_t size() const { return _live.load(); }
+
+  /*! The domain operations on this arena have to enter. */
+  EpochDomain& epochs() { return _epochs; }
+
+private:
+  struct Page
+  {
+    Page()
+      : refs(1)
+    {
+    }
+    Page(const Page& other);
+
+    // the number of page tables referring to this page
+    std::atomic<std::uint32_t> refs;
+    FSNode nodes[k_page_size];
+  };
+
+  struct PageTable
+  {
+    explicit PageTable(std::size_t cap);
+
+    // the number of arenas referring to this table
+    std::atomic<std::uint32_t> refs;
+    // false if the pages are owned by a later table of the same arena
+    bool owns_pages = true;
+    std::size_t count = 0;
+    std::size_t capacity;
+    std::unique_ptr<std::atomic<Page*>[]> pages;
+  };
+
+  PageTable* writable_table(std::size_t min_capacity);
+  void retire_table(PageTable* table);
+  static void release_table(PageTable* table);
+  static void release_page(Page* page);
+  void try_reclaim();
+
+  std::atomic<PageTable*> _table;
+  std::atomic<std::size_t> _live;
+  EpochDomain _epochs;
+
+  // protects all of the following
+  std::mutex _mutex;
+  std::vector<node_handle> _free;
+  node_handle _next = 0;
+  // items freed in either phase of _epochs, waiting to be reused
+  std::vector<node_handle> _retired_nodes[2];
+  std::vector<PageTable*> _retired_tables[2];
+};
+
+
+/*! The locks protecting the nodes of a NodeArena.
+ *
+ * There are k_stripe_count locks; the nodes of one arena page are all protected by the
+ * same lock.  Each stripe also counts the open files and directory iterators of its
+ * nodes.  Threads holding more than one stripe lock have to acquire them in ascending
+ * order.
+ */
+class NodeLocks
+{
+public:
+  static const std::size_t k_stripe_count = 256;
+
+  static std::size_t stripe(node_handle nd)
+  {
+    return (nd >> NodeArena::k_page_bits) & (k_stripe_count - 1);
+  }
+
+  RwLock& lock(std::size_t stripe) { return _stripes[stripe].lock; }
+
+  /*! The number of users per node of @p stripe.  Requires an exclusive lock. */
+  std::unordered_map<node_handle, std::uint32_t>& opens(std::size_t stripe)
+  {
+    return _stripes[stripe].opens;
+  }
+
+private:
+  struct Stripe
+  {
+    RwLock lock;
+    std::unordered_map<node_handle, std::uint32_t> opens;
+  };
+
+  Stripe _stripes[k_stripe_count];
+};
+
+
+/*! Holds the lock of a node shared. */
+class SharedNodeLock
+{
+public:
+  SharedNodeLock(NodeLocks& locks, node_handle nd)
+    : _lock(locks.lock(NodeLocks::stripe(nd)))
+  {
+    _lock.lock_shared();
+  }
+
+  SharedNodeLock(const SharedNodeLock&) = delete;
+  SharedNodeLock& operator=(const SharedNodeLock&) = delete;
+
+  ~SharedNodeLock() { _lock.unlock_shared(); }
+
+private:
+  RwLock& _lock;
+};
+
+
+/*! Maps directory paths to the directory nodes they have been resolved to.
+ *
+ * The cache is an open addressing hash table of at most k_max_entries entries keyed by
+ * the path string as given, so different spellings of a path get different entries.
+ * It is cleared completely when it is full and whenever a directory is removed or
+ * renamed; clearing takes constant time by bumping the generation the entries are
+ * stamped with.  A cache is not thread safe; the memory VFS keeps one per thread.
+ */
+class PathCache
+{
+public:
+  /*! 1024 parent directories per thread and filesystem; the slots (and the keys they
+   *  keep) are allocated on the first insert. */
+  static const std::size_t k_max_entries = 1024;
+
+  /*! Returns the node cached for the @p len characters at @p str or k_no_node. */
+  node_handle find(const path::value_type* str, std::size_t len) const;
+  void insert(const path::value_type* str, std::size_t len, node_handle nd);
+  void clear();
+
+private:
+  struct Slot
+  {
+    path::string_type key;
+    std::size_t hash = 0;
+    node_handle node = k_no_node;
+    // entries from older generations are considered empty
+    std::uint32_t generation = 0;
+  };
+
+  std::vector<Slot> _slots;
+  std::size_t _count = 0;
+  std::uint32_t _generation = 1;
+};
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -3,6 +3,7 @@
 #include "fspp/details/operations.hpp"
 
 #include "common.hpp"
+#include "instrumentation_private.hpp"
 #include "operations_impl.hpp"
 #include "vfs_private.hpp"
 
@@ -13,8 +14,15 @@
 #include "fspp/limits.hpp"
 #include "fspp/utils.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <new>
+#include <system_error>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 
 namespace eyestep {
@@ -241,8 +249,11 @@ copy(const path& from, const path& to, copy_options options)
 void
 copy(const path& from, const path& to, copy_options options, std::error_code& ec) NOEXCEPT
 {
-  const auto copy_impl = [](file_status from_st, const path& from_p, const path& to_p,
-                            copy_options opts, std::error_code& ec2) -> file_status {
+  const auto copy_impl = [](file_status from_st, const directory_entry& from_e,
+                            const path& to_p, copy_options opts,
+                            std::error_code& ec2) -> file_status {
+    const auto& from_p = from_e.path();
+
     if (!exists(from_st)) {
       ec2 = std::make_error_code(std::errc::no_such_file_or_directory);
       return file_status{};
@@ -261,7 +272,17 @@ copy(const path& from, const path& to, copy_options options, std::error_code& ec
       return file_status{};
     }
     if (exists(to_st)) {
-      if (equivalent(from_p, to_p, ec2)) {
+      // the source entry's id is cached (or provided by the directory iterator), so this
+      // costs one lookup of the destination only.
+      const auto from_id = from_e.file_id(ec2);
+      if (ec2) {
+        return file_status{};
+      }
+      const auto to_id = file_identity(to_p, ec2);
+      if (ec2) {
+        return file_status{};
+      }
+      if (from_id == to_id) {
         ec2 = std::make_error_code(std::errc::file_exists);
         return file_status{};
       }
@@ -336,7 +357,7 @@ copy(const path& from, const path& to, copy_options options, std::error_code& ec
     return;
   }
 
-  const auto to_st = copy_impl(from_st, from, to, options, ec);
+  const auto to_st = copy_impl(from_st, directory_entry(from), to, options, ec);
   if (ec) {
     return;
   }
@@ -373,7 +394,7 @@ copy(const path& from, const path& to, copy_options options, std::error_code& ec
                                     || (options & copy_options::create_symlinks) != 0
                                   ? e.symlink_status(ec)
                                   : e.status(ec);
-      const auto next_to_st = copy_impl(next_from_st, next_from, next_to, options, ec);
+      const auto next_to_st = copy_impl(next_from_st, e, next_to, options, ec);
       if (ec) {
         return;
       }
@@ -434,12 +455,13 @@ copy_file(const path& from,
           std::error_code& ec) NOEXCEPT
 {
   if (auto val = vfs::with_vfs_do<bool>(
-        from, to, [&](vfs::IFilesystem& fs, const path& from2, const path& to2) {
+        from, to, ec, [&](vfs::IFilesystem& fs, const path& from2, const path& to2) {
           return fs.copy_file(from2, to2, options, ec);
         })) {
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::copy_file, ec);
   return impl::copy_file(from, to, options, ec);
 }
 
@@ -499,6 +521,7 @@ create_directory(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::create_directory, ec);
   return impl::create_directory(p, ec);
 }
 
@@ -520,13 +543,14 @@ bool
 create_directory(const path& p, const path& existing_p, std::error_code& ec) NOEXCEPT
 {
   if (auto val = vfs::with_vfs_do<bool>(
-        p, existing_p,
+        p, existing_p, ec,
         [&](vfs::IFilesystem& fs, const path& p2, const path& existing_p2) {
           return fs.create_directory(p2, existing_p2, ec);
         })) {
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::create_directory, ec);
   return impl::create_directory(p, existing_p, ec);
 }
 
@@ -591,11 +615,12 @@ void
 create_hard_link(const path& target_p, const path& link_p, std::error_code& ec) NOEXCEPT
 {
   if (!vfs::with_vfs_do<bool>(
-        target_p, link_p,
+        target_p, link_p, ec,
         [&](vfs::IFilesystem& fs, const path& target_p2, const path& link_p2) {
           fs.create_hard_link(target_p2, link_p2, ec);
           return false;
         })) {
+    ScopedTiming timing(native_recorder(), Operation::create_hard_link, ec);
     impl::create_hard_link(target_p, link_p, ec);
   }
 }
@@ -616,11 +641,12 @@ void
 create_symlink(const path& target_p, const path& link_p, std::error_code& ec) NOEXCEPT
 {
   if (!vfs::with_vfs_do<bool>(
-        target_p, link_p,
+        target_p, link_p, ec,
         [&](vfs::IFilesystem& fs, const path& target_p2, const path& link_p2) {
           fs.create_symlink(target_p2, link_p2, ec);
           return false;
         })) {
+    ScopedTiming timing(native_recorder(), Operation::create_symlink, ec);
     impl::create_symlink(target_p, link_p, ec);
   }
 }
@@ -643,11 +669,12 @@ create_directory_symlink(const path& target_p,
                          std::error_code& ec) NOEXCEPT
 {
   if (!vfs::with_vfs_do<bool>(
-        target_p, link_p,
+        target_p, link_p, ec,
         [&](vfs::IFilesystem& fs, const path& target_p2, const path& link_p2) {
           fs.create_directory_symlink(target_p2, link_p2, ec);
           return false;
         })) {
+    ScopedTiming timing(native_recorder(), Operation::create_directory_symlink, ec);
     impl::create_directory_symlink(target_p, link_p, ec);
   }
 }
@@ -694,12 +721,17 @@ bool
 equivalent(const path& p1, const path& p2, std::error_code& ec) NOEXCEPT
 {
   if (auto val = vfs::with_vfs_do<bool>(
-        p1, p2, [&](vfs::IFilesystem& fs, const path& rp1, const path& rp2) {
+        p1, p2, ec, [&](vfs::IFilesystem& fs, const path& rp1, const path& rp2) {
           return fs.equivalent(rp1, rp2, ec);
         })) {
+    if (ec == std::errc::cross_device_link) {
+      // paths on different roots are never the same file
+      ec.clear();
+    }
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::equivalent, ec);
   return impl::equivalent(p1, p2, ec);
 }
 
@@ -746,10 +778,38 @@ file_size(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::file_size, ec);
   return impl::file_size(p, ec);
 }
 
 
+file_id
+file_identity(const path& p)
+{
+  std::error_code ec;
+  auto rv = file_identity(p, ec);
+  if (ec) {
+    throw filesystem_error("can't determine file identity", p, ec);
+  }
+
+  return rv;
+}
+
+
+file_id
+file_identity(const path& p, std::error_code& ec) NOEXCEPT
+{
+  if (auto val = vfs::with_vfs_do<file_id>(p, [&](vfs::IFilesystem& fs, const path& p2) {
+        return fs.file_identity(p2, ec);
+      })) {
+    return val.value();
+  }
+
+  ScopedTiming timing(native_recorder(), Operation::file_identity, ec);
+  return impl::file_identity(p, ec);
+}
+
+
 std::uintmax_t
 hard_link_count(const path& p)
 {
@@ -773,6 +833,7 @@ hard_link_count(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::hard_link_count, ec);
   return impl::hard_link_count(p, ec);
 }
 
@@ -800,6 +861,7 @@ last_write_time(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::last_write_time, ec);
   return impl::last_write_time(p, ec);
 }
 
@@ -822,6 +884,7 @@ last_write_time(const path& p, file_time_type new_time, std::error_code& ec) NOE
         fs.last_write_time(p2, new_time, ec);
         return false;
       })) {
+    ScopedTiming timing(native_recorder(), Operation::set_last_write_time, ec);
     impl::last_write_time(p, new_time, ec);
   }
 }
@@ -845,6 +908,7 @@ permissions(const path& p, perms prms, std::error_code& ec) NOEXCEPT
         fs.permissions(p2, prms, ec);
         return false;
       })) {
+    ScopedTiming timing(native_recorder(), Operation::permissions, ec);
     impl::permissions(p, prms, ec);
   }
 }
@@ -913,6 +977,7 @@ read_symlink(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::read_symlink, ec);
   return impl::read_symlink(p, ec);
 }
 
@@ -978,6 +1043,7 @@ remove(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::remove, ec);
   return impl::remove(p, ec);
 }
 
@@ -1003,6 +1069,7 @@ remove_all(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::remove_all, ec);
   return impl::remove_all(p, ec);
 }
 
@@ -1022,10 +1089,12 @@ void
 rename(const path& old_p, const path& new_p, std::error_code& ec) NOEXCEPT
 {
   if (!vfs::with_vfs_do<bool>(
-        old_p, new_p, [&](vfs::IFilesystem& fs, const path& old_p2, const path& new_p2) {
+        old_p, new_p, ec,
+        [&](vfs::IFilesystem& fs, const path& old_p2, const path& new_p2) {
           fs.rename(old_p2, new_p2, ec);
           return false;
         })) {
+    ScopedTiming timing(native_recorder(), Operation::rename, ec);
     impl::rename(old_p, new_p, ec);
   }
 }
@@ -1049,6 +1118,7 @@ resize_file(const path& p, file_size_type new_size, std::error_code& ec) NOEXCEP
         fs.resize_file(p2, new_size, ec);
         return false;
       })) {
+    ScopedTiming timing(native_recorder(), Operation::resize_file, ec);
     impl::resize_file(p, new_size, ec);
   }
 }
@@ -1075,6 +1145,7 @@ space(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::space, ec);
   return impl::space(p, ec);
 }
 
@@ -1100,10 +1171,99 @@ status(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::status, ec);
   return impl::status(p, ec);
 }
 
 
+void
+status_many(const path* paths,
+            std::size_t count,
+            file_status* results,
+            std::error_code* ecs,
+            const status_many_options& options) NOEXCEPT
+{
+  const auto follow = options.follow_symlinks;
+
+  // paths on a virtual filesystem are done right here; the backends are not required to
+  // be thread safe.  Collect the native ones for the workers.
+  auto native_idx = std::vector<std::size_t>{};
+  try {
+    native_idx.reserve(count);
+  }
+  catch (const std::bad_alloc&) {
+    // no memory to hand out the work; stat one after the other
+    for (auto i = std::size_t(0); i < count; ++i) {
+      results[i] = follow ? status(paths[i], ecs[i]) : symlink_status(paths[i], ecs[i]);
+    }
+    return;
+  }
+
+  for (auto i = std::size_t(0); i < count; ++i) {
+    if (auto val = vfs::with_vfs_do<file_status>(
+          paths[i], [&](vfs::IFilesystem& fs, const path& p2) {
+            return follow ? fs.status(p2, ecs[i]) : fs.symlink_status(p2, ecs[i]);
+          })) {
+      results[i] = val.value();
+    }
+    else {
+      native_idx.push_back(i);
+    }
+  }
+
+  const auto batch_size = std::max(options.batch_size, std::size_t(1));
+  std::atomic<std::size_t> next_batch(0);
+
+  auto* recorder = native_recorder();
+  const auto op = follow ? Operation::status : Operation::symlink_status;
+  const auto worker = [&]() {
+    for (;;) {
+      const auto first = next_batch.fetch_add(batch_size);
+      if (first >= native_idx.size()) {
+        return;
+      }
+
+      const auto last = std::min(first + batch_size, native_idx.size());
+      for (auto j = first; j < last; ++j) {
+        const auto i = native_idx[j];
+        ScopedTiming timing(recorder, op, ecs[i]);
+        results[i] = follow ? impl::status(paths[i], ecs[i])
+                            : impl::symlink_status(paths[i], ecs[i]);
+      }
+    }
+  };
+
+  const auto max_threads =
+    options.max_threads != 0 ? options.max_threads : std::thread::hardware_concurrency();
+  const auto batch_count = (native_idx.size() + batch_size - 1) / batch_size;
+  // the calling thread is one of the workers
+  const auto thread_count =
+    std::min(static_cast<std::size_t>(std::max(max_threads, 1u)), batch_count);
+
+  auto threads = std::vector<std::thread>{};
+  if (thread_count > 1) {
+    try {
+      threads.reserve(thread_count - 1);
+      for (auto i = std::size_t(1); i < thread_count; ++i) {
+        threads.emplace_back(worker);
+      }
+    }
+    catch (const std::system_error&) {
+      // out of threads; the ones started (and this one) take over the rest
+    }
+    catch (const std::bad_alloc&) {
+      // likewise
+    }
+  }
+
+  worker();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+
 file_status
 symlink_status(const path& p)
 {
@@ -1127,6 +1287,7 @@ symlink_status(const path& p, std::error_code& ec) NOEXCEPT
     return val.value();
   }
 
+  ScopedTiming timing(native_recorder(), Operation::symlink_status, ec);
   return impl::symlink_status(p, ec);
 }
 
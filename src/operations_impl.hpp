@@ -11,6 +11,8 @@
 #include "fspp/details/file_status.hpp"
 #include "fspp/filesystem.hpp"
 
+#include <memory>
+
 
 namespace eyestep {
 namespace filesystem {
@@ -43,6 +45,9 @@ equivalent(const path& p1, const path& p2, std::error_code& ec) NOEXCEPT;
 file_size_type
 file_size(const path& p, std::error_code& ec) NOEXCEPT;
 
+file_id
+file_identity(const path& p, std::error_code& ec) NOEXCEPT;
+
 std::uintmax_t
 hard_link_count(const path& p, std::error_code& ec) NOEXCEPT;
 
@@ -54,6 +59,14 @@ last_write_time(const path& p, file_time_type new_time, std::error_code& ec) NOE
 void
 permissions(const path& p, perms prms, std::error_code& ec) NOEXCEPT;
 
+/*! Maps the native file @p p (see mapped_file).  Implemented per platform. */
+std::unique_ptr<mapped_file::IMappingImpl>
+map_file(const path& p,
+         map_mode mode,
+         file_size_type offset,
+         file_size_type length,
+         std::error_code& ec) NOEXCEPT;
+
 path
 read_symlink(const path& p, std::error_code& ec) NOEXCEPT;
 
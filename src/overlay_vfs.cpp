@@ -0,0 +1,1088 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "dir_iterator_private.hpp"
+#include "vfs_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <ios>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+// the index of the upper layer; lower layer i has index i + 1.
+const std::size_t k_upper = 0;
+// the number of merged listings kept before the cache is cleared
+const std::size_t k_max_listings = 4096;
+const std::size_t k_copy_buffer_size = 64 * 1024;
+
+
+bool
+is_absent(const std::error_code& ec)
+{
+  return ec == std::errc::no_such_file_or_directory || ec == std::errc::not_a_directory;
+}
+
+
+/*! An entry of a merged directory listing. */
+struct OverlayEntry
+{
+  file_type type = file_type::not_found;
+  // the layers providing the entry, top most first: the one holding it for files, all
+  // layers merged into it for directories.
+  std::vector<std::size_t> layers;
+  // true if a lower layer has an entry of this name, which has to be hidden by a
+  // whiteout once the entry is removed.
+  bool in_lower = false;
+};
+
+
+using Listing = std::map<std::string, OverlayEntry>;
+
+
+/*! A file of a lower layer, accessed through the regular File interface. */
+class LayerFileImpl : public detail::IFileImpl
+{
+public:
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    _file = File(p);
+    return _file.open(mode, ec);
+  }
+
+  std::iostream& stream() override { return _file.stream(); }
+
+  bool is_open() const override { return _file.is_valid() && _file.is_open(); }
+
+  void close(std::error_code& ec) override { _file.close(ec); }
+
+private:
+  File _file;
+};
+
+
+/*! A filesystem stacking a number of read only lower layers under a writable upper
+ * layer.
+ *
+ * Paths resolve top down: the upper layer hides everything of the same name in the
+ * layers below, a file in a lower layer hides the layers below it.  Directories of the
+ * same name are merged.  The merged listing of a directory is built when it is looked up
+ * first and cached; lookups of a path walk the cached listings of its ancestors.
+ *
+ * The lower layers are never changed.  Changing a file or directory of a lower layer
+ * copies it (and the directories leading to it) to the upper layer first ("copy up").
+ * Removing an entry provided by a lower layer records a whiteout for its path, which
+ * hides the lower layers from there on; recreating the entry later puts it into the
+ * upper layer only, so a recreated directory starts empty.
+ *
+ * Operations are serialized by a mutex.  Reading and writing open files is not.
+ */
+class OverlayFilesystem : public IFilesystem
+{
+public:
+  OverlayFilesystem(std::vector<path> lower_layers, std::unique_ptr<IFilesystem> upper)
+    : _lowers(std::move(lower_layers))
+    , _upper(std::move(upper))
+  {
+    _root.type = file_type::directory;
+    _root.layers.push_back(k_upper);
+    for (auto i = std::size_t(0); i < _lowers.size(); ++i) {
+      _root.layers.push_back(i + 1);
+    }
+  }
+
+  std::unique_ptr<detail::IFileImpl> make_file_impl() override;
+
+  std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
+    const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto* listing = listing_of(path_key(vfs::deroot(p)), ec);
+    if (!listing) {
+      return {};
+    }
+
+    auto names = std::vector<std::string>();
+    names.reserve(listing->size());
+    for (const auto& entry : *listing) {
+      names.push_back(entry.first);
+    }
+    return estd::make_unique<ListingDirIter>(p, std::move(names));
+  }
+
+  void dump(std::ostream& os) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    os << "-----------------------------------------------------------------\n";
+    dump_dir("/", os, 1);
+    os << "-----------------------------------------------------------------\n";
+  }
+
+  path canonical(const path& p, const path& base, std::error_code& ec) override
+  {
+    (void)p;
+    (void)base;
+    ec = std::make_error_code(std::errc::function_not_supported);
+    return path();
+  }
+
+  bool copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto from_key = path_key(from);
+    const auto to_key = path_key(to);
+
+    auto src = OverlayEntry();
+    if (!lookup(from_key, src, ec)) {
+      return false;
+    }
+    if (src.type == file_type::directory) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return false;
+    }
+
+    auto dst = OverlayEntry();
+    if (lookup(to_key, dst, ec)) {
+      if (dst.type == file_type::directory) {
+        ec = std::make_error_code(std::errc::is_a_directory);
+        return false;
+      }
+      if (from_key == to_key) {
+        ec = std::make_error_code(std::errc::file_exists);
+        return false;
+      }
+      if ((options & copy_options::overwrite_existing) != 0) {
+        // copy
+      }
+      else if ((options & copy_options::skip_existing) != 0) {
+        ec.clear();
+        return false;
+      }
+      else if ((options & copy_options::update_existing) != 0) {
+        const auto src_time = layer_last_write_time(from_key, src, ec);
+        const auto dst_time = !ec ? layer_last_write_time(to_key, dst, ec) : src_time;
+        if (ec || src_time <= dst_time) {
+          return false;
+        }
+      }
+      else {
+        ec = std::make_error_code(std::errc::file_exists);
+        return false;
+      }
+    }
+    else if (!is_absent(ec)) {
+      return false;
+    }
+
+    const auto to_parent = parent_key(to_key);
+    if (!copy_up_parent(to_key, ec)) {
+      return false;
+    }
+
+    if (src.layers.front() == k_upper) {
+      _upper->copy_file(u8path(from_key), u8path(to_key),
+                        copy_options::overwrite_existing, ec);
+    }
+    else {
+      copy_content(from_key, src.layers.front(), to_key, ec);
+    }
+    forget_listing(to_parent);
+    return !ec;
+  }
+
+  void copy_symlink(const path& from, const path& to, std::error_code& ec) override
+  {
+    const auto target = read_symlink(from, ec);
+    if (!ec) {
+      create_symlink(target, to, ec);
+    }
+  }
+
+  bool create_directory(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(p);
+    auto entry = OverlayEntry();
+    if (lookup(key, entry, ec)) {
+      if (entry.type == file_type::directory) {
+        ec.clear();
+      }
+      else {
+        ec = std::make_error_code(std::errc::file_exists);
+      }
+      return false;
+    }
+    if (!is_absent(ec) || !copy_up_parent(key, ec)) {
+      return false;
+    }
+
+    const auto created = _upper->create_directory(u8path(key), ec);
+    forget_listing(parent_key(key));
+    return created;
+  }
+
+  bool create_directory(const path& p,
+                        const path& existing_p,
+                        std::error_code& ec) override
+  {
+    // like the memory vfs the upper layer is most likely to be, don't copy attributes
+    (void)existing_p;
+    return create_directory(p, ec);
+  }
+
+  bool create_directories(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+
+    auto created = false;
+    for (auto pos = key.find('/', 1);; pos = key.find('/', pos + 1)) {
+      created = create_directory(u8path(key.substr(0, pos)), ec);
+      if (ec) {
+        return false;
+      }
+      if (pos == std::string::npos) {
+        break;
+      }
+    }
+    return created;
+  }
+
+  void create_hard_link(const path& target,
+                        const path& link,
+                        std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto target_key = path_key(target);
+    const auto link_key = path_key(link);
+
+    auto entry = OverlayEntry();
+    if (lookup(link_key, entry, ec)) {
+      ec = std::make_error_code(std::errc::file_exists);
+      return;
+    }
+    if (!is_absent(ec) || !lookup(target_key, entry, ec)) {
+      return;
+    }
+    if (entry.type == file_type::directory) {
+      ec = std::make_error_code(std::errc::operation_not_permitted);
+      return;
+    }
+
+    if (copy_up(target_key, entry, true, ec) && copy_up_parent(link_key, ec)) {
+      _upper->create_hard_link(u8path(target_key), u8path(link_key), ec);
+      forget_listing(parent_key(link_key));
+    }
+  }
+
+  void create_symlink(const path& target, const path& link, std::error_code& ec) override
+  {
+    create_link(link, ec, [&](const path& upper_link) {
+      _upper->create_symlink(target, upper_link, ec);
+    });
+  }
+
+  void create_directory_symlink(const path& target,
+                                const path& link,
+                                std::error_code& ec) override
+  {
+    create_link(link, ec, [&](const path& upper_link) {
+      _upper->create_directory_symlink(target, upper_link, ec);
+    });
+  }
+
+  bool equivalent(const path& p1, const path& p2, std::error_code& ec) override
+  {
+    const auto id1 = file_identity(p1, ec);
+    if (ec) {
+      return false;
+    }
+    const auto id2 = file_identity(p2, ec);
+    if (ec) {
+      return false;
+    }
+    return id1 == id2;
+  }
+
+  file_size_type file_size(const path& p, std::error_code& ec) override
+  {
+    return forward<file_size_type>(
+      p, ec, [&](const path& upper) { return _upper->file_size(upper, ec); },
+      [&](const path& lower) { return filesystem::file_size(lower, ec); });
+  }
+
+  file_id file_identity(const path& p, std::error_code& ec) override
+  {
+    return forward<file_id>(
+      p, ec, [&](const path& upper) { return _upper->file_identity(upper, ec); },
+      [&](const path& lower) { return filesystem::file_identity(lower, ec); });
+  }
+
+  std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override
+  {
+    return forward<std::uintmax_t>(
+      p, ec, [&](const path& upper) { return _upper->hard_link_count(upper, ec); },
+      [&](const path& lower) { return filesystem::hard_link_count(lower, ec); });
+  }
+
+  file_time_type last_write_time(const path& p, std::error_code& ec) override
+  {
+    return forward<file_time_type>(
+      p, ec, [&](const path& upper) { return _upper->last_write_time(upper, ec); },
+      [&](const path& lower) { return filesystem::last_write_time(lower, ec); });
+  }
+
+  void last_write_time(const path& p,
+                       file_time_type new_time,
+                       std::error_code& ec) override
+  {
+    modify(p, ec,
+           [&](const path& upper) { _upper->last_write_time(upper, new_time, ec); });
+  }
+
+  void permissions(const path& p, perms prms, std::error_code& ec) override
+  {
+    modify(p, ec, [&](const path& upper) { _upper->permissions(upper, prms, ec); });
+  }
+
+  path read_symlink(const path& p, std::error_code& ec) override
+  {
+    return forward<path>(
+      p, ec, [&](const path& upper) { return _upper->read_symlink(upper, ec); },
+      [&](const path& lower) { return filesystem::read_symlink(lower, ec); });
+  }
+
+  bool remove(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(p);
+    auto entry = OverlayEntry();
+    if (!check_removable(key, entry, ec)) {
+      return false;
+    }
+    if (entry.type == file_type::directory) {
+      const auto* listing = listing_of(key, ec);
+      if (!listing) {
+        return false;
+      }
+      if (!listing->empty()) {
+        ec = std::make_error_code(std::errc::directory_not_empty);
+        return false;
+      }
+    }
+
+    if (entry.layers.front() == k_upper && !_upper->remove(u8path(key), ec)) {
+      return false;
+    }
+    hide(key, entry);
+    ec.clear();
+    return true;
+  }
+
+  std::uintmax_t remove_all(const path& p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(p);
+    auto entry = OverlayEntry();
+    if (!check_removable(key, entry, ec)) {
+      if (ec == std::errc::no_such_file_or_directory) {
+        ec.clear();
+        return 0;
+      }
+      return static_cast<std::uintmax_t>(-1);
+    }
+
+    const auto count = count_entries(key, entry, ec);
+    if (ec) {
+      return static_cast<std::uintmax_t>(-1);
+    }
+    if (entry.layers.front() == k_upper) {
+      _upper->remove_all(u8path(key), ec);
+      if (ec) {
+        return static_cast<std::uintmax_t>(-1);
+      }
+    }
+    hide(key, entry);
+    ec.clear();
+    return count;
+  }
+
+  void rename(const path& old_p, const path& new_p, std::error_code& ec) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto old_key = path_key(old_p);
+    const auto new_key = path_key(new_p);
+
+    auto src = OverlayEntry();
+    if (!check_removable(old_key, src, ec)) {
+      return;
+    }
+    if (old_key == new_key) {
+      ec.clear();
+      return;
+    }
+    if (new_key.compare(0, old_key.size() + 1, old_key + "/") == 0) {
+      ec = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+
+    auto dst = OverlayEntry();
+    const auto dst_exists = lookup(new_key, dst, ec);
+    if (dst_exists) {
+      if (dst.type == file_type::directory) {
+        if (src.type != file_type::directory) {
+          ec = std::make_error_code(std::errc::is_a_directory);
+          return;
+        }
+        const auto* listing = listing_of(new_key, ec);
+        if (!listing) {
+          return;
+        }
+        if (!listing->empty()) {
+          ec = std::make_error_code(std::errc::directory_not_empty);
+          return;
+        }
+      }
+      else if (src.type == file_type::directory) {
+        ec = std::make_error_code(std::errc::not_a_directory);
+        return;
+      }
+    }
+    else if (!is_absent(ec)) {
+      return;
+    }
+
+    // the upper layer can only rename what it has, so copy up the complete tree.
+    if (!copy_up_tree(old_key, src, ec) || !copy_up_parent(new_key, ec)) {
+      return;
+    }
+    _upper->rename(u8path(old_key), u8path(new_key), ec);
+    if (ec) {
+      return;
+    }
+
+    hide(old_key, src);
+    if (dst_exists) {
+      hide(new_key, dst);
+    }
+    forget_tree(new_key);
+  }
+
+  void resize_file(const path& p, file_size_type new_size, std::error_code& ec) override
+  {
+    modify(p, ec, [&](const path& upper) { _upper->resize_file(upper, new_size, ec); });
+  }
+
+  space_info space(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    (void)p;
+    return _upper->space(u8path("/"), ec);
+  }
+
+  file_status status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return layer_status(
+      p, ec, [&](const path& upper) { return _upper->status(upper, ec); },
+      [&](const path& lower) { return filesystem::status(lower, ec); });
+  }
+
+  file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return layer_status(
+      p, ec, [&](const path& upper) { return _upper->symlink_status(upper, ec); },
+      [&](const path& lower) { return filesystem::symlink_status(lower, ec); });
+  }
+
+  /*! Opens the file @p p, copying it up first if it is opened for writing.  Returns null
+   *  (with @p ec set) on failure. */
+  std::unique_ptr<detail::IFileImpl> open_file(const path& p,
+                                               std::ios::openmode mode,
+                                               std::error_code& ec)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(vfs::deroot(p));
+    auto entry = OverlayEntry();
+    const auto exists = lookup(key, entry, ec);
+    if (exists && entry.type == file_type::directory) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return {};
+    }
+
+    if ((mode & (std::ios::out | std::ios::app)) == 0) {
+      return exists ? open_layer_file(key, entry.layers.front(), mode, ec) : nullptr;
+    }
+
+    if (exists) {
+      // the content is only copied if the stream would keep it
+      const auto keep = (mode & std::ios::trunc) == 0
+                        && (mode & (std::ios::app | std::ios::in)) != 0;
+      if (!copy_up(key, entry, keep, ec)) {
+        return {};
+      }
+    }
+    else if (!is_absent(ec) || !copy_up_parent(key, ec)) {
+      return {};
+    }
+
+    auto impl = open_layer_file(key, k_upper, mode, ec);
+    forget_listing(parent_key(key));
+    return impl;
+  }
+
+private:
+  path layer_path(const std::string& key, std::size_t layer) const
+  {
+    if (layer == k_upper) {
+      return u8path(key);
+    }
+    return key == "/" ? _lowers[layer - 1] : _lowers[layer - 1] / u8path(key.substr(1));
+  }
+
+  /*! Sets @p entry to the merged entry of @p key.  Returns false with @p ec set to
+   *  no_such_file_or_directory or not_a_directory if there is none. */
+  bool lookup(const std::string& key, OverlayEntry& entry, std::error_code& ec)
+  {
+    if (key == "/") {
+      entry = _root;
+      ec.clear();
+      return true;
+    }
+
+    const auto* listing = listing_of(parent_key(key), ec);
+    if (!listing) {
+      return false;
+    }
+    const auto i_entry = listing->find(key.substr(key.rfind('/') + 1));
+    if (i_entry == listing->end()) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return false;
+    }
+
+    entry = i_entry->second;
+    ec.clear();
+    return true;
+  }
+
+  /*! Returns the merged listing of directory @p key, building it if it isn't cached.
+   *  The listing stays valid until the next call. */
+  const Listing* listing_of(const std::string& key, std::error_code& ec)
+  {
+    const auto i_listing = _listings.find(key);
+    if (i_listing != _listings.end()) {
+      ec.clear();
+      return &i_listing->second;
+    }
+
+    auto dir = OverlayEntry();
+    if (!lookup(key, dir, ec)) {
+      return nullptr;
+    }
+    if (dir.type != file_type::directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+      return nullptr;
+    }
+
+    auto listing = Listing();
+    // directories of which a lower layer had a non-directory; the layers below are
+    // hidden for them.
+    auto sealed = std::set<std::string>();
+    for (const auto layer : dir.layers) {
+      const auto merge = [&](const std::string& name, file_type type) {
+        if (layer != k_upper && _whiteouts.count(child_key(key, name)) > 0) {
+          return;
+        }
+
+        auto& entry = listing[name];
+        if (entry.layers.empty()) {
+          entry.type = type;
+          entry.layers.push_back(layer);
+        }
+        else if (entry.type == file_type::directory && type == file_type::directory
+                 && sealed.count(name) == 0) {
+          entry.layers.push_back(layer);
+        }
+        else {
+          sealed.insert(name);
+        }
+        entry.in_lower = entry.in_lower || layer != k_upper;
+      };
+
+      if (!read_layer_dir(key, layer, merge, ec)) {
+        return nullptr;
+      }
+    }
+
+    if (_listings.size() >= k_max_listings) {
+      _listings.clear();
+    }
+    ec.clear();
+    return &_listings.emplace(key, std::move(listing)).first->second;
+  }
+
+  template <typename Functor>
+  bool read_layer_dir(const std::string& key,
+                      std::size_t layer,
+                      Functor functor,
+                      std::error_code& ec)
+  {
+    if (layer == k_upper) {
+      auto iter = _upper->make_dir_iterator(u8path(key), ec);
+      if (ec || !iter) {
+        return !ec;
+      }
+      return for_each_entry(*iter, ec, [&](const directory_entry& e) {
+        const auto name = e.path().filename().generic_u8string();
+        std::error_code sec;
+        functor(name, _upper->symlink_status(u8path(child_key(key, name)), sec).type());
+        return true;
+      });
+    }
+
+    auto iter = directory_iterator(layer_path(key, layer), ec);
+    return !ec && for_each_entry(iter, ec, [&](const directory_entry& e) {
+      std::error_code sec;
+      auto st = e.status(sec);
+      if (!exists(st)) {
+        st = e.symlink_status(sec);
+      }
+      functor(e.path().filename().generic_u8string(), st.type());
+      return true;
+    });
+  }
+
+  void forget_listing(const std::string& key) { _listings.erase(key); }
+
+  /*! Forgets the listings of @p key's parent, @p key and all directories below it. */
+  void forget_tree(const std::string& key)
+  {
+    forget_listing(parent_key(key));
+    forget_listing(key);
+
+    const auto prefix = key == "/" ? key : key + "/";
+    auto i_listing = _listings.lower_bound(prefix);
+    while (i_listing != _listings.end()
+           && i_listing->first.compare(0, prefix.size(), prefix) == 0) {
+      i_listing = _listings.erase(i_listing);
+    }
+  }
+
+  /*! Hides the lower layers' entries at @p key after @p entry has been removed from the
+   *  upper layer. */
+  void hide(const std::string& key, const OverlayEntry& entry)
+  {
+    if (entry.in_lower) {
+      // whiteouts below key are covered by this one now
+      const auto prefix = key + "/";
+      auto i_whiteout = _whiteouts.lower_bound(prefix);
+      while (i_whiteout != _whiteouts.end()
+             && i_whiteout->compare(0, prefix.size(), prefix) == 0) {
+        i_whiteout = _whiteouts.erase(i_whiteout);
+      }
+      _whiteouts.insert(key);
+    }
+    forget_tree(key);
+  }
+
+  /*! Copies @p key described by @p entry into the upper layer unless it's there
+   *  already.  The content of files is only copied if @p with_content is true. */
+  bool copy_up(const std::string& key,
+               const OverlayEntry& entry,
+               bool with_content,
+               std::error_code& ec)
+  {
+    const auto layer = entry.layers.front();
+    if (layer == k_upper) {
+      ec.clear();
+      return true;
+    }
+    if (!copy_up_parent(key, ec)) {
+      return false;
+    }
+
+    const auto upper = u8path(key);
+    if (entry.type == file_type::directory) {
+      _upper->create_directory(upper, ec);
+    }
+    else if (with_content) {
+      copy_content(key, layer, key, ec);
+    }
+    else {
+      auto file = open_layer_file(key, k_upper, std::ios::out | std::ios::binary, ec);
+      if (file) {
+        file->close(ec);
+      }
+    }
+    if (ec) {
+      return false;
+    }
+
+    // attributes the upper layer doesn't support are lost
+    std::error_code aec;
+    const auto lower = layer_path(key, layer);
+    const auto mtime = filesystem::last_write_time(lower, aec);
+    if (!aec) {
+      _upper->last_write_time(upper, mtime, aec);
+    }
+    const auto st = filesystem::status(lower, aec);
+    if (!aec) {
+      _upper->permissions(upper, st.permissions(), aec);
+    }
+
+    forget_listing(parent_key(key));
+    ec.clear();
+    return true;
+  }
+
+  /*! Copies the parent directory of @p key into the upper layer. */
+  bool copy_up_parent(const std::string& key, std::error_code& ec)
+  {
+    const auto parent = parent_key(key);
+    auto entry = OverlayEntry();
+    if (!lookup(parent, entry, ec)) {
+      return false;
+    }
+    if (entry.type != file_type::directory) {
+      ec = std::make_error_code(std::errc::not_a_directory);
+      return false;
+    }
+    return copy_up(parent, entry, true, ec);
+  }
+
+  bool copy_up_tree(const std::string& key,
+                    const OverlayEntry& entry,
+                    std::error_code& ec)
+  {
+    if (!copy_up(key, entry, true, ec)) {
+      return false;
+    }
+    if (entry.type == file_type::directory) {
+      const auto* listing = listing_of(key, ec);
+      if (!listing) {
+        return false;
+      }
+      const auto children = *listing;
+      for (const auto& child : children) {
+        if (!copy_up_tree(child_key(key, child.first), child.second, ec)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  std::unique_ptr<detail::IFileImpl> open_layer_file(const std::string& key,
+                                                     std::size_t layer,
+                                                     std::ios::openmode mode,
+                                                     std::error_code& ec)
+  {
+    auto file = layer == k_upper ? _upper->make_file_impl()
+                                 : std::unique_ptr<detail::IFileImpl>(new LayerFileImpl);
+    file->open(layer_path(key, layer), mode, ec);
+    if (ec) {
+      return {};
+    }
+    return file;
+  }
+
+  /*! Copies the content of file @p from_key in @p layer to @p to_key in the upper
+   *  layer. */
+  void copy_content(const std::string& from_key,
+                    std::size_t layer,
+                    const std::string& to_key,
+                    std::error_code& ec)
+  {
+    auto src = open_layer_file(from_key, layer, std::ios::in | std::ios::binary, ec);
+    if (!src) {
+      return;
+    }
+    auto dst = open_layer_file(to_key, k_upper,
+                               std::ios::out | std::ios::trunc | std::ios::binary, ec);
+    if (dst) {
+      auto& is = src->stream();
+      auto& os = dst->stream();
+      auto buffer = std::vector<char>(k_copy_buffer_size);
+      while (is && os) {
+        is.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        os.write(buffer.data(), is.gcount());
+      }
+      const auto is_ok = !os.fail();
+      dst->close(ec);
+      if (!ec && !is_ok) {
+        ec = std::make_error_code(std::errc::io_error);
+      }
+    }
+
+    std::error_code cec;
+    src->close(cec);
+  }
+
+  file_time_type layer_last_write_time(const std::string& key,
+                                       const OverlayEntry& entry,
+                                       std::error_code& ec)
+  {
+    const auto layer = entry.layers.front();
+    return layer == k_upper ? _upper->last_write_time(u8path(key), ec)
+                            : filesystem::last_write_time(layer_path(key, layer), ec);
+  }
+
+  /*! Sets @p entry to the entry of @p key if it can be removed or renamed. */
+  bool check_removable(const std::string& key, OverlayEntry& entry, std::error_code& ec)
+  {
+    if (key == "/") {
+      ec = std::make_error_code(std::errc::operation_not_permitted);
+      return false;
+    }
+    if (!lookup(key, entry, ec)) {
+      ec = std::make_error_code(std::errc::no_such_file_or_directory);
+      return false;
+    }
+    return true;
+  }
+
+  std::uintmax_t count_entries(const std::string& key,
+                               const OverlayEntry& entry,
+                               std::error_code& ec)
+  {
+    auto count = std::uintmax_t(1);
+    if (entry.type == file_type::directory) {
+      const auto* listing = listing_of(key, ec);
+      if (!listing) {
+        return 0;
+      }
+      const auto children = *listing;
+      for (const auto& child : children) {
+        count += count_entries(child_key(key, child.first), child.second, ec);
+        if (ec) {
+          return 0;
+        }
+      }
+    }
+    return count;
+  }
+
+  /*! Calls @p upper or @p lower with the path of @p p in the layer providing it. */
+  template <typename T, typename Upper, typename Lower>
+  T forward(const path& p, std::error_code& ec, Upper upper, Lower lower)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(p);
+    auto entry = OverlayEntry();
+    if (!lookup(key, entry, ec)) {
+      return T();
+    }
+    const auto layer = entry.layers.front();
+    return layer == k_upper ? upper(u8path(key)) : lower(layer_path(key, layer));
+  }
+
+  template <typename Upper, typename Lower>
+  file_status layer_status(const path& p, std::error_code& ec, Upper upper, Lower lower)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(p);
+    auto entry = OverlayEntry();
+    if (!lookup(key, entry, ec)) {
+      if (is_absent(ec)) {
+        ec.clear();
+        return file_status(file_type::not_found);
+      }
+      return file_status(file_type::none);
+    }
+    const auto layer = entry.layers.front();
+    return layer == k_upper ? upper(u8path(key)) : lower(layer_path(key, layer));
+  }
+
+  /*! Copies @p p up and calls @p functor with its path in the upper layer. */
+  template <typename Functor>
+  void modify(const path& p, std::error_code& ec, Functor functor)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(p);
+    auto entry = OverlayEntry();
+    if (lookup(key, entry, ec) && copy_up(key, entry, true, ec)) {
+      functor(u8path(key));
+    }
+  }
+
+  template <typename Functor>
+  void create_link(const path& link, std::error_code& ec, Functor functor)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto key = path_key(link);
+    auto entry = OverlayEntry();
+    if (lookup(key, entry, ec)) {
+      ec = std::make_error_code(std::errc::file_exists);
+      return;
+    }
+    if (is_absent(ec) && copy_up_parent(key, ec)) {
+      functor(u8path(key));
+      forget_listing(parent_key(key));
+    }
+  }
+
+  void dump_dir(const std::string& key, std::ostream& os, std::size_t level)
+  {
+    std::error_code ec;
+    const auto* listing = listing_of(key, ec);
+    if (!listing) {
+      return;
+    }
+
+    const auto children = *listing;
+    for (const auto& child : children) {
+      os << std::string(level * 2, ' ') << child.first;
+      if (child.second.type == file_type::directory) {
+        os << "/";
+      }
+      for (const auto layer : child.second.layers) {
+        os << (layer == k_upper ? " [upper]" : " [lower " + std::to_string(layer) + "]");
+      }
+      os << "\n";
+
+      if (child.second.type == file_type::directory) {
+        dump_dir(child_key(key, child.first), os, level + 1);
+      }
+    }
+  }
+
+  std::mutex _mutex;
+  const std::vector<path> _lowers;
+  std::unique_ptr<IFilesystem> _upper;
+  OverlayEntry _root;
+  // the merged listings of directories by key
+  std::map<std::string, Listing> _listings;
+  // the keys at and below which the lower layers are hidden
+  std::set<std::string> _whiteouts;
+};
+
+
+class OverlayFileImpl : public detail::IFileImpl
+{
+public:
+  explicit OverlayFileImpl(OverlayFilesystem* fs)
+    : _fs(fs)
+    , _closed(nullptr)
+  {
+  }
+
+  ~OverlayFileImpl() override
+  {
+    if (is_open()) {
+      std::error_code ec;
+      close(ec);
+    }
+  }
+
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    assert(!is_open());
+
+    _impl = _fs->open_file(p, mode, ec);
+    return stream();
+  }
+
+  std::iostream& stream() override { return _impl ? _impl->stream() : _closed; }
+
+  bool is_open() const override { return _impl && _impl->is_open(); }
+
+  void close(std::error_code& ec) override
+  {
+    if (_impl) {
+      _impl->close(ec);
+      _impl.reset();
+    }
+    else {
+      ec = std::make_error_code(std::errc::bad_file_descriptor);
+    }
+  }
+
+private:
+  OverlayFilesystem* _fs;
+  // the file opened in the layer providing it
+  std::unique_ptr<detail::IFileImpl> _impl;
+  std::iostream _closed;
+};
+
+
+std::unique_ptr<detail::IFileImpl>
+OverlayFilesystem::make_file_impl()
+{
+  return estd::make_unique<OverlayFileImpl>(this);
+}
+
+}  // namespace
+
+
+std::unique_ptr<IFilesystem>
+make_overlay_filesystem(const std::vector<path>& lower_layers,
+                        std::unique_ptr<IFilesystem> upper,
+                        std::error_code& ec)
+{
+  for (const auto& layer : lower_layers) {
+    if (!is_directory(layer, ec)) {
+      if (!ec) {
+        ec = std::make_error_code(std::errc::not_a_directory);
+      }
+      return nullptr;
+    }
+  }
+
+  ec.clear();
+  return estd::make_unique<OverlayFilesystem>(lower_layers,
+                                              upper ? std::move(upper)
+                                                    : make_memory_filesystem());
+}
+
+
+std::unique_ptr<IFilesystem>
+make_overlay_filesystem(const std::vector<path>& lower_layers,
+                        std::unique_ptr<IFilesystem> upper)
+{
+  std::error_code ec;
+  auto fs = make_overlay_filesystem(lower_layers, std::move(upper), ec);
+  if (ec) {
+    throw filesystem_error("can't create overlay filesystem", ec);
+  }
+  return fs;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -83,6 +83,54 @@ public:
   }
 
   void increment(std::error_code& ec) override
+  {
+    read_entry(_current, ec);
+  }
+
+  std::size_t next_batch(directory_entry* entries,
+                         std::size_t n,
+                         std::error_code& ec) override
+  {
+    ec.clear();
+    if (n == 0 || is_end()) {
+      return 0;
+    }
+
+    // read straight into entries; _current only takes the entry following them.
+    auto count = std::size_t(0);
+    entries[count++] = std::move(_current);
+    while (count < n && read_entry(entries[count], ec)) {
+      ++count;
+    }
+    if (count == n) {
+      read_entry(_current, ec);
+    }
+    return count;
+  }
+
+  const directory_entry& object() const override { return _current; }
+
+  bool equal(const IDirIterImpl* other) const override
+  {
+    if (auto mac_impl = dynamic_cast<const PosixDirIterImpl*>(other)) {
+      if (is_end() == mac_impl->is_end()) {
+        if (!is_end()) {
+          return _current == mac_impl->_current;
+        }
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool is_end() const override { return !_dirp; }
+
+private:
+  // Reads the next entry into @p entry.  Returns false at the end, after closing the
+  // directory, or on error.
+  bool read_entry(directory_entry& entry, std::error_code& ec)
   {
 #if defined(FSPP_USE_READDIR_R)
     struct dirent* direntp = nullptr;
@@ -94,7 +142,7 @@ public:
     do {
       if (::readdir_r(_dirp, _dirent, &direntp)) {
         ec = std::error_code(errno, std::generic_category());
-        return;
+        return false;
       }
 
       if (direntp) {
@@ -102,9 +150,9 @@ public:
           continue;
         }
 
-        _current.assign(_path / direntp->d_name);
+        entry.assign(_path / direntp->d_name);
         ec.clear();
-        return;
+        return true;
       }
     } while (direntp);
 #else
@@ -118,41 +166,22 @@ public:
           continue;
         }
 
-        _current.assign(_path / direntp->d_name);
+        entry.assign(_path / direntp->d_name);
         ec.clear();
-        return;
+        return true;
       }
       else if (errno != 0) {
         ec = std::error_code(errno, std::generic_category());
-        return;
+        return false;
       }
     } while (direntp);
 #endif
 
     close_dir();
     ec.clear();
-  }
-
-  const directory_entry& object() const override { return _current; }
-
-  bool equal(const IDirIterImpl* other) const override
-  {
-    if (auto mac_impl = dynamic_cast<const PosixDirIterImpl*>(other)) {
-      if (is_end() == mac_impl->is_end()) {
-        if (!is_end()) {
-          return _current == mac_impl->_current;
-        }
-
-        return true;
-      }
-    }
-
     return false;
   }
 
-  bool is_end() const override { return !_dirp; }
-
-private:
   DIR* _dirp = nullptr;
   path _path;
 #if defined(FSPP_USE_READDIR_R)
@@ -0,0 +1,157 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "operations_impl.hpp"
+
+#include "fspp/details/mapped_file.hpp"
+#include "fspp/estd/memory.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace impl {
+
+namespace {
+
+class PosixMapping : public mapped_file::IMappingImpl
+{
+public:
+  // @p base is the page aligned start of the mapping, which holds @p size bytes from
+  // @p offset_in_page on
+  PosixMapping(char* base, std::size_t offset_in_page, std::size_t size)
+    : _base(base)
+    , _base_size(offset_in_page + size)
+    , _data(base ? base + offset_in_page : nullptr)
+    , _size(size)
+  {
+  }
+
+  ~PosixMapping() override
+  {
+    if (_base) {
+      ::munmap(_base, _base_size);
+    }
+  }
+
+  char* data() override { return _data; }
+  std::size_t size() const override { return _size; }
+
+  void advise(map_advice advice, std::error_code& ec) override
+  {
+    if (_base && ::madvise(_base, _base_size, map_advice_flag(advice)) != 0) {
+      ec = std::error_code(errno, std::generic_category());
+    }
+    else {
+      ec.clear();
+    }
+  }
+
+  void flush(std::error_code& ec) override
+  {
+    // msync() on read only mappings does nothing
+    if (_base && ::msync(_base, _base_size, MS_SYNC) != 0) {
+      ec = std::error_code(errno, std::generic_category());
+    }
+    else {
+      ec.clear();
+    }
+  }
+
+private:
+  static int map_advice_flag(map_advice advice)
+  {
+    switch (advice) {
+    case map_advice::normal:
+      return MADV_NORMAL;
+    case map_advice::sequential:
+      return MADV_SEQUENTIAL;
+    case map_advice::random:
+      return MADV_RANDOM;
+    case map_advice::will_need:
+      return MADV_WILLNEED;
+    case map_advice::dont_need:
+      return MADV_DONTNEED;
+    }
+    return MADV_NORMAL;
+  }
+
+  char* _base;
+  std::size_t _base_size;
+  char* _data;
+  std::size_t _size;
+};
+
+}  // namespace
+
+
+std::unique_ptr<mapped_file::IMappingImpl>
+map_file(const path& p,
+         map_mode mode,
+         file_size_type offset,
+         file_size_type length,
+         std::error_code& ec) NOEXCEPT
+{
+  const auto is_write = mode == map_mode::read_write;
+  const auto fd = ::open(p.c_str(), (is_write ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (fd < 0) {
+    ec = std::error_code(errno, std::generic_category());
+    return nullptr;
+  }
+
+  auto result = std::unique_ptr<mapped_file::IMappingImpl>();
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ec = std::error_code(errno, std::generic_category());
+  }
+  else if (S_ISDIR(st.st_mode)) {
+    ec = std::make_error_code(std::errc::is_a_directory);
+  }
+  else if (offset > static_cast<file_size_type>(st.st_size)) {
+    ec = std::make_error_code(std::errc::invalid_argument);
+  }
+  else {
+    const auto size = static_cast<std::size_t>(
+      std::min(length, static_cast<file_size_type>(st.st_size) - offset));
+    if (size == 0) {
+      // there is nothing to map
+      ec.clear();
+      result = estd::make_unique<PosixMapping>(nullptr, 0, 0);
+    }
+    else {
+      // mappings start at page boundaries
+      const auto page_size = static_cast<file_size_type>(::sysconf(_SC_PAGESIZE));
+      const auto offset_in_page = static_cast<std::size_t>(offset % page_size);
+      const auto prot = is_write ? PROT_READ | PROT_WRITE : PROT_READ;
+      auto* base = ::mmap(nullptr, offset_in_page + size, prot, MAP_SHARED, fd,
+                          static_cast<off_t>(offset - offset_in_page));
+      if (base == MAP_FAILED) {
+        ec = std::error_code(errno, std::generic_category());
+      }
+      else {
+        ec.clear();
+        result =
+          estd::make_unique<PosixMapping>(static_cast<char*>(base), offset_in_page, size);
+      }
+    }
+  }
+
+  // the mapping stays valid without the descriptor
+  ::close(fd);
+  return result;
+}
+
+}  // namespace impl
+}  // namespace filesystem
+}  // namespace eyestep
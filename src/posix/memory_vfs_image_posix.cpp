@@ -0,0 +1,63 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs_image.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+ImageMapping::ImageMapping(const path& p, std::error_code& ec)
+{
+  const auto fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    ec = std::error_code(errno, std::generic_category());
+    return;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ec = std::error_code(errno, std::generic_category());
+  }
+  else if (st.st_size == 0) {
+    // can't map an empty file; it's no valid image anyway
+    ec = std::make_error_code(std::errc::bad_message);
+  }
+  else {
+    const auto size = static_cast<std::size_t>(st.st_size);
+    // private, such that the data doesn't change when the file is written to
+    auto* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      ec = std::error_code(errno, std::generic_category());
+    }
+    else {
+      _data = static_cast<const char*>(data);
+      _size = size;
+      ec.clear();
+    }
+  }
+
+  // the mapping stays valid without the descriptor
+  ::close(fd);
+}
+
+
+ImageMapping::~ImageMapping()
+{
+  if (_data) {
+    ::munmap(const_cast<char*>(_data), _size);
+  }
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
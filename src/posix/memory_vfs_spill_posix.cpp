@@ -0,0 +1,127 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs_nodes.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+#include <system_error>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+int
+open_anonymous_file(const path& directory, std::error_code& ec)
+{
+#if defined(O_TMPFILE)
+  const auto tmp_fd =
+    ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+  if (tmp_fd >= 0) {
+    return tmp_fd;
+  }
+  // not supported by all file systems; fall back to a named file
+#endif
+
+  const auto tmpl = (directory / "fspp-spill-XXXXXX").string();
+  auto name = std::vector<char>(begin(tmpl), end(tmpl));
+  name.push_back('\0');
+
+  const auto fd = ::mkstemp(name.data());
+  if (fd < 0) {
+    ec = std::error_code(errno, std::generic_category());
+    return -1;
+  }
+  ::unlink(name.data());
+  ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+}  // namespace
+
+
+SpillFile::SpillFile(const path& directory, std::error_code& ec)
+  : _handle(open_anonymous_file(directory, ec))
+{
+}
+
+
+SpillFile::~SpillFile()
+{
+  if (is_open()) {
+    ::close(static_cast<int>(_handle));
+  }
+}
+
+
+bool
+SpillFile::is_open() const
+{
+  return _handle >= 0;
+}
+
+
+bool
+SpillFile::resize(std::uintmax_t size, std::error_code& ec)
+{
+  const auto fd = static_cast<int>(_handle);
+#if defined(__linux__)
+  // reserve the blocks now, so writing to the mapping later can't fail with SIGBUS
+  const auto err = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+  if (err != EOPNOTSUPP && err != EINVAL) {
+    ec = std::error_code(err, std::generic_category());
+    return err == 0;
+  }
+#endif
+  if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    ec = std::error_code(errno, std::generic_category());
+    return false;
+  }
+  ec.clear();
+  return true;
+}
+
+
+char*
+SpillFile::map_window(std::uintmax_t offset, std::error_code& ec)
+{
+  // mapping beyond the end of the file is fine as long as these pages aren't touched
+  auto* window = ::mmap(nullptr, k_window_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        static_cast<int>(_handle), static_cast<off_t>(offset));
+  if (window == MAP_FAILED) {
+    ec = std::error_code(errno, std::generic_category());
+    return nullptr;
+  }
+  ec.clear();
+  return static_cast<char*>(window);
+}
+
+
+void
+SpillFile::unmap_window(char* window)
+{
+  ::munmap(window, k_window_size);
+}
+
+
+void
+SpillFile::evict(char* region)
+{
+  // for a shared file mapping this only drops the pages from the process; the data
+  // stays in the file.
+  ::madvise(region, k_region_size, MADV_DONTNEED);
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -2,6 +2,7 @@
 
 #include "fspp/details/operations.hpp"
 
+#include "dir_iterator_private.hpp"
 #include "operations_impl.hpp"
 
 #include "fspp/details/file_status.hpp"
@@ -259,18 +260,16 @@ create_directory_symlink(const path& target_p,
 bool
 equivalent(const path& p1, const path& p2, std::error_code& ec) NOEXCEPT
 {
-  struct stat buf1;
-  struct stat buf2;
-  auto rv1 = ::stat(p1.c_str(), &buf1);
-  auto rv2 = ::stat(p2.c_str(), &buf2);
-
-  if (rv1 || rv2) {
-    ec = std::error_code(errno, std::generic_category());
+  const auto id1 = impl::file_identity(p1, ec);
+  if (ec) {
+    return false;
+  }
+  const auto id2 = impl::file_identity(p2, ec);
+  if (ec) {
     return false;
   }
 
-  ec.clear();
-  return buf1.st_dev == buf2.st_dev && buf1.st_ino == buf2.st_ino;
+  return id1 == id2;
 }
 
 
@@ -287,6 +286,21 @@ file_size(const path& p, std::error_code& ec) NOEXCEPT
 }
 
 
+file_id
+file_identity(const path& p, std::error_code& ec) NOEXCEPT
+{
+  struct stat buf;
+  if (::stat(p.c_str(), &buf) == 0) {
+    ec.clear();
+    return file_id(static_cast<std::uintmax_t>(buf.st_dev),
+                   static_cast<std::uintmax_t>(buf.st_ino));
+  }
+
+  ec = std::error_code(errno, std::generic_category());
+  return {};
+}
+
+
 std::uintmax_t
 hard_link_count(const path& p, std::error_code& ec) NOEXCEPT
 {
@@ -422,35 +436,31 @@ permissions(const path& p, perms prms, std::error_code& ec) NOEXCEPT
 std::uintmax_t
 remove_all(const path& p, std::error_code& ec) NOEXCEPT
 {
-  using std::end;
-
   std::uintmax_t count = 0;
   auto iter = directory_iterator(p, ec);
   if (ec) {
     return count;
   }
 
-  for (; !ec && iter != end(iter); iter.increment(ec)) {
-    auto& e = *iter;
-
+  const auto is_done = for_each_entry(iter, ec, [&](const directory_entry& e) {
     auto ty = impl::symlink_status(e.path(), ec);
     if (ec) {
-      return count;
+      return false;
     }
 
     if (is_directory(ty)) {
       count += impl::remove_all(e.path(), ec);
-      if (ec) {
-        return count;
-      }
     }
     else {
       impl::remove(e.path(), ec);
-      if (ec) {
-        return count;
+      if (!ec) {
+        ++count;
       }
-      ++count;
     }
+    return !ec;
+  });
+  if (!is_done) {
+    return count;
   }
 
   impl::remove(p, ec);
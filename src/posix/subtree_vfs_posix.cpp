@@ -0,0 +1,1243 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "dir_iterator_private.hpp"
+#include "vfs_private.hpp"
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/platform.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/estd/memory.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(FSPP_IS_UNIX)
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <ios>
+#include <iostream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+#if defined(FSPP_IS_UNIX) && defined(SYS_openat2)
+#define FSPP_HAVE_OPENAT2 1
+
+// struct open_how and RESOLVE_BENEATH from <linux/openat2.h>, which older kernel
+// headers don't have.
+struct OpenHow
+{
+  std::uint64_t flags;
+  std::uint64_t mode;
+  std::uint64_t resolve;
+};
+
+const std::uint64_t k_resolve_beneath = 0x08;
+
+long
+sys_openat2(int dir_fd, const char* name, OpenHow& how)
+{
+  long fd;
+  do {
+    fd = ::syscall(SYS_openat2, dir_fd, name, &how, sizeof(how));
+  } while (fd < 0 && errno == EINTR);
+  return fd;
+}
+
+
+/*! Returns true if the kernel knows openat2().  Probed once with a harmless call, since
+ *  failures of real opens say nothing about the syscall itself. */
+bool
+has_openat2()
+{
+  static const bool s_has_openat2 = []() {
+    OpenHow how;
+    how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    how.mode = 0;
+    how.resolve = k_resolve_beneath;
+
+    const auto fd = sys_openat2(AT_FDCWD, ".", how);
+    if (fd >= 0) {
+      ::close(static_cast<int>(fd));
+      return true;
+    }
+    // seccomp filters of some container runtimes fail unknown syscalls with EPERM
+    return errno != ENOSYS && errno != EPERM;
+  }();
+  return s_has_openat2;
+}
+#endif
+
+#if defined(O_PATH)
+// opens a file only to refer to it, without needing read permission
+const int k_path_flags = O_PATH;
+#else
+const int k_path_flags = O_RDONLY;
+#endif
+
+
+std::error_code
+last_error()
+{
+  return std::error_code(errno, std::generic_category());
+}
+
+
+perms
+map_posix_permissions(mode_t mode)
+{
+  return static_cast<perms>(mode & 07777);
+}
+
+
+file_type
+map_buf_mode(mode_t mode)
+{
+  if (S_ISREG(mode)) {
+    return file_type::regular;
+  }
+  else if (S_ISDIR(mode)) {
+    return file_type::directory;
+  }
+  else if (S_ISLNK(mode)) {
+    return file_type::symlink;
+  }
+  else if (S_ISCHR(mode)) {
+    return file_type::character;
+  }
+  else if (S_ISBLK(mode)) {
+    return file_type::block;
+  }
+  else if (S_ISFIFO(mode)) {
+    return file_type::fifo;
+  }
+  else if (S_ISSOCK(mode)) {
+    return file_type::socket;
+  }
+
+  return file_type::unknown;
+}
+
+
+/*! Owns a file descriptor and closes it when destroyed. */
+class Descriptor
+{
+public:
+  explicit Descriptor(int fd = -1)
+    : _fd(fd)
+  {
+  }
+
+  Descriptor(Descriptor&& other)
+    : _fd(other.release())
+  {
+  }
+
+  Descriptor& operator=(Descriptor&& other)
+  {
+    if (this != &other) {
+      reset(other.release());
+    }
+    return *this;
+  }
+
+  Descriptor(const Descriptor&) = delete;
+  Descriptor& operator=(const Descriptor&) = delete;
+
+  ~Descriptor()
+  {
+    reset();
+  }
+
+  int get() const
+  {
+    return _fd;
+  }
+
+  bool is_valid() const
+  {
+    return _fd >= 0;
+  }
+
+  int release()
+  {
+    const auto fd = _fd;
+    _fd = -1;
+    return fd;
+  }
+
+  void reset(int fd = -1)
+  {
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+    _fd = fd;
+  }
+
+private:
+  int _fd;
+};
+
+
+bool
+copy_descriptor(int from_fd, int to_fd, std::error_code& ec)
+{
+  auto buf = std::array<char, 16384>();
+  for (;;) {
+    const auto bytes_read = ::read(from_fd, buf.data(), buf.size());
+    if (bytes_read == 0) {
+      break;
+    }
+    else if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ec = last_error();
+      return false;
+    }
+
+    auto ofs = ssize_t(0);
+    while (ofs < bytes_read) {
+      const auto bytes_written =
+        ::write(to_fd, buf.data() + ofs, std::size_t(bytes_read - ofs));
+      if (bytes_written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ec = last_error();
+        return false;
+      }
+      ofs += bytes_written;
+    }
+  }
+
+  ec.clear();
+  return true;
+}
+
+
+/*! A buffered stream buffer on a file descriptor, which it owns. */
+class DescriptorBuf : public std::streambuf
+{
+public:
+  DescriptorBuf()
+    : _buffer(65536)
+  {
+  }
+
+  bool is_open() const
+  {
+    return _fd.is_valid();
+  }
+
+  void open(Descriptor fd, bool can_read, bool can_write)
+  {
+    _fd = std::move(fd);
+    _can_read = can_read;
+    _can_write = can_write;
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+  }
+
+  void close(std::error_code& ec)
+  {
+    ec.clear();
+    if (sync() != 0) {
+      ec = _last_error;
+    }
+    if (::close(_fd.release()) != 0 && !ec) {
+      ec = last_error();
+    }
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+  }
+
+protected:
+  int_type underflow() override
+  {
+    if (!_can_read || flush_output() != 0) {
+      return traits_type::eof();
+    }
+
+    ssize_t bytes_read;
+    do {
+      bytes_read = ::read(_fd.get(), _buffer.data(), _buffer.size());
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read <= 0) {
+      if (bytes_read < 0) {
+        _last_error = last_error();
+      }
+      setg(nullptr, nullptr, nullptr);
+      return traits_type::eof();
+    }
+
+    setg(_buffer.data(), _buffer.data(), _buffer.data() + bytes_read);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  int_type overflow(int_type c) override
+  {
+    if (!_can_write || drop_input() != 0 || flush_output() != 0) {
+      return traits_type::eof();
+    }
+
+    setp(_buffer.data(), _buffer.data() + _buffer.size());
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override
+  {
+    return flush_output() == 0 && drop_input() == 0 ? 0 : -1;
+  }
+
+  pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode) override
+  {
+    if (sync() != 0) {
+      return pos_type(off_type(-1));
+    }
+
+    const auto whence = dir == std::ios::beg ? SEEK_SET
+                                             : dir == std::ios::cur ? SEEK_CUR : SEEK_END;
+    const auto pos = ::lseek(_fd.get(), off, whence);
+    if (pos < 0) {
+      _last_error = last_error();
+      return pos_type(off_type(-1));
+    }
+    return pos_type(off_type(pos));
+  }
+
+  pos_type seekpos(pos_type pos, std::ios::openmode which) override
+  {
+    return seekoff(off_type(pos), std::ios::beg, which);
+  }
+
+private:
+  // writes the put area to the file
+  int flush_output()
+  {
+    auto* p = pbase();
+    while (p < pptr()) {
+      const auto bytes_written = ::write(_fd.get(), p, std::size_t(pptr() - p));
+      if (bytes_written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        _last_error = last_error();
+        return -1;
+      }
+      p += bytes_written;
+    }
+    setp(nullptr, nullptr);
+    return 0;
+  }
+
+  // moves the file position back over the read ahead, but not yet consumed input
+  int drop_input()
+  {
+    if (gptr() < egptr()) {
+      if (::lseek(_fd.get(), gptr() - egptr(), SEEK_CUR) < 0) {
+        _last_error = last_error();
+        return -1;
+      }
+    }
+    setg(nullptr, nullptr, nullptr);
+    return 0;
+  }
+
+  Descriptor _fd;
+  std::vector<char> _buffer;
+  bool _can_read = false;
+  bool _can_write = false;
+  std::error_code _last_error;
+};
+
+
+/*! A filesystem showing the directory referred to by a descriptor; see
+ *  make_subtree_filesystem(). */
+class SubtreeFilesystem : public IFilesystem
+{
+public:
+  explicit SubtreeFilesystem(Descriptor dir_fd)
+    : _dir_fd(std::move(dir_fd))
+  {
+  }
+
+  /*! Opens @p key relative to the directory with @p flags.  Lookups can't leave the
+   *  directory where the kernel supports RESOLVE_BENEATH; elsewhere only ".." is kept
+   *  in by resolving it lexically. */
+  Descriptor open_at(const std::string& key, int flags, mode_t mode, std::error_code& ec)
+  {
+    const auto rel = relative(key);
+    flags |= O_CLOEXEC;
+
+#if defined(FSPP_HAVE_OPENAT2)
+    if (has_openat2()) {
+      OpenHow how;
+      how.flags = static_cast<std::uint64_t>(flags);
+      how.mode = (flags & O_CREAT) != 0 ? mode : 0;
+      how.resolve = k_resolve_beneath;
+
+      const auto fd = sys_openat2(_dir_fd.get(), rel.c_str(), how);
+      if (fd < 0) {
+        // EXDEV: the path tried to escape the directory
+        ec = errno == EXDEV ? std::make_error_code(std::errc::operation_not_permitted)
+                            : last_error();
+        return Descriptor();
+      }
+      ec.clear();
+      return Descriptor(static_cast<int>(fd));
+    }
+#endif
+
+    int fd;
+    do {
+      fd = ::openat(_dir_fd.get(), rel.c_str(), flags, mode);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+      ec = last_error();
+      return Descriptor();
+    }
+    ec.clear();
+    return Descriptor(fd);
+  }
+
+  std::unique_ptr<detail::IFileImpl> make_file_impl() override;
+
+  std::unique_ptr<directory_iterator::IDirIterImpl> make_dir_iterator(
+    const path& p, std::error_code& ec) override
+  {
+    auto names = std::vector<std::string>();
+    if (!list(path_key(vfs::deroot(p)), names, ec)) {
+      return {};
+    }
+    return estd::make_unique<ListingDirIter>(p, std::move(names));
+  }
+
+  void dump(std::ostream& os) override
+  {
+    dump_dir(os, "/", 0);
+  }
+
+  path canonical(const path& p, const path& base, std::error_code& ec) override
+  {
+    (void)p;
+    (void)base;
+    ec = std::make_error_code(std::errc::function_not_supported);
+    return path();
+  }
+
+  bool copy_file(const path& from,
+                 const path& to,
+                 copy_options options,
+                 std::error_code& ec) override
+  {
+    struct stat from_buf;
+    if (!stat_at(path_key(from), true, from_buf, ec)) {
+      return false;
+    }
+    if (!S_ISREG(from_buf.st_mode)) {
+      ec = std::make_error_code(S_ISDIR(from_buf.st_mode) ? std::errc::is_a_directory
+                                                          : std::errc::invalid_argument);
+      return false;
+    }
+
+    const auto to_key = path_key(to);
+    struct stat to_buf;
+    if (!stat_at(to_key, true, to_buf, ec)) {
+      if (ec != std::errc::no_such_file_or_directory) {
+        return false;
+      }
+      return copy_content(path_key(from), to_key, from_buf.st_mode, true, ec);
+    }
+
+    if (from_buf.st_dev == to_buf.st_dev && from_buf.st_ino == to_buf.st_ino) {
+      ec = std::error_code(EINVAL, std::generic_category());
+      return false;
+    }
+    else if ((options & copy_options::skip_existing) != 0) {
+      ec.clear();
+      return false;
+    }
+    else if ((options & copy_options::overwrite_existing) != 0) {
+      return copy_content(path_key(from), to_key, from_buf.st_mode, false, ec);
+    }
+    else if ((options & copy_options::update_existing) != 0) {
+      if (from_buf.st_mtime > to_buf.st_mtime) {
+        return copy_content(path_key(from), to_key, from_buf.st_mode, false, ec);
+      }
+      ec.clear();
+      return false;
+    }
+
+    ec = std::error_code(EINVAL, std::generic_category());
+    return false;
+  }
+
+  void copy_symlink(const path& from, const path& to, std::error_code& ec) override
+  {
+    const auto target = read_symlink(from, ec);
+    if (!ec) {
+      create_symlink(target, to, ec);
+    }
+  }
+
+  bool create_directory(const path& p, std::error_code& ec) override
+  {
+    return make_directory(path_key(p), 0777, ec);
+  }
+
+  bool create_directory(const path& p,
+                        const path& existing_p,
+                        std::error_code& ec) override
+  {
+    struct stat buf;
+    if (!stat_at(path_key(existing_p), true, buf, ec)) {
+      return false;
+    }
+    return make_directory(path_key(p), buf.st_mode & 07777, ec);
+  }
+
+  bool create_directories(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    auto created = false;
+    ec.clear();
+
+    auto prefix = std::string();
+    std::size_t pos = 1;
+    while (pos <= key.size() && key != "/") {
+      const auto end = std::min(key.find('/', pos), key.size());
+      prefix = key.substr(0, end);
+      pos = end + 1;
+
+      created = make_directory(prefix, 0777, ec);
+      if (ec) {
+        return false;
+      }
+      if (!created) {
+        struct stat buf;
+        if (!stat_at(prefix, true, buf, ec)) {
+          return false;
+        }
+        if (!S_ISDIR(buf.st_mode)) {
+          ec = std::make_error_code(std::errc::not_a_directory);
+          return false;
+        }
+      }
+    }
+
+    return created;
+  }
+
+  void create_hard_link(const path& target,
+                        const path& link,
+                        std::error_code& ec) override
+  {
+    auto target_name = std::string();
+    const auto target_dir = open_parent(path_key(target), target_name, ec);
+    if (ec) {
+      return;
+    }
+    auto link_name = std::string();
+    const auto link_dir = open_parent(path_key(link), link_name, ec);
+    if (ec) {
+      return;
+    }
+
+    if (::linkat(target_dir.get(), target_name.c_str(), link_dir.get(), link_name.c_str(),
+                 0)) {
+      ec = last_error();
+    }
+  }
+
+  void create_symlink(const path& target,
+                      const path& link,
+                      std::error_code& ec) override
+  {
+    auto name = std::string();
+    const auto dir = open_parent(path_key(link), name, ec);
+    if (ec) {
+      return;
+    }
+
+    if (::symlinkat(target.c_str(), dir.get(), name.c_str())) {
+      ec = last_error();
+    }
+  }
+
+  void create_directory_symlink(const path& target,
+                                const path& link,
+                                std::error_code& ec) override
+  {
+    create_symlink(target, link, ec);
+  }
+
+  bool equivalent(const path& p1, const path& p2, std::error_code& ec) override
+  {
+    struct stat buf1;
+    struct stat buf2;
+    if (!stat_at(path_key(p1), true, buf1, ec)
+        || !stat_at(path_key(p2), true, buf2, ec)) {
+      return false;
+    }
+    return buf1.st_dev == buf2.st_dev && buf1.st_ino == buf2.st_ino;
+  }
+
+  file_size_type file_size(const path& p, std::error_code& ec) override
+  {
+    struct stat buf;
+    if (!stat_at(path_key(p), true, buf, ec)) {
+      return static_cast<file_size_type>(-1);
+    }
+    if (S_ISDIR(buf.st_mode)) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      return static_cast<file_size_type>(-1);
+    }
+    return static_cast<file_size_type>(buf.st_size);
+  }
+
+  file_id file_identity(const path& p, std::error_code& ec) override
+  {
+    struct stat buf;
+    if (!stat_at(path_key(p), true, buf, ec)) {
+      return {};
+    }
+    return file_id(static_cast<std::uintmax_t>(buf.st_dev), buf.st_ino);
+  }
+
+  std::uintmax_t hard_link_count(const path& p, std::error_code& ec) override
+  {
+    struct stat buf;
+    if (!stat_at(path_key(p), true, buf, ec)) {
+      return static_cast<std::uintmax_t>(-1);
+    }
+    return static_cast<std::uintmax_t>(buf.st_nlink);
+  }
+
+  file_time_type last_write_time(const path& p, std::error_code& ec) override
+  {
+    struct stat buf;
+    if (!stat_at(path_key(p), true, buf, ec)) {
+      return {};
+    }
+    return static_cast<file_time_type>(buf.st_mtime);
+  }
+
+  void last_write_time(const path& p,
+                       file_time_type new_time,
+                       std::error_code& ec) override
+  {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = static_cast<time_t>(new_time);
+    times[1].tv_nsec = 0;
+
+    const auto key = path_key(p);
+#if defined(O_PATH)
+    if (change_by_proc_path(key, ec, [&](const char* proc_path) {
+          return ::utimensat(AT_FDCWD, proc_path, times, 0);
+        })) {
+      return;
+    }
+#endif
+
+    const auto fd = open_at(key, O_RDONLY | O_NONBLOCK | O_NOCTTY, 0, ec);
+    if (fd.is_valid()) {
+      if (::futimens(fd.get(), times)) {
+        ec = last_error();
+      }
+      return;
+    }
+    else if (ec != std::errc::permission_denied) {
+      return;
+    }
+
+    // not readable; changing the time of a file needs ownership, not read permission
+    auto name = std::string();
+    const auto dir = open_parent_of_non_symlink(key, name, ec);
+    if (!ec && ::utimensat(dir.get(), name.c_str(), times, AT_SYMLINK_NOFOLLOW)) {
+      ec = last_error();
+    }
+  }
+
+  void permissions(const path& p, perms prms, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    const auto follow = (prms & perms::resolve_symlinks) != 0;
+
+    mode_t mode;
+    if ((prms & perms::add_perms) != 0 && (prms & perms::remove_perms) != 0) {
+      ec = std::error_code(EINVAL, std::generic_category());
+      return;
+    }
+    else if ((prms & (perms::add_perms | perms::remove_perms)) != 0) {
+      struct stat buf;
+      if (!stat_at(key, follow, buf, ec)) {
+        return;
+      }
+      mode = (prms & perms::add_perms) != 0
+               ? mode_t((buf.st_mode & 07777) | mode_t(prms & perms::mask))
+               : mode_t((buf.st_mode & 07777) & ~mode_t(prms & perms::mask));
+    }
+    else {
+      mode = mode_t(prms & perms::mask);
+    }
+
+    // open the file itself and use fchmod(), since fchmodat() would follow a symlink in
+    // the last component wherever it points to.
+#if defined(O_PATH)
+    if (change_by_proc_path(
+          key, ec, [&](const char* proc_path) { return ::chmod(proc_path, mode); })) {
+      return;
+    }
+#endif
+
+    const auto fd = open_at(key, O_RDONLY | O_NONBLOCK | O_NOCTTY, 0, ec);
+    if (fd.is_valid()) {
+      if (::fchmod(fd.get(), mode)) {
+        ec = last_error();
+      }
+      return;
+    }
+    else if (ec != std::errc::permission_denied) {
+      return;
+    }
+
+    auto name = std::string();
+    const auto dir = open_parent_of_non_symlink(key, name, ec);
+    if (!ec && ::fchmodat(dir.get(), name.c_str(), mode, AT_SYMLINK_NOFOLLOW)) {
+      ec = last_error();
+    }
+  }
+
+  path read_symlink(const path& p, std::error_code& ec) override
+  {
+    auto name = std::string();
+    const auto dir = open_parent(path_key(p), name, ec);
+    if (ec) {
+      return path();
+    }
+
+    auto buf = std::vector<char>(256);
+    for (;;) {
+      const auto len = ::readlinkat(dir.get(), name.c_str(), buf.data(), buf.size());
+      if (len < 0) {
+        ec = last_error();
+        return path();
+      }
+      else if (std::size_t(len) < buf.size()) {
+        return path(std::string(buf.data(), std::size_t(len)));
+      }
+      buf.resize(buf.size() * 2);
+    }
+  }
+
+  bool remove(const path& p, std::error_code& ec) override
+  {
+    return remove_key(path_key(p), ec);
+  }
+
+  std::uintmax_t remove_all(const path& p, std::error_code& ec) override
+  {
+    const auto key = path_key(p);
+    struct stat buf;
+    if (!stat_at(key, false, buf, ec)) {
+      if (ec == std::errc::no_such_file_or_directory) {
+        ec.clear();
+      }
+      return 0;
+    }
+    return remove_tree(key, buf, ec);
+  }
+
+  void rename(const path& old_p, const path& new_p, std::error_code& ec) override
+  {
+    auto old_name = std::string();
+    const auto old_dir = open_parent(path_key(old_p), old_name, ec);
+    if (ec) {
+      return;
+    }
+    auto new_name = std::string();
+    const auto new_dir = open_parent(path_key(new_p), new_name, ec);
+    if (ec) {
+      return;
+    }
+
+    if (::renameat(old_dir.get(), old_name.c_str(), new_dir.get(), new_name.c_str())) {
+      ec = last_error();
+    }
+  }
+
+  void resize_file(const path& p,
+                   file_size_type new_size,
+                   std::error_code& ec) override
+  {
+    const auto fd = open_at(path_key(p), O_WRONLY, 0, ec);
+    if (fd.is_valid() && ::ftruncate(fd.get(), static_cast<off_t>(new_size))) {
+      ec = last_error();
+    }
+  }
+
+  space_info space(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    (void)p;
+
+    space_info result;
+    struct statvfs buf;
+    if (::fstatvfs(_dir_fd.get(), &buf)) {
+      ec = last_error();
+
+      result.capacity = static_cast<std::uintmax_t>(-1);
+      result.free = static_cast<std::uintmax_t>(-1);
+      result.available = static_cast<std::uintmax_t>(-1);
+      return result;
+    }
+
+    ec.clear();
+    result.capacity = static_cast<std::uintmax_t>(buf.f_blocks) * buf.f_frsize;
+    result.free = static_cast<std::uintmax_t>(buf.f_bfree) * buf.f_frsize;
+    result.available = static_cast<std::uintmax_t>(buf.f_bavail) * buf.f_frsize;
+    return result;
+  }
+
+  file_status status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return status_of(p, true, ec);
+  }
+
+  file_status symlink_status(const path& p, std::error_code& ec) NOEXCEPT override
+  {
+    return status_of(p, false, ec);
+  }
+
+private:
+  static std::string relative(const std::string& key)
+  {
+    return key == "/" ? std::string(".") : key.substr(1);
+  }
+
+  file_status status_of(const path& p, bool follow, std::error_code& ec) NOEXCEPT
+  {
+    try {
+      struct stat buf;
+      if (stat_at(path_key(p), follow, buf, ec)) {
+        return file_status(map_buf_mode(buf.st_mode), map_posix_permissions(buf.st_mode));
+      }
+      else if (ec == std::errc::no_such_file_or_directory) {
+        ec.clear();
+        return file_status(file_type::not_found);
+      }
+    }
+    catch (const std::bad_alloc&) {
+      ec = std::make_error_code(std::errc::not_enough_memory);
+    }
+    return file_status(file_type::none);
+  }
+
+  bool stat_at(const std::string& key, bool follow, struct stat& buf, std::error_code& ec)
+  {
+#if defined(O_PATH)
+    // O_PATH|O_NOFOLLOW opens a symlink itself
+    const auto fd = open_at(key, O_PATH | (follow ? 0 : O_NOFOLLOW), 0, ec);
+    if (!fd.is_valid()) {
+      return false;
+    }
+    if (::fstat(fd.get(), &buf)) {
+      ec = last_error();
+      return false;
+    }
+    return true;
+#else
+    auto name = std::string();
+    const auto dir = open_parent(key, name, ec);
+    if (ec) {
+      return false;
+    }
+    if (::fstatat(dir.get(), name.c_str(), &buf, follow ? 0 : AT_SYMLINK_NOFOLLOW)) {
+      ec = last_error();
+      return false;
+    }
+    return true;
+#endif
+  }
+
+  // Opens the directory containing @p key and returns the last component in @p name.
+  // The root is "." in itself.
+  Descriptor open_parent(const std::string& key, std::string& name, std::error_code& ec)
+  {
+    if (key == "/") {
+      name = ".";
+      return open_at(key, k_path_flags | O_DIRECTORY, 0, ec);
+    }
+
+    name = key.substr(key.rfind('/') + 1);
+    return open_at(parent_key(key), k_path_flags | O_DIRECTORY, 0, ec);
+  }
+
+  // Like open_parent(), but keeps the permission_denied error in @p ec if @p key is a
+  // symlink, which would lead out of the directory when followed from its parent.
+  Descriptor open_parent_of_non_symlink(const std::string& key,
+                                        std::string& name,
+                                        std::error_code& ec)
+  {
+    const auto denied = ec;
+    auto dir = open_parent(key, name, ec);
+    if (ec) {
+      return dir;
+    }
+    struct stat buf;
+    if (::fstatat(dir.get(), name.c_str(), &buf, AT_SYMLINK_NOFOLLOW)) {
+      ec = last_error();
+      return Descriptor();
+    }
+    if (S_ISLNK(buf.st_mode)) {
+      ec = denied;
+      return Descriptor();
+    }
+    return dir;
+  }
+
+#if defined(O_PATH)
+  // Opens @p key with O_PATH, which neither needs read permission nor opens devices or
+  // FIFOs, and calls @p change with the /proc entry of the descriptor naming the file
+  // it refers to.  Returns false without /proc.
+  template <typename Functor>
+  bool change_by_proc_path(const std::string& key, std::error_code& ec, Functor change)
+  {
+    const auto fd = open_at(key, O_PATH, 0, ec);
+    if (!fd.is_valid()) {
+      return true;
+    }
+
+    const auto proc_path = "/proc/self/fd/" + std::to_string(fd.get());
+    if (change(proc_path.c_str()) != 0) {
+      if (errno == ENOENT) {
+        return false;
+      }
+      ec = last_error();
+    }
+    return true;
+  }
+#endif
+
+  bool make_directory(const std::string& key, mode_t mode, std::error_code& ec)
+  {
+    auto name = std::string();
+    const auto dir = open_parent(key, name, ec);
+    if (ec) {
+      return false;
+    }
+
+    if (::mkdirat(dir.get(), name.c_str(), mode)) {
+      if (errno == EEXIST) {
+        ec.clear();
+        return false;
+      }
+      ec = last_error();
+      return false;
+    }
+    return true;
+  }
+
+  bool copy_content(const std::string& from_key,
+                    const std::string& to_key,
+                    mode_t mode,
+                    bool is_exclusive,
+                    std::error_code& ec)
+  {
+    const auto from_fd = open_at(from_key, O_RDONLY, 0, ec);
+    if (!from_fd.is_valid()) {
+      return false;
+    }
+    const auto flags = O_WRONLY | O_CREAT | O_TRUNC | (is_exclusive ? O_EXCL : 0);
+    auto to_fd = open_at(to_key, flags, mode & 07777, ec);
+    if (!to_fd.is_valid()) {
+      return false;
+    }
+
+    if (!copy_descriptor(from_fd.get(), to_fd.get(), ec)) {
+      return false;
+    }
+    if (::close(to_fd.release())) {
+      ec = last_error();
+      return false;
+    }
+    return true;
+  }
+
+  bool list(const std::string& key, std::vector<std::string>& names, std::error_code& ec)
+  {
+    auto fd = open_at(key, O_RDONLY | O_DIRECTORY, 0, ec);
+    if (!fd.is_valid()) {
+      return false;
+    }
+
+    // the DIR takes over the descriptor
+    auto* dir = ::fdopendir(fd.get());
+    if (!dir) {
+      ec = last_error();
+      return false;
+    }
+    fd.release();
+
+    errno = 0;
+    while (const auto* entry = ::readdir(dir)) {
+      if (::strcmp(entry->d_name, ".") != 0 && ::strcmp(entry->d_name, "..") != 0) {
+        names.emplace_back(entry->d_name);
+      }
+      errno = 0;
+    }
+    if (errno != 0) {
+      ec = last_error();
+    }
+    ::closedir(dir);
+    return !ec;
+  }
+
+  bool remove_key(const std::string& key, std::error_code& ec)
+  {
+    struct stat buf;
+    if (!stat_at(key, false, buf, ec)) {
+      return false;
+    }
+
+    auto name = std::string();
+    const auto dir = open_parent(key, name, ec);
+    if (ec) {
+      return false;
+    }
+    if (::unlinkat(dir.get(), name.c_str(), S_ISDIR(buf.st_mode) ? AT_REMOVEDIR : 0)) {
+      ec = last_error();
+      return false;
+    }
+    return true;
+  }
+
+  std::uintmax_t remove_tree(const std::string& key,
+                             const struct stat& buf,
+                             std::error_code& ec)
+  {
+    std::uintmax_t count = 0;
+    if (S_ISDIR(buf.st_mode)) {
+      auto names = std::vector<std::string>();
+      if (!list(key, names, ec)) {
+        return count;
+      }
+      for (const auto& name : names) {
+        const auto child = child_key(key, name);
+        struct stat child_buf;
+        if (!stat_at(child, false, child_buf, ec)) {
+          return count;
+        }
+        count += remove_tree(child, child_buf, ec);
+        if (ec) {
+          return count;
+        }
+      }
+    }
+
+    if (remove_key(key, ec)) {
+      ++count;
+    }
+    return count;
+  }
+
+  void dump_dir(std::ostream& os, const std::string& key, int depth)
+  {
+    std::error_code ec;
+    auto names = std::vector<std::string>();
+    if (!list(key, names, ec)) {
+      return;
+    }
+
+    for (const auto& name : names) {
+      const auto child = child_key(key, name);
+      struct stat buf;
+      if (!stat_at(child, false, buf, ec)) {
+        continue;
+      }
+
+      os << std::string(std::size_t(depth) * 2, ' ') << name;
+      if (S_ISDIR(buf.st_mode)) {
+        os << "/" << std::endl;
+        dump_dir(os, child, depth + 1);
+      }
+      else {
+        os << " (" << buf.st_size << " bytes)" << std::endl;
+      }
+    }
+  }
+
+  // the directory shown; never changes
+  Descriptor _dir_fd;
+};
+
+
+int
+map_open_mode(std::ios::openmode mode)
+{
+  const auto m = mode & ~(std::ios::binary | std::ios::ate);
+  if (m == std::ios::in) {
+    return O_RDONLY;
+  }
+  else if (m == std::ios::out || m == (std::ios::out | std::ios::trunc)) {
+    return O_WRONLY | O_CREAT | O_TRUNC;
+  }
+  else if (m == std::ios::app || m == (std::ios::out | std::ios::app)) {
+    return O_WRONLY | O_CREAT | O_APPEND;
+  }
+  else if (m == (std::ios::in | std::ios::out)) {
+    return O_RDWR;
+  }
+  else if (m == (std::ios::in | std::ios::out | std::ios::trunc)) {
+    return O_RDWR | O_CREAT | O_TRUNC;
+  }
+  else if (m == (std::ios::in | std::ios::app)
+           || m == (std::ios::in | std::ios::out | std::ios::app)) {
+    return O_RDWR | O_CREAT | O_APPEND;
+  }
+  return -1;
+}
+
+
+class SubtreeFileImpl : public detail::IFileImpl
+{
+public:
+  explicit SubtreeFileImpl(SubtreeFilesystem* fs)
+    : _fs(fs)
+    , _stream(&_buf)
+  {
+  }
+
+  ~SubtreeFileImpl() override
+  {
+    if (is_open()) {
+      std::error_code ec;
+      close(ec);
+    }
+  }
+
+  std::iostream& open(const path& p,
+                      std::ios::openmode mode,
+                      std::error_code& ec) override
+  {
+    assert(!is_open());
+
+    const auto flags = map_open_mode(mode);
+    if (flags < 0) {
+      ec = std::make_error_code(std::errc::invalid_argument);
+      _stream.setstate(std::ios::failbit);
+      return _stream;
+    }
+
+    auto fd = _fs->open_at(path_key(vfs::deroot(p)), flags, 0666, ec);
+    if (!fd.is_valid()) {
+      _stream.setstate(std::ios::failbit);
+      return _stream;
+    }
+
+    struct stat buf;
+    if (::fstat(fd.get(), &buf) == 0 && S_ISDIR(buf.st_mode)) {
+      ec = std::make_error_code(std::errc::is_a_directory);
+      _stream.setstate(std::ios::failbit);
+      return _stream;
+    }
+
+    const auto access = flags & O_ACCMODE;
+    _buf.open(std::move(fd), access != O_WRONLY, access != O_RDONLY);
+    _stream.clear();
+    if ((mode & std::ios::ate) != 0) {
+      _stream.seekg(0, std::ios::end);
+    }
+    return _stream;
+  }
+
+  std::iostream& stream() override
+  {
+    return _stream;
+  }
+
+  bool is_open() const override
+  {
+    return _buf.is_open();
+  }
+
+  void close(std::error_code& ec) override
+  {
+    if (!is_open()) {
+      ec = std::make_error_code(std::errc::bad_file_descriptor);
+      return;
+    }
+    _buf.close(ec);
+  }
+
+private:
+  SubtreeFilesystem* _fs;
+  DescriptorBuf _buf;
+  std::iostream _stream;
+};
+
+
+std::unique_ptr<detail::IFileImpl>
+SubtreeFilesystem::make_file_impl()
+{
+  return estd::make_unique<SubtreeFileImpl>(this);
+}
+
+}  // namespace
+
+
+std::unique_ptr<IFilesystem>
+make_subtree_filesystem(const path& dir, std::error_code& ec)
+{
+  const auto fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    ec = last_error();
+    return nullptr;
+  }
+
+  ec.clear();
+  return estd::make_unique<SubtreeFilesystem>(Descriptor(fd));
+}
+
+
+std::unique_ptr<IFilesystem>
+make_subtree_filesystem(const path& dir)
+{
+  std::error_code ec;
+  auto fs = make_subtree_filesystem(dir, ec);
+  if (ec) {
+    throw filesystem_error("can't create subtree filesystem", dir, ec);
+  }
+  return fs;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,160 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "sha256.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+
+namespace eyestep {
+namespace filesystem {
+
+namespace {
+
+const std::uint32_t k_round_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+  0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+  0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+  0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+  0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+  0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+  0xc67178f2,
+};
+
+
+std::uint32_t
+rotr(std::uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+}  // namespace
+
+
+Sha256::Sha256()
+  : _state{{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+            0x1f83d9ab, 0x5be0cd19}}
+{
+}
+
+
+void
+Sha256::update(const char* data, std::size_t size)
+{
+  const auto* bytes = reinterpret_cast<const std::uint8_t*>(data);
+  _total_size += size;
+
+  while (size > 0) {
+    const auto n = std::min(size, _block.size() - _block_size);
+    std::memcpy(_block.data() + _block_size, bytes, n);
+    _block_size += n;
+    bytes += n;
+    size -= n;
+
+    if (_block_size == _block.size()) {
+      transform(_block.data());
+      _block_size = 0;
+    }
+  }
+}
+
+
+std::string
+Sha256::hex_digest()
+{
+  const auto bit_size = _total_size * 8;
+
+  // pad with a 1 bit, zeros up to 56 bytes mod 64 and the size in bits
+  const auto pad = std::uint8_t(0x80);
+  update(reinterpret_cast<const char*>(&pad), 1);
+  const auto zero = std::uint8_t(0);
+  while (_block_size != 56) {
+    update(reinterpret_cast<const char*>(&zero), 1);
+  }
+  std::uint8_t size_bytes[8];
+  for (auto i = 0; i < 8; ++i) {
+    size_bytes[i] = std::uint8_t(bit_size >> (56 - 8 * i));
+  }
+  update(reinterpret_cast<const char*>(size_bytes), 8);
+
+  static const char* k_hex_digits = "0123456789abcdef";
+  auto result = std::string();
+  result.reserve(64);
+  for (const auto word : _state) {
+    for (auto shift = 28; shift >= 0; shift -= 4) {
+      result.push_back(k_hex_digits[(word >> shift) & 0xf]);
+    }
+  }
+  return result;
+}
+
+
+void
+Sha256::transform(const std::uint8_t* block)
+{
+  std::uint32_t w[64];
+  for (auto i = 0; i < 16; ++i) {
+    w[i] = std::uint32_t(block[4 * i]) << 24 | std::uint32_t(block[4 * i + 1]) << 16
+           | std::uint32_t(block[4 * i + 2]) << 8 | std::uint32_t(block[4 * i + 3]);
+  }
+  for (auto i = 16; i < 64; ++i) {
+    const auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    const auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  auto a = _state[0];
+  auto b = _state[1];
+  auto c = _state[2];
+  auto d = _state[3];
+  auto e = _state[4];
+  auto f = _state[5];
+  auto g = _state[6];
+  auto h = _state[7];
+
+  for (auto i = 0; i < 64; ++i) {
+    const auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    const auto ch = (e & f) ^ (~e & g);
+    const auto t1 = h + s1 + ch + k_round_constants[i] + w[i];
+    const auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    const auto maj = (a & b) ^ (a & c) ^ (b & c);
+    const auto t2 = s0 + maj;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  _state[0] += a;
+  _state[1] += b;
+  _state[2] += c;
+  _state[3] += d;
+  _state[4] += e;
+  _state[5] += f;
+  _state[6] += g;
+  _state[7] += h;
+}
+
+
+std::string
+sha256_hex(const std::string& data)
+{
+  auto sha = Sha256();
+  sha.update(data.data(), data.size());
+  return sha.hex_digest();
+}
+
+}  // namespace filesystem
+}  // namespace eyestep
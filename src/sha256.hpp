@@ -0,0 +1,40 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+namespace eyestep {
+namespace filesystem {
+
+/*! Computes the SHA-256 digest of the data passed to update(). */
+class Sha256
+{
+public:
+  Sha256();
+
+  void update(const char* data, std::size_t size);
+  /*! Returns the digest as 64 lower case hex digits.  The object can't be updated
+   *  afterwards. */
+  std::string hex_digest();
+
+private:
+  void transform(const std::uint8_t* block);
+
+  std::array<std::uint32_t, 8> _state;
+  std::array<std::uint8_t, 64> _block;
+  std::size_t _block_size = 0;
+  std::uint64_t _total_size = 0;
+};
+
+
+/*! Returns the SHA-256 digest of @p data as hex digits. */
+std::string
+sha256_hex(const std::string& data);
+
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,251 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+const auto k_mtime = std::uint64_t(1500000000);
+
+
+void
+put_octal(std::string& block, std::size_t pos, std::size_t len, std::uint64_t value)
+{
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%0*llo", static_cast<int>(len - 1),
+                static_cast<unsigned long long>(value));
+  block.replace(pos, len - 1, buf);
+}
+
+
+std::string
+tar_member(const std::string& name,
+           char type,
+           const std::string& data,
+           const std::string& link_name = std::string())
+{
+  auto block = std::string(512, '\0');
+  block.replace(0, std::min<std::size_t>(name.size(), 100), name, 0, 100);
+  put_octal(block, 100, 8, 0644);
+  put_octal(block, 124, 12, data.size());
+  put_octal(block, 136, 12, k_mtime);
+  block[156] = type;
+  block.replace(157, link_name.size(), link_name);
+  block.replace(257, 8, std::string("ustar\0" "00", 8));
+
+  block.replace(148, 8, std::string(8, ' '));
+  auto sum = 0u;
+  for (auto c : block) {
+    sum += static_cast<unsigned char>(c);
+  }
+  put_octal(block, 148, 7, sum);
+
+  return block + data + std::string((512 - data.size() % 512) % 512, '\0');
+}
+
+
+void
+put_le(std::string& s, std::uint64_t value, std::size_t bytes)
+{
+  for (auto i = std::size_t(0); i < bytes; ++i) {
+    s += static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+
+// Creates a zip archive of @p members (name, data) stored with @p method.
+std::string
+zip_archive(const std::vector<std::pair<std::string, std::string>>& members,
+            std::uint64_t method = 0)
+{
+  auto archive = std::string();
+  auto directory = std::string();
+
+  for (const auto& member : members) {
+    // 2017-07-14 02:40:00
+    const auto time = (2u << 11) | (40u << 5);
+    const auto date = (37u << 9) | (7u << 5) | 14u;
+
+    auto common = std::string();
+    put_le(common, 10, 2);  // version needed
+    put_le(common, 0, 2);   // flags
+    put_le(common, method, 2);
+    put_le(common, time, 2);
+    put_le(common, date, 2);
+    put_le(common, 0, 4);  // crc, not checked
+    put_le(common, member.second.size(), 4);
+    put_le(common, member.second.size(), 4);
+    put_le(common, member.first.size(), 2);
+    put_le(common, 0, 2);  // extra length
+
+    const auto offset = archive.size();
+    put_le(archive, 0x04034b50, 4);
+    archive += common + member.first + member.second;
+
+    put_le(directory, 0x02014b50, 4);
+    put_le(directory, 20, 2);  // version made by
+    directory += common;
+    put_le(directory, 0, 2);  // comment length
+    put_le(directory, 0, 2);  // disk
+    put_le(directory, 0, 2);  // internal attributes
+    put_le(directory, 0, 4);  // external attributes
+    put_le(directory, offset, 4);
+    directory += member.first;
+  }
+
+  const auto directory_offset = archive.size();
+  archive += directory;
+  put_le(archive, 0x06054b50, 4);
+  put_le(archive, 0, 2);
+  put_le(archive, 0, 2);
+  put_le(archive, members.size(), 2);
+  put_le(archive, members.size(), 2);
+  put_le(archive, directory.size(), 4);
+  put_le(archive, directory_offset, 4);
+  put_le(archive, 0, 2);
+
+  return archive;
+}
+
+
+std::set<std::string>
+entries_of(const path& p)
+{
+  auto result = std::set<std::string>();
+  for (const auto& e : directory_iterator(p)) {
+    result.insert(e.path().filename().string());
+  }
+  return result;
+}
+
+}  // namespace
+
+
+TEST_CASE("archive vfs - tar", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    const auto large = make_random_string(100000);
+    const auto long_name = "d/" + std::string(120, 'n');
+
+    write_file(tmp / "a.tar",
+               tar_member("d/", '5', "") + tar_member("d/a.txt", '0', "hello")
+                 + tar_member("./d/e/large.bin", '0', large)
+                 + tar_member("././@LongLink", 'L', long_name + '\0')
+                 + tar_member("truncated", '0', "long")
+                 + tar_member("d/link", '1', "", "d/a.txt")
+                 + tar_member("d/sym", '2', "", "a.txt") + tar_member("empty", '0', "")
+                 + std::string(1024, '\0'));
+
+    const auto root = u8path("//<tar>/");
+    vfs::register_vfs("//<tar>", vfs::make_archive_filesystem(tmp / "a.tar"));
+    auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<tar>"); });
+
+    REQUIRE(entries_of(root) == (std::set<std::string>{"d", "empty"}));
+    REQUIRE(entries_of(root / "d")
+            == (std::set<std::string>{"a.txt", "e", "link", std::string(120, 'n')}));
+
+    REQUIRE(is_directory(root / "d/e"));
+    REQUIRE(read_file(root / "d/a.txt") == "hello");
+    REQUIRE(file_size(root / "d/e/large.bin") == large.size());
+    REQUIRE(read_file(root / "d/e/large.bin") == large);
+    REQUIRE(read_file(root / long_name) == "long");
+    REQUIRE(file_size(root / "empty") == 0);
+    REQUIRE(equivalent(root / "d/link", root / "d/a.txt"));
+    REQUIRE(last_write_time(root / "d/a.txt") == static_cast<file_time_type>(k_mtime));
+
+    std::error_code ec;
+    remove(root / "d/a.txt", ec);
+    REQUIRE(ec == std::errc::read_only_file_system);
+  });
+}
+
+
+TEST_CASE("archive vfs - zip", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    const auto large = make_random_string(100000);
+    write_file(tmp / "a.zip", zip_archive({{"d/", ""},
+                                           {"d/a.txt", "hello"},
+                                           {"d/e/large.bin", large},
+                                           {"empty", ""}}));
+
+    const auto root = u8path("//<zip>/");
+    vfs::register_vfs("//<zip>", vfs::make_archive_filesystem(tmp / "a.zip"));
+    auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<zip>"); });
+
+    REQUIRE(entries_of(root) == (std::set<std::string>{"d", "empty"}));
+    REQUIRE(read_file(root / "d/a.txt") == "hello");
+    REQUIRE(read_file(root / "d/e/large.bin") == large);
+    REQUIRE(file_size(root / "empty") == 0);
+    REQUIRE(last_write_time(root / "d/a.txt") == static_cast<file_time_type>(k_mtime));
+  });
+}
+
+
+TEST_CASE("archive vfs - invalid archives", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    std::error_code ec;
+
+    write_file(tmp / "compressed.zip", zip_archive({{"a.txt", "hello"}}, 8));
+    REQUIRE(vfs::make_archive_filesystem(tmp / "compressed.zip", ec) == nullptr);
+    REQUIRE(ec == std::errc::not_supported);
+
+    auto tar = tar_member("a.txt", '0', "hello");
+    tar[0] = 'b';
+    write_file(tmp / "bad-checksum.tar", tar);
+    REQUIRE(vfs::make_archive_filesystem(tmp / "bad-checksum.tar", ec) == nullptr);
+    REQUIRE(ec == std::errc::bad_message);
+
+    write_file(tmp / "escaping.tar", tar_member("../a.txt", '0', "hello"));
+    REQUIRE(vfs::make_archive_filesystem(tmp / "escaping.tar", ec) == nullptr);
+    REQUIRE(ec == std::errc::bad_message);
+
+    // a zip64 locator pointing to an end record which runs past the end of the file;
+    // its signature is the directory size of the end record.
+    auto truncated = std::string();
+    put_le(truncated, 0x07064b50, 4);
+    put_le(truncated, 0, 4);
+    put_le(truncated, 32, 8);
+    put_le(truncated, 1, 4);
+    put_le(truncated, 0x06054b50, 4);
+    put_le(truncated, 0, 4);
+    put_le(truncated, 0, 2);
+    put_le(truncated, 0xffff, 2);
+    put_le(truncated, 0x06064b50, 4);
+    put_le(truncated, 0, 4);
+    put_le(truncated, 0, 2);
+    write_file(tmp / "truncated64.zip", truncated);
+    REQUIRE(vfs::make_archive_filesystem(tmp / "truncated64.zip", ec) == nullptr);
+    REQUIRE(ec == std::errc::bad_message);
+
+    REQUIRE_THROWS_AS(vfs::make_archive_filesystem(tmp / "missing.tar"),
+                      const filesystem_error&);
+  });
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
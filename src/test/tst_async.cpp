@@ -0,0 +1,234 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/async.hpp"
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/filesystem_error.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+class CountingExecutor : public IExecutor
+{
+public:
+  void post(std::function<void()> work) override
+  {
+    ++_posted;
+    _pool->post(std::move(work));
+  }
+
+  int posted() const { return _posted; }
+
+private:
+  std::shared_ptr<IExecutor> _pool = make_thread_pool_executor(2);
+  std::atomic<int> _posted{0};
+};
+
+
+void
+check_operations(AsyncFilesystem& afs, const path& tmp)
+{
+  write_file(tmp / "a.txt", "hello");
+
+  REQUIRE(afs.status(tmp / "a.txt").get().type() == file_type::regular);
+  REQUIRE(afs.status(tmp).get().type() == file_type::directory);
+  REQUIRE(afs.status(tmp / "missing").get().type() == file_type::not_found);
+  REQUIRE(afs.symlink_status(tmp / "a.txt").get().type() == file_type::regular);
+  REQUIRE(afs.status(tmp / "a.txt").get().permissions()
+          == status(tmp / "a.txt").permissions());
+  REQUIRE(afs.file_size(tmp / "a.txt").get() == 5);
+  REQUIRE(afs.last_write_time(tmp / "a.txt").get() == last_write_time(tmp / "a.txt"));
+
+  REQUIRE(afs.create_directory(tmp / "d").get());
+  REQUIRE(!afs.create_directory(tmp / "d").get());
+  REQUIRE(afs.create_directories(tmp / "d/e/f").get());
+  REQUIRE(is_directory(tmp / "d/e/f"));
+
+  REQUIRE(afs.copy_file(tmp / "a.txt", tmp / "d/b.txt").get());
+  REQUIRE(read_file(tmp / "d/b.txt") == "hello");
+  afs.rename(tmp / "d/b.txt", tmp / "d/c.txt").get();
+  REQUIRE(read_file(tmp / "d/c.txt") == "hello");
+
+  REQUIRE(afs.remove(tmp / "d/e/f").get());
+  REQUIRE(!exists(tmp / "d/e/f"));
+  REQUIRE(afs.remove(tmp / "a.txt").get());
+  REQUIRE(!exists(tmp / "a.txt"));
+  REQUIRE_THROWS_AS(afs.remove(tmp / "a.txt").get(), const filesystem_error&);
+  REQUIRE_THROWS_AS(afs.file_size(tmp / "a.txt").get(), const filesystem_error&);
+  REQUIRE_THROWS_AS(afs.rename(tmp / "a.txt", tmp / "b.txt").get(),
+                    const filesystem_error&);
+
+  REQUIRE(afs.remove_all(tmp / "d").get() == 3);
+  REQUIRE(!exists(tmp / "d"));
+}
+
+}  // namespace
+
+
+TEST_CASE("async - native operations", "[async]")
+{
+  with_temp_dir([](const path& tmp) {
+    SECTION("io_uring where available")
+    {
+      AsyncFilesystem afs;
+      check_operations(afs, tmp);
+    }
+
+    SECTION("executor only")
+    {
+      auto options = AsyncOptions();
+      options.use_io_uring = false;
+      AsyncFilesystem afs(options);
+      REQUIRE(!afs.uses_io_uring());
+      check_operations(afs, tmp);
+    }
+  });
+}
+
+
+TEST_CASE("async - handlers", "[async]")
+{
+  with_temp_dir([](const path& tmp) {
+    auto executor = std::make_shared<CountingExecutor>();
+    auto options = AsyncOptions();
+    options.executor = executor;
+    AsyncFilesystem afs(options);
+
+    const auto count = 64;
+    for (auto i = 0; i < count; ++i) {
+      write_file(tmp / std::to_string(i), std::string(std::size_t(i), 'x'));
+    }
+
+    std::mutex mutex;
+    auto total = std::uintmax_t(0);
+    auto failures = 0;
+    const auto add_size = [&](file_size_type size, std::error_code ec) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (ec) {
+        ++failures;
+      }
+      else {
+        total += size;
+      }
+    };
+    for (auto i = 0; i < count; ++i) {
+      afs.file_size(tmp / std::to_string(i), add_size);
+    }
+    afs.file_size(tmp / "missing", [&](file_size_type, std::error_code ec) {
+      std::lock_guard<std::mutex> lock(mutex);
+      failures += ec ? 1 : 100;
+    });
+    afs.wait();
+
+    REQUIRE(total == count * (count - 1) / 2);
+    REQUIRE(failures == 1);
+    // without io_uring everything runs on the executor
+    REQUIRE(executor->posted() == (afs.uses_io_uring() ? 0 : count + 1));
+
+    afs.copy_file(tmp / "1", tmp / "copy", copy_options::none,
+                  [&](bool copied, std::error_code ec) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failures += copied && !ec ? 0 : 1;
+                  });
+    afs.wait();
+    REQUIRE(failures == 1);
+    REQUIRE(read_file(tmp / "copy") == "x");
+  });
+}
+
+
+TEST_CASE("async - memory vfs runs operations natively", "[async][vfs]")
+{
+  vfs::register_vfs("//<async>", vfs::make_memory_filesystem());
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<async>"); });
+
+  const auto root = u8path("//<async>/");
+  auto executor = std::make_shared<CountingExecutor>();
+  auto options = AsyncOptions();
+  options.executor = executor;
+  AsyncFilesystem afs(options);
+
+  REQUIRE(afs.create_directories(root / "a/b").get());
+  write_file(root / "a/1.txt", "abc");
+  REQUIRE(afs.status(root / "a/b").get().type() == file_type::directory);
+  REQUIRE(afs.file_size(root / "a/1.txt").get() == 3);
+  afs.rename(root / "a/1.txt", root / "a/2.txt").get();
+
+  // the memory filesystem completes these on the calling thread
+  auto handler_thread = std::thread::id();
+  afs.status(root / "a/2.txt", [&](file_status st, std::error_code ec) {
+    REQUIRE(st.type() == file_type::regular);
+    REQUIRE(!ec);
+    handler_thread = std::this_thread::get_id();
+  });
+  REQUIRE(handler_thread == std::this_thread::get_id());
+  REQUIRE(executor->posted() == 0);
+
+  // a throwing handler does not leave the operation pending
+  REQUIRE_THROWS_AS(afs.file_size(root / "a/2.txt",
+                                  [](file_size_type, std::error_code) {
+                                    throw std::runtime_error("handler");
+                                  }),
+                    const std::runtime_error&);
+  afs.wait();
+
+  // ... while copies run on the executor
+  REQUIRE(afs.copy_file(root / "a/2.txt", root / "a/3.txt").get());
+  REQUIRE(read_file(root / "a/3.txt") == "abc");
+
+  // ... as do renames across roots, which fail
+  auto rename_ec = std::error_code();
+  afs.rename(root / "a/3.txt", u8path("/tmp/3.txt"),
+             [&](std::error_code ec) { rename_ec = ec; });
+  afs.wait();
+  REQUIRE(rename_ec == std::errc::cross_device_link);
+  REQUIRE(exists(root / "a/3.txt"));
+
+  REQUIRE(afs.remove_all(root / "a").get() == 4);
+  REQUIRE(executor->posted() == 3);
+}
+
+
+TEST_CASE("async - thread pool executor", "[async]")
+{
+  auto order = std::vector<int>();
+  {
+    auto executor = make_thread_pool_executor(1);
+    for (auto i = 0; i < 100; ++i) {
+      executor->post([&order, i]() { order.push_back(i); });
+    }
+  }
+
+  // all work ran, in order, before the executor was gone
+  REQUIRE(order.size() == 100);
+  for (auto i = 0; i < 100; ++i) {
+    REQUIRE(order[std::size_t(i)] == i);
+  }
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
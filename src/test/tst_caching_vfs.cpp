@@ -0,0 +1,145 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <iterator>
+#include <string>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+// Registers a caching filesystem for @p dir as "//<cache>" and calls @p functor with it.
+template <typename Functor>
+void
+with_cache(const path& dir, const vfs::CacheOptions& options, Functor functor)
+{
+  auto fs = vfs::make_caching_filesystem(dir, options);
+  auto& cache = *fs;
+  vfs::register_vfs("//<cache>", std::move(fs));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<cache>"); });
+
+  functor(cache);
+}
+
+}  // namespace
+
+
+TEST_CASE("caching vfs - reads", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    create_directories(tmp / "d");
+    write_file(tmp / "d/a.txt", "hello");
+    const auto large = make_random_string(4096);
+    write_file(tmp / "d/large.bin", large);
+
+    auto options = vfs::CacheOptions();
+    options.max_file_size = 1024;
+    options.revalidate_after_ms = 60 * 60 * 1000;
+    with_cache(tmp, options, [&](vfs::ICachingFilesystem& cache) {
+      const auto root = u8path("//<cache>/");
+
+      REQUIRE(is_directory(root / "d"));
+      REQUIRE(std::distance(directory_iterator(root / "d"), directory_iterator()) == 2);
+      REQUIRE(read_file(root / "d/a.txt") == "hello");
+      REQUIRE(read_file(root / "d/large.bin") == large);
+      REQUIRE(!exists(root / "d/missing"));
+
+      const auto before = cache.statistics();
+      REQUIRE(before.content_misses == 1);
+      REQUIRE(before.listing_misses == 1);
+
+      REQUIRE(std::distance(directory_iterator(root / "d"), directory_iterator()) == 2);
+      REQUIRE(read_file(root / "d/a.txt") == "hello");
+      REQUIRE(file_size(root / "d/a.txt") == 5);
+      REQUIRE(!exists(root / "d/missing"));
+
+      const auto after = cache.statistics();
+      REQUIRE(after.content_hits == before.content_hits + 1);
+      REQUIRE(after.listing_hits == before.listing_hits + 1);
+      REQUIRE(after.metadata_misses == before.metadata_misses);
+      REQUIRE(after.size > 5);
+
+      // changes behind the cache's back stay unnoticed until revalidation
+      write_file(tmp / "d/a.txt", "changed");
+      REQUIRE(read_file(root / "d/a.txt") == "hello");
+      cache.clear_cache();
+      REQUIRE(read_file(root / "d/a.txt") == "changed");
+      REQUIRE(cache.statistics().size < after.size);
+    });
+  });
+}
+
+
+TEST_CASE("caching vfs - revalidation and eviction", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    write_file(tmp / "a.txt", "hello");
+    for (auto i = 0; i < 20; ++i) {
+      write_file(tmp / ("f" + std::to_string(i)), make_random_string(512));
+    }
+
+    auto options = vfs::CacheOptions();
+    options.capacity = 4096;
+    options.revalidate_after_ms = 0;
+    with_cache(tmp, options, [&](vfs::ICachingFilesystem& cache) {
+      const auto root = u8path("//<cache>/");
+
+      REQUIRE(read_file(root / "a.txt") == "hello");
+      write_file(tmp / "a.txt", "changed");
+      REQUIRE(read_file(root / "a.txt") == "changed");
+      REQUIRE(cache.statistics().revalidations > 0);
+
+      for (auto i = 0; i < 20; ++i) {
+        REQUIRE(read_file(root / ("f" + std::to_string(i))).size() == 512);
+      }
+      REQUIRE(cache.statistics().evictions > 0);
+      REQUIRE(cache.statistics().size <= options.capacity);
+    });
+  });
+}
+
+
+TEST_CASE("caching vfs - writes", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    write_file(tmp / "a.txt", "hello");
+
+    with_cache(tmp, vfs::CacheOptions(), [&](vfs::ICachingFilesystem&) {
+      const auto root = u8path("//<cache>/");
+
+      REQUIRE(read_file(root / "a.txt") == "hello");
+      REQUIRE(std::distance(directory_iterator(root), directory_iterator()) == 1);
+
+      write_file(root / "a.txt", "changed");
+      REQUIRE(read_file(tmp / "a.txt") == "changed");
+      REQUIRE(read_file(root / "a.txt") == "changed");
+
+      create_directory(root / "d");
+      rename(root / "a.txt", root / "d/b.txt");
+      REQUIRE(!exists(root / "a.txt"));
+      REQUIRE(read_file(root / "d/b.txt") == "changed");
+      REQUIRE(std::distance(directory_iterator(root), directory_iterator()) == 1);
+
+      REQUIRE(remove_all(root / "d") == 2);
+      REQUIRE(!exists(tmp / "d"));
+      REQUIRE(!exists(root / "d/b.txt"));
+    });
+  });
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,142 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <iterator>
+#include <memory>
+#include <string>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+// Registers @p fs as "//<dedup>" and calls @p functor with it.
+template <typename Functor>
+void
+with_dedup(std::unique_ptr<vfs::IDedupFilesystem> fs, Functor functor)
+{
+  auto& dedup = *fs;
+  vfs::register_vfs("//<dedup>", std::move(fs));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<dedup>"); });
+
+  functor(dedup);
+}
+
+}  // namespace
+
+
+TEST_CASE("dedup vfs - memory store", "[vfs]")
+{
+  with_dedup(vfs::make_dedup_filesystem(), [](vfs::IDedupFilesystem& dedup) {
+    const auto root = u8path("//<dedup>/");
+    const auto content = make_random_string(1000);
+
+    create_directories(root / "a/b");
+    write_file(root / "a/1.txt", content);
+    write_file(root / "a/b/2.txt", content);
+    write_file(root / "a/empty.txt", "");
+    REQUIRE(read_file(root / "a/b/2.txt") == content);
+    REQUIRE(file_size(root / "a/1.txt") == 1000);
+    REQUIRE(std::distance(directory_iterator(root / "a"), directory_iterator()) == 3);
+
+    auto stats = dedup.statistics();
+    REQUIRE(stats.files == 3);
+    REQUIRE(stats.blobs == 1);
+    REQUIRE(stats.logical_size == 2000);
+    REQUIRE(stats.stored_size == 1000);
+    REQUIRE(stats.ratio() == 2.0);
+
+    // copies only refer to the same blob
+    copy_file(root / "a/1.txt", root / "a/3.txt");
+    REQUIRE(read_file(root / "a/3.txt") == content);
+    REQUIRE(!equivalent(root / "a/1.txt", root / "a/3.txt"));
+    stats = dedup.statistics();
+    REQUIRE(stats.blobs == 1);
+    REQUIRE(stats.ratio() == 3.0);
+
+    // changing a copy leaves the others alone
+    write_file(root / "a/3.txt", "other");
+    REQUIRE(read_file(root / "a/1.txt") == content);
+    REQUIRE(read_file(root / "a/3.txt") == "other");
+    REQUIRE(dedup.statistics().blobs == 2);
+
+    rename(root / "a", root / "c");
+    REQUIRE(read_file(root / "c/b/2.txt") == content);
+    REQUIRE(!exists(root / "a"));
+
+    // renaming a hard link onto another link to the same file keeps both
+    create_hard_link(root / "c/1.txt", root / "c/4.txt");
+    rename(root / "c/1.txt", root / "c/4.txt");
+    REQUIRE(read_file(root / "c/1.txt") == content);
+    REQUIRE(read_file(root / "c/4.txt") == content);
+    REQUIRE(equivalent(root / "c/1.txt", root / "c/4.txt"));
+  });
+}
+
+
+TEST_CASE("dedup vfs - garbage collection", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    const auto blobs = tmp / "blobs";
+    create_directory(blobs);
+
+    with_dedup(vfs::make_dedup_filesystem(blobs), [&](vfs::IDedupFilesystem& dedup) {
+      const auto root = u8path("//<dedup>/");
+
+      write_file(root / "1.txt", "abc");
+      copy_file(root / "1.txt", root / "2.txt");
+      // blobs are named by the content's SHA-256 hash
+      const auto abc_blob =
+        blobs / "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+      REQUIRE(read_file(abc_blob) == "abc");
+      REQUIRE(std::distance(directory_iterator(blobs), directory_iterator()) == 1);
+
+      remove(root / "1.txt");
+      REQUIRE(dedup.collect_garbage() == 0);
+      REQUIRE(exists(abc_blob));
+
+      write_file(root / "2.txt", "overwritten");
+      REQUIRE(dedup.statistics().garbage_size == 3);
+      REQUIRE(dedup.collect_garbage() == 3);
+      REQUIRE(!exists(abc_blob));
+      REQUIRE(dedup.statistics().blobs == 1);
+
+      // empty files have no blob
+      write_file(root / "empty.txt", "");
+      copy_file(root / "empty.txt", root / "2.txt", copy_options::overwrite_existing);
+      REQUIRE(dedup.statistics().blobs == 1);
+      REQUIRE(dedup.collect_garbage() == 11);
+      REQUIRE(dedup.statistics().blobs == 0);
+
+      remove_all(root);
+      REQUIRE(dedup.collect_garbage() == 0);
+      REQUIRE(directory_iterator(blobs) == directory_iterator());
+    });
+
+    // blobs left in the directory are used again
+    write_file(blobs / "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+               "abc");
+    with_dedup(vfs::make_dedup_filesystem(blobs), [&](vfs::IDedupFilesystem& dedup) {
+      REQUIRE(dedup.statistics().garbage_size == 3);
+      write_file(u8path("//<dedup>/x.txt"), "abc");
+      REQUIRE(dedup.statistics().garbage_size == 0);
+      REQUIRE(dedup.collect_garbage() == 0);
+    });
+  });
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
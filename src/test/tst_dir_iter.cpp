@@ -81,6 +81,74 @@ TEST_CASE("empty folder", "[dir-iter]")
 }
 
 
+namespace {
+
+// Reads the entries of @p dir in batches of @p n, mixed with single increments.
+std::set<path>
+read_batched(const path& dir, std::size_t n)
+{
+  auto result = std::set<path>();
+  auto batch = std::vector<directory_entry>(n);
+  auto iter = directory_iterator(dir);
+  for (;;) {
+    std::error_code ec;
+    const auto count = iter.next_batch(batch.data(), batch.size(), ec);
+    REQUIRE(!ec);
+    for (auto i = std::size_t(0); i < count; ++i) {
+      REQUIRE(result.insert(batch[i].path().filename()).second);
+    }
+    if (count < n) {
+      REQUIRE(iter == directory_iterator());
+      return result;
+    }
+    if (iter != directory_iterator()) {
+      REQUIRE(result.insert(iter->path().filename()).second);
+      ++iter;
+    }
+  }
+}
+
+}  // anon namespace
+
+
+TEST_CASE("batches", "[dir-iter]")
+{
+  const auto check = [](const path& root) {
+    create_directories(root / "dir");
+    auto expected = std::set<path>();
+    for (auto i = 0; i < 100; ++i) {
+      const auto name = "f-" + std::to_string(i);
+      write_file(root / "dir" / name, name);
+      expected.insert(name);
+    }
+
+    for (auto n : {1, 7, 64, 200}) {
+      REQUIRE(read_batched(root / "dir", std::size_t(n)) == expected);
+    }
+
+    std::error_code ec;
+    auto entry = directory_entry();
+    REQUIRE(directory_iterator().next_batch(&entry, 1, ec) == 0);
+    REQUIRE(!ec);
+  };
+
+  SECTION("native") { with_temp_dir(check); }
+
+  SECTION("memory vfs")
+  {
+    vfs::with_memory_vfs("//<vfs>",
+                         [&](vfs::IFilesystem&) { check(u8path("//<vfs>/")); });
+  }
+
+  SECTION("listing backends")
+  {
+    vfs::register_vfs("//<dedup>", vfs::make_dedup_filesystem());
+    auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<dedup>"); });
+    check(u8path("//<dedup>/"));
+  }
+}
+
+
 namespace {
 void
 test_directory_setup(const path& root)
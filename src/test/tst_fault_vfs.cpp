@@ -0,0 +1,134 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/instrumentation.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <system_error>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+// Registers a fault injecting filesystem on an empty memory filesystem as "//<faulty>"
+// and calls @p functor.
+template <typename Functor>
+void
+with_faulty_vfs(const vfs::FaultOptions& options, Functor functor)
+{
+  vfs::register_vfs("//<faulty>", vfs::make_fault_injecting_filesystem(
+                                    vfs::make_memory_filesystem(), options));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<faulty>"); });
+
+  functor();
+}
+
+
+// Returns which of 100 status() calls on @p p failed.
+std::vector<bool>
+failure_pattern(const path& p)
+{
+  auto result = std::vector<bool>();
+  for (auto i = 0; i < 100; ++i) {
+    std::error_code ec;
+    status(p, ec);
+    result.push_back(bool(ec));
+  }
+  return result;
+}
+
+
+template <typename Functor>
+std::chrono::milliseconds
+time_of(Functor functor)
+{
+  const auto start = std::chrono::steady_clock::now();
+  functor();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start);
+}
+
+}  // namespace
+
+
+TEST_CASE("fault vfs - errors", "[vfs]")
+{
+  auto options = vfs::FaultOptions();
+  options.seed = 42;
+  options.operations[Operation::status].error_rate = 0.5;
+  options.operations[Operation::file_size].error_rate = 1.0;
+  options.operations[Operation::file_size].error = std::errc::timed_out;
+
+  auto first = std::vector<bool>();
+  with_faulty_vfs(options, [&]() {
+    const auto root = u8path("//<faulty>/");
+    write_file(root / "a.txt", "hello");
+    REQUIRE(read_file(root / "a.txt") == "hello");
+
+    std::error_code ec;
+    file_size(root / "a.txt", ec);
+    REQUIRE(ec == std::errc::timed_out);
+
+    first = failure_pattern(root / "a.txt");
+    const auto failures = std::count(first.begin(), first.end(), true);
+    REQUIRE(failures > 20);
+    REQUIRE(failures < 80);
+  });
+
+  // the same seed gives the same faults
+  with_faulty_vfs(options, [&]() {
+    const auto root = u8path("//<faulty>/");
+    write_file(root / "a.txt", "hello");
+    std::error_code ec;
+    file_size(root / "a.txt", ec);
+    REQUIRE(failure_pattern(root / "a.txt") == first);
+  });
+}
+
+
+TEST_CASE("fault vfs - latency and bandwidth", "[vfs]")
+{
+  auto options = vfs::FaultOptions();
+  options.operations[Operation::status].latency.base_us = 2000;
+  options.operations[Operation::status].latency.jitter_us = 1000;
+  options.operations[Operation::status].latency.max_us = 4000;
+  options.read_bytes_per_second = 1024 * 1024;
+
+  with_faulty_vfs(options, [&]() {
+    const auto root = u8path("//<faulty>/");
+    const auto data = make_random_string(64 * 1024);
+    write_file(root / "a.bin", data);
+
+    const auto lookups = time_of([&]() {
+      for (auto i = 0; i < 10; ++i) {
+        REQUIRE(exists(root / "a.bin"));
+      }
+    });
+    REQUIRE(lookups >= std::chrono::milliseconds(20));
+
+    // 64 KB at 1 MB/s take at least 60 ms
+    auto content = std::string();
+    const auto reading = time_of([&]() { content = read_file(root / "a.bin"); });
+    REQUIRE(content == data);
+    REQUIRE(reading >= std::chrono::milliseconds(60));
+  });
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
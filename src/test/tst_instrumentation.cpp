@@ -0,0 +1,125 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/instrumentation.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+std::uint64_t
+histogram_total(const OperationStatistics& stats)
+{
+  auto total = std::uint64_t(0);
+  for (const auto count : stats.latency) {
+    total += count;
+  }
+  return total;
+}
+
+}  // namespace
+
+
+TEST_CASE("instrumenting vfs", "[vfs]")
+{
+  auto fs = vfs::make_instrumenting_filesystem(vfs::make_memory_filesystem());
+  auto& instrumented = *fs;
+  vfs::register_vfs("//<instr>", std::move(fs));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<instr>"); });
+
+  const auto root = u8path("//<instr>/");
+  create_directory(root / "d");
+  write_file(root / "d/a.txt", "hello");
+  REQUIRE(read_file(root / "d/a.txt") == "hello");
+  REQUIRE(is_regular_file(root / "d/a.txt"));
+  REQUIRE(std::distance(directory_iterator(root / "d"), directory_iterator()) == 1);
+
+  std::error_code ec;
+  file_size(root / "d/missing", ec);
+  REQUIRE(ec);
+  REQUIRE(file_size(root / "d/a.txt") == 5);
+
+  const auto stats = instrumented.statistics();
+  REQUIRE(stats[Operation::create_directory].calls == 1);
+  REQUIRE(stats[Operation::open_file].calls == 2);
+  REQUIRE(stats[Operation::make_dir_iterator].calls == 1);
+  REQUIRE(stats[Operation::file_size].calls == 2);
+  REQUIRE(stats[Operation::file_size].errors == 1);
+  REQUIRE(stats[Operation::status].calls >= 1);
+  REQUIRE(stats[Operation::rename].calls == 0);
+  REQUIRE(histogram_total(stats[Operation::file_size]) == 2);
+
+  auto os = std::ostringstream();
+  write_statistics(os, stats);
+  REQUIRE(os.str().find("file_size calls=2 errors=1 ") != std::string::npos);
+  REQUIRE(os.str().find("rename") == std::string::npos);
+}
+
+
+TEST_CASE("native instrumentation", "[operations]")
+{
+  with_temp_dir([](const path& tmp) {
+    write_file(tmp / "a.txt", "hello");
+
+    set_native_instrumentation(true);
+    auto guard = utility::make_scope([]() { set_native_instrumentation(false); });
+
+    const auto before = native_statistics();
+
+    const auto thread_count = 4;
+    const auto iterations = 100;
+    auto threads = std::vector<std::thread>();
+    for (auto i = 0; i < thread_count; ++i) {
+      threads.emplace_back([&]() {
+        for (auto j = 0; j < iterations; ++j) {
+          std::error_code ec;
+          status(tmp / "a.txt", ec);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    std::error_code ec;
+    file_size(tmp / "missing", ec);
+    REQUIRE(ec);
+
+    const auto after = native_statistics();
+    const auto& status_before = before[Operation::status];
+    const auto& status_after = after[Operation::status];
+    REQUIRE(status_after.calls - status_before.calls >= thread_count * iterations);
+    REQUIRE(histogram_total(status_after) == status_after.calls);
+    REQUIRE(after[Operation::file_size].errors > before[Operation::file_size].errors);
+
+    set_native_instrumentation(false);
+    file_size(tmp / "a.txt");
+    REQUIRE(native_statistics()[Operation::file_size].calls
+            == after[Operation::file_size].calls);
+  });
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,150 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/filesystem_error.hpp"
+#include "fspp/details/mapped_file.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <string>
+#include <system_error>
+#include <utility>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+std::string
+mapped_string(const mapped_file& m)
+{
+  return std::string(m.begin(), m.end());
+}
+
+
+// Checks mapping (ranges of) @p p, which holds @p content.
+void
+check_ranges(const path& p, const std::string& content)
+{
+  auto whole = mapped_file(p);
+  REQUIRE(whole.is_mapped());
+  REQUIRE(whole.mode() == map_mode::read_only);
+  REQUIRE(mapped_string(whole) == content);
+  whole.advise(map_advice::sequential);
+  whole.advise(map_advice::dont_need);
+
+  auto range = mapped_file(p, map_mode::read_only, 5000, 70000);
+  REQUIRE(range.size() == 70000);
+  REQUIRE(mapped_string(range) == content.substr(5000, 70000));
+
+  // ranges end at the end of the file
+  auto tail = mapped_file(p, map_mode::read_only, content.size() - 10, 100);
+  REQUIRE(mapped_string(tail) == content.substr(content.size() - 10));
+  auto at_end = mapped_file(p, map_mode::read_only, content.size());
+  REQUIRE(at_end.is_mapped());
+  REQUIRE(at_end.size() == 0);
+
+  std::error_code ec;
+  auto beyond = mapped_file(p, map_mode::read_only, content.size() + 1,
+                            mapped_file::k_to_end, ec);
+  REQUIRE(ec);
+  REQUIRE(!beyond.is_mapped());
+  REQUIRE_THROWS_AS(mapped_file(p.parent_path() / "missing"), const filesystem_error&);
+  REQUIRE_THROWS_AS(mapped_file(p.parent_path()), const filesystem_error&);
+}
+
+
+// Writes to a read_write mapping of @p p, which holds at least 100 bytes.
+void
+check_writing(const path& p)
+{
+  auto content = read_file(p);
+
+  auto m = mapped_file(p, map_mode::read_write, 10, 5);
+  REQUIRE(m.size() == 5);
+  m.data()[0] = '<';
+  m.data()[4] = '>';
+  m.flush();
+  content[10] = '<';
+  content[14] = '>';
+  REQUIRE(read_file(p) == content);
+
+  // the rest is written when the mapping ends
+  m.data()[2] = '!';
+  content[12] = '!';
+  auto moved = std::move(m);
+  REQUIRE(!m.is_mapped());
+  moved.unmap();
+  REQUIRE(!moved.is_mapped());
+  REQUIRE(read_file(p) == content);
+  REQUIRE(file_size(p) == content.size());
+}
+
+}  // namespace
+
+
+TEST_CASE("mapped file - native", "[mapped_file]")
+{
+  with_temp_dir([](const path& tmp) {
+    const auto content = make_random_string(200000);
+    write_file(tmp / "a.txt", content);
+    check_ranges(tmp / "a.txt", content);
+    check_writing(tmp / "a.txt");
+
+    write_file(tmp / "empty.txt", "");
+    auto empty = mapped_file(tmp / "empty.txt");
+    REQUIRE(empty.is_mapped());
+    REQUIRE(empty.size() == 0);
+  });
+}
+
+
+TEST_CASE("mapped file - memory vfs", "[mapped_file][vfs]")
+{
+  vfs::register_vfs("//<map>", vfs::make_memory_filesystem());
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<map>"); });
+
+  const auto root = u8path("//<map>/");
+  const auto content = make_random_string(200000);
+  write_file(root / "a.txt", content);
+  check_ranges(root / "a.txt", content);
+  check_writing(root / "a.txt");
+
+  // small files are handed out in place
+  write_file(root / "small.txt", "hello world");
+  auto m1 = mapped_file(root / "small.txt");
+  auto m2 = mapped_file(root / "small.txt", map_mode::read_only, 6);
+  REQUIRE(mapped_string(m2) == "world");
+  REQUIRE(m1.data() + 6 == m2.data());
+
+  // mappings view a snapshot of the content
+  write_file(root / "small.txt", "changed");
+  REQUIRE(mapped_string(m1) == "hello world");
+  REQUIRE(mapped_string(mapped_file(root / "small.txt")) == "changed");
+}
+
+
+TEST_CASE("mapped file - buffered vfs", "[mapped_file][vfs]")
+{
+  vfs::register_vfs("//<map>", vfs::make_dedup_filesystem());
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<map>"); });
+
+  const auto root = u8path("//<map>/");
+  const auto content = make_random_string(200000);
+  write_file(root / "a.txt", content);
+  check_ranges(root / "a.txt", content);
+  check_writing(root / "a.txt");
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
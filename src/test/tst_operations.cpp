@@ -14,6 +14,7 @@
 #include <algorithm>
 #include <ostream>
 #include <random>
+#include <unordered_set>
 
 #if defined(FSPP_IS_MAC)
 #include <dirent.h>
@@ -54,6 +55,60 @@ TEST_CASE("status", "[operations][emulate-win]")
 }
 
 
+TEST_CASE("status_many", "[operations][emulate-win]")
+{
+  with_temp_dir([](const path& root) {
+    create_directory(root / "foo");
+
+    auto paths = std::vector<path>{};
+    for (auto i = 0; i < 100; ++i) {
+      const auto p = root / ("f-" + std::to_string(i));
+      if (i % 3 == 0) {
+        touch(p);
+      }
+      paths.push_back(p);
+    }
+    paths.push_back(root / "foo");
+
+    auto results = std::vector<file_status>(paths.size());
+    auto ecs = std::vector<std::error_code>(paths.size());
+
+    status_many_options opts;
+    opts.max_threads = 4;
+    opts.batch_size = 8;
+    status_many(paths.data(), paths.size(), results.data(), ecs.data(), opts);
+
+    for (auto i = 0u; i < 100; ++i) {
+      REQUIRE(!ecs[i]);
+      REQUIRE(results[i].type()
+              == (i % 3 == 0 ? file_type::regular : file_type::not_found));
+    }
+    REQUIRE(results[100].type() == file_type::directory);
+  });
+}
+
+
+TEST_CASE("status_many in memory vfs", "[operations][emulate-win]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    create_directories(root / "abc");
+    touch(root / "abc/m1.txt");
+
+    const auto paths =
+      std::vector<path>{root / "abc", root / "abc/m1.txt", root / "abc/m2.txt"};
+    auto results = std::vector<file_status>(paths.size());
+    auto ecs = std::vector<std::error_code>(paths.size());
+
+    status_many(paths.data(), paths.size(), results.data(), ecs.data());
+
+    REQUIRE(results[0].type() == file_type::directory);
+    REQUIRE(results[1].type() == file_type::regular);
+    REQUIRE(results[2].type() == file_type::not_found);
+  });
+}
+
+
 TEST_CASE("is_empty", "[operations][emulate-win]")
 {
   with_temp_dir([](const path& root) {
@@ -165,6 +220,48 @@ TEST_CASE("equivalent", "[operations][emulate-win]")
 }
 
 
+TEST_CASE("file_identity", "[operations][emulate-win]")
+{
+  with_temp_dir([](const path& root) {
+    touch(root / "foo.txt");
+    touch(root / "gaz.txt");
+    create_hard_link(root / "foo.txt", root / "bar.txt");
+
+    REQUIRE(file_identity(root / "foo.txt").is_valid());
+    REQUIRE(file_identity(root / "foo.txt") == file_identity(root / "bar.txt"));
+    REQUIRE(file_identity(root / "foo.txt") != file_identity(root / "gaz.txt"));
+
+    auto ids = std::unordered_set<file_id>{};
+    for (const auto& e : directory_iterator(root)) {
+      ids.insert(e.file_id());
+    }
+    REQUIRE(ids.size() == 2u);
+
+    std::error_code ec;
+    REQUIRE(!file_identity(root / "nope.txt", ec).is_valid());
+    REQUIRE(ec);
+  });
+}
+
+
+TEST_CASE("file_identity in memory vfs", "[operations][emulate-win]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    create_directories(root / "abc");
+    touch(root / "abc/m1.txt");
+    touch(root / "abc/m2.txt");
+
+    REQUIRE(file_identity(root / "abc/m1.txt") == file_identity(root / "abc/./m1.txt"));
+    REQUIRE(file_identity(root / "abc/m1.txt") != file_identity(root / "abc/m2.txt"));
+
+    for (const auto& e : directory_iterator(root / "abc")) {
+      REQUIRE(e.file_id() == file_identity(e.path()));
+    }
+  });
+}
+
+
 TEST_CASE("equivalent with symlinks", "[operations][emulate-win]")
 {
   with_privilege_check([]() {
@@ -0,0 +1,162 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <ios>
+#include <set>
+#include <string>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+std::set<std::string>
+entries_of(const path& p)
+{
+  auto result = std::set<std::string>();
+  for (const auto& e : directory_iterator(p)) {
+    result.insert(e.path().filename().string());
+  }
+  return result;
+}
+
+
+// Creates two lower layers in @p tmp, registers an overlay of them as "//<overlay>" and
+// calls @p functor with the layers.
+template <typename Functor>
+void
+with_overlay(const path& tmp, Functor functor)
+{
+  const auto top = tmp / "top";
+  const auto bottom = tmp / "bottom";
+
+  create_directories(top / "d");
+  write_file(top / "a.txt", "top a");
+  write_file(top / "d/x.txt", "top x");
+  write_file(top / "s", "top s");
+
+  create_directories(bottom / "d");
+  create_directories(bottom / "s");
+  write_file(bottom / "a.txt", "bottom a");
+  write_file(bottom / "b.txt", "bottom b");
+  write_file(bottom / "d/y.txt", "bottom y");
+  write_file(bottom / "s/z.txt", "bottom z");
+
+  vfs::register_vfs("//<overlay>", vfs::make_overlay_filesystem({top, bottom}));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<overlay>"); });
+
+  functor(top, bottom);
+}
+
+}  // namespace
+
+
+TEST_CASE("overlay vfs - lookups", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    with_overlay(tmp, [](const path&, const path&) {
+      const auto root = u8path("//<overlay>/");
+
+      REQUIRE(entries_of(root) == (std::set<std::string>{"a.txt", "b.txt", "d", "s"}));
+      REQUIRE(entries_of(root / "d") == (std::set<std::string>{"x.txt", "y.txt"}));
+
+      REQUIRE(read_file(root / "a.txt") == "top a");
+      REQUIRE(read_file(root / "b.txt") == "bottom b");
+      REQUIRE(read_file(root / "d/y.txt") == "bottom y");
+      REQUIRE(file_size(root / "d/x.txt") == 5);
+
+      // a file hides directories of the same name below it
+      REQUIRE(is_regular_file(root / "s"));
+      REQUIRE(!exists(root / "s/z.txt"));
+      REQUIRE(!exists(root / "missing"));
+    });
+  });
+}
+
+
+TEST_CASE("overlay vfs - copy up", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    with_overlay(tmp, [](const path& top, const path& bottom) {
+      const auto root = u8path("//<overlay>/");
+
+      write_file(root / "a.txt", "new a");
+      REQUIRE(read_file(root / "a.txt") == "new a");
+      REQUIRE(read_file(top / "a.txt") == "top a");
+
+      {
+        auto f = File(root / "d/y.txt");
+        f.open(std::ios::out | std::ios::app) << " appended";
+        f.close();
+      }
+      REQUIRE(read_file(root / "d/y.txt") == "bottom y appended");
+      REQUIRE(read_file(bottom / "d/y.txt") == "bottom y");
+
+      write_file(root / "d/new.txt", "new");
+      REQUIRE(entries_of(root / "d")
+              == (std::set<std::string>{"new.txt", "x.txt", "y.txt"}));
+      REQUIRE(!exists(top / "d/new.txt"));
+
+      create_directories(root / "d/e/f");
+      copy_file(root / "b.txt", root / "d/e/f/b.txt");
+      REQUIRE(read_file(root / "d/e/f/b.txt") == "bottom b");
+
+      resize_file(root / "d/x.txt", 3);
+      REQUIRE(read_file(root / "d/x.txt") == "top");
+      REQUIRE(read_file(top / "d/x.txt") == "top x");
+    });
+  });
+}
+
+
+TEST_CASE("overlay vfs - whiteouts", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    with_overlay(tmp, [](const path& top, const path& bottom) {
+      const auto root = u8path("//<overlay>/");
+
+      write_file(root / "a.txt", "new a");
+      REQUIRE(remove(root / "a.txt"));
+      REQUIRE(!exists(root / "a.txt"));
+      REQUIRE(exists(top / "a.txt"));
+      REQUIRE(exists(bottom / "a.txt"));
+
+      std::error_code ec;
+      remove(root / "d", ec);
+      REQUIRE(ec == std::errc::directory_not_empty);
+      REQUIRE(remove_all(root / "d") == 3);
+      REQUIRE(!exists(root / "d"));
+      REQUIRE(exists(bottom / "d/y.txt"));
+
+      // a recreated directory doesn't show the lower layers' content anymore
+      create_directory(root / "d");
+      REQUIRE(entries_of(root / "d").empty());
+
+      rename(root / "b.txt", root / "d/b.txt");
+      REQUIRE(!exists(root / "b.txt"));
+      REQUIRE(read_file(root / "d/b.txt") == "bottom b");
+      REQUIRE(entries_of(root) == (std::set<std::string>{"d", "s"}));
+
+      write_file(root / "a.txt", "again");
+      REQUIRE(read_file(root / "a.txt") == "again");
+    });
+  });
+}
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
@@ -1,9 +1,11 @@
 // Copyright (c) 2016 Gregor Klinke
 
 #include "fspp/details/file_status.hpp"
+#include "fspp/details/instrumentation.hpp"
 #include "fspp/details/types.hpp"
 #include "fspp/details/vfs.hpp"
 #include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
 #include "fspp/utility/time_logger.hpp"
 #include "fspp/utils.hpp"
 
@@ -11,9 +13,20 @@
 
 #include <catch/catch.hpp>
 
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
 #include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <limits>
+#include <memory>
 #include <ostream>
 #include <random>
+#include <string>
+#include <thread>
+#include <vector>
 
 
 namespace eyestep {
@@ -40,6 +53,22 @@ create_level(const path& base_p, int fcount, int dcount, int depth_count)
     }
   }
 }
+
+
+// Returns the resident set size of the process in bytes or 0 if unknown
+std::size_t
+resident_memory()
+{
+#if defined(__linux__)
+  std::size_t pages = 0;
+  std::size_t resident = 0;
+  std::ifstream statm("/proc/self/statm");
+  if (statm >> pages >> resident) {
+    return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  }
+#endif
+  return 0;
+}
 }  // anon namespace
 
 
@@ -64,6 +93,339 @@ TEST_CASE("copy - directory recursive large", "[.][performance]")
   });
 }
 
+
+
+TEST_CASE("memory vfs - memory per node", "[.][performance]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    const auto dir_count = 1000;
+    const auto file_count = 1000;
+    const auto root = u8path("//<vfs>");
+
+    const auto before = resident_memory();
+    {
+      auto time_guard = utility::make_timer_logger("create 1M nodes", std::cout);
+      for (auto d = 0; d < dir_count; ++d) {
+        const auto dir_p = root / ("d-" + std::to_string(d));
+        create_directory(dir_p);
+        for (auto f = 0; f < file_count; ++f) {
+          touch(dir_p / ("f-" + std::to_string(f)));
+        }
+      }
+    }
+    const auto after = resident_memory();
+
+    if (after > before) {
+      std::cout << "Memory per node: "
+                << double(after - before) / double(dir_count * (file_count + 1))
+                << " bytes" << std::endl;
+    }
+
+    {
+      auto time_guard = utility::make_timer_logger("status 1M nodes", std::cout);
+      for (auto d = 0; d < dir_count; ++d) {
+        const auto dir_p = root / ("d-" + std::to_string(d));
+        for (auto f = 0; f < file_count; ++f) {
+          REQUIRE(is_regular_file(dir_p / ("f-" + std::to_string(f))));
+        }
+      }
+    }
+  });
+}
+
+
+
+TEST_CASE("memory vfs - deep path lookups", "[.][performance]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto dir_p = u8path("//<vfs>");
+    for (auto i = 0; i < 32; ++i) {
+      dir_p /= "dir-" + std::to_string(i);
+    }
+    create_directories(dir_p);
+    for (auto i = 0; i < 100; ++i) {
+      touch(dir_p / ("f-" + std::to_string(i)));
+    }
+
+    const auto paths = [&]() {
+      auto result = std::vector<path>();
+      for (auto i = 0; i < 100; ++i) {
+        result.push_back(dir_p / ("f-" + std::to_string(i)));
+      }
+      return result;
+    }();
+
+    auto time_guard = utility::make_timer_logger("status 100K deep paths", std::cout);
+    for (auto n = 0; n < 1000; ++n) {
+      for (const auto& p : paths) {
+        REQUIRE(is_regular_file(p));
+      }
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - concurrent lookups", "[.][performance]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    const auto root = u8path("//<vfs>");
+    auto paths = std::vector<path>();
+    for (auto d = 0; d < 64; ++d) {
+      const auto dir_p = root / ("dir-" + std::to_string(d));
+      create_directories(dir_p);
+      for (auto i = 0; i < 16; ++i) {
+        paths.push_back(dir_p / ("f-" + std::to_string(i)));
+        touch(paths.back());
+      }
+    }
+
+    // every thread does the same work, so ideal scaling keeps the time constant.
+    for (const auto thread_count : {1, 2, 4, 8}) {
+      auto time_guard = utility::make_timer_logger(
+        std::to_string(thread_count) + " threads, 100K lookups each", std::cout);
+
+      auto threads = std::vector<std::thread>();
+      auto found = std::vector<std::size_t>(static_cast<std::size_t>(thread_count));
+      for (auto t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t]() {
+          for (auto n = 0; n < 100; ++n) {
+            for (const auto& p : paths) {
+              found[static_cast<std::size_t>(t)] += is_regular_file(p) ? 1 : 0;
+            }
+          }
+        });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+
+      for (const auto count : found) {
+        REQUIRE(count == 100 * paths.size());
+      }
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - large file streams", "[.][performance]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    const auto p = u8path("//<vfs>/large.bin");
+    const auto block = std::string(1024 * 1024, 'x');
+    const auto block_count = 256;
+
+    {
+      auto time_guard = utility::make_timer_logger("write 256 MB", std::cout);
+      with_stream_for_writing(p, [&](std::ostream& os) {
+        for (auto i = 0; i < block_count; ++i) {
+          os.write(block.data(), static_cast<std::streamsize>(block.size()));
+        }
+      });
+    }
+
+    {
+      auto time_guard = utility::make_timer_logger("1000 appends", std::cout);
+      for (auto i = 0; i < 1000; ++i) {
+        with_stream_for_writing(p, [&](std::ostream& os) { os << "line\n"; },
+                                std::ios::app);
+      }
+    }
+
+    {
+      auto time_guard = utility::make_timer_logger("1000 open and read 1 KB", std::cout);
+      auto buf = std::vector<char>(1024);
+      for (auto i = 0; i < 1000; ++i) {
+        with_stream_for_reading(p, [&](std::istream& is) {
+          is.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        });
+      }
+    }
+
+    REQUIRE(file_size(p) == block.size() * block_count + 5000);
+  });
+}
+
+
+TEST_CASE("memory vfs - spilled file streams", "[.][performance]")
+{
+  const auto unlimited = std::numeric_limits<std::uintmax_t>::max();
+  vfs::register_vfs("//<spill>", vfs::make_memory_filesystem(unlimited, 1024 * 1024));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<spill>"); });
+
+  const auto p = u8path("//<spill>/large.bin");
+  const auto block = std::string(1024 * 1024, 'x');
+  const auto block_count = 256;
+
+  const auto before = resident_memory();
+  {
+    auto time_guard = utility::make_timer_logger("write 256 MB spilled", std::cout);
+    with_stream_for_writing(p, [&](std::ostream& os) {
+      for (auto i = 0; i < block_count; ++i) {
+        os.write(block.data(), static_cast<std::streamsize>(block.size()));
+      }
+    });
+  }
+
+  {
+    auto time_guard = utility::make_timer_logger("read 256 MB spilled", std::cout);
+    auto buf = std::vector<char>(block.size());
+    with_stream_for_reading(p, [&](std::istream& is) {
+      while (is.read(buf.data(), static_cast<std::streamsize>(buf.size()))) {
+      }
+    });
+  }
+  if (before > 0) {
+    std::cout << "resident memory growth: " << (resident_memory() - before) / 1024
+              << " KB" << std::endl;
+  }
+
+  REQUIRE(file_size(p) == block.size() * block_count);
+}
+
+
+TEST_CASE("memory vfs - loading images", "[.][performance]")
+{
+  with_temp_dir([](const path& tmp) {
+    const auto dir_count = 200;
+    const auto file_count = 1000;
+    const auto image_p = tmp / "fs.img";
+
+    vfs::with_memory_vfs("//<vfs>", [&](vfs::IFilesystem& fs) {
+      const auto root = u8path("//<vfs>");
+      {
+        auto time_guard = utility::make_timer_logger("write 200k files", std::cout);
+        for (auto d = 0; d < dir_count; ++d) {
+          const auto dir_p = root / ("d-" + std::to_string(d));
+          create_directory(dir_p);
+          for (auto f = 0; f < file_count; ++f) {
+            write_file(dir_p / ("f-" + std::to_string(f)), std::string(100, 'x'));
+          }
+        }
+      }
+
+      auto time_guard = utility::make_timer_logger("save image", std::cout);
+      std::ofstream os(image_p.string(), std::ios::binary);
+      dynamic_cast<vfs::IMemoryFilesystem&>(fs).save_image(os);
+    });
+
+    auto loaded = std::unique_ptr<vfs::IMemoryFilesystem>();
+    {
+      auto time_guard = utility::make_timer_logger("load image", std::cout);
+      loaded = vfs::load_image(image_p);
+    }
+    vfs::register_vfs("//<image>", std::move(loaded));
+    auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<image>"); });
+
+    REQUIRE(file_size(u8path("//<image>/d-199/f-999")) == 100);
+  });
+}
+
+
+TEST_CASE("dir iter - batches versus increments", "[.][performance]")
+{
+  const auto run = [](const std::string& name, const path& dir) {
+    create_directory(dir);
+    for (auto i = 0; i < 100000; ++i) {
+      touch(dir / ("f-" + std::to_string(i)));
+    }
+
+    auto by_increment = std::size_t(0);
+    {
+      auto time_guard =
+        utility::make_timer_logger(name + ": 100K increments", std::cout);
+      for (auto iter = directory_iterator(dir); iter != directory_iterator(); ++iter) {
+        by_increment += iter->path().native().size();
+      }
+    }
+
+    auto batched = std::size_t(0);
+    {
+      auto time_guard =
+        utility::make_timer_logger(name + ": 100K in batches", std::cout);
+      auto batch = std::vector<directory_entry>(256);
+      auto iter = directory_iterator(dir);
+      std::error_code ec;
+      for (auto count = batch.size(); count == batch.size();) {
+        count = iter.next_batch(batch.data(), batch.size(), ec);
+        for (auto i = std::size_t(0); i < count; ++i) {
+          batched += batch[i].path().native().size();
+        }
+      }
+    }
+    REQUIRE(batched == by_increment);
+  };
+
+  with_temp_dir([&](const path& tmp) { run("native", tmp / "dir"); });
+  vfs::with_memory_vfs("//<vfs>", [&](vfs::IFilesystem&) {
+    run("memory vfs", u8path("//<vfs>/dir"));
+  });
+}
+
+
+TEST_CASE("fault vfs - walks on slow storage", "[.][performance]")
+{
+  // roughly the metadata latency of a network filesystem
+  auto options = vfs::FaultOptions();
+  options.seed = 1;
+  options.defaults.latency.base_us = 200;
+  options.defaults.latency.jitter_us = 100;
+  options.defaults.latency.max_us = 2000;
+
+  vfs::register_vfs("//<slow>", vfs::make_fault_injecting_filesystem(
+                                  vfs::make_memory_filesystem(), options));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<slow>"); });
+
+  const auto root = u8path("//<slow>/");
+  auto dirs = std::vector<std::string>();
+  for (auto d = 0; d < 32; ++d) {
+    dirs.push_back("d-" + std::to_string(d));
+    create_directory(root / dirs.back());
+    for (auto f = 0; f < 16; ++f) {
+      with_stream_for_writing(root / dirs.back() / ("f-" + std::to_string(f)),
+                              [](std::ostream& os) { os << "x"; });
+    }
+  }
+
+  const auto walk = [&dirs](const path& base, int thread_count) {
+    auto threads = std::vector<std::thread>();
+    auto found = std::vector<std::size_t>(static_cast<std::size_t>(thread_count));
+    for (auto t = 0; t < thread_count; ++t) {
+      threads.emplace_back([&, t]() {
+        for (auto d = std::size_t(t); d < dirs.size();
+             d += static_cast<std::size_t>(thread_count)) {
+          for (const auto& e : directory_iterator(base / dirs[d])) {
+            found[static_cast<std::size_t>(t)] += is_regular_file(e.path()) ? 1 : 0;
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    auto total = std::size_t(0);
+    for (const auto count : found) {
+      total += count;
+    }
+    return total;
+  };
+
+  for (const auto thread_count : {1, 4, 16}) {
+    auto time_guard = utility::make_timer_logger(
+      "walk 512 files, " + std::to_string(thread_count) + " threads", std::cout);
+    REQUIRE(walk(root, thread_count) == 512);
+  }
+
+  vfs::register_vfs("//<cached>", vfs::make_caching_filesystem(root));
+  auto cache_guard = utility::make_scope([]() { vfs::unregister_vfs("//<cached>"); });
+  for (const auto* pass : {"cold", "warm"}) {
+    auto time_guard = utility::make_timer_logger(
+      std::string("walk 512 files cached, ") + pass, std::cout);
+    REQUIRE(walk(u8path("//<cached>/"), 1) == 512);
+  }
+}
+
+
 }  // namespace tests
 }  // namespace filesystem
 }  // namespace eyestep
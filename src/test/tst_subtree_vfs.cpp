@@ -0,0 +1,191 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file.hpp"
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/platform.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#include <ios>
+#include <iterator>
+#include <string>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+#if !defined(FSPP_IS_WIN)
+
+namespace {
+
+// Registers a subtree filesystem for @p dir as "//<subtree>" and calls @p functor.
+template <typename Functor>
+void
+with_subtree(const path& dir, Functor functor)
+{
+  vfs::register_vfs("//<subtree>", vfs::make_subtree_filesystem(dir));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<subtree>"); });
+
+  functor();
+}
+
+
+#if defined(__linux__)
+// Sets or clears the append-only flag of @p p.  Returns false if the filesystem or the
+// process' privileges don't allow it.
+bool
+set_append_only(const path& p, bool append_only)
+{
+  const auto fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  int flags = 0;
+  auto result = ::ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0;
+  if (result) {
+    flags = append_only ? flags | FS_APPEND_FL : flags & ~FS_APPEND_FL;
+    result = ::ioctl(fd, FS_IOC_SETFLAGS, &flags) == 0;
+  }
+  ::close(fd);
+  return result;
+}
+#endif
+
+}  // namespace
+
+
+TEST_CASE("subtree vfs - operations", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    create_directories(tmp / "sub/d");
+    write_file(tmp / "sub/a.txt", "hello");
+
+    with_subtree(tmp / "sub", [&]() {
+      const auto root = u8path("//<subtree>/");
+
+      REQUIRE(is_directory(root / "d"));
+      REQUIRE(read_file(root / "a.txt") == "hello");
+      REQUIRE(file_size(root / "a.txt") == 5);
+      REQUIRE(std::distance(directory_iterator(root), directory_iterator()) == 2);
+      REQUIRE(!exists(root / "missing"));
+
+      write_file(root / "d/b.txt", "world");
+      REQUIRE(read_file(tmp / "sub/d/b.txt") == "world");
+
+      {
+        auto f = File(root / "d/b.txt");
+        auto& s = f.open(std::ios::in | std::ios::out);
+        s.seekp(1);
+        s << "O";
+        s.seekg(0);
+        auto content = std::string();
+        s >> content;
+        REQUIRE(content == "wOrld");
+        f.close();
+      }
+
+      create_directories(root / "x/y/z");
+      copy_file(root / "a.txt", root / "x/y/z/c.txt");
+      rename(root / "x/y/z/c.txt", root / "x/c.txt");
+      REQUIRE(read_file(root / "x/c.txt") == "hello");
+      resize_file(root / "x/c.txt", 2);
+      REQUIRE(read_file(tmp / "sub/x/c.txt") == "he");
+
+      permissions(root / "a.txt", perms::owner_read | perms::owner_write);
+      REQUIRE(status(root / "a.txt").permissions()
+              == (perms::owner_read | perms::owner_write));
+
+      REQUIRE(remove_all(root / "x") == 4);
+      REQUIRE(!exists(tmp / "sub/x"));
+
+      // the filesystem follows the directory it has opened
+      rename(tmp / "sub", tmp / "moved");
+      REQUIRE(read_file(root / "a.txt") == "hello");
+    });
+  });
+}
+
+
+TEST_CASE("subtree vfs - confinement", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    create_directories(tmp / "sub/d");
+    write_file(tmp / "secret.txt", "secret");
+    write_file(tmp / "sub/d/a.txt", "hello");
+    create_symlink("d/a.txt", tmp / "sub/inside");
+#if defined(FSPP_IS_UNIX)
+    create_symlink("../secret.txt", tmp / "sub/outside");
+#endif
+
+    with_subtree(tmp / "sub", [&]() {
+      const auto root = u8path("//<subtree>/");
+
+      REQUIRE(read_file(root / "../../d/a.txt") == "hello");
+      REQUIRE(!exists(root / "../secret.txt"));
+
+      REQUIRE(read_file(root / "inside") == "hello");
+
+#if defined(FSPP_IS_UNIX)
+      // openat2() with RESOLVE_BENEATH refuses symlinks leading out of the directory
+      REQUIRE(symlink_status(root / "outside").type() == file_type::symlink);
+
+      std::error_code ec;
+      status(root / "outside", ec);
+      REQUIRE(ec == std::errc::operation_not_permitted);
+
+      // ... as do changes to the attributes of what they lead to
+      const auto secret_perms = status(tmp / "secret.txt").permissions();
+      const auto secret_time = last_write_time(tmp / "secret.txt");
+      permissions(root / "outside", perms::all, ec);
+      REQUIRE(ec == std::errc::operation_not_permitted);
+      last_write_time(root / "outside", secret_time - 3600, ec);
+      REQUIRE(ec == std::errc::operation_not_permitted);
+      REQUIRE(status(tmp / "secret.txt").permissions() == secret_perms);
+      REQUIRE(last_write_time(tmp / "secret.txt") == secret_time);
+#endif
+
+#if defined(__linux__)
+      // a refused open doesn't give up the confinement for later lookups
+      if (set_append_only(tmp / "sub/d/a.txt", true)) {
+        auto flags_guard = utility::make_scope(
+          [&]() { set_append_only(tmp / "sub/d/a.txt", false); });
+
+        auto file = File(root / "d/a.txt");
+        file.open(std::ios::out | std::ios::trunc, ec);
+        REQUIRE(ec == std::errc::operation_not_permitted);
+
+        status(root / "outside", ec);
+        REQUIRE(ec == std::errc::operation_not_permitted);
+        REQUIRE_THROWS(read_file(root / "outside"));
+      }
+#endif
+
+      permissions(root / "inside", perms::owner_read);
+      REQUIRE(status(tmp / "sub/d/a.txt").permissions() == perms::owner_read);
+      last_write_time(root / "inside", file_time_type(1000000000));
+      REQUIRE(last_write_time(tmp / "sub/d/a.txt") == file_time_type(1000000000));
+    });
+  });
+}
+
+#endif
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
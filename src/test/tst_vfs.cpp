@@ -0,0 +1,960 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/details/types.hpp"
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+#include "fspp/utility/scope.hpp"
+#include "fspp/utils.hpp"
+
+#include "test_utils.hpp"
+
+#include <catch/catch.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace tests {
+
+namespace {
+
+// Returns the number of memory mappings of the process or 0 if unknown
+std::size_t
+mapping_count()
+{
+  auto count = std::size_t(0);
+#if defined(__linux__)
+  std::ifstream maps("/proc/self/maps");
+  for (auto line = std::string(); std::getline(maps, line);) {
+    ++count;
+  }
+#endif
+  return count;
+}
+
+}  // anon namespace
+
+
+TEST_CASE("vfs registry - concurrent registration", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    create_directories(root / "abc");
+
+    std::atomic<bool> done(false);
+    auto registrar = std::thread([&]() {
+      for (auto i = 0; i < 200; ++i) {
+        const auto name = "//<tmp-" + std::to_string(i % 5) + ">";
+        vfs::register_vfs(name, vfs::make_memory_filesystem());
+        vfs::unregister_vfs(name);
+      }
+      done = true;
+    });
+
+    auto count = 0;
+    while (!done) {
+      REQUIRE(status(root / "abc").type() == file_type::directory);
+      ++count;
+    }
+    registrar.join();
+
+    REQUIRE(count > 0);
+    REQUIRE(status(u8path("//<tmp-1>/abc")).type() == file_type::none);
+  });
+}
+
+
+TEST_CASE("vfs dispatch - root name parsing", "[vfs]")
+{
+  REQUIRE(status(u8path("//<vfs>/abc")).type() == file_type::none);
+  REQUIRE(!exists(u8path("//<vfs>")));
+
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    create_directories(u8path("//<vfs>/abc/def"));
+
+    REQUIRE(is_directory(u8path("//<vfs>/abc")));
+    REQUIRE(is_directory(u8path("//<vfs>//abc///def")));
+    REQUIRE(is_directory(u8path("//<vfs>/abc/def/")));
+    REQUIRE(is_directory(u8path("//<vfs>/")));
+    REQUIRE(is_directory(u8path("//<vfs>///")));
+    REQUIRE(status(u8path("//<vfs2>/abc")).type() == file_type::none);
+
+    // operations on two paths don't cross roots
+    write_file(u8path("//<vfs>/abc/a.txt"), "hello");
+    std::error_code ec;
+    rename(u8path("//<vfs>/abc/a.txt"), u8path("/tmp/a.txt"), ec);
+    REQUIRE(ec == std::errc::cross_device_link);
+    rename(u8path("//<vfs>/abc/a.txt"), u8path("//<vfs2>/abc/a.txt"), ec);
+    REQUIRE(ec == std::errc::cross_device_link);
+    REQUIRE(!copy_file(u8path("//<vfs>/abc/a.txt"), u8path("//<vfs>x/a.txt"), ec));
+    REQUIRE(ec == std::errc::cross_device_link);
+    create_hard_link(u8path("/tmp/a.txt"), u8path("//<vfs>/abc/b.txt"), ec);
+    REQUIRE(ec == std::errc::cross_device_link);
+    REQUIRE(!equivalent(u8path("//<vfs>/abc/a.txt"), u8path("/tmp/a.txt"), ec));
+    REQUIRE(!ec);
+    REQUIRE(read_file(u8path("//<vfs>/abc/a.txt")) == "hello");
+    REQUIRE(!exists(u8path("//<vfs>/abc/b.txt")));
+
+    rename(u8path("//<vfs>/abc/a.txt"), u8path("//<vfs>/b.txt"), ec);
+    REQUIRE(!ec);
+    REQUIRE(read_file(u8path("//<vfs>/b.txt")) == "hello");
+  });
+
+  REQUIRE(status(u8path("//<vfs>/abc")).type() == file_type::none);
+}
+
+
+TEST_CASE("memory vfs - large directories", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>/abc");
+    create_directories(root);
+
+    const auto count = 200;
+    for (auto i = 0; i < count; ++i) {
+      touch(root / ("f-" + std::to_string(i)));
+    }
+
+    auto names = std::set<std::string>();
+    for (const auto& e : directory_iterator(root)) {
+      names.insert(e.path().filename().string());
+    }
+    REQUIRE(names.size() == count);
+    REQUIRE(names.count("f-0") == 1);
+    REQUIRE(names.count("f-199") == 1);
+
+    // shrink the directory until it falls back to a small one.
+    for (auto i = 0; i < count - 3; ++i) {
+      REQUIRE(remove(root / ("f-" + std::to_string(i))));
+    }
+    REQUIRE(!exists(root / "f-0"));
+    REQUIRE(exists(root / "f-198"));
+    REQUIRE(std::distance(directory_iterator(root), directory_iterator()) == 3);
+
+    REQUIRE(remove_all(root) == 4);
+    REQUIRE(!exists(root));
+  });
+}
+
+
+TEST_CASE("memory vfs - removing entries while iterating", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    const auto root = u8path("//<vfs>/abc");
+
+    // small directories keep their entries sorted, large ones hash them
+    for (const auto count : {10, 40}) {
+      CAPTURE(count);
+      create_directories(root);
+      for (auto i = 0; i < count; ++i) {
+        touch(root / ("f-" + std::to_string(i)));
+      }
+
+      auto visited = 0;
+      for (auto it = directory_iterator(root); it != directory_iterator(); ++it) {
+        REQUIRE(remove(it->path()));
+        ++visited;
+      }
+      REQUIRE(visited == count);
+      REQUIRE(directory_iterator(root) == directory_iterator());
+
+      // ... and entries removed before being reached are not reported
+      for (auto i = 0; i < count; ++i) {
+        touch(root / ("f-" + std::to_string(i)));
+      }
+      auto names = std::set<std::string>();
+      auto first_is_even = false;
+      for (auto it = directory_iterator(root); it != directory_iterator(); ++it) {
+        const auto name = it->path().filename().string();
+        REQUIRE(names.insert(name).second);
+        REQUIRE(exists(it->path()));
+        if (names.size() == 1) {
+          first_is_even = (name.back() - '0') % 2 == 0;
+          for (auto i = 0; i < count; i += 2) {
+            remove(root / ("f-" + std::to_string(i)));
+          }
+        }
+      }
+      REQUIRE(names.size() == std::size_t(count / 2 + (first_is_even ? 1 : 0)));
+
+      remove_all(root);
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - removing open files", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    write_file(root / "a.txt", "hello world");
+
+    File f(root / "a.txt");
+    auto& is = f.open(std::ios::in);
+    REQUIRE(remove(root / "a.txt"));
+    REQUIRE(!exists(root / "a.txt"));
+
+    // the content is alive as long as the file is open
+    auto content = std::string();
+    std::getline(is, content);
+    REQUIRE(content == "hello world");
+    f.close();
+
+    touch(root / "b.txt");
+    REQUIRE(is_regular_file(root / "b.txt"));
+  });
+}
+
+
+TEST_CASE("memory vfs - rename directory into itself", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    create_directories(root / "a/b");
+
+    std::error_code ec;
+    rename(root / "a", root / "a/b/c", ec);
+    REQUIRE(ec == std::errc::invalid_argument);
+    REQUIRE(is_directory(root / "a/b"));
+
+    rename(root / "a/b", root / "c", ec);
+    REQUIRE(!ec);
+    REQUIRE(is_directory(root / "c"));
+    REQUIRE(is_directory(root / "c/../a"));
+  });
+}
+
+
+TEST_CASE("memory vfs - file streams", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    const auto data = make_random_string(100000);
+
+    SECTION("write and read back")
+    {
+      write_file(root / "a.txt", data);
+      REQUIRE(file_size(root / "a.txt") == data.size());
+      REQUIRE(read_file(root / "a.txt") == data);
+    }
+
+    SECTION("out truncates")
+    {
+      write_file(root / "a.txt", data);
+      write_file(root / "a.txt", "hello");
+      REQUIRE(read_file(root / "a.txt") == "hello");
+    }
+
+    SECTION("append")
+    {
+      write_file(root / "a.txt", "hello");
+      with_stream_for_writing(root / "a.txt", [](std::ostream& os) { os << " world"; },
+                              std::ios::app);
+      REQUIRE(read_file(root / "a.txt") == "hello world");
+    }
+
+    SECTION("seek and overwrite")
+    {
+      write_file(root / "a.txt", "hello world");
+      with_stream(root / "a.txt", std::ios::in | std::ios::out, [](std::iostream& s) {
+        s.seekp(6);
+        s << "there";
+        s.seekg(0);
+        auto word = std::string();
+        s >> word;
+        REQUIRE(word == "hello");
+        s.seekp(0, std::ios::end);
+        s << "!";
+      });
+      REQUIRE(read_file(root / "a.txt") == "hello there!");
+    }
+
+    SECTION("writing past the end fills with zeros")
+    {
+      write_file(root / "a.txt", "abc");
+      with_stream(root / "a.txt", std::ios::in | std::ios::out, [](std::iostream& s) {
+        s.seekp(6);
+        s << "x";
+      });
+      REQUIRE(read_file(root / "a.txt") == std::string("abc\0\0\0x", 7));
+    }
+
+    SECTION("readers keep the content as of opening")
+    {
+      write_file(root / "a.txt", data);
+
+      File f(root / "a.txt");
+      auto& is = f.open(std::ios::in);
+      write_file(root / "a.txt", "hello");
+      resize_file(root / "a.txt", 2);
+
+      std::stringstream buf;
+      buf << is.rdbuf();
+      REQUIRE(buf.str() == data);
+      f.close();
+
+      REQUIRE(read_file(root / "a.txt") == "he");
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - content larger than a chunk", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    const auto data = make_random_string(200000);
+    write_file(root / "a.bin", data);
+
+    SECTION("random writes across chunk boundaries")
+    {
+      auto expected = data;
+      with_stream(root / "a.bin", std::ios::in | std::ios::out, [&](std::iostream& s) {
+        for (auto pos : {65530, 131070, 199990}) {
+          const auto patch = std::string(20, '#');
+          s.seekp(pos);
+          s.write(patch.data(), static_cast<std::streamsize>(patch.size()));
+          expected.replace(static_cast<std::size_t>(pos), patch.size(), patch);
+        }
+      });
+      expected.resize(200010, '#');
+
+      REQUIRE(file_size(root / "a.bin") == expected.size());
+      REQUIRE(read_file(root / "a.bin") == expected);
+    }
+
+    SECTION("truncating and extending")
+    {
+      resize_file(root / "a.bin", 70000);
+      REQUIRE(read_file(root / "a.bin") == data.substr(0, 70000));
+
+      resize_file(root / "a.bin", 140000);
+      REQUIRE(read_file(root / "a.bin")
+              == data.substr(0, 70000) + std::string(70000, '\0'));
+
+      resize_file(root / "a.bin", 10);
+      with_stream_for_writing(root / "a.bin", [](std::ostream& os) { os << "!"; },
+                              std::ios::app);
+      REQUIRE(read_file(root / "a.bin") == data.substr(0, 10) + "!");
+    }
+
+    SECTION("extending a file is cheap")
+    {
+      const auto size = std::uintmax_t(1) << 34;
+      resize_file(root / "a.bin", size);
+      REQUIRE(file_size(root / "a.bin") == size);
+
+      with_stream_for_reading(root / "a.bin", [&](std::istream& is) {
+        is.seekg(static_cast<std::streamoff>(size - 2));
+        REQUIRE(is.get() == 0);
+        REQUIRE(is.get() == 0);
+        REQUIRE(is.get() == std::char_traits<char>::eof());
+      });
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - fork and snapshot", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem& fs) {
+    auto root = u8path("//<vfs>");
+    auto fork_root = u8path("//<fork>");
+
+    create_directories(root / "a/b");
+    for (auto i = 0; i < 2000; ++i) {
+      touch(root / "a" / ("f-" + std::to_string(i)));
+    }
+    write_file(root / "a/b/c.txt", "hello world");
+
+    auto& memfs = dynamic_cast<vfs::IMemoryFilesystem&>(fs);
+    vfs::register_vfs("//<fork>", memfs.fork());
+    auto fork_guard =
+      utility::make_scope([]() { vfs::unregister_vfs("//<fork>"); });
+
+    SECTION("forks share the content")
+    {
+      REQUIRE(read_file(fork_root / "a/b/c.txt") == "hello world");
+      REQUIRE(is_regular_file(fork_root / "a/f-1999"));
+      REQUIRE(std::distance(directory_iterator(fork_root / "a"), directory_iterator())
+              == 2001);
+    }
+
+    SECTION("changes are not seen by the other side")
+    {
+      write_file(fork_root / "a/b/c.txt", "hello fork");
+      remove(fork_root / "a/f-10");
+      rename(fork_root / "a/b", fork_root / "b");
+      touch(root / "a/g");
+
+      REQUIRE(read_file(root / "a/b/c.txt") == "hello world");
+      REQUIRE(exists(root / "a/f-10"));
+      REQUIRE(!exists(fork_root / "a/g"));
+
+      REQUIRE(read_file(fork_root / "b/c.txt") == "hello fork");
+      REQUIRE(!exists(fork_root / "a/f-10"));
+      REQUIRE(exists(fork_root / "a/f-11"));
+
+      REQUIRE(remove_all(root / "a") == 2004);
+      REQUIRE(read_file(fork_root / "b/c.txt") == "hello fork");
+      REQUIRE(exists(fork_root / "a/f-11"));
+    }
+
+    SECTION("open files write to their own side")
+    {
+      File f(root / "a/b/c.txt");
+      auto& os = f.open(std::ios::in | std::ios::out);
+
+      vfs::register_vfs("//<fork2>", memfs.fork());
+      auto fork2_guard =
+        utility::make_scope([]() { vfs::unregister_vfs("//<fork2>"); });
+
+      os << "HELLO";
+      f.close();
+
+      REQUIRE(read_file(root / "a/b/c.txt") == "HELLO world");
+      REQUIRE(read_file(u8path("//<fork2>/a/b/c.txt")) == "hello world");
+    }
+
+    SECTION("snapshots are read only")
+    {
+      auto snapshot = memfs.snapshot();
+      vfs::register_vfs("//<snapshot>", memfs.snapshot());
+      auto snapshot_guard =
+        utility::make_scope([]() { vfs::unregister_vfs("//<snapshot>"); });
+      auto snapshot_root = u8path("//<snapshot>");
+
+      std::error_code ec;
+      create_directory(snapshot_root / "x", ec);
+      REQUIRE(ec == std::errc::read_only_file_system);
+      remove(snapshot_root / "a/b/c.txt", ec);
+      REQUIRE(ec == std::errc::read_only_file_system);
+      resize_file(snapshot_root / "a/b/c.txt", 0, ec);
+      REQUIRE(ec == std::errc::read_only_file_system);
+
+      File f(snapshot_root / "a/b/c.txt");
+      f.open(std::ios::out, ec);
+      REQUIRE(ec == std::errc::read_only_file_system);
+
+      write_file(root / "a/b/c.txt", "changed");
+      REQUIRE(read_file(snapshot_root / "a/b/c.txt") == "hello world");
+
+      // a fork of a snapshot can be written to again
+      vfs::register_vfs("//<restored>", snapshot->fork());
+      auto restored_guard =
+        utility::make_scope([]() { vfs::unregister_vfs("//<restored>"); });
+      write_file(u8path("//<restored>/a/x.txt"), "x");
+      REQUIRE(read_file(u8path("//<restored>/a/b/c.txt")) == "hello world");
+      REQUIRE(!exists(root / "a/x.txt"));
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - copies and hard links", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    create_directories(root / "a/b");
+    write_file(root / "a/x.txt", "hello world");
+    write_file(root / "a/b/y.txt", "hello y");
+
+    SECTION("copies don't see changes of each other")
+    {
+      copy(root / "a", root / "c", copy_options::recursive);
+      REQUIRE(read_file(root / "c/b/y.txt") == "hello y");
+
+      write_file(root / "c/x.txt", "hello copy");
+      resize_file(root / "a/b/y.txt", 5);
+      with_stream_for_writing(root / "c/b/y.txt", [](std::ostream& os) { os << "!"; },
+                              std::ios::app);
+
+      REQUIRE(read_file(root / "a/x.txt") == "hello world");
+      REQUIRE(read_file(root / "c/x.txt") == "hello copy");
+      REQUIRE(read_file(root / "a/b/y.txt") == "hello");
+      REQUIRE(read_file(root / "c/b/y.txt") == "hello y!");
+      REQUIRE(!equivalent(root / "a/x.txt", root / "c/x.txt"));
+    }
+
+    SECTION("hard links share the file")
+    {
+      create_hard_link(root / "a/x.txt", root / "a/b/z.txt");
+      REQUIRE(hard_link_count(root / "a/x.txt") == 2);
+      REQUIRE(equivalent(root / "a/x.txt", root / "a/b/z.txt"));
+
+      with_stream_for_writing(root / "a/b/z.txt", [](std::ostream& os) { os << "!"; },
+                              std::ios::app);
+      REQUIRE(read_file(root / "a/x.txt") == "hello world!");
+
+      // renaming onto another link of the same file does nothing
+      rename(root / "a/x.txt", root / "a/b/z.txt");
+      REQUIRE(hard_link_count(root / "a/x.txt") == 2);
+
+      REQUIRE(remove(root / "a/x.txt"));
+      REQUIRE(hard_link_count(root / "a/b/z.txt") == 1);
+      REQUIRE(read_file(root / "a/b/z.txt") == "hello world!");
+
+      std::error_code ec;
+      create_hard_link(root / "a/b", root / "d", ec);
+      REQUIRE(ec == std::errc::operation_not_permitted);
+      create_hard_link(root / "a/b/z.txt", root / "a/b/y.txt", ec);
+      REQUIRE(ec == std::errc::file_exists);
+      create_hard_link(root / "a/nothing", root / "d", ec);
+      REQUIRE(ec == std::errc::no_such_file_or_directory);
+    }
+  });
+}
+
+
+TEST_CASE("memory vfs - lookups after changing directories", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    auto root = u8path("//<vfs>");
+    create_directories(root / "a/b/c");
+    write_file(root / "a/b/c/x.txt", "x");
+    REQUIRE(is_regular_file(root / "a/b/c/x.txt"));
+    REQUIRE(is_regular_file(root / "a/b/../b/c/x.txt"));
+
+    rename(root / "a/b", root / "d");
+    REQUIRE(!exists(root / "a/b/c/x.txt"));
+    REQUIRE(!exists(root / "a/b/../b/c/x.txt"));
+    REQUIRE(is_regular_file(root / "d/c/x.txt"));
+
+    create_directories(root / "a/b/c");
+    REQUIRE(!exists(root / "a/b/c/x.txt"));
+    write_file(root / "a/b/c/x.txt", "y");
+    REQUIRE(read_file(root / "a/b/c/x.txt") == "y");
+    REQUIRE(read_file(root / "d/c/x.txt") == "x");
+
+    remove(root / "d/c/x.txt");
+    remove(root / "d/c");
+    REQUIRE(!exists(root / "d/c/x.txt"));
+    REQUIRE(!exists(root / "d/c"));
+    write_file(root / "d/c", "now a file");
+    REQUIRE(is_regular_file(root / "d/c"));
+
+    std::error_code ec;
+    REQUIRE(!exists(root / "d/c/x.txt", ec));
+
+    remove_all(root / "a");
+    REQUIRE(!exists(root / "a/b/c/x.txt"));
+    REQUIRE(!exists(root / "a/b/c"));
+  });
+}
+
+
+TEST_CASE("memory vfs - concurrent access", "[vfs]")
+{
+  vfs::with_memory_vfs("//<vfs>", [](vfs::IFilesystem&) {
+    const auto root = u8path("//<vfs>");
+    const auto shared = root / "shared";
+    create_directories(shared);
+    with_stream_for_writing(root / "stable.txt",
+                            [](std::ostream& os) { os << "stable"; });
+
+    const auto k_writers = 2;
+    const auto k_readers = 2;
+    const auto k_rounds = 200;
+
+    // Catch's assertions are not thread safe; the threads only count failures.
+    std::atomic<int> failures(0);
+    std::atomic<int> running_writers(k_writers);
+    auto threads = std::vector<std::thread>();
+
+    for (auto w = 0; w < k_writers; ++w) {
+      // writers prepare directories in their own tree, move them into the shared
+      // one and remove every other one again.
+      threads.emplace_back([&, w]() {
+        const auto own = root / ("w" + std::to_string(w));
+        for (auto n = 0; n < k_rounds; ++n) {
+          const auto name = std::to_string(w) + "-" + std::to_string(n);
+          std::error_code ec;
+          create_directories(own / name, ec);
+          with_stream_for_writing(own / name / "f.txt", ec,
+                                  [&](std::ostream& os) { os << name; });
+          rename(own / name, shared / name, ec);
+          failures += ec ? 1 : 0;
+
+          if (n % 2 == 1) {
+            const auto prev = std::to_string(w) + "-" + std::to_string(n - 1);
+            failures += remove_all(shared / prev, ec) != 2 || ec ? 1 : 0;
+          }
+
+          // replace a file others are reading
+          const auto tmp = root / ("stable-" + std::to_string(w) + ".tmp");
+          with_stream_for_writing(tmp, ec, [](std::ostream& os) { os << "stable"; });
+          rename(tmp, root / "stable.txt", ec);
+          failures += ec ? 1 : 0;
+        }
+        --running_writers;
+      });
+    }
+
+    for (auto r = 0; r < k_readers; ++r) {
+      // readers only ever see complete directories
+      threads.emplace_back([&]() {
+        while (running_writers > 0) {
+          std::error_code ec;
+          const auto end_it = directory_iterator();
+          for (auto it = directory_iterator(shared, ec); !ec && it != end_it;
+               it.increment(ec)) {
+            auto content = std::string();
+            std::error_code rec;
+            with_stream_for_reading(it->path() / "f.txt", rec,
+                                    [&](std::istream& is) { is >> content; });
+            // the directory may have been removed meanwhile
+            failures += !rec && content != it->path().filename().string() ? 1 : 0;
+          }
+          failures += ec ? 1 : 0;
+
+          auto content = std::string();
+          with_stream_for_reading(root / "stable.txt", ec,
+                                  [&](std::istream& is) { is >> content; });
+          failures += ec || content != "stable" ? 1 : 0;
+        }
+      });
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    REQUIRE(failures == 0);
+
+    auto names = std::set<std::string>();
+    for (const auto& entry : directory_iterator(shared)) {
+      names.insert(entry.path().filename().string());
+    }
+    REQUIRE(names.size() == k_writers * k_rounds / 2);
+    REQUIRE(names.count("0-1") == 1);
+    REQUIRE(names.count("1-199") == 1);
+    REQUIRE(names.count("1-198") == 0);
+  });
+}
+
+
+TEST_CASE("memory vfs - capacity", "[vfs]")
+{
+  const auto root = u8path("//<small>");
+  vfs::register_vfs("//<small>", vfs::make_memory_filesystem(256 * 1024));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<small>"); });
+
+  const auto initial = space(root);
+  REQUIRE(initial.capacity == 256 * 1024);
+  REQUIRE(initial.free < initial.capacity);
+  REQUIRE(initial.available == initial.free);
+
+  const auto block = std::string(100 * 1024, 'x');
+  write_file(root / "a.bin", block);
+  const auto after_a = space(root).free;
+  REQUIRE(after_a < initial.free - block.size());
+
+  SECTION("writing stops when full")
+  {
+    std::error_code ec;
+    with_stream_for_writing(root / "b.bin", ec, [&](std::ostream& os) {
+      os << block << block;
+      REQUIRE(!os);
+    });
+    REQUIRE(ec == std::errc::no_space_on_device);
+    REQUIRE(file_size(root / "b.bin") < 2 * block.size());
+    REQUIRE(space(root).free == 0);
+
+    remove(root / "b.bin");
+    REQUIRE(space(root).free == after_a);
+  }
+
+  SECTION("other operations fail when full")
+  {
+    std::error_code ec;
+    resize_file(root / "a.bin", 1024 * 1024, ec);
+    REQUIRE(ec == std::errc::no_space_on_device);
+    REQUIRE(file_size(root / "a.bin") == block.size());
+
+    copy_file(root / "a.bin", root / "c.bin");
+    copy_file(root / "a.bin", root / "d.bin", ec);
+    REQUIRE(ec == std::errc::no_space_on_device);
+    REQUIRE(!exists(root / "d.bin"));
+
+    resize_file(root / "c.bin", block.size() + space(root).free);
+    REQUIRE(space(root).free == 0);
+    create_directory(root / "dir", ec);
+    REQUIRE(ec == std::errc::no_space_on_device);
+  }
+
+  SECTION("removing files gives back their space")
+  {
+    remove(root / "a.bin");
+    REQUIRE(space(root).free == initial.free);
+  }
+
+  SECTION("an overfull filesystem stays full")
+  {
+    with_stream(root / "a.bin", std::ios::in | std::ios::out, [&](std::iostream& s) {
+      s.seekp(0, std::ios::end);
+      s << "x";
+      // the stream's content comes back when it's closed
+      write_file(root / "a.bin", "");
+      write_file(root / "c.bin", "");
+      resize_file(root / "c.bin", space(root).free);
+    });
+    REQUIRE(file_size(root / "a.bin") == block.size() + 1);
+    REQUIRE(space(root).free == 0);
+
+    std::error_code ec;
+    create_directory(root / "dir", ec);
+    REQUIRE(ec == std::errc::no_space_on_device);
+    resize_file(root / "c.bin", 1024 * 1024, ec);
+    REQUIRE(ec == std::errc::no_space_on_device);
+  }
+}
+
+
+
+TEST_CASE("memory vfs - spilling large files", "[vfs]")
+{
+  const auto root = u8path("//<spill>");
+  const auto unlimited = std::numeric_limits<std::uintmax_t>::max();
+  vfs::register_vfs("//<spill>", vfs::make_memory_filesystem(unlimited, 256 * 1024));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<spill>"); });
+
+  const auto data = make_random_string(1024 * 1024 + 10);
+  with_stream_for_writing(root / "a.bin", [&](std::ostream& os) {
+    for (auto pos = std::size_t(0); pos < data.size(); pos += 1000) {
+      os << data.substr(pos, 1000);
+    }
+  });
+  REQUIRE(file_size(root / "a.bin") == data.size());
+  REQUIRE(read_file(root / "a.bin") == data);
+
+  SECTION("copies of spilled files are independent")
+  {
+    copy_file(root / "a.bin", root / "b.bin");
+    auto expected = data;
+    with_stream(root / "b.bin", std::ios::in | std::ios::out, [&](std::iostream& s) {
+      for (auto pos : {10, 300000, 1048570}) {
+        const auto patch = std::string(20, '#');
+        s.seekp(pos);
+        s.write(patch.data(), static_cast<std::streamsize>(patch.size()));
+        expected.replace(static_cast<std::size_t>(pos), patch.size(), patch);
+      }
+    });
+
+    REQUIRE(read_file(root / "a.bin") == data);
+    REQUIRE(read_file(root / "b.bin") == expected);
+  }
+
+  SECTION("truncating and extending")
+  {
+    resize_file(root / "a.bin", 300000);
+    resize_file(root / "a.bin", 600000);
+    REQUIRE(read_file(root / "a.bin")
+            == data.substr(0, 300000) + std::string(300000, '\0'));
+  }
+
+  SECTION("small files growing large")
+  {
+    write_file(root / "c.bin", data.substr(0, 1000));
+    resize_file(root / "c.bin", 512 * 1024);
+    with_stream_for_writing(root / "c.bin", [](std::ostream& os) { os << "!"; },
+                            std::ios::app);
+    REQUIRE(read_file(root / "c.bin")
+            == data.substr(0, 1000) + std::string(512 * 1024 - 1000, '\0') + "!");
+  }
+
+  SECTION("spilled content takes few mappings")
+  {
+    const auto before = mapping_count();
+    touch(root / "large.bin");
+    resize_file(root / "large.bin", 32 * 1024 * 1024);
+    with_stream(root / "large.bin", std::ios::in | std::ios::out, [](std::iostream& s) {
+      for (auto pos = 0; pos < 32 * 1024 * 1024; pos += 64 * 1024) {
+        s.seekp(pos);
+        s << "x";
+      }
+    });
+    REQUIRE(mapping_count() <= before + 4);
+  }
+
+  SECTION("the spill directory must exist")
+  {
+    REQUIRE_THROWS_AS(vfs::make_memory_filesystem(
+                        unlimited, 1024, temp_directory_path() / "fspp-no-such-dir"),
+                      const filesystem_error&);
+  }
+}
+
+
+
+TEST_CASE("memory vfs - compression", "[vfs]")
+{
+  auto fs = vfs::make_memory_filesystem();
+  auto& memfs = *fs;
+  const auto root = u8path("//<vfs>");
+  vfs::register_vfs("//<vfs>", std::move(fs));
+  auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<vfs>"); });
+
+  auto text = std::string();
+  for (auto i = 0; text.size() < 200000; ++i) {
+    text += "{\"id\": " + std::to_string(i) + ", \"name\": \"item "
+            + std::to_string(i % 7) + "\"}\n";
+  }
+  const auto random = make_random_string(100000);
+
+  create_directory(root / "packed");
+  create_directory(root / "plain");
+  memfs.set_compression("/packed", true);
+  create_directory(root / "packed/sub");
+  write_file(root / "packed/sub/a.json", text);
+  write_file(root / "packed/b.bin", random);
+  write_file(root / "plain/a.json", text);
+
+  REQUIRE(file_size(root / "packed/sub/a.json") == text.size());
+  REQUIRE(read_file(root / "packed/sub/a.json") == text);
+  REQUIRE(read_file(root / "packed/b.bin") == random);
+
+  auto stats = memfs.compression_statistics();
+  REQUIRE(stats.files == 2);
+  REQUIRE(stats.logical_size == text.size() + random.size());
+  // random data is kept as is
+  REQUIRE(stats.stored_size > random.size());
+  REQUIRE(stats.stored_size < random.size() + text.size() / 3);
+  REQUIRE(stats.ratio() > 1.0);
+
+  SECTION("reading parts and writing into compressed files")
+  {
+    with_stream(root / "packed/sub/a.json", std::ios::in | std::ios::out,
+                [](std::iostream& s) {
+                  s.seekg(150000);
+                  auto buffer = std::string(10, '\0');
+                  s.read(&buffer[0], 10);
+                  REQUIRE(s.gcount() == 10);
+                  s.seekp(70000);
+                  s << "changed";
+                });
+
+    auto expected = text;
+    expected.replace(70000, 7, "changed");
+    REQUIRE(read_file(root / "packed/sub/a.json") == expected);
+    REQUIRE(memfs.compression_statistics().stored_size < stats.logical_size);
+  }
+
+  SECTION("copies keep their content compressed")
+  {
+    copy_file(root / "packed/sub/a.json", root / "packed/copy.json");
+    REQUIRE(read_file(root / "packed/copy.json") == text);
+    resize_file(root / "packed/copy.json", 100);
+    REQUIRE(read_file(root / "packed/copy.json") == text.substr(0, 100));
+    REQUIRE(read_file(root / "packed/sub/a.json") == text);
+  }
+
+  SECTION("turning compression on for existing files")
+  {
+    memfs.set_compression("/plain/a.json", true);
+    REQUIRE(read_file(root / "plain/a.json") == text);
+    REQUIRE(memfs.compression_statistics().files == 3);
+    REQUIRE_THROWS_AS(memfs.set_compression("/missing", true), const filesystem_error&);
+  }
+}
+
+
+TEST_CASE("memory vfs - images", "[vfs]")
+{
+  with_temp_dir([](const path& tmp) {
+    const auto image_p = tmp / "fs.img";
+    const auto large = make_random_string(200000);
+
+    vfs::with_memory_vfs("//<vfs>", [&](vfs::IFilesystem& fs) {
+      auto root = u8path("//<vfs>");
+      create_directories(root / "a/b");
+      create_directory(root / "empty");
+      for (auto i = 0; i < 100; ++i) {
+        write_file(root / "a" / ("f-" + std::to_string(i)), std::to_string(i));
+      }
+      write_file(root / "a/b/large.bin", large);
+      copy_file(root / "a/b/large.bin", root / "copy.bin");
+      create_hard_link(root / "a/f-1", root / "link");
+      touch(root / "zero");
+
+      std::ofstream os(image_p.string(), std::ios::binary);
+      dynamic_cast<vfs::IMemoryFilesystem&>(fs).save_image(os);
+    });
+    // copies share their data in the image
+    REQUIRE(file_size(image_p) < 2 * large.size());
+
+    const auto root = u8path("//<image>");
+    vfs::register_vfs("//<image>", vfs::load_image(image_p));
+    auto guard = utility::make_scope([]() { vfs::unregister_vfs("//<image>"); });
+
+    SECTION("loads all files and directories")
+    {
+      REQUIRE(is_directory(root / "empty"));
+      for (auto i = 0; i < 100; ++i) {
+        REQUIRE(read_file(root / "a" / ("f-" + std::to_string(i))) == std::to_string(i));
+      }
+      REQUIRE(read_file(root / "a/b/large.bin") == large);
+      REQUIRE(read_file(root / "copy.bin") == large);
+      REQUIRE(file_size(root / "zero") == 0);
+      REQUIRE(hard_link_count(root / "link") == 2);
+      REQUIRE(equivalent(root / "link", root / "a/f-1"));
+    }
+
+    SECTION("loaded files can be changed")
+    {
+      with_stream(root / "copy.bin", std::ios::in | std::ios::out, [](std::iostream& s) {
+        s.seekp(70000);
+        s << "changed";
+      });
+      auto expected = large;
+      expected.replace(70000, 7, "changed");
+      REQUIRE(read_file(root / "copy.bin") == expected);
+      REQUIRE(read_file(root / "a/b/large.bin") == large);
+
+      write_file(root / "link", "new");
+      REQUIRE(read_file(root / "a/f-1") == "new");
+      remove_all(root / "a");
+      create_directory(root / "a");
+      REQUIRE(read_file(root / "link") == "new");
+    }
+
+    SECTION("damaged images are rejected")
+    {
+      const auto bad_p = tmp / "bad.img";
+      auto data = read_file(image_p);
+      data.resize(data.size() - 10);
+      write_file(bad_p, data);
+
+      std::error_code ec;
+      REQUIRE(vfs::load_image(bad_p, ec) == nullptr);
+      REQUIRE(ec == std::errc::bad_message);
+      REQUIRE_THROWS_AS(vfs::load_image(tmp / "missing.img"), const filesystem_error&);
+
+      // the root node follows the 48 bytes header; make it an empty file
+      data = read_file(image_p);
+      const auto regular = std::uint32_t(2);
+      std::memcpy(&data[48], &regular, sizeof(regular));
+      std::fill(data.begin() + 64, data.begin() + 80, '\0');
+      write_file(bad_p, data);
+      REQUIRE(vfs::load_image(bad_p, ec) == nullptr);
+      REQUIRE(ec == std::errc::invalid_argument);
+    }
+  });
+}
+
+
+}  // namespace tests
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,516 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "async_private.hpp"
+
+#include "fspp/details/async.hpp"
+
+#if defined(FSPP_HAVE_IO_URING)
+
+#include "instrumentation_private.hpp"
+
+#include "fspp/details/file_status.hpp"
+#include "fspp/estd/memory.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#endif
+
+
+namespace eyestep {
+namespace filesystem {
+
+#if defined(FSPP_HAVE_IO_URING)
+
+namespace {
+
+int
+io_uring_setup(unsigned entries, io_uring_params* params)
+{
+  return int(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+
+int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return int(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                       nullptr, 0));
+}
+
+
+int
+io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+  return int(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+
+// The ring indices are shared with the kernel.
+unsigned
+load_acquire(const unsigned* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+
+void
+store_release(unsigned* p, unsigned value)
+{
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+
+file_type
+map_statx_mode(unsigned mode)
+{
+  switch (mode & S_IFMT) {
+  case S_IFREG:
+    return file_type::regular;
+  case S_IFDIR:
+    return file_type::directory;
+  case S_IFLNK:
+    return file_type::symlink;
+  case S_IFCHR:
+    return file_type::character;
+  case S_IFBLK:
+    return file_type::block;
+  case S_IFIFO:
+    return file_type::fifo;
+  case S_IFSOCK:
+    return file_type::socket;
+  default:
+    return file_type::unknown;
+  }
+}
+
+
+/*! Runs status, symlink_status, file_size, last_write_time, create_directory, remove
+ *  and rename in an io_uring.  A thread of its own reaps the completions and calls the
+ *  handlers. */
+class UringEngine : public IAsyncEngine
+{
+public:
+  UringEngine() = default;
+  ~UringEngine() override;
+
+  UringEngine(const UringEngine&) = delete;
+  UringEngine& operator=(const UringEngine&) = delete;
+
+  bool open(unsigned queue_depth);
+
+  bool start(const AsyncRequest& request, const AsyncHandler& done) override;
+
+private:
+  struct Op
+  {
+    AsyncRequest request;
+    AsyncHandler done;
+    std::string p;
+    std::string p2;
+    struct statx buf;
+    // remove first tries to unlink and then, for directories, to rmdir
+    bool remove_dir = false;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  static std::uint8_t opcode(const Op& op);
+
+  bool submit(Op* op);
+  bool submit_nop();
+  void reap();
+  void complete(std::unique_ptr<Op> op, int res);
+
+  int _fd = -1;
+  void* _sq_ring = MAP_FAILED;
+  std::size_t _sq_ring_size = 0;
+  void* _cq_ring = MAP_FAILED;
+  std::size_t _cq_ring_size = 0;
+  io_uring_sqe* _sqes = nullptr;
+  std::size_t _sqes_size = 0;
+
+  unsigned* _sq_head = nullptr;
+  unsigned* _sq_tail = nullptr;
+  unsigned _sq_mask = 0;
+  unsigned _sq_entries = 0;
+  unsigned* _sq_array = nullptr;
+
+  unsigned* _cq_head = nullptr;
+  unsigned* _cq_tail = nullptr;
+  unsigned _cq_mask = 0;
+  io_uring_cqe* _cqes = nullptr;
+
+  std::bitset<IORING_OP_LAST> _supported;
+
+  std::mutex _submit_mutex;
+  // the operations submitted and not reaped yet; limited to the submission queue's
+  // size such that the completion queue (twice as large) never overflows
+  unsigned _in_flight = 0;
+  std::thread _reaper;
+};
+
+
+UringEngine::~UringEngine()
+{
+  if (_reaper.joinable()) {
+    while (!submit_nop()) {
+      std::this_thread::yield();
+    }
+    _reaper.join();
+  }
+
+  if (_sqes) {
+    ::munmap(_sqes, _sqes_size);
+  }
+  if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring) {
+    ::munmap(_cq_ring, _cq_ring_size);
+  }
+  if (_sq_ring != MAP_FAILED) {
+    ::munmap(_sq_ring, _sq_ring_size);
+  }
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+}
+
+
+bool
+UringEngine::open(unsigned queue_depth)
+{
+  auto params = io_uring_params();
+  std::memset(&params, 0, sizeof(params));
+  _fd = io_uring_setup(queue_depth, &params);
+  if (_fd < 0) {
+    return false;
+  }
+
+  _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+  }
+
+  _sq_ring = ::mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+  if (_sq_ring == MAP_FAILED) {
+    return false;
+  }
+  _cq_ring = single_mmap ? _sq_ring
+                         : ::mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+  if (_cq_ring == MAP_FAILED) {
+    return false;
+  }
+  _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  auto* sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  _sqes = static_cast<io_uring_sqe*>(sqes);
+
+  auto* sq = static_cast<char*>(_sq_ring);
+  _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  _sq_entries = params.sq_entries;
+  _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+  auto* cq = static_cast<char*>(_cq_ring);
+  _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  // the operations on paths are younger than io_uring itself; ask which ones the
+  // running kernel knows
+  const auto probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+  auto probe_mem = std::vector<char>(probe_size, 0);
+  auto* probe = reinterpret_cast<io_uring_probe*>(probe_mem.data());
+  if (io_uring_register(_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+    return false;
+  }
+  for (auto i = 0u; i < probe->ops_len; ++i) {
+    const auto& op = probe->ops[i];
+    if (op.op < IORING_OP_LAST && (op.flags & IO_URING_OP_SUPPORTED) != 0) {
+      _supported.set(op.op);
+    }
+  }
+  if (!_supported.test(IORING_OP_NOP)) {
+    return false;
+  }
+
+  _reaper = std::thread([this]() { reap(); });
+  return true;
+}
+
+
+std::uint8_t
+UringEngine::opcode(const Op& op)
+{
+  switch (op.request.op) {
+  case Operation::status:
+  case Operation::symlink_status:
+  case Operation::file_size:
+  case Operation::last_write_time:
+    return IORING_OP_STATX;
+  case Operation::create_directory:
+    return IORING_OP_MKDIRAT;
+  case Operation::remove:
+    return IORING_OP_UNLINKAT;
+  case Operation::rename:
+    return IORING_OP_RENAMEAT;
+  default:
+    return IORING_OP_LAST;
+  }
+}
+
+
+bool
+UringEngine::start(const AsyncRequest& request, const AsyncHandler& done)
+{
+  auto op = estd::make_unique<Op>();
+  op->request = request;
+  const auto code = opcode(*op);
+  if (code == IORING_OP_LAST || !_supported.test(code)) {
+    return false;
+  }
+
+  op->done = done;
+  op->p = request.p.native();
+  op->p2 = request.p2.native();
+  op->start = std::chrono::steady_clock::now();
+
+  if (!submit(op.get())) {
+    return false;
+  }
+  op.release();
+  return true;
+}
+
+
+bool
+UringEngine::submit(Op* op)
+{
+  std::lock_guard<std::mutex> lock(_submit_mutex);
+
+  const auto tail = *_sq_tail;
+  if (tail - load_acquire(_sq_head) >= _sq_entries || _in_flight >= _sq_entries) {
+    return false;
+  }
+
+  auto& sqe = _sqes[tail & _sq_mask];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode(*op);
+  sqe.fd = AT_FDCWD;
+  sqe.addr = reinterpret_cast<std::uintptr_t>(op->p.c_str());
+  sqe.user_data = reinterpret_cast<std::uintptr_t>(op);
+
+  switch (op->request.op) {
+  case Operation::status:
+  case Operation::file_size:
+  case Operation::last_write_time:
+  case Operation::symlink_status:
+    sqe.len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+    sqe.off = reinterpret_cast<std::uintptr_t>(&op->buf);
+    sqe.statx_flags =
+      op->request.op == Operation::symlink_status ? AT_SYMLINK_NOFOLLOW : 0;
+    break;
+  case Operation::create_directory:
+    sqe.len = S_IRWXU | S_IRWXG | S_IRWXO;
+    break;
+  case Operation::remove:
+    sqe.unlink_flags = op->remove_dir ? AT_REMOVEDIR : 0;
+    break;
+  case Operation::rename:
+    sqe.len = unsigned(AT_FDCWD);
+    sqe.addr2 = reinterpret_cast<std::uintptr_t>(op->p2.c_str());
+    break;
+  default:
+    break;
+  }
+
+  _sq_array[tail & _sq_mask] = tail & _sq_mask;
+  store_release(_sq_tail, tail + 1);
+  ++_in_flight;
+
+  // the entry is queued already; the kernel only refuses to take it while its
+  // completion queue is full, which the reaper is about to drain
+  while (io_uring_enter(_fd, 1, 0, 0) < 0
+         && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+
+bool
+UringEngine::submit_nop()
+{
+  std::lock_guard<std::mutex> lock(_submit_mutex);
+
+  const auto tail = *_sq_tail;
+  if (tail - load_acquire(_sq_head) >= _sq_entries) {
+    return false;
+  }
+
+  // user data 0 tells the reaper to stop
+  auto& sqe = _sqes[tail & _sq_mask];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_NOP;
+  _sq_array[tail & _sq_mask] = tail & _sq_mask;
+  store_release(_sq_tail, tail + 1);
+
+  while (io_uring_enter(_fd, 1, 0, 0) < 0
+         && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+
+void
+UringEngine::reap()
+{
+  auto stopping = false;
+  while (!stopping) {
+    auto head = *_cq_head;
+    const auto tail = load_acquire(_cq_tail);
+    if (head == tail) {
+      if (io_uring_enter(_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+        std::this_thread::yield();
+      }
+      continue;
+    }
+
+    for (; head != tail; ++head) {
+      const auto& cqe = _cqes[head & _cq_mask];
+      auto* op = reinterpret_cast<Op*>(static_cast<std::uintptr_t>(cqe.user_data));
+      const auto res = cqe.res;
+      store_release(_cq_head, head + 1);
+
+      if (!op) {
+        stopping = true;
+        continue;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(_submit_mutex);
+        --_in_flight;
+      }
+      complete(std::unique_ptr<Op>(op), res);
+    }
+  }
+}
+
+
+void
+UringEngine::complete(std::unique_ptr<Op> op, int res)
+{
+  const auto error = res < 0 ? -res : 0;
+
+  if (op->request.op == Operation::remove && error == EISDIR && !op->remove_dir) {
+    op->remove_dir = true;
+    if (submit(op.get())) {
+      op.release();
+      return;
+    }
+    res = ::rmdir(op->p.c_str()) == 0 ? 0 : -errno;
+    return complete(std::move(op), res);
+  }
+
+  auto result = AsyncResult();
+  if (error != 0) {
+    result.ec = std::error_code(error, std::generic_category());
+  }
+
+  switch (op->request.op) {
+  case Operation::status:
+  case Operation::symlink_status:
+    if (error == ENOENT) {
+      result.ec.clear();
+      result.status = file_status(file_type::not_found);
+    }
+    else if (!result.ec) {
+      result.status = file_status(map_statx_mode(op->buf.stx_mode),
+                                  static_cast<perms>(op->buf.stx_mode & 07777));
+    }
+    else {
+      result.status = file_status(file_type::none);
+    }
+    break;
+  case Operation::file_size:
+    result.count = result.ec ? static_cast<std::uintmax_t>(-1) : op->buf.stx_size;
+    break;
+  case Operation::last_write_time:
+    result.time = result.ec ? file_time_type() : file_time_type(op->buf.stx_mtime.tv_sec);
+    break;
+  case Operation::create_directory:
+    // like mkdir() an existing directory is no error
+    if (error == EEXIST || error == EISDIR) {
+      result.ec.clear();
+    }
+    result.flag = error == 0;
+    break;
+  case Operation::remove:
+    result.flag = error == 0;
+    break;
+  default:
+    break;
+  }
+
+  if (auto* recorder = native_recorder()) {
+    const auto elapsed = std::chrono::steady_clock::now() - op->start;
+    recorder->record(op->request.op, bool(result.ec),
+                     std::uint64_t(
+                       std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                         .count()));
+  }
+
+  op->done(result);
+}
+
+}  // namespace
+
+
+std::unique_ptr<IAsyncEngine>
+make_native_async_engine(unsigned queue_depth)
+{
+  auto engine = estd::make_unique<UringEngine>();
+  if (!engine->open(queue_depth)) {
+    return nullptr;
+  }
+  return engine;
+}
+
+#else
+
+std::unique_ptr<IAsyncEngine>
+make_native_async_engine(unsigned)
+{
+  return nullptr;
+}
+
+#endif
+
+}  // namespace filesystem
+}  // namespace eyestep
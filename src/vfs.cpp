@@ -2,20 +2,26 @@
 
 #include "fspp/details/vfs.hpp"
 
+#include "epoch_domain.hpp"
 #include "vfs_private.hpp"
 
 #include "fspp/details/path.hpp"
 #include "fspp/details/platform.hpp"
+#include "fspp/estd/memory.hpp"
 #include "fspp/filesystem.hpp"
 
 #if defined(FSPP_HAVE_STD_CODECVT)
 #include <codecvt>
 #endif
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_map>
 #include <utility>
+#include <vector>
 
 
 namespace eyestep {
@@ -37,17 +43,93 @@ convert_to_native(const std::string& str)
 }
 
 
-using FilesystemMap = std::unordered_map<path::string_type, std::unique_ptr<IFilesystem>>;
+/* The registry is read on every VFS rooted operation, but changed only rarely.  Readers
+ * therefore never lock: they work on an immutable snapshot of (name, filesystem) pairs,
+ * which writers replace atomically under a mutex.
+ *
+ * Readers are counted per thread slot in an EpochDomain, so lookups from different
+ * threads don't contend on one counter.  A replaced snapshot is retired in the current
+ * phase and freed once the phase has been flipped away and back, i.e. once every reader
+ * that could have started before the swap has left.
+ */
+struct Snapshot
+{
+  std::vector<std::pair<path::string_type, IFilesystem*>> entries;
+};
+
+
+using FilesystemEntry = std::pair<path::string_type, std::unique_ptr<IFilesystem>>;
+
+
+struct Registry
+{
+  std::mutex mutex;
+  std::vector<FilesystemEntry> filesystems;
+  EpochDomain epochs;
+  std::vector<std::unique_ptr<const Snapshot>> retired[2];
+};
+
+
+std::atomic<const Snapshot*> s_current_snapshot(nullptr);
+
 
-FilesystemMap&
+Registry&
 vfs_registry()
 {
-  static FilesystemMap registry;
+  static Registry registry;
   return registry;
 }
+
+
+// requires registry.mutex to be held
+void
+reclaim_snapshots(Registry& registry)
+{
+  const auto other = registry.epochs.phase() ^ 1;
+  if (registry.epochs.try_flip()) {
+    registry.retired[other].clear();
+  }
+}
+
+
+// requires registry.mutex to be held
+void
+publish_snapshot(Registry& registry)
+{
+  auto snapshot = estd::make_unique<Snapshot>();
+  snapshot->entries.reserve(registry.filesystems.size());
+  for (const auto& entry : registry.filesystems) {
+    snapshot->entries.emplace_back(entry.first, entry.second.get());
+  }
+
+  auto old = std::unique_ptr<const Snapshot>(
+    s_current_snapshot.exchange(registry.filesystems.empty() ? nullptr
+                                                             : snapshot.release()));
+  if (old) {
+    registry.retired[registry.epochs.phase()].push_back(std::move(old));
+  }
+
+  // two flips free the snapshot just retired unless readers are still in flight
+  reclaim_snapshots(registry);
+  reclaim_snapshots(registry);
+
+  g_any_vfs_registered.store(!registry.filesystems.empty());
+}
+
+
+std::vector<FilesystemEntry>::iterator
+find_registered(Registry& registry, const path::string_type& name)
+{
+  return std::find_if(
+    begin(registry.filesystems), end(registry.filesystems),
+    [&](const FilesystemEntry& entry) { return entry.first == name; });
+}
 }  // namespace
 
 
+std::atomic<bool> g_any_vfs_registered(false);
+
+
 bool
 is_vfs_root_name(const path::string_type& rootname) NOEXCEPT
 {
@@ -56,12 +138,32 @@ is_vfs_root_name(const path::string_type& rootname) NOEXCEPT
 }
 
 
+IFilesystem*
+find_vfs(const path::value_type* name, std::size_t len) NOEXCEPT
+{
+  using traits_type = path::string_type::traits_type;
+
+  IFilesystem* result = nullptr;
+
+  EpochDomain::Guard guard(vfs_registry().epochs);
+  if (const auto* snapshot = s_current_snapshot.load()) {
+    for (const auto& entry : snapshot->entries) {
+      if (entry.first.size() == len
+          && traits_type::compare(entry.first.data(), name, len) == 0) {
+        result = entry.second;
+        break;
+      }
+    }
+  }
+
+  return result;
+}
+
+
 IFilesystem*
 find_vfs(const path::string_type& rootname) NOEXCEPT
 {
-  auto& registry = vfs_registry();
-  auto i_found = registry.find(rootname);
-  return i_found != registry.end() ? i_found->second.get() : nullptr;
+  return find_vfs(rootname.data(), rootname.size());
 }
 
 
@@ -72,6 +174,67 @@ deroot(const path& p) NOEXCEPT
 }
 
 
+path
+deroot(const path& p, std::size_t rootlen) NOEXCEPT
+{
+  const auto& str = p.native();
+  assert(rootlen <= str.size());
+
+  if (rootlen == str.size()) {
+    return {};
+  }
+
+  // root_directory() is the first separator after the root name, relative_path() what
+  // follows after skipping all separators.
+  const path::value_type separators[] = {'/', path::preferred_separator, 0};
+  auto i_rel = str.find_first_not_of(separators, rootlen);
+  if (i_rel == path::string_type::npos) {
+    return path(str.substr(rootlen, 1));
+  }
+
+  auto result = path::string_type(1, str[rootlen]);
+  result.append(str, i_rel, path::string_type::npos);
+  return path(std::move(result));
+}
+
+
+std::string
+path_key(const path& p)
+{
+  auto key = std::string();
+  for (const auto& elt : p) {
+    const auto name = elt.generic_u8string();
+    if (name.empty() || name == "/" || name == ".") {
+      continue;
+    }
+    if (name == "..") {
+      if (!key.empty()) {
+        key.erase(key.rfind('/'));
+      }
+      continue;
+    }
+    key += '/';
+    key += name;
+  }
+  return key.empty() ? std::string("/") : key;
+}
+
+
+std::string
+parent_key(const std::string& key)
+{
+  const auto pos = key.rfind('/');
+  return pos == 0 || pos == std::string::npos ? std::string("/") : key.substr(0, pos);
+}
+
+
+std::string
+child_key(const std::string& dir, const std::string& name)
+{
+  return dir == "/" ? "/" + name : dir + "/" + name;
+}
+
+
 void
 register_vfs(const std::string& name, std::unique_ptr<IFilesystem> fs)
 {
@@ -79,9 +242,12 @@ register_vfs(const std::string& name, std::unique_ptr<IFilesystem> fs)
 
   auto& registry = vfs_registry();
   auto nativekey = convert_to_native(name);
-  assert(registry.find(nativekey) == registry.end());
 
-  registry[nativekey] = std::move(fs);
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  assert(find_registered(registry, nativekey) == end(registry.filesystems));
+
+  registry.filesystems.emplace_back(std::move(nativekey), std::move(fs));
+  publish_snapshot(registry);
 }
 
 
@@ -89,10 +255,13 @@ std::unique_ptr<IFilesystem>
 unregister_vfs(const std::string& name)
 {
   auto& registry = vfs_registry();
-  auto i_find = registry.find(convert_to_native(name));
-  if (i_find != end(registry)) {
+
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  auto i_find = find_registered(registry, convert_to_native(name));
+  if (i_find != end(registry.filesystems)) {
     auto retv = std::move(i_find->second);
-    registry.erase(i_find);
+    registry.filesystems.erase(i_find);
+    publish_snapshot(registry);
     return retv;
   }
 
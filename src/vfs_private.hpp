@@ -12,9 +12,13 @@
 #include "fspp/details/vfs.hpp"
 #include "fspp/estd/optional.hpp"
 
-#include <cassert>
+#include <atomic>
+#include <cstddef>
+#include <ios>
 #include <memory>
+#include <streambuf>
 #include <string>
+#include <system_error>
 #include <unordered_map>
 #include <utility>
 
@@ -23,21 +27,115 @@ namespace eyestep {
 namespace filesystem {
 namespace vfs {
 
+/*! Set while at least one filesystem is registered.  Only a hint to skip the VFS
+ *  lookup in processes which never register one; find_vfs() remains authoritative. */
+extern std::atomic<bool> g_any_vfs_registered;
+
+inline bool
+any_vfs_registered() NOEXCEPT
+{
+  return g_any_vfs_registered.load(std::memory_order_relaxed);
+}
+
 bool
 is_vfs_root_name(const path::string_type& rootname) NOEXCEPT;
+/*! Returns the length of the VFS root name (`//<name>`) @p p starts with or 0.  Reads
+ *  the native string in place, i.e. does not allocate. */
+inline std::size_t
+vfs_root_name_length(const path::string_type& p) NOEXCEPT
+{
+  const auto is_sep = [](path::value_type c) {
+    return c == '/' || c == path::preferred_separator;
+  };
+
+  if (p.size() < 3 || p[0] != '/' || p[1] != '/' || p[2] != '<') {
+    return 0;
+  }
+
+  auto i = std::size_t(3);
+  while (i < p.size() && !is_sep(p[i])) {
+    ++i;
+  }
+  return i;
+}
+/*! Returns true if @p p1 and @p p2 start with the same VFS root name or are both native
+ *  paths. */
+inline bool
+is_same_vfs_root(const path::string_type& p1, const path::string_type& p2) NOEXCEPT
+{
+  const auto rootlen = vfs_root_name_length(p1);
+  return rootlen == vfs_root_name_length(p2)
+         && p1.compare(0, rootlen, p2, 0, rootlen) == 0;
+}
+/*! Returns the filesystem registered for the root name given by @p len characters at @p
+ *  name or nullptr.  Wait-free and safe to call concurrently with register_vfs(). */
+IFilesystem*
+find_vfs(const path::value_type* name, std::size_t len) NOEXCEPT;
 IFilesystem*
 find_vfs(const path::string_type& rootname) NOEXCEPT;
 path
 deroot(const path& src) NOEXCEPT;
+/*! Like deroot(src), but for a path known to start with a root name of @p rootlen
+ *  characters. */
+path
+deroot(const path& src, std::size_t rootlen) NOEXCEPT;
+
+/*! Returns the (derooted) path @p p in the normalized form backends use as key into
+ *  their tables: "/" for the root, "/a/b" otherwise.  "." and ".." are resolved
+ *  lexically; ".." never leaves the root. */
+std::string
+path_key(const path& p);
+std::string
+parent_key(const std::string& key);
+std::string
+child_key(const std::string& dir, const std::string& name);
+
+/*! Reads file content shared with a backend's store, e.g. a cache.  The content is never
+ *  written to. */
+class SharedContentBuf : public std::streambuf
+{
+public:
+  void assign(std::shared_ptr<const std::string> content)
+  {
+    _content = std::move(content);
+    auto* data = _content ? const_cast<char*>(_content->data()) : nullptr;
+    setg(data, data, data + (_content ? _content->size() : 0));
+  }
+
+protected:
+  pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override
+  {
+    const auto size = egptr() - eback();
+    const auto base = dir == std::ios::beg ? 0 : dir == std::ios::cur ? gptr() - eback()
+                                                                       : size;
+    const auto pos = base + off;
+    if ((which & std::ios::in) == 0 || pos < 0 || pos > size) {
+      return pos_type(off_type(-1));
+    }
+
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios::openmode which) override
+  {
+    return seekoff(off_type(pos), std::ios::beg, which);
+  }
+
+private:
+  std::shared_ptr<const std::string> _content;
+};
+
 
 template <typename T, typename Functor>
 estd::optional<T>
 with_vfs_do(const path& p, Functor functor) NOEXCEPT
 {
-  auto rootname = p.root_name().native();
-  if (is_vfs_root_name(rootname)) {
-    if (auto* fs = find_vfs(rootname)) {
-      return {functor(*fs, deroot(p))};
+  const auto& str = p.native();
+  if (auto rootlen = vfs_root_name_length(str)) {
+    auto* fs = any_vfs_registered() ? find_vfs(str.data(), rootlen) : nullptr;
+    if (fs) {
+      return {functor(*fs, deroot(p, rootlen))};
     }
     else {
       return {T()};
@@ -48,15 +146,22 @@ with_vfs_do(const path& p, Functor functor) NOEXCEPT
 }
 
 
+/*! Like with_vfs_do(p, functor) for operations on two paths, which must both be on the
+ *  same VFS or both be native.  Sets @p ec to cross_device_link otherwise. */
 template <typename T, typename Functor>
 estd::optional<T>
-with_vfs_do(const path& p1, const path& p2, Functor functor) NOEXCEPT
+with_vfs_do(const path& p1, const path& p2, std::error_code& ec, Functor functor) NOEXCEPT
 {
-  auto rootname = p1.root_name().native();
-  if (is_vfs_root_name(rootname)) {
-    if (auto* fs = find_vfs(rootname)) {
-      assert(p1.root_name() == p2.root_name());
-      return {functor(*fs, deroot(p1), deroot(p2))};
+  const auto& str = p1.native();
+  if (!is_same_vfs_root(str, p2.native())) {
+    ec = std::make_error_code(std::errc::cross_device_link);
+    return {T()};
+  }
+
+  if (auto rootlen = vfs_root_name_length(str)) {
+    auto* fs = any_vfs_registered() ? find_vfs(str.data(), rootlen) : nullptr;
+    if (fs) {
+      return {functor(*fs, deroot(p1, rootlen), deroot(p2, rootlen))};
     }
     else {
       return {T()};
@@ -0,0 +1,142 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "operations_impl.hpp"
+
+#include "fspp/details/mapped_file.hpp"
+#include "fspp/estd/memory.hpp"
+
+#include <windows.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace impl {
+
+namespace {
+
+class WinMapping : public mapped_file::IMappingImpl
+{
+public:
+  // @p base is the start of the view, which holds @p size bytes from @p offset_in_view
+  // on.  Keeps @p file to flush it.
+  WinMapping(HANDLE file, char* base, std::size_t offset_in_view, std::size_t size)
+    : _file(file)
+    , _base(base)
+    , _data(base ? base + offset_in_view : nullptr)
+    , _size(size)
+  {
+  }
+
+  ~WinMapping() override
+  {
+    if (_base) {
+      ::UnmapViewOfFile(_base);
+    }
+    ::CloseHandle(_file);
+  }
+
+  char* data() override { return _data; }
+  std::size_t size() const override { return _size; }
+
+  void advise(map_advice, std::error_code& ec) override
+  {
+    // views have no access pattern hints
+    ec.clear();
+  }
+
+  void flush(std::error_code& ec) override
+  {
+    if (_base && (!::FlushViewOfFile(_base, 0) || !::FlushFileBuffers(_file))) {
+      ec = std::error_code(::GetLastError(), std::system_category());
+    }
+    else {
+      ec.clear();
+    }
+  }
+
+private:
+  HANDLE _file;
+  char* _base;
+  char* _data;
+  std::size_t _size;
+};
+
+}  // namespace
+
+
+std::unique_ptr<mapped_file::IMappingImpl>
+map_file(const path& p,
+         map_mode mode,
+         file_size_type offset,
+         file_size_type length,
+         std::error_code& ec) NOEXCEPT
+{
+  const auto is_write = mode == map_mode::read_write;
+  const auto access = is_write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+  auto file = ::CreateFileW(p.c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return nullptr;
+  }
+
+  LARGE_INTEGER file_size;
+  if (!::GetFileSizeEx(file, &file_size)) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    ::CloseHandle(file);
+    return nullptr;
+  }
+  if (offset > static_cast<file_size_type>(file_size.QuadPart)) {
+    ec = std::make_error_code(std::errc::invalid_argument);
+    ::CloseHandle(file);
+    return nullptr;
+  }
+
+  const auto size = static_cast<std::size_t>(
+    std::min(length, static_cast<file_size_type>(file_size.QuadPart) - offset));
+  if (size == 0) {
+    // can't map an empty range
+    ec.clear();
+    return estd::make_unique<WinMapping>(file, nullptr, 0, 0);
+  }
+
+  // views start at multiples of the allocation granularity
+  SYSTEM_INFO info;
+  ::GetSystemInfo(&info);
+  const auto offset_in_view =
+    static_cast<std::size_t>(offset % info.dwAllocationGranularity);
+  const auto view_offset = offset - offset_in_view;
+
+  const auto protection = is_write ? PAGE_READWRITE : PAGE_READONLY;
+  const auto view_access = is_write ? FILE_MAP_WRITE : FILE_MAP_READ;
+  auto mapping = ::CreateFileMappingW(file, nullptr, protection, 0, 0, nullptr);
+  auto* base = mapping ? ::MapViewOfFile(mapping, view_access,
+                                         static_cast<DWORD>(view_offset >> 32),
+                                         static_cast<DWORD>(view_offset & 0xffffffff),
+                                         offset_in_view + size)
+                       : nullptr;
+  if (!base) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+  }
+  if (mapping) {
+    // the view keeps the mapping alive
+    ::CloseHandle(mapping);
+  }
+  if (!base) {
+    ::CloseHandle(file);
+    return nullptr;
+  }
+
+  ec.clear();
+  return estd::make_unique<WinMapping>(file, static_cast<char*>(base), offset_in_view,
+                                       size);
+}
+
+}  // namespace impl
+}  // namespace filesystem
+}  // namespace eyestep
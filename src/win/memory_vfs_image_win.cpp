@@ -0,0 +1,61 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs_image.hpp"
+
+#include <windows.h>
+
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+ImageMapping::ImageMapping(const path& p, std::error_code& ec)
+{
+  auto file = ::CreateFileW(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return;
+  }
+
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file, &size)) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+  }
+  else if (size.QuadPart == 0) {
+    // can't map an empty file; it's no valid image anyway
+    ec = std::make_error_code(std::errc::bad_message);
+  }
+  else {
+    auto mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    auto* data = mapping ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!data) {
+      ec = std::error_code(::GetLastError(), std::system_category());
+    }
+    else {
+      _data = static_cast<const char*>(data);
+      _size = static_cast<std::size_t>(size.QuadPart);
+      ec.clear();
+    }
+    if (mapping) {
+      // the view keeps the mapping alive
+      ::CloseHandle(mapping);
+    }
+  }
+
+  ::CloseHandle(file);
+}
+
+
+ImageMapping::~ImageMapping()
+{
+  if (_data) {
+    ::UnmapViewOfFile(_data);
+  }
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -0,0 +1,129 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "memory_vfs_nodes.hpp"
+
+#include <windows.h>
+
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+namespace {
+
+HANDLE
+open_anonymous_file(const path& directory, std::error_code& ec)
+{
+  wchar_t name[MAX_PATH];
+  if (::GetTempFileNameW(directory.c_str(), L"fsp", 0, name) == 0) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return INVALID_HANDLE_VALUE;
+  }
+
+  auto handle =
+    ::CreateFileW(name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                  FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    ::DeleteFileW(name);
+  }
+  return handle;
+}
+
+}  // namespace
+
+
+SpillFile::SpillFile(const path& directory, std::error_code& ec)
+  : _handle(reinterpret_cast<std::intptr_t>(open_anonymous_file(directory, ec)))
+{
+}
+
+
+SpillFile::~SpillFile()
+{
+  if (is_open()) {
+    ::CloseHandle(reinterpret_cast<HANDLE>(_handle));
+  }
+}
+
+
+bool
+SpillFile::is_open() const
+{
+  return reinterpret_cast<HANDLE>(_handle) != INVALID_HANDLE_VALUE;
+}
+
+
+bool
+SpillFile::resize(std::uintmax_t size, std::error_code& ec)
+{
+  auto handle = reinterpret_cast<HANDLE>(_handle);
+  LARGE_INTEGER current;
+  if (!::GetFileSizeEx(handle, &current)) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return false;
+  }
+  // mapping a window grows the file already; a mapped file can't shrink
+  if (static_cast<std::uintmax_t>(current.QuadPart) >= size) {
+    ec.clear();
+    return true;
+  }
+
+  LARGE_INTEGER pos;
+  pos.QuadPart = static_cast<LONGLONG>(size);
+  if (!::SetFilePointerEx(handle, pos, nullptr, FILE_BEGIN) || !::SetEndOfFile(handle)) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return false;
+  }
+  ec.clear();
+  return true;
+}
+
+
+char*
+SpillFile::map_window(std::uintmax_t offset, std::error_code& ec)
+{
+  // the file grows to the end of the window
+  const auto end = offset + k_window_size;
+  auto mapping = ::CreateFileMappingW(reinterpret_cast<HANDLE>(_handle), nullptr,
+                                      PAGE_READWRITE, static_cast<DWORD>(end >> 32),
+                                      static_cast<DWORD>(end), nullptr);
+  if (!mapping) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return nullptr;
+  }
+
+  auto* window = ::MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS,
+                                 static_cast<DWORD>(offset >> 32),
+                                 static_cast<DWORD>(offset), k_window_size);
+  if (!window) {
+    ec = std::error_code(::GetLastError(), std::system_category());
+  }
+  else {
+    ec.clear();
+  }
+  // the view keeps the mapping alive
+  ::CloseHandle(mapping);
+  return static_cast<char*>(window);
+}
+
+
+void
+SpillFile::unmap_window(char* window)
+{
+  ::UnmapViewOfFile(window);
+}
+
+
+void
+SpillFile::evict(char* region)
+{
+  // pages which are not locked are dropped from the working set
+  ::VirtualUnlock(region, k_region_size);
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep
@@ -489,6 +489,34 @@ file_size(const path& p, std::error_code& ec) NOEXCEPT
 }
 
 
+file_id
+file_identity(const path& p, std::error_code& ec) NOEXCEPT
+{
+  auto handle =
+    ::CreateFileW(p.c_str(), FILE_READ_ATTRIBUTES,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                  OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+  if (handle != INVALID_HANDLE_VALUE) {
+    auto guard = make_handle_scope(handle);
+
+    auto file_info = BY_HANDLE_FILE_INFORMATION{};
+    if (::GetFileInformationByHandle(handle, &file_info)) {
+      ec.clear();
+      return file_id(static_cast<std::uintmax_t>(file_info.dwVolumeSerialNumber),
+                     (static_cast<std::uintmax_t>(file_info.nFileIndexHigh) << 32)
+                       | static_cast<std::uintmax_t>(file_info.nFileIndexLow));
+    }
+
+    // read the error before the guard closes the handle, which may change it
+    ec = std::error_code(::GetLastError(), std::system_category());
+    return {};
+  }
+
+  ec = std::error_code(::GetLastError(), std::system_category());
+  return {};
+}
+
+
 std::uintmax_t
 hard_link_count(const path& p, std::error_code& ec) NOEXCEPT
 {
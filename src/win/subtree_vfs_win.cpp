@@ -0,0 +1,37 @@
+// Copyright (c) 2016 Gregor Klinke
+
+#include "fspp/details/vfs.hpp"
+#include "fspp/filesystem.hpp"
+
+#include <memory>
+#include <system_error>
+
+
+namespace eyestep {
+namespace filesystem {
+namespace vfs {
+
+// Windows has no *at() functions to resolve paths relative to a directory handle.
+std::unique_ptr<IFilesystem>
+make_subtree_filesystem(const path& dir, std::error_code& ec)
+{
+  (void)dir;
+  ec = std::make_error_code(std::errc::function_not_supported);
+  return nullptr;
+}
+
+
+std::unique_ptr<IFilesystem>
+make_subtree_filesystem(const path& dir)
+{
+  std::error_code ec;
+  auto fs = make_subtree_filesystem(dir, ec);
+  if (ec) {
+    throw filesystem_error("can't create subtree filesystem", dir, ec);
+  }
+  return fs;
+}
+
+}  // namespace vfs
+}  // namespace filesystem
+}  // namespace eyestep